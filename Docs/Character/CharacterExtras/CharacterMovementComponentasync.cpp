@@ -5,3028 +5,8726 @@
 #include "Components/PrimitiveComponent.h"
 #include "PBDRigidsSolver.h"
 #include "Engine/World.h"
+#include "EngineUtils.h"
+#include "GameFramework/Character.h"
+#include "Algo/StableSort.h"
+#include "Async/ParallelFor.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/ScopeExit.h"
+#include "Misc/Paths.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "Containers/Ticker.h"
+#include "Misc/App.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/StaticMeshActor.h"
+#include "Engine/CollisionProfile.h"
+#include "Components/StaticMeshComponent.h"
+#include "PhysicsEngine/PhysicsSettings.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+#include "HAL/FileManager.h"
+#include "UObject/ObjectKey.h"
+#include "UObject/SoftObjectPath.h"
+#include "PhysicalMaterials/PhysicalMaterial.h"
+#include "Misc/Crc.h"
+#include "GameFramework/PhysicsVolume.h"
+#include "GameFramework/PlayerController.h"
+#include "Chaos/GeometryQueries.h"
+#include "Chaos/Capsule.h"
+#include "Chaos/Sphere.h"
+#include "Chaos/Box.h"
+#include "Physics/PhysicsFiltering.h"
+#include "Components/BrushComponent.h"
 #include UE_INLINE_GENERATED_CPP_BY_NAME(CharacterMovementComponentAsync)
-void FCharacterMovementComponentAsyncInput::Simulate(const float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+// Scene query counters and timers per query site, movement mode and character. Compiled out of shipping builds unless overridden.
+#ifndef ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_STATS (!UE_BUILD_SHIPPING)
+#endif
+#ifndef ASYNC_CHARACTER_MOVEMENT_CAPTURE
+#define ASYNC_CHARACTER_MOVEMENT_CAPTURE (!UE_BUILD_SHIPPING)
+#endif
+// Movement math that rounds the same on every platform, for lockstep and rollback games. Off by default, it gives up rsqrt estimates and closed-form braking.
+// Engine headers included above are compiled with the project's settings, so deterministic builds should also pass -ffp-contract=off (/fp:precise on MSVC).
+#ifndef ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+#define ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC 0
+#endif
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC && defined(__clang__)
+// ARM targets contract a * b + c into fused multiply-adds by default, which round once instead of twice.
+#pragma clang fp contract(off)
+#endif
+namespace CharacterMovementAsyncCVars
+{
+static int32 BatchSimulate = 0;
+FAutoConsoleVariableRef CVarBatchSimulate(
+TEXT("p.AsyncCharacterMovement.BatchSimulate"),
+BatchSimulate,
+TEXT("Simulate all async characters of a physics tick as one batch, gathering hot movement state into structure-of-arrays and advancing it in lockstep phases.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 BatchVelocityKernels = 1;
+FAutoConsoleVariableRef CVarBatchVelocityKernels(
+TEXT("p.AsyncCharacterMovement.BatchVelocityKernels"),
+BatchVelocityKernels,
+TEXT("In the batch path, run the first velocity update of walking and falling characters through the SIMD lane kernels, one phase per movement mode, before PerformMovement. ")
+TEXT("PerformMovement takes the result when its inputs match exactly, otherwise it computes the velocity itself.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 ParallelSimulate = 0;
+FAutoConsoleVariableRef CVarParallelSimulate(
+TEXT("p.AsyncCharacterMovement.ParallelSimulate"),
+ParallelSimulate,
+TEXT("Spread async character simulation across task graph workers. Each character only writes its own output, and outputs keep input order.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 ParallelSimulateMinBatchSize = 8;
+FAutoConsoleVariableRef CVarParallelSimulateMinBatchSize(
+TEXT("p.AsyncCharacterMovement.ParallelSimulateMinBatchSize"),
+ParallelSimulateMinBatchSize,
+TEXT("Minimum number of characters a worker takes at once when p.AsyncCharacterMovement.ParallelSimulate is enabled."),
+ECVF_Default);
+static int32 BatchSceneQueries = 0;
+FAutoConsoleVariableRef CVarBatchSceneQueries(
+TEXT("p.AsyncCharacterMovement.BatchSceneQueries"),
+BatchSceneQueries,
+TEXT("When simulating as a batch, gather broadphase candidates for nearby characters with one shared overlap query per cell, and resolve MoveComponent sweeps against those candidates only.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float BatchSceneQueryCellSize = 1000.f;
+FAutoConsoleVariableRef CVarBatchSceneQueryCellSize(
+TEXT("p.AsyncCharacterMovement.BatchSceneQueryCellSize"),
+BatchSceneQueryCellSize,
+TEXT("Size of the grid cells used to group characters into one shared broadphase query (cm)."),
+ECVF_Default);
+static int32 FloorCache = 0;
+FAutoConsoleVariableRef CVarFloorCache(
+TEXT("p.AsyncCharacterMovement.FloorCache"),
+FloorCache,
+TEXT("Reuse the current floor in FindFloor when the caller allows cached locations, the movement base has not moved and the capsule stayed within p.AsyncCharacterMovement.FloorCacheTolerance.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float FloorCacheTolerance = 1.f;
+FAutoConsoleVariableRef CVarFloorCacheTolerance(
+TEXT("p.AsyncCharacterMovement.FloorCacheTolerance"),
+FloorCacheTolerance,
+TEXT("Distance the capsule may move away from where the current floor was computed and still reuse it (cm). 0 only reuses the floor when the capsule has not moved."),
+ECVF_Default);
+static int32 StepUpCache = 0;
+FAutoConsoleVariableRef CVarStepUpCache(
+TEXT("p.AsyncCharacterMovement.StepUpCache"),
+StepUpCache,
+TEXT("Remember the last validated step per character, keyed by the stepped component and face. Later step ups against the same face place the capsule on the cached step and verify it with one downward sweep instead of the up, forward and down sweeps.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float StepUpCacheHeightTolerance = 2.f;
+FAutoConsoleVariableRef CVarStepUpCacheHeightTolerance(
+TEXT("p.AsyncCharacterMovement.StepUpCacheHeightTolerance"),
+StepUpCacheHeightTolerance,
+TEXT("How far the verified step height may differ from the cached one before the full step up runs again (cm)."),
+ECVF_Default);
+static int32 AdaptiveSubstepping = 0;
+FAutoConsoleVariableRef CVarAdaptiveSubstepping(
+TEXT("p.AsyncCharacterMovement.AdaptiveSubstepping"),
+AdaptiveSubstepping,
+TEXT("Let walking and falling take substeps longer than MaxSimulationTimeStep while the position error of holding acceleration constant stays within p.AsyncCharacterMovement.AdaptiveSubstepTolerance. ")
+TEXT("Falls back to fixed substeps after a blocking hit or a movement mode change.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float AdaptiveSubstepTolerance = 1.f;
+FAutoConsoleVariableRef CVarAdaptiveSubstepTolerance(
+TEXT("p.AsyncCharacterMovement.AdaptiveSubstepTolerance"),
+AdaptiveSubstepTolerance,
+TEXT("Largest position error an adaptive substep may accumulate from the acceleration or braking it does not resolve (cm)."),
+ECVF_Default);
+static float AdaptiveSubstepMaxTimeStep = 0.25f;
+FAutoConsoleVariableRef CVarAdaptiveSubstepMaxTimeStep(
+TEXT("p.AsyncCharacterMovement.AdaptiveSubstepMaxTimeStep"),
+AdaptiveSubstepMaxTimeStep,
+TEXT("Longest adaptive substep (s)."),
+ECVF_Default);
+static int32 AdaptiveSubstepCompare = 0;
+FAutoConsoleVariableRef CVarAdaptiveSubstepCompare(
+TEXT("p.AsyncCharacterMovement.AdaptiveSubstepCompare"),
+AdaptiveSubstepCompare,
+TEXT("With adaptive substepping, run every controlled character a second time with fixed substeps on a copy of its state and record how far the results are apart. Read with p.AsyncCharacterMovement.AdaptiveSubstepReport.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 SnapshotFrames = 0;
+FAutoConsoleVariableRef CVarSnapshotFrames(
+TEXT("p.AsyncCharacterMovement.SnapshotFrames"),
+SnapshotFrames,
+TEXT("Number of physics frames of movement state each character keeps for resimulation and rollback. Saved before every tick, 0 disables saving."),
+ECVF_Default);
+static int32 LedgeProbeCache = 0;
+FAutoConsoleVariableRef CVarLedgeProbeCache(
+TEXT("p.AsyncCharacterMovement.LedgeProbeCache"),
+LedgeProbeCache,
+TEXT("Reuse the side found by the last ledge probe while the character stays on the same static floor, keeps its heading and stays within p.AsyncCharacterMovement.LedgeProbeCacheTolerance of the probe.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float LedgeProbeCacheTolerance = 25.f;
+FAutoConsoleVariableRef CVarLedgeProbeCacheTolerance(
+TEXT("p.AsyncCharacterMovement.LedgeProbeCacheTolerance"),
+LedgeProbeCacheTolerance,
+TEXT("Distance from the last ledge probe within which its result is reused (cm)."),
+ECVF_Default);
+static int32 MovementSleep = 0;
+FAutoConsoleVariableRef CVarMovementSleep(
+TEXT("p.AsyncCharacterMovement.MovementSleep"),
+MovementSleep,
+TEXT("Skip PerformMovement for walking characters at rest on a static base with no input, forces or root motion. They wake as soon as any of that changes.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 MovementSleepDelay = 2;
+FAutoConsoleVariableRef CVarMovementSleepDelay(
+TEXT("p.AsyncCharacterMovement.MovementSleepDelay"),
+MovementSleepDelay,
+TEXT("Number of consecutive idle updates a character must run fully before its movement goes to sleep."),
+ECVF_Default);
+static int32 MovementLOD = 0;
+FAutoConsoleVariableRef CVarMovementLOD(
+TEXT("p.AsyncCharacterMovement.MovementLOD"),
+MovementLOD,
+TEXT("Simulate characters far from every player, or not net relevant, once every few physics ticks with the accumulated time, and interpolate their transform in between.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float MovementLODDistance = 3000.f;
+FAutoConsoleVariableRef CVarMovementLODDistance(
+TEXT("p.AsyncCharacterMovement.MovementLODDistance"),
+MovementLODDistance,
+TEXT("Distance from the nearest player beyond which a character drops to movement LOD 1 (cm). Every doubling of the distance drops it one more level."),
+ECVF_Default);
+static int32 MovementLODMaxLevel = 3;
+FAutoConsoleVariableRef CVarMovementLODMaxLevel(
+TEXT("p.AsyncCharacterMovement.MovementLODMaxLevel"),
+MovementLODMaxLevel,
+TEXT("Lowest movement LOD, at most 7. A character at level L simulates every 2^L physics ticks. Characters that are not net relevant, or have no player to measure against, use this level."),
+ECVF_Default);
+static int32 MovementLODMaxIterations = 4;
+FAutoConsoleVariableRef CVarMovementLODMaxIterations(
+TEXT("p.AsyncCharacterMovement.MovementLODMaxIterations"),
+MovementLODMaxIterations,
+TEXT("MaxSimulationIterations for reduced rate updates. 0 keeps the character's own."),
+ECVF_Default);
+static int32 MovementBudget = 0;
+FAutoConsoleVariableRef CVarMovementBudget(
+TEXT("p.AsyncCharacterMovement.MovementBudget"),
+MovementBudget,
+TEXT("Cap the time the movement pass takes per physics tick. Players and characters near them always update, the rest are admitted nearest first and deferred or run with fewer iterations once the budget is spent.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float MovementBudgetMs = 2.f;
+FAutoConsoleVariableRef CVarMovementBudgetMs(
+TEXT("p.AsyncCharacterMovement.MovementBudgetMs"),
+MovementBudgetMs,
+TEXT("Time the movement pass may take per physics tick before characters outside the guaranteed set are deferred or degraded (ms)."),
+ECVF_Default);
+static float MovementBudgetGuaranteedDistance = 1500.f;
+FAutoConsoleVariableRef CVarMovementBudgetGuaranteedDistance(
+TEXT("p.AsyncCharacterMovement.MovementBudgetGuaranteedDistance"),
+MovementBudgetGuaranteedDistance,
+TEXT("Characters within this distance of a player always get their full update, whatever the budget (cm)."),
+ECVF_Default);
+static int32 MovementBudgetMaxDeferTicks = 2;
+FAutoConsoleVariableRef CVarMovementBudgetMaxDeferTicks(
+TEXT("p.AsyncCharacterMovement.MovementBudgetMaxDeferTicks"),
+MovementBudgetMaxDeferTicks,
+TEXT("Consecutive ticks an over budget character may be deferred. After that it updates with the accumulated time and MovementBudgetDegradedIterations."),
+ECVF_Default);
+static int32 MovementBudgetDegradedIterations = 1;
+FAutoConsoleVariableRef CVarMovementBudgetDegradedIterations(
+TEXT("p.AsyncCharacterMovement.MovementBudgetDegradedIterations"),
+MovementBudgetDegradedIterations,
+TEXT("MaxSimulationIterations for over budget characters that can no longer be deferred."),
+ECVF_Default);
+static int32 PawnHash = 0;
+FAutoConsoleVariableRef CVarPawnHash(
+TEXT("p.AsyncCharacterMovement.PawnHash"),
+PawnHash,
+TEXT("Test character against character contacts analytically through a per-tick spatial hash of all async character capsules, and sweep only against non-pawn geometry. Overlapping characters are separated softly.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float PawnHashCellSize = 200.f;
+FAutoConsoleVariableRef CVarPawnHashCellSize(
+TEXT("p.AsyncCharacterMovement.PawnHashCellSize"),
+PawnHashCellSize,
+TEXT("Cell size of the character spatial hash (cm)."),
+ECVF_Default);
+static float PawnSeparationStiffness = 0.5f;
+FAutoConsoleVariableRef CVarPawnSeparationStiffness(
+TEXT("p.AsyncCharacterMovement.PawnSeparationStiffness"),
+PawnSeparationStiffness,
+TEXT("Fraction of the overlap between two characters removed per update, split evenly between them. 0 disables separation."),
+ECVF_Default);
+static int32 DeltaOutputCopy = 0;
+FAutoConsoleVariableRef CVarDeltaOutputCopy(
+TEXT("p.AsyncCharacterMovement.DeltaOutputCopy"),
+DeltaOutputCopy,
+TEXT("Only copy the floor, speculative overlaps and character state into an output when they changed since that output was last filled from the same character.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 QueryStats = 0;
+FAutoConsoleVariableRef CVarQueryStats(
+TEXT("p.AsyncCharacterMovement.QueryStats"),
+QueryStats,
+TEXT("Count and time the scene queries of every async character per query site and movement mode, and export them to the AsyncCharacterMovement trace channel and CSV category.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 DeferredTransformCommit = 0;
+FAutoConsoleVariableRef CVarDeferredTransformCommit(
+TEXT("p.AsyncCharacterMovement.DeferredTransformCommit"),
+DeferredTransformCommit,
+TEXT("Keep the updated component's transform in a working copy during PerformMovement, and write it to the physics particle and mark it dirty once at the end instead of on every move.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 ClosedFormBraking = 0;
+FAutoConsoleVariableRef CVarClosedFormBraking(
+TEXT("p.AsyncCharacterMovement.ClosedFormBraking"),
+ClosedFormBraking,
+TEXT("Integrate braking friction and deceleration analytically over the whole tick instead of in BrakingSubStepTime substeps.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 TickChecksum = ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC;
+FAutoConsoleVariableRef CVarTickChecksum(
+TEXT("p.AsyncCharacterMovement.TickChecksum"),
+TickChecksum,
+TEXT("Hash the position, rotation, velocity and movement mode of every character after each physics tick, so peers can compare simulations frame by frame.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 SimulatedProxy = 0;
+FAutoConsoleVariableRef CVarSimulatedProxy(
+TEXT("p.AsyncCharacterMovement.SimulatedProxy"),
+SimulatedProxy,
+TEXT("Move simulated proxies on the physics thread by extrapolating their last replicated state, instead of leaving them to game thread smoothing.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static float SimulatedProxyMaxExtrapolationTime = 0.25f;
+FAutoConsoleVariableRef CVarSimulatedProxyMaxExtrapolationTime(
+TEXT("p.AsyncCharacterMovement.SimulatedProxyMaxExtrapolationTime"),
+SimulatedProxyMaxExtrapolationTime,
+TEXT("How long a simulated proxy keeps extrapolating after its last replicated state before it holds position (s)."),
+ECVF_Default);
+static int32 SimulatedProxyFloorSnap = 1;
+FAutoConsoleVariableRef CVarSimulatedProxyFloorSnap(
+TEXT("p.AsyncCharacterMovement.SimulatedProxyFloorSnap"),
+SimulatedProxyFloorSnap,
+TEXT("Snap walking simulated proxies to the floor, and land falling ones, with a single line trace per update.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+static int32 SimulatedProxyCollision = 0;
+FAutoConsoleVariableRef CVarSimulatedProxyCollision(
+TEXT("p.AsyncCharacterMovement.SimulatedProxyCollision"),
+SimulatedProxyCollision,
+TEXT("Sweep simulated proxies along their extrapolated move and stop them at the first blocking hit.\n")
+TEXT("0: Disable, 1: Enable"),
+ECVF_Default);
+}
+// Substeps taken by the character simulating on this thread, and whether it must use fixed substeps, as the reference run of the comparison does.
+static thread_local int32 GAsyncCharacterMovementSubsteps = 0;
+static thread_local bool GAsyncCharacterMovementFixedSubsteps = false;
+// Set while a reduced rate movement LOD update simulates a whole interval on this thread.
+static thread_local bool GAsyncCharacterMovementLODUpdate = false;
+// Iteration cap of an update the movement budget degraded on this thread, 0 when there is none.
+static thread_local int32 GAsyncCharacterMovementBudgetIterations = 0;
+// Set while the character on this thread makes a move that should not collide with other characters, such as its own separation push.
+static thread_local bool GAsyncCharacterMovementSkipPawnHash = false;
+DECLARE_STATS_GROUP(TEXT("AsyncCharacterMovement"), STATGROUP_AsyncCharacterMovement, STATCAT_Advanced);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Floor Cache Hits"), STAT_AsyncCharacterMovementFloorCacheHits, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Floor Cache Misses"), STAT_AsyncCharacterMovementFloorCacheMisses, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Step Up Cache Hits"), STAT_AsyncCharacterMovementStepUpCacheHits, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Step Up Cache Misses"), STAT_AsyncCharacterMovementStepUpCacheMisses, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Step Up Saved Queries"), STAT_AsyncCharacterMovementStepUpSavedQueries, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Ledge Probe Cache Hits"), STAT_AsyncCharacterMovementLedgeProbeCacheHits, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Ledge Probe Cache Misses"), STAT_AsyncCharacterMovementLedgeProbeCacheMisses, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Sleeping Characters"), STAT_AsyncCharacterMovementSleepingCharacters, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("LOD Reduced Rate Updates"), STAT_AsyncCharacterMovementLODUpdates, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("LOD Interpolated Updates"), STAT_AsyncCharacterMovementLODInterpolatedUpdates, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Budget Deferred Updates"), STAT_AsyncCharacterMovementBudgetDeferredUpdates, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Budget Degraded Updates"), STAT_AsyncCharacterMovementBudgetDegradedUpdates, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Pawn Hash Tests"), STAT_AsyncCharacterMovementPawnHashTests, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Pawn Hash Hits"), STAT_AsyncCharacterMovementPawnHashHits, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Pawn Separations"), STAT_AsyncCharacterMovementPawnSeparations, STATGROUP_AsyncCharacterMovement);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Scratch Allocations"), STAT_AsyncCharacterMovementScratchAllocations, STATGROUP_AsyncCharacterMovement);
+// Movement base transforms for one tick, keyed by base component.
+// Built once from the inputs before any character simulates and read-only afterwards. Every character on the same elevator or ship reads the same entry,
+// and a character that changes base during the tick still finds its new base if any character started the tick on it.
+// Entries only hold what the base itself is now. Where the base was at a character's last update is per character, FindMovementBase adds it.
+struct FCharacterMovementAsyncBaseTable
+{
+struct FEntry
+{
+FQuat OldBaseQuat = FQuat::Identity;
+FVector OldBaseLocation = FVector::ZeroVector;
+FQuat BaseQuat = FQuat::Identity;
+FVector BaseLocation = FVector::ZeroVector;
+bool bIsBaseTransformValid = false;
+bool bUsesRelativeLocation = false;
+bool bIsSimulated = false;
+bool bIsValid = false;
+bool bOwnerIsValid = false;
+// The base's current transform and flags. The old transform is left equal to the current one.
+static FEntry FromBaseData(const FMovementBaseAsyncData& BaseData)
+{
+FEntry Entry;
+Entry.OldBaseQuat = BaseData.BaseQuat;
+Entry.OldBaseLocation = BaseData.BaseLocation;
+Entry.BaseQuat = BaseData.BaseQuat;
+Entry.BaseLocation = BaseData.BaseLocation;
+Entry.bIsBaseTransformValid = BaseData.bIsBaseTransformValid;
+Entry.bUsesRelativeLocation = BaseData.bMovementBaseUsesRelativeLocationCached;
+Entry.bIsSimulated = BaseData.bMovementBaseIsSimulatedCached;
+Entry.bIsValid = BaseData.bMovementBaseIsValidCached;
+Entry.bOwnerIsValid = BaseData.bMovementBaseOwnerIsValidCached;
+return Entry;
+}
+// True if the base moved since the characters on it last updated, is simulated, or has no valid transform.
+bool HasMoved() const
+{
+return !bIsBaseTransformValid || bIsSimulated || !OldBaseQuat.Equals(BaseQuat, 1e-8f) || (OldBaseLocation != BaseLocation);
+}
+};
+TMap<const UPrimitiveComponent*, FEntry> Entries;
+void Reset()
+{
+Entries.Reset();
+}
+void Add(const FCharacterMovementComponentAsyncInput& Input)
+{
+const FMovementBaseAsyncData& BaseData = Input.MovementBaseAsyncData;
+// Characters on the same base captured the same current transform at input build, so the first one describes the base for everyone.
+if (BaseData.CachedMovementBase != nullptr && !Entries.Contains(BaseData.CachedMovementBase))
+{
+Entries.Add(BaseData.CachedMovementBase, FEntry::FromBaseData(BaseData));
+}
+}
+};
+// Entry of the base the character stands on now, false if it has none or the base is unknown this tick.
+// Without a table, as when replaying a capture, only the base captured with the character's own input is known.
+static bool FindMovementBase(const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output, FCharacterMovementAsyncBaseTable::FEntry& OutEntry)
+{
+const UPrimitiveComponent* MovementBase = Output.NewMovementBase;
+if (MovementBase == nullptr)
 {
-Output.DeltaTime = DeltaSeconds;
-if (CharacterInput->LocalRole > ROLE_SimulatedProxy)
+return false;
+}
+const FMovementBaseAsyncData& BaseData = Input.MovementBaseAsyncData;
+const bool bIsInputBase = (BaseData.CachedMovementBase == MovementBase);
+if (Output.MovementBaseTable != nullptr)
 {
-const bool bIsClient = (CharacterInput->LocalRole == ROLE_AutonomousProxy && bIsNetModeClient);
-if (CharacterInput->bIsLocallyControlled)
+const FCharacterMovementAsyncBaseTable::FEntry* Entry = Output.MovementBaseTable->Entries.Find(MovementBase);
+if (Entry == nullptr)
 {
-ControlledCharacterMove(DeltaSeconds, Output);
+return false;
 }
+OutEntry = *Entry;
 }
-else if (CharacterInput->LocalRole == ROLE_SimulatedProxy)
+else if (bIsInputBase)
 {
-ensure(false);
-}
+OutEntry = FCharacterMovementAsyncBaseTable::FEntry::FromBaseData(BaseData);
 }
-void FCharacterMovementComponentAsyncInput::ControlledCharacterMove(const float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
-{
+else
 {
-// We need to check the jump state before adjusting input acceleration, to minimize latency
-// and to make sure acceleration respects our potentially new falling state.
-CharacterInput->CheckJumpInput(DeltaSeconds, *this, Output);
-// apply input to acceleration
-Output.Acceleration = ScaleInputAcceleration(ConstrainInputAcceleration(InputVector, Output), Output);
-Output.AnalogInputModifier = ComputeAnalogInputModifier(Output.Acceleration);
+return false;
 }
+// Where the base was at this character's last update. Characters that landed, slept, skipped LOD ticks or were deferred each saw it elsewhere.
+// A base the character only reached during this tick has not carried it yet, so it keeps the current transform.
+if (bIsInputBase)
 {
-PerformMovement(DeltaSeconds, Output);
+OutEntry.OldBaseQuat = BaseData.OldBaseQuat;
+OutEntry.OldBaseLocation = BaseData.OldBaseLocation;
 }
+return true;
 }
-void FCharacterMovementComponentAsyncInput::PerformMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+// A character may sleep when a full update would leave it exactly where it is: walking on a walkable floor of a static base,
+// with no acceleration, velocity, forces, root motion, jump or path following, and nothing external moved it since its last update.
+static bool IsMovementAtRest(const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output)
 {
-EMovementMode& MovementMode = Output.MovementMode;
-FVector& LastUpdateLocation = Output.LastUpdateLocation;
-const FVector UpdatedComponentLocation = UpdatedComponentInput->GetPosition();
-bool& bForceNextFloorCheck = Output.bForceNextFloorCheck;
-const FVector& Velocity = Output.Velocity;
-const FVector& LastUpdateVelocity = Output.LastUpdateVelocity;
-// Force floor update if we've moved outside of CharacterMovement since last update.
-bForceNextFloorCheck |= (IsMovingOnGround(Output) && UpdatedComponentLocation != LastUpdateLocation);
-// Update saved LastPreAdditiveVelocity with any external changes to character Velocity that happened since last update.
-if (RootMotion.bHasAdditiveRootMotion)
+if (Output.MovementMode != MOVE_Walking || !Output.CurrentFloor.IsWalkableFloor() || Output.bForceNextFloorCheck || Output.bJustTeleported)
 {
-FVector Adjustment = (Velocity - LastUpdateVelocity);
-Output.LastPreAdditiveVelocity += Adjustment;
+return false;
 }
+if (!Output.Acceleration.IsZero() || !Output.Velocity.IsZero() || Output.Velocity != Output.LastUpdateVelocity || Output.bHasRequestedVelocity)
 {
-MaybeUpdateBasedMovement(DeltaSeconds, Output);
-const bool bHasRootMotionSources = Output.bWasSimulatingRootMotion;
-Output.OldVelocity = Velocity;
-Output.OldLocation = UpdatedComponentLocation;
-ApplyAccumulatedForces(DeltaSeconds, Output);
-ClearAccumulatedForces(Output);
-// Update saved LastPreAdditiveVelocity with any external changes to character Velocity that happened due to ApplyAccumulatedForces/HandlePendingLaunch
-if (RootMotion.bHasAdditiveRootMotion)
-{
-const FVector Adjustment = (Velocity - Output.OldVelocity);
-Output.LastPreAdditiveVelocity += Adjustment;
+return false;
 }
-// Apply Root Motion to Velocity
-if (RootMotion.bHasOverrideRootMotion || RootMotion.bHasAnimRootMotion)
+if (!Output.PendingImpulseToApply.IsZero() || !Output.PendingForceToApply.IsZero() || !Output.PendingLaunchVelocity.IsZero() || Output.bIsAdditiveVelocityApplied)
 {
-// Animation root motion overrides Velocity and currently doesn't allow any other root motion sources
-if (RootMotion.bHasAnimRootMotion)
-{
-// Turn root motion to velocity to be used by various physics modes.
-if (RootMotion.TimeAccumulated > 0.f)
+return false;
+}
+if (Input.RootMotion.bHasAnimRootMotion || Input.RootMotion.bHasOverrideRootMotion || Input.RootMotion.bHasAdditiveRootMotion)
 {
-Output.AnimRootMotionVelocity = CalcAnimRootMotionVelocity(RootMotion.AnimTransform.GetTranslation(), RootMotion.TimeAccumulated, Velocity);
-Output.Velocity = ConstrainAnimRootMotionVelocity(Output.AnimRootMotionVelocity, Output.Velocity, Output);
+return false;
 }
+if (Output.CharacterOutput->bPressedJump || Output.CharacterOutput->JumpForceTimeRemaining > 0.f)
+{
+return false;
 }
-else
+// Crouch and uncrouch requests are handled by UpdateCharacterStateAfterMovement, which a sleeping character skips.
+if (Output.bWantsToCrouch != Output.bIsCrouched)
 {
-// We don't have animation root motion so we apply other sources
-if (DeltaSeconds > 0.f)
+return false;
+}
+if (Input.UpdatedComponentInput->GetPosition() != Output.LastUpdateLocation || !Input.UpdatedComponentInput->GetRotation().Equals(Output.LastUpdateRotation))
 {
-Output.Velocity = RootMotion.OverrideVelocity;
+return false;
 }
+// Controller rotation can still turn a character that stands still.
+if (Input.bUseControllerDesiredRotation && !FRotator(Output.LastUpdateRotation).Equals(Input.CharacterInput->ControllerDesiredRotation, 1e-3f))
+{
+return false;
 }
+FCharacterMovementAsyncBaseTable::FEntry MovementBase;
+return FindMovementBase(Input, Output, MovementBase) && !MovementBase.HasMoved();
 }
-// Clear jump input now, to allow movement events to trigger it for next update.
-CharacterInput->ClearJumpInput(DeltaSeconds, *this, Output);
-Output.NumJumpApexAttempts = 0;
-StartNewPhysics(DeltaSeconds, 0, Output);
-if (!bHasValidData)
+// Vector helpers for the movement code. Deterministic builds use correctly rounded IEEE square roots and divisions, which give the same bits on every platform,
+// where the engine may use reciprocal square root estimates. The operations are written out in FVector's order so the results otherwise match the engine versions.
+namespace CharacterMovementAsyncMath
 {
-return;
-}
-UpdateCharacterStateAfterMovement(DeltaSeconds, Output);
-if ((bAllowPhysicsRotationDuringAnimRootMotion || !RootMotion.bHasAnimRootMotion))
+static FORCEINLINE double Sqrt(double Value)
 {
-PhysicsRotation(DeltaSeconds, Output);
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+return std::sqrt(Value);
+#else
+return FMath::Sqrt(Value);
+#endif
 }
-// Apply Root Motion rotation after movement is complete.
-if (RootMotion.bHasAnimRootMotion)
+static FORCEINLINE FVector GetSafeNormal(const FVector& Vector, double Tolerance = UE_SMALL_NUMBER)
 {
-const FQuat OldActorRotationQuat = UpdatedComponentInput->GetRotation();
-const FQuat RootMotionRotationQuat = RootMotion.AnimTransform.GetRotation();
-if (!RootMotionRotationQuat.IsIdentity())
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+const double SquareSum = Vector.X * Vector.X + Vector.Y * Vector.Y + Vector.Z * Vector.Z;
+if (SquareSum == 1.0)
 {
-const FQuat NewActorRotationQuat = RootMotionRotationQuat * OldActorRotationQuat;
-MoveUpdatedComponent(FVector::ZeroVector, NewActorRotationQuat, true, Output);
+return Vector;
+}
+if (SquareSum < Tolerance)
+{
+return FVector::ZeroVector;
 }
+const double Scale = 1.0 / std::sqrt(SquareSum);
+return FVector(Vector.X * Scale, Vector.Y * Scale, Vector.Z * Scale);
+#else
+return Vector.GetSafeNormal(Tolerance);
+#endif
 }
-else if (RootMotion.bHasOverrideRootMotion)
+static FORCEINLINE FVector GetSafeNormal2D(const FVector& Vector, double Tolerance = UE_SMALL_NUMBER)
 {
-if (UpdatedComponentInput && !RootMotion.OverrideRotation.IsIdentity())
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+const double SquareSum = Vector.X * Vector.X + Vector.Y * Vector.Y;
+if (SquareSum == 1.0)
 {
-const FQuat OldActorRotationQuat = UpdatedComponentInput->GetRotation();
-const FQuat NewActorRotationQuat = RootMotion.OverrideRotation * OldActorRotationQuat;
-MoveUpdatedComponent(FVector::ZeroVector, NewActorRotationQuat, true, Output);
+return FVector(Vector.X, Vector.Y, 0.0);
 }
+if (SquareSum < Tolerance)
+{
+return FVector::ZeroVector;
 }
-// consume path following requested velocity
-Output.LastUpdateRequestedVelocity = Output.bHasRequestedVelocity ? Output.RequestedVelocity : FVector::ZeroVector;
-Output.bHasRequestedVelocity = false;
-} // End scoped movement update
-const FVector NewLocation = UpdatedComponentInput->GetPosition();
-const FQuat NewRotation = UpdatedComponentInput->GetRotation();
-Output.LastUpdateLocation = NewLocation;
-Output.LastUpdateRotation = NewRotation;
-Output.LastUpdateVelocity = Velocity;
+const double Scale = 1.0 / std::sqrt(SquareSum);
+return FVector(Vector.X * Scale, Vector.Y * Scale, 0.0);
+#else
+return Vector.GetSafeNormal2D(Tolerance);
+#endif
 }
-void FCharacterMovementComponentAsyncInput::MaybeUpdateBasedMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+static FORCEINLINE FVector GetClampedToMaxSize(const FVector& Vector, double MaxSize)
 {
-bool& bDeferUpdateBasedMovement = Output.bDeferUpdateBasedMovement;
-MovementBaseAsyncData.Validate(Output);
-const bool& bMovementBaseUsesRelativeLocation = MovementBaseAsyncData.bMovementBaseUsesRelativeLocationCached;
-const bool& bMovementBaseIsSimulated = MovementBaseAsyncData.bMovementBaseIsSimulatedCached;
-bDeferUpdateBasedMovement = false;
-if (bMovementBaseUsesRelativeLocation) 
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+if (MaxSize < UE_KINDA_SMALL_NUMBER)
 {
-// Need to see if anything we're on is simulating physics or has a parent that is.
-if (bMovementBaseIsSimulated == false)
+return FVector::ZeroVector;
+}
+const double VSq = Vector.X * Vector.X + Vector.Y * Vector.Y + Vector.Z * Vector.Z;
+if (VSq > MaxSize * MaxSize)
 {
-bDeferUpdateBasedMovement = false;
-UpdateBasedMovement(DeltaSeconds, Output);
-Output.bShouldDisablePostPhysicsTick = true;
-Output.bShouldAddMovementBaseTickDependency = true;
+const double Scale = MaxSize * (1.0 / std::sqrt(VSq));
+return FVector(Vector.X * Scale, Vector.Y * Scale, Vector.Z * Scale);
 }
-else
+return Vector;
+#else
+return Vector.GetClampedToMaxSize(MaxSize);
+#endif
+}
+static FORCEINLINE FVector VectorPlaneProject(const FVector& Vector, const FVector& PlaneNormal)
 {
-// defer movement base update until after physics
-bDeferUpdateBasedMovement = true;
-Output.bShouldEnablePostPhysicsTick = true;
-Output.bShouldRemoveMovementBaseTickDependency = true;
+#if ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC
+const double Dot = Vector.X * PlaneNormal.X + Vector.Y * PlaneNormal.Y + Vector.Z * PlaneNormal.Z;
+return FVector(Vector.X - PlaneNormal.X * Dot, Vector.Y - PlaneNormal.Y * Dot, Vector.Z - PlaneNormal.Z * Dot);
+#else
+return FVector::VectorPlaneProject(Vector, PlaneNormal);
+#endif
 }
 }
-else
+// Capsules of all async characters for one tick, filed by center in a uniform grid over XY.
+// Built once from the inputs before any character simulates and read-only afterwards, so every character sees the others where they started the tick,
+// whatever order or thread it simulates in. Character capsules are assumed upright.
+// Collision settings come from the game thread's input build, so no worker reads a live component's responses.
+struct FCharacterMovementAsyncPawnHash
 {
-Output.bShouldEnablePostPhysicsTick = true;
+struct FEntry
+{
+const UPrimitiveComponent* Component = nullptr;
+const AActor* Owner = nullptr;
+FVector Location = FVector::ZeroVector;
+float Radius = 0.f;
+float HalfHeight = 0.f;
+ECollisionChannel ObjectType = ECC_Pawn;
+FCollisionResponseContainer Responses;
+};
+TArray<FEntry> Entries;
+TMap<uint64, TArray<int32, TInlineAllocator<4>>> Cells;
+// Components with an entry. Scene queries leave these out, and every other object keeps its real response.
+TSet<const UPrimitiveComponent*> Components;
+float CellSize = 200.f;
+float MaxRadius = 0.f;
+void Reset(float InCellSize)
+{
+Entries.Reset();
+Cells.Reset();
+Components.Reset();
+CellSize = FMath::Max(1.f, InCellSize);
+MaxRadius = 0.f;
 }
+static uint64 MakeKey(int32 X, int32 Y)
+{
+return ((uint64)(uint32)X << 32) | (uint32)Y;
 }
-void FCharacterMovementComponentAsyncInput::UpdateBasedMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+int32 ToCell(double Coordinate) const
 {
-MovementBaseAsyncData.Validate(Output);
-const bool& bMovementBaseUsesRelativeLocation = MovementBaseAsyncData.bMovementBaseUsesRelativeLocationCached;
-const bool& bIsMovementBaseValid = MovementBaseAsyncData.bMovementBaseIsValidCached;
-const bool& bIsMovementBaseOwnerValid = MovementBaseAsyncData.bMovementBaseOwnerIsValidCached;
-EMoveComponentFlags& MoveComponentFlags = Output.MoveComponentFlags;
-const FQuat& OldBaseQuat = MovementBaseAsyncData.OldBaseQuat;
-const FVector& OldBaseLocation = MovementBaseAsyncData.OldBaseLocation;
-if (bMovementBaseUsesRelativeLocation == false)
+return FMath::FloorToInt32(Coordinate / CellSize);
+}
+void Add(const FCharacterMovementComponentAsyncInput& Input)
+{
+if (!Input.bHasValidData || Input.UpdatedComponentInput == nullptr || !Input.UpdatedComponentInput->bIsQueryCollisionEnabled)
 {
 return;
 }
-if (!bIsMovementBaseValid || !bIsMovementBaseOwnerValid)
+FEntry Entry;
+Entry.Component = Input.UpdatedComponentInput->UpdatedComponent;
+Entry.Owner = Entry.Component->GetOwner();
+Entry.Location = Input.UpdatedComponentInput->GetPosition();
+Entry.Radius = Input.AsyncSimState->ScaledCapsuleRadius;
+Entry.HalfHeight = Input.AsyncSimState->ScaledCapsuleHalfHeight;
+Entry.ObjectType = Input.CollisionChannel;
+Entry.Responses = Input.UpdatedComponentInput->MoveComponentCollisionResponseParams.CollisionResponse;
+const int32 Index = Entries.Add(Entry);
+Components.Add(Entry.Component);
+Cells.FindOrAdd(MakeKey(ToCell(Entry.Location.X), ToCell(Entry.Location.Y))).Add(Index);
+MaxRadius = FMath::Max(MaxRadius, Entry.Radius);
+}
+bool Contains(const UPrimitiveComponent* Component) const
 {
-Output.NewMovementBase = nullptr; 
-Output.NewMovementBaseOwner = nullptr;
-return;
+return Components.Contains(Component);
 }
-// Ignore collision with bases during these movements.
-TGuardValue<EMoveComponentFlags> ScopedFlagRestore(MoveComponentFlags, MoveComponentFlags | MOVECOMP_IgnoreBases);
-Output.DeltaQuat = FQuat::Identity;
-Output.DeltaPosition = FVector::ZeroVector;
-if (!MovementBaseAsyncData.bIsBaseTransformValid)
+// Calls Visitor with every capsule whose bounds overlap Bounds.
+template <typename VisitorType>
+void ForEachCandidate(const FBox& Bounds, VisitorType&& Visitor) const
 {
-return;
+auto VisitEntry = [&Bounds, &Visitor](const FEntry& Entry)
+{
+const FVector Extent(Entry.Radius, Entry.Radius, Entry.HalfHeight);
+if (Bounds.Intersect(FBox(Entry.Location - Extent, Entry.Location + Extent)))
+{
+Visitor(Entry);
 }
-FQuat NewBaseQuat = MovementBaseAsyncData.BaseQuat;
-FVector NewBaseLocation = MovementBaseAsyncData.BaseLocation;
-// Find change in rotation
-const bool bRotationChanged = !OldBaseQuat.Equals(NewBaseQuat, 1e-8f);
-if (bRotationChanged)
+};
+// Entries are filed by center, so widen the search by the largest radius.
+const int32 MinX = ToCell(Bounds.Min.X - MaxRadius);
+const int32 MinY = ToCell(Bounds.Min.Y - MaxRadius);
+const int32 MaxX = ToCell(Bounds.Max.X + MaxRadius);
+const int32 MaxY = ToCell(Bounds.Max.Y + MaxRadius);
+// A long move covers more cells than there are characters.
+if ((int64)(MaxX - MinX + 1) * (MaxY - MinY + 1) > Entries.Num())
 {
-Output.DeltaQuat = NewBaseQuat * OldBaseQuat.Inverse();
+for (const FEntry& Entry : Entries)
+{
+VisitEntry(Entry);
 }
-// only if base moved
-if (bRotationChanged || (OldBaseLocation != NewBaseLocation))
+return;
+}
+for (int32 X = MinX; X <= MaxX; ++X)
 {
-// Calculate new transform matrix of base actor (ignoring scale).
-const FQuatRotationTranslationMatrix OldLocalToWorld(OldBaseQuat, OldBaseLocation);
-const FQuatRotationTranslationMatrix NewLocalToWorld(NewBaseQuat, NewBaseLocation);
-FQuat FinalQuat = UpdatedComponentInput->GetRotation();
-if (bRotationChanged && !bIgnoreBaseRotation)
+for (int32 Y = MinY; Y <= MaxY; ++Y)
 {
-// Apply change in rotation and pipe through FaceRotation to maintain axis restrictions
-const FQuat PawnOldQuat = UpdatedComponentInput->GetRotation();
-const FQuat TargetQuat = Output.DeltaQuat * FinalQuat;
-FRotator TargetRotator(TargetQuat);
-CharacterInput->FaceRotation(TargetRotator, 0.0f, *this, Output);
-FinalQuat =  Output.CharacterOutput->Rotation.Quaternion();
-if (PawnOldQuat.Equals(FinalQuat, 1e-6f))
+if (const TArray<int32, TInlineAllocator<4>>* Cell = Cells.Find(MakeKey(X, Y)))
 {
-// Nothing changed. This means we probably are using another rotation mechanism (bOrientToMovement etc). We should still follow the base object.
-// @todo: This assumes only Yaw is used, currently a valid assumption. This is the only reason FaceRotation() is used above really, aside from being a virtual hook.
-if (bOrientRotationToMovement || (bUseControllerDesiredRotation /*&& CharacterOwner->Controller*/))
+for (const int32 Index : *Cell)
 {
-TargetRotator.Pitch = 0.f;
-TargetRotator.Roll = 0.f;
-MoveUpdatedComponent(FVector::ZeroVector, FQuat(TargetRotator), false, Output);
-FinalQuat = UpdatedComponentInput->GetRotation();
+VisitEntry(Entries[Index]);
 }
 }
 }
-// We need to offset the base of the character here, not its origin, so offset by half height
-float HalfHeight = Output.ScaledCapsuleHalfHeight;
-float Radius = Output.ScaledCapsuleRadius;
-FVector const BaseOffset(0.0f, 0.0f, HalfHeight);
-FVector const LocalBasePos = OldLocalToWorld.InverseTransformPosition(UpdatedComponentInput->GetPosition() - BaseOffset);
-FVector const NewWorldPos = ConstrainLocationToPlane(NewLocalToWorld.TransformPosition(LocalBasePos) + BaseOffset);
-Output.DeltaPosition = ConstrainDirectionToPlane(NewWorldPos - UpdatedComponentInput->GetPosition());
-// move attached actor
-if (false)
+}
+}
+// The weaker of the two responses wins, as in a component sweep. The moving character's settings come from its own input.
+static ECollisionResponse GetPairResponse(const FCharacterMovementComponentAsyncInput& Moving, const FEntry& Other)
 {
-UpdatedComponentInput->SetPosition(NewWorldPos);
-UpdatedComponentInput->SetRotation(FinalQuat);
+const FCollisionResponseContainer& MovingResponses = Moving.UpdatedComponentInput->MoveComponentCollisionResponseParams.CollisionResponse;
+return (ECollisionResponse)FMath::Min<uint8>(Other.Responses.GetResponse(Moving.CollisionChannel), MovingResponses.GetResponse(Other.ObjectType));
 }
-else
+};
+// Sweeps an upright capsule from Start to End against an upright capsule at OtherCenter. The pair reduces to a point moving against
+// their Minkowski sum, an upright capsule with the summed radii and segment half lengths: a ray against a cylinder side and two sphere caps.
+// OutNormal points from the other capsule towards the moving one. A capsule that starts overlapping reports time 0 and its penetration depth.
+static bool SweepCapsuleCapsule(const FVector& Start, const FVector& End, float Radius, float HalfHeight, const FVector& OtherCenter, float OtherRadius, float OtherHalfHeight, float& OutTime, FVector& OutNormal, float& OutPenetration)
 {
-// hack - transforms between local and world space introducing slight error FIXMESTEVE - discuss with engine team: just skip the transforms if no rotation?
-FVector BaseMoveDelta = NewBaseLocation - OldBaseLocation;
-if (!bRotationChanged && (BaseMoveDelta.X == 0.f) && (BaseMoveDelta.Y == 0.f))
+const double SumRadius = (double)Radius + OtherRadius;
+const double SumSegment = FMath::Max(0.0, (double)HalfHeight - Radius) + FMath::Max(0.0, (double)OtherHalfHeight - OtherRadius);
+const FVector S = Start - OtherCenter;
+const FVector D = End - Start;
+const FVector StartOffset(S.X, S.Y, S.Z - FMath::Clamp(S.Z, -SumSegment, SumSegment));
+const double StartDistanceSquared = StartOffset.SizeSquared();
+if (StartDistanceSquared < SumRadius * SumRadius)
 {
-Output.DeltaPosition.X = 0.f;
-Output.DeltaPosition.Y = 0.f;
+// Exactly on the axis, push out sideways.
+OutNormal = (StartDistanceSquared > UE_SMALL_NUMBER) ? StartOffset / CharacterMovementAsyncMath::Sqrt(StartDistanceSquared) : FVector::ForwardVector;
+OutPenetration = (float)(SumRadius - CharacterMovementAsyncMath::Sqrt(StartDistanceSquared));
+OutTime = 0.f;
+return true;
 }
-FHitResult MoveOnBaseHit(1.f);
-const FVector OldLocation = UpdatedComponentInput->GetPosition();
-MoveUpdatedComponent(Output.DeltaPosition, FinalQuat, true, Output, &MoveOnBaseHit);
-if ((UpdatedComponentInput->GetPosition() - (OldLocation + Output.DeltaPosition)).IsNearlyZero() == false)
+double BestTime = 2.0;
+// Cylinder side.
+const double A2D = D.X * D.X + D.Y * D.Y;
+if (A2D > UE_SMALL_NUMBER)
 {
-}
-}
-MovementBaseAsyncData.Validate(Output); // ensure we haven't changed movement base
-if (MovementBaseAsyncData.bMovementBaseIsSimulatedCached )
+const double B = S.X * D.X + S.Y * D.Y;
+const double C = S.X * S.X + S.Y * S.Y - SumRadius * SumRadius;
+const double Discriminant = B * B - A2D * C;
+if (Discriminant >= 0.0)
 {
-// If we hit this multiple times, our DeltaPostion/DeltaQuat is being stomped. Do we need to call for each, or just latest?
-ensure(Output.bShouldApplyDeltaToMeshPhysicsTransforms == false);
-Output.bShouldApplyDeltaToMeshPhysicsTransforms = true;
+const double Time = (-B - CharacterMovementAsyncMath::Sqrt(Discriminant)) / A2D;
+if (Time >= 0.0 && Time <= 1.0 && FMath::Abs(S.Z + Time * D.Z) <= SumSegment)
+{
+BestTime = Time;
 }
 }
 }
-void FCharacterMovementComponentAsyncInput::StartNewPhysics(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+// Sphere caps at both ends of the segment.
+const double A = D | D;
+if (A > UE_SMALL_NUMBER)
 {
-if ((deltaTime < UCharacterMovementComponent::MIN_TICK_TIME) || (Iterations >= MaxSimulationIterations) || !bHasValidData)
+for (const double CapZ : { -SumSegment, SumSegment })
 {
-return;
-}
-if (UpdatedComponentInput->bIsSimulatingPhysics)
+const FVector P(S.X, S.Y, S.Z - CapZ);
+const double B = P | D;
+const double C = (P | P) - SumRadius * SumRadius;
+const double Discriminant = B * B - A * C;
+if (Discriminant >= 0.0)
 {
-return;
-}
-const bool bSavedMovementInProgress = Output.bMovementInProgress;
-Output.bMovementInProgress = true;
-switch (Output.MovementMode)
+const double Time = (-B - CharacterMovementAsyncMath::Sqrt(Discriminant)) / A;
+if (Time >= 0.0 && Time < BestTime)
 {
-case MOVE_None:
-break;
-case MOVE_Walking:
-PhysWalking(deltaTime, Iterations, Output);
-break;
-case MOVE_Falling:
-PhysFalling(deltaTime, Iterations, Output);
-break;
-default:
-SetMovementMode(MOVE_None, Output);
-break;
+BestTime = Time;
 }
-Output.bMovementInProgress = bSavedMovementInProgress;
-if (bDeferUpdateMoveComponent)
+}
+}
+}
+if (BestTime > 1.0)
 {
-ensure(false);
+return false;
 }
+const FVector Contact = S + BestTime * D;
+OutNormal = CharacterMovementAsyncMath::GetSafeNormal(FVector(Contact.X, Contact.Y, Contact.Z - FMath::Clamp(Contact.Z, -SumSegment, SumSegment)));
+OutPenetration = 0.f;
+OutTime = (float)BestTime;
+return true;
 }
-void FCharacterMovementComponentAsyncInput::PhysWalking(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+// Velocity math shared by the member functions and the batched path.
+// The scalar functions are the reference. The lane functions repeat them operation for operation on four characters at a time in double precision,
+// with branches turned into lane masks, so results match the scalar path bit for bit as long as the compiler does not contract the scalar code into fused multiply-adds.
+namespace CharacterMovementAsyncKernels
 {
-const FCharacterMovementComponentAsyncInput& Input = *this;
-if (deltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+static constexpr int32 NumLanes = 4;
+using FLaneRegister = VectorRegister4Double;
+static bool IsExceedingMaxSpeed(const FVector& Velocity, float MaxSpeed)
 {
-return;
+MaxSpeed = FMath::Max(0.f, MaxSpeed);
+const float MaxSpeedSquared = FMath::Square(MaxSpeed);
+// Allow 1% error tolerance, to account for numeric imprecision.
+const float OverVelocityPercent = 1.01f;
+return (Velocity.SizeSquared() > MaxSpeedSquared * OverVelocityPercent);
 }
-FVector& Velocity = Output.Velocity;
-FVector& Acceleration = Output.Acceleration;
-if (false)
+// Friction and BrakingDeceleration must already be clamped to zero and scaled by the braking friction factor.
+static void ApplyVelocityBraking(FVector& Velocity, float Friction, float BrakingDeceleration, float DeltaTime, float MaxTimeStep)
 {
-Acceleration = FVector::ZeroVector;
-Velocity = FVector::ZeroVector;
-return;
-}
-if (!UpdatedComponentInput->bIsQueryCollisionEnabled)
+const bool bZeroFriction = (Friction == 0.f);
+const bool bZeroBraking = (BrakingDeceleration == 0.f);
+if (Velocity.IsZero() || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME || (bZeroFriction && bZeroBraking))
 {
-SetMovementMode(MOVE_Walking, Output);
 return;
 }
-Output.bJustTeleported = false;
-bool bCheckedFall = false;
-bool bTriedLedgeMove = false;
-float remainingTime = deltaTime;
-// Perform the move
-while ((remainingTime >= UCharacterMovementComponent::MIN_TICK_TIME) && (Iterations < MaxSimulationIterations)  && ( bRunPhysicsWithNoController
-|| RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideRootMotion || (true)))
-{
-Iterations++;
-Output.bJustTeleported = false;
-const float timeTick = GetSimulationTimeStep(remainingTime, Iterations);
-remainingTime -= timeTick;
-// Save current values
-MovementBaseAsyncData.Validate(Output);
-UPrimitiveComponent* const OldBase = MovementBaseAsyncData.CachedMovementBase;
-const FVector PreviousBaseLocation = MovementBaseAsyncData.BaseLocation;
-const FVector OldLocation = UpdatedComponentInput->GetPosition();
-const FFindFloorResult OldFloor = Output.CurrentFloor;
-RestorePreAdditiveRootMotionVelocity(Output);
-// Ensure velocity is horizontal.
-MaintainHorizontalGroundVelocity(Output);
-const FVector OldVelocity = Velocity;
-Acceleration.Z = 0.f;
-// Apply acceleration
-if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+const FVector OldVel = Velocity;
+// subdivide braking to get reasonably consistent results at lower frame rates
+float RemainingTime = DeltaTime;
+// Decelerate to brake to a stop
+const FVector RevAccel = (bZeroBraking ? FVector::ZeroVector : (-BrakingDeceleration * CharacterMovementAsyncMath::GetSafeNormal(Velocity)));
+while (RemainingTime >= UCharacterMovementComponent::MIN_TICK_TIME)
 {
-CalcVelocity(timeTick, GroundFriction, false, GetMaxBrakingDeceleration(Output), Output);
-}
-ApplyRootMotionToVelocity(timeTick, Output);
-if (IsFalling(Output))
+// Zero friction uses constant deceleration, so no need for iteration.
+const float dt = ((RemainingTime > MaxTimeStep && !bZeroFriction) ? FMath::Min(MaxTimeStep, RemainingTime * 0.5f) : RemainingTime);
+RemainingTime -= dt;
+// apply friction and braking
+Velocity = Velocity + ((-Friction) * Velocity + RevAccel) * dt;
+// Don't reverse direction
+if ((Velocity | OldVel) <= 0.f)
 {
-StartNewPhysics(remainingTime + timeTick, Iterations - 1, Output);
+Velocity = FVector::ZeroVector;
 return;
 }
-// Compute move parameters
-const FVector MoveVelocity = Velocity;
-const FVector Delta = timeTick * MoveVelocity;
-const bool bZeroDelta = Delta.IsNearlyZero();
-FStepDownResult StepDownResult;
-if (bZeroDelta)
+}
+// Clamp to zero if nearly zero, or if below min threshold and braking.
+const float VSizeSq = Velocity.SizeSquared();
+if (VSizeSq <= UE_KINDA_SMALL_NUMBER || (!bZeroBraking && VSizeSq <= FMath::Square(UCharacterMovementComponent::BRAKE_TO_STOP_VELOCITY)))
 {
-remainingTime = 0.f;
+Velocity = FVector::ZeroVector;
 }
-else
+}
+static FVector NewFallVelocity(const FVector& InitialVelocity, const FVector& Gravity, float DeltaTime, float TerminalLimit)
 {
-// try to move forward
-MoveAlongFloor(MoveVelocity, timeTick, &StepDownResult, Output);
-if (IsFalling(Output))
+FVector Result = InitialVelocity;
+if (DeltaTime > 0.f)
 {
-// pawn decided to jump up
-const float DesiredDist = Delta.Size();
-if (DesiredDist > UE_KINDA_SMALL_NUMBER)
+Result += Gravity * DeltaTime;
+// Don't exceed terminal velocity.
+if (Result.SizeSquared() > FMath::Square(TerminalLimit))
 {
-const float ActualDist = (UpdatedComponentInput->GetPosition() - OldLocation).Size2D();
-remainingTime += timeTick * (1.f - FMath::Min(1.f, ActualDist / DesiredDist));
+const FVector GravityDir = CharacterMovementAsyncMath::GetSafeNormal(Gravity);
+if ((Result | GravityDir) > TerminalLimit)
+{
+Result = FVector::PointPlaneProject(Result, FVector::ZeroVector, GravityDir) + GravityDir * TerminalLimit;
 }
-StartNewPhysics(remainingTime, Iterations, Output);
-return;
 }
 }
-// Update floor.
-// StepUp might have already done it for us.
-if (StepDownResult.bComputedFloor)
+return Result;
+}
+// Exact solution of dV/dt = -Friction * V - BrakingDeceleration * Dir over DeltaTime, with Dir the initial direction of travel.
+// Velocity stays along Dir, so only the speed needs integrating: exponential friction decay plus constant deceleration, stopping where the speed reaches zero.
+// This is the limit the substepped loop converges to as BrakingSubStepTime shrinks, and costs the same at any tick rate.
+static void ApplyVelocityBrakingClosedForm(FVector& Velocity, float Friction, float BrakingDeceleration, float DeltaTime)
 {
-Output.CurrentFloor = StepDownResult.FloorResult;
+const bool bZeroFriction = (Friction == 0.f);
+const bool bZeroBraking = (BrakingDeceleration == 0.f);
+if (Velocity.IsZero() || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME || (bZeroFriction && bZeroBraking))
+{
+return;
 }
-else
+// Below the GetSafeNormal tolerance the loop has no braking direction either, and friction alone applies.
+const FVector Dir = CharacterMovementAsyncMath::GetSafeNormal(Velocity);
+const double Deceleration = Dir.IsZero() ? 0.0 : (double)BrakingDeceleration;
+const double Speed = Velocity.Size();
+double NewSpeed = 0.0;
+if (bZeroFriction)
 {
-FindFloor(UpdatedComponentInput->GetPosition(), Output.CurrentFloor, bZeroDelta, Output);
+NewSpeed = Speed - Deceleration * DeltaTime;
 }
-// check for ledges here
-const bool bCheckLedges = !CanWalkOffLedges(Output);
-if (bCheckLedges && !Output.CurrentFloor.IsWalkableFloor())
+else
 {
-// calculate possible alternate movement
-const FVector GravDir = FVector(0.f, 0.f, -1.f);
-const FVector NewDelta = bTriedLedgeMove ? FVector::ZeroVector : GetLedgeMove(OldLocation, Delta, GravDir, Output);
-if (!NewDelta.IsZero())
+const double Decay = FMath::Exp(-(double)Friction * DeltaTime);
+NewSpeed = Speed * Decay - (Deceleration / Friction) * (1.0 - Decay);
+}
+// Don't reverse direction
+if (NewSpeed <= 0.0)
 {
-// first revert this move
-RevertMove(OldLocation, OldBase, PreviousBaseLocation, OldFloor, false, Output);
-// avoid repeated ledge moves if the first one fails
-bTriedLedgeMove = true;
-// Try new movement direction
-Velocity = NewDelta / timeTick;
-remainingTime += timeTick;
-continue;
+Velocity = FVector::ZeroVector;
+return;
 }
-else
+Velocity *= NewSpeed / Speed;
+// Clamp to zero if nearly zero, or if below min threshold and braking.
+const float VSizeSq = Velocity.SizeSquared();
+if (VSizeSq <= UE_KINDA_SMALL_NUMBER || (!bZeroBraking && VSizeSq <= FMath::Square(UCharacterMovementComponent::BRAKE_TO_STOP_VELOCITY)))
 {
-ensure(false); 
-break;
+Velocity = FVector::ZeroVector;
 }
 }
-else
+// Everything CalcVelocity needs once path following and forced acceleration have been resolved.
+struct FCalcVelocityParams
 {
-// Validate the floor check
-if (Output.CurrentFloor.IsWalkableFloor())
+float DeltaTime = 0.f;
+float Friction = 0.f;
+bool bFluid = false;
+// Clamped and scaled like the arguments of ApplyVelocityBraking.
+float BrakingFriction = 0.f;
+float BrakingDeceleration = 0.f;
+float MaxBrakingTimeStep = 0.f;
+bool bClosedFormBraking = false;
+float MaxInputSpeed = 0.f;
+FVector RequestedAcceleration = FVector::ZeroVector;
+float RequestedSpeed = 0.f;
+bool bZeroRequestedAcceleration = true;
+};
+static void CalcVelocity(FVector& Velocity, const FVector& Acceleration, const FCalcVelocityParams& Params)
 {
-if (ShouldCatchAir(OldFloor, Output.CurrentFloor))
+const float DeltaTime = Params.DeltaTime;
+const float MaxSpeed = FMath::Max(Params.RequestedSpeed, Params.MaxInputSpeed);
+// Apply braking or deceleration
+const bool bZeroAcceleration = Acceleration.IsZero();
+const bool bVelocityOverMax = IsExceedingMaxSpeed(Velocity, MaxSpeed);
+// Only apply braking if there is no acceleration, or we are over our max speed and need to slow down to it.
+if ((bZeroAcceleration && Params.bZeroRequestedAcceleration) || bVelocityOverMax)
 {
-HandleWalkingOffLedge(OldFloor.HitResult.ImpactNormal, OldFloor.HitResult.Normal, OldLocation, timeTick);
-if (IsMovingOnGround(Output))
+const FVector OldVelocity = Velocity;
+if (Params.bClosedFormBraking)
 {
-// If still walking, then fall. If not, assume the user set a different mode they want to keep.
-StartFalling(Iterations, remainingTime, timeTick, Delta, OldLocation, Output);
+ApplyVelocityBrakingClosedForm(Velocity, Params.BrakingFriction, Params.BrakingDeceleration, DeltaTime);
 }
-return;
+else
+{
+ApplyVelocityBraking(Velocity, Params.BrakingFriction, Params.BrakingDeceleration, DeltaTime, Params.MaxBrakingTimeStep);
 }
-AdjustFloorHeight(Output);
-Output.NewMovementBase = Output.CurrentFloor.HitResult.Component.Get();
-Output.NewMovementBaseOwner = Output.CurrentFloor.HitResult.GetActor();
+// Don't allow braking to lower us below max speed if we started above it.
+if (bVelocityOverMax && Velocity.SizeSquared() < FMath::Square(MaxSpeed) && FVector::DotProduct(Acceleration, OldVelocity) > 0.0f)
+{
+Velocity = CharacterMovementAsyncMath::GetSafeNormal(OldVelocity) * MaxSpeed;
 }
-else if (Output.CurrentFloor.HitResult.bStartPenetrating && remainingTime <= 0.f)
+}
+else if (!bZeroAcceleration)
 {
-// The floor check failed because it started in penetration
-// We do not want to try to move downward because the downward sweep failed, rather we'd like to try to pop out of the floor.
-FHitResult Hit(Output.CurrentFloor.HitResult);
-Hit.TraceEnd = Hit.TraceStart + FVector(0.f, 0.f, UCharacterMovementComponent::MAX_FLOOR_DIST);
-const FVector RequestedAdjustment = GetPenetrationAdjustment(Hit);
-ResolvePenetration(RequestedAdjustment, Hit, UpdatedComponentInput->GetRotation(), Output);
-Output.bForceNextFloorCheck = true;
+// Friction affects our ability to change direction. This is only done for input acceleration, not path following.
+const FVector AccelDir = CharacterMovementAsyncMath::GetSafeNormal(Acceleration);
+const float VelSize = Velocity.Size();
+Velocity = Velocity - (Velocity - AccelDir * VelSize) * FMath::Min(DeltaTime * Params.Friction, 1.f);
 }
-// See if we need to start falling.
-if (!Output.CurrentFloor.IsWalkableFloor() && !Output.CurrentFloor.HitResult.bStartPenetrating)
+if (Params.bFluid)
 {
-const bool bMustJump = Output.bJustTeleported || bZeroDelta;// || (OldBase == NULL || (!OldBase->IsQueryCollisionEnabled() && MovementBaseUtility::IsDynamicBase(OldBase)));
-if ((bMustJump || !bCheckedFall) && CheckFall(OldFloor, Output.CurrentFloor.HitResult, Delta, OldLocation, remainingTime, timeTick, Iterations, bMustJump, Output))
+Velocity = Velocity * (1.f - FMath::Min(Params.Friction * DeltaTime, 1.f));
+}
+if (!bZeroAcceleration)
 {
-return;
+const float NewMaxInputSpeed = IsExceedingMaxSpeed(Velocity, Params.MaxInputSpeed) ? Velocity.Size() : Params.MaxInputSpeed;
+Velocity += Acceleration * DeltaTime;
+Velocity = CharacterMovementAsyncMath::GetClampedToMaxSize(Velocity, NewMaxInputSpeed);
 }
-bCheckedFall = true;
+// Apply additional requested acceleration
+if (!Params.bZeroRequestedAcceleration)
+{
+const float NewMaxRequestedSpeed = IsExceedingMaxSpeed(Velocity, Params.RequestedSpeed) ? Velocity.Size() : Params.RequestedSpeed;
+Velocity += Params.RequestedAcceleration * DeltaTime;
+Velocity = CharacterMovementAsyncMath::GetClampedToMaxSize(Velocity, NewMaxRequestedSpeed);
 }
 }
-// Allow overlap events and such to change physics state and velocity
-if (IsMovingOnGround(Output))
+// Vectors stored as structure-of-arrays, padded with zeros to a whole number of lanes.
+struct FVectorLanes
 {
-// Make velocity reflect actual move
-if (!Output.bJustTeleported && !RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion && timeTick >= UCharacterMovementComponent::MIN_TICK_TIME)
+TArray<double> X;
+TArray<double> Y;
+TArray<double> Z;
+void SetNum(int32 Num)
 {
-Velocity = (UpdatedComponentInput->GetPosition() - OldLocation) / timeTick;
-MaintainHorizontalGroundVelocity(Output);
+const int32 NumPadded = Align(Num, NumLanes);
+X.SetNumZeroed(NumPadded);
+Y.SetNumZeroed(NumPadded);
+Z.SetNumZeroed(NumPadded);
 }
-}
-// If we didn't move at all this iteration then abort (since future iterations will also be stuck).
-if (UpdatedComponentInput->GetPosition() == OldLocation)
+void Set(int32 Index, const FVector& Value)
 {
-remainingTime = 0.f;
-break;
-}
+X[Index] = Value.X;
+Y[Index] = Value.Y;
+Z[Index] = Value.Z;
 }
-if (IsMovingOnGround(Output))
+FVector Get(int32 Index) const
 {
-MaintainHorizontalGroundVelocity(Output);
+return FVector(X[Index], Y[Index], Z[Index]);
 }
+};
+// Per-character inputs of CalcVelocityBatch. Only characters without path following or fluid friction can go through the lanes,
+// everything else must use the scalar CalcVelocity.
+struct FCalcVelocityLanes
+{
+FVectorLanes Velocities;
+FVectorLanes Accelerations;
+TArray<float> Friction;
+TArray<float> BrakingFriction;
+TArray<float> BrakingDeceleration;
+TArray<float> MaxInputSpeed;
+void SetNum(int32 Num)
+{
+const int32 NumPadded = Align(Num, NumLanes);
+Velocities.SetNum(Num);
+Accelerations.SetNum(Num);
+Friction.SetNumZeroed(NumPadded);
+BrakingFriction.SetNumZeroed(NumPadded);
+BrakingDeceleration.SetNumZeroed(NumPadded);
+MaxInputSpeed.SetNumZeroed(NumPadded);
 }
-void FCharacterMovementComponentAsyncInput::PhysFalling(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+};
+struct FLaneVector
 {
-const float MIN_TICK_TIME = UCharacterMovementComponent::MIN_TICK_TIME;
-if (deltaTime < MIN_TICK_TIME)
+FLaneRegister X;
+FLaneRegister Y;
+FLaneRegister Z;
+};
+// Lane masks are 0 or 1, so they combine with multiply (and), max (or) and 1 - x (not).
+static FORCEINLINE FLaneRegister SplatLanes(double Value)
 {
-return;
+return MakeVectorRegisterDouble(Value, Value, Value, Value);
 }
-FVector& Velocity = Output.Velocity;
-FVector FallAcceleration = GetFallingLateralAcceleration(deltaTime, Output);
-FallAcceleration.Z = 0.f;
-const bool bHasLimitedAirControl = ShouldLimitAirControl(deltaTime, FallAcceleration, Output);
-float remainingTime = deltaTime;
-while ((remainingTime >= MIN_TICK_TIME) && (Iterations < MaxSimulationIterations))
+static FORCEINLINE FLaneRegister LoadLanes(const float* Values)
 {
-Iterations++;
-float timeTick = GetSimulationTimeStep(remainingTime, Iterations);
-remainingTime -= timeTick;
-const FVector OldLocation = UpdatedComponentInput->GetPosition();
-const FQuat PawnRotation = UpdatedComponentInput->GetRotation();
-Output.bJustTeleported = false;
-RestorePreAdditiveRootMotionVelocity(Output);
-const FVector OldVelocity = Velocity;
-const float MaxDecel = GetMaxBrakingDeceleration(Output);
-if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+return MakeVectorRegisterDouble((double)Values[0], (double)Values[1], (double)Values[2], (double)Values[3]);
+}
+static FORCEINLINE FLaneVector LoadLanes(const FVectorLanes& Vectors, int32 Index)
 {
+return { VectorLoad(&Vectors.X[Index]), VectorLoad(&Vectors.Y[Index]), VectorLoad(&Vectors.Z[Index]) };
+}
+static FORCEINLINE void StoreLanes(const FLaneVector& Value, FVectorLanes& Vectors, int32 Index)
 {
-TGuardValue<FVector> RestoreAcceleration(Output.Acceleration, FallAcceleration);
-Velocity.Z = 0.f;
-CalcVelocity(timeTick, FallingLateralFriction, false, MaxDecel, Output);
-Velocity.Z = OldVelocity.Z;
+VectorStore(Value.X, &Vectors.X[Index]);
+VectorStore(Value.Y, &Vectors.Y[Index]);
+VectorStore(Value.Z, &Vectors.Z[Index]);
 }
+static FORCEINLINE FLaneRegister LaneMask(const FLaneRegister& CompareMask)
+{
+return VectorSelect(CompareMask, VectorOneDouble(), VectorZeroDouble());
 }
-const FVector Gravity(0.f, 0.f, GravityZ);
-float GravityTime = timeTick;
-// If jump is providing force, gravity may be affected.
-bool bEndingJumpForce = false;
-if (Output.CharacterOutput->JumpForceTimeRemaining > 0.0f)
+static FORCEINLINE FLaneRegister NotLanes(const FLaneRegister& Mask)
 {
-// Consume some of the force time. Only the remaining time (if any) is affected by gravity when bApplyGravityWhileJumping=false.
-const float JumpForceTime = FMath::Min(Output.CharacterOutput->JumpForceTimeRemaining, timeTick);
-GravityTime = bApplyGravityWhileJumping ? timeTick : FMath::Max(0.0f, timeTick - JumpForceTime);
-Output.CharacterOutput->JumpForceTimeRemaining -= JumpForceTime;
-if (Output.CharacterOutput->JumpForceTimeRemaining <= 0.0f)
+return VectorSubtract(VectorOneDouble(), Mask);
+}
+static FORCEINLINE bool AnyLane(const FLaneRegister& Mask)
 {
-CharacterInput->ResetJumpState(*this, Output);
-bEndingJumpForce = true;
+return VectorMaskBits(VectorCompareGT(Mask, VectorZeroDouble())) != 0;
 }
+// Rounds every lane through float, like scalar code that stores a double result in a float.
+static FORCEINLINE FLaneRegister RoundLanesToFloat(const FLaneRegister& Value)
+{
+return VectorRegister4Double(MakeVectorRegisterFloatFromDouble(Value));
 }
-Velocity = NewFallVelocity(Velocity, Gravity, GravityTime, Output);
-// See if we need to sub-step to exactly reach the apex. This is important for avoiding "cutting off the top" of the trajectory as framerate varies.
-if (CharacterMovementCVars::ForceJumpPeakSubstep && OldVelocity.Z > 0.f && Velocity.Z <= 0.f && Output.NumJumpApexAttempts < MaxJumpApexAttemptsPerSimulation)
+static FORCEINLINE FLaneRegister SelectLanes(const FLaneRegister& Mask, const FLaneRegister& A, const FLaneRegister& B)
 {
-const FVector DerivedAccel = (Velocity - OldVelocity) / timeTick;
-if (!FMath::IsNearlyZero(DerivedAccel.Z))
+return VectorSelect(VectorCompareGT(Mask, VectorZeroDouble()), A, B);
+}
+static FORCEINLINE FLaneVector SelectLanes(const FLaneRegister& Mask, const FLaneVector& A, const FLaneVector& B)
 {
-const float TimeToApex = -OldVelocity.Z / DerivedAccel.Z;
-// The time-to-apex calculation should be precise, and we want to avoid adding a substep when we are basically already at the apex from the previous iteration's work.
-const float ApexTimeMinimum = 0.0001f;
-if (TimeToApex >= ApexTimeMinimum && TimeToApex < timeTick)
+const FLaneRegister CompareMask = VectorCompareGT(Mask, VectorZeroDouble());
+return { VectorSelect(CompareMask, A.X, B.X), VectorSelect(CompareMask, A.Y, B.Y), VectorSelect(CompareMask, A.Z, B.Z) };
+}
+static FORCEINLINE FLaneVector SplatLanes(const FVector& Value)
 {
-const FVector ApexVelocity = OldVelocity + DerivedAccel * TimeToApex;
-Velocity = ApexVelocity;
-Velocity.Z = 0.f; // Should be nearly zero anyway, but this makes apex notifications consistent.
-// We only want to move the amount of time it takes to reach the apex, and refund the unused time for next iteration.
-remainingTime += (timeTick - TimeToApex);
-timeTick = TimeToApex;
-Iterations--;
-Output.NumJumpApexAttempts++;
+return { SplatLanes(Value.X), SplatLanes(Value.Y), SplatLanes(Value.Z) };
 }
+static FORCEINLINE FLaneVector AddLanes(const FLaneVector& A, const FLaneVector& B)
+{
+return { VectorAdd(A.X, B.X), VectorAdd(A.Y, B.Y), VectorAdd(A.Z, B.Z) };
 }
+static FORCEINLINE FLaneVector SubtractLanes(const FLaneVector& A, const FLaneVector& B)
+{
+return { VectorSubtract(A.X, B.X), VectorSubtract(A.Y, B.Y), VectorSubtract(A.Z, B.Z) };
 }
-// Compute change in position (using midpoint integration method).
-FVector Adjusted = 0.5f * (OldVelocity + Velocity) * timeTick;
-// Special handling if ending the jump force where we didn't apply gravity during the jump.
-if (bEndingJumpForce && !bApplyGravityWhileJumping)
+static FORCEINLINE FLaneVector ScaleLanes(const FLaneVector& A, const FLaneRegister& Scale)
 {
-// We had a portion of the time at constant speed then a portion with acceleration due to gravity.
-// Account for that here with a more correct change in position.
-const float NonGravityTime = FMath::Max(0.f, timeTick - GravityTime);
-Adjusted = (OldVelocity * NonGravityTime) + (0.5f * (OldVelocity + Velocity) * GravityTime);
+return { VectorMultiply(A.X, Scale), VectorMultiply(A.Y, Scale), VectorMultiply(A.Z, Scale) };
 }
-FHitResult Hit(1.f);
-SafeMoveUpdatedComponent(Adjusted, PawnRotation, true, Hit, Output);
-if (!bHasValidData)
+// Same summation order as FVector::operator| and FVector::SizeSquared.
+static FORCEINLINE FLaneRegister DotLanes(const FLaneVector& A, const FLaneVector& B)
 {
-return;
+return VectorAdd(VectorAdd(VectorMultiply(A.X, B.X), VectorMultiply(A.Y, B.Y)), VectorMultiply(A.Z, B.Z));
 }
-float LastMoveTimeSlice = timeTick;
-float subTimeTickRemaining = timeTick * (1.f - Hit.Time);
-if (false)//IsSwimming()) //just entered water
+static FORCEINLINE FLaneRegister IsZeroLanes(const FLaneVector& A)
 {
+const FLaneRegister Zero = VectorZeroDouble();
+return VectorMultiply(VectorMultiply(LaneMask(VectorCompareEQ(A.X, Zero)), LaneMask(VectorCompareEQ(A.Y, Zero))), LaneMask(VectorCompareEQ(A.Z, Zero)));
 }
-else if (Hit.bBlockingHit)
+// FVector::GetSafeNormal with the default tolerance.
+static FORCEINLINE FLaneVector GetSafeNormalLanes(const FLaneVector& A)
 {
-if (IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output))
+const FLaneRegister SquareSum = DotLanes(A, A);
+const FLaneVector Normal = ScaleLanes(A, VectorDivide(VectorOneDouble(), VectorSqrt(SquareSum)));
+const FLaneVector Unit = SelectLanes(LaneMask(VectorCompareEQ(SquareSum, VectorOneDouble())), A, Normal);
+return SelectLanes(LaneMask(VectorCompareGT(SplatLanes(UE_SMALL_NUMBER), SquareSum)), SplatLanes(FVector::ZeroVector), Unit);
+}
+// Lane version of ApplyVelocityBraking. Lanes whose Active mask is 0 are left untouched.
+static void ApplyVelocityBrakingLanes(FLaneVector& Velocity, const FLaneRegister& Friction, const FLaneRegister& BrakingDeceleration, const FLaneRegister& Active, float DeltaTime, float MaxTimeStep)
+{
+if (DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
 {
-remainingTime += subTimeTickRemaining;
-ProcessLanded(Hit, remainingTime, Iterations, Output);
 return;
 }
-else
+const FLaneRegister Zero = VectorZeroDouble();
+const FLaneRegister ZeroFriction = LaneMask(VectorCompareEQ(Friction, Zero));
+const FLaneRegister ZeroBraking = LaneMask(VectorCompareEQ(BrakingDeceleration, Zero));
+const FLaneRegister Live = VectorMultiply(Active, NotLanes(VectorMax(IsZeroLanes(Velocity), VectorMultiply(ZeroFriction, ZeroBraking))));
+if (!AnyLane(Live))
 {
-// Compute impact deflection based on final velocity, not integration step.
-// This allows us to compute a new velocity from the deflected vector, and ensures the full gravity effect is included in the slide result.
-Adjusted = Velocity * timeTick;
-// See if we can convert a normally invalid landing spot (based on the hit result) to a usable one.
-if (!Hit.bStartPenetrating && ShouldCheckForValidLandingSpot(timeTick, Adjusted, Hit, Output))
+return;
+}
+const FLaneVector OldVel = Velocity;
+const FLaneRegister NegFriction = VectorNegate(Friction);
+const FLaneVector RevAccel = SelectLanes(ZeroBraking, SplatLanes(FVector::ZeroVector), ScaleLanes(GetSafeNormalLanes(Velocity), VectorNegate(BrakingDeceleration)));
+FLaneRegister Braking = Live;
+float RemainingTime = DeltaTime;
+while (RemainingTime >= UCharacterMovementComponent::MIN_TICK_TIME && AnyLane(Braking))
 {
-const FVector PawnLocation = UpdatedComponentInput->GetPosition();
-FFindFloorResult FloorResult;
-FindFloor(PawnLocation, FloorResult, false, Output);
-if (FloorResult.IsWalkableFloor() && IsValidLandingSpot(PawnLocation, FloorResult.HitResult, Output))
+// Lanes with friction share one substep schedule. Frictionless lanes take all of DeltaTime in their first step, like the scalar loop.
+const float FrictionStep = ((RemainingTime > MaxTimeStep) ? FMath::Min(MaxTimeStep, RemainingTime * 0.5f) : RemainingTime);
+RemainingTime -= FrictionStep;
+const FLaneRegister Step = SelectLanes(ZeroFriction, SplatLanes(DeltaTime), SplatLanes(FrictionStep));
+FLaneVector NewVelocity = AddLanes(Velocity, ScaleLanes(AddLanes(ScaleLanes(Velocity, NegFriction), RevAccel), Step));
+// Don't reverse direction
+const FLaneRegister Reversed = LaneMask(VectorCompareGE(Zero, DotLanes(NewVelocity, OldVel)));
+NewVelocity = SelectLanes(Reversed, SplatLanes(FVector::ZeroVector), NewVelocity);
+Velocity = SelectLanes(Braking, NewVelocity, Velocity);
+Braking = VectorMultiply(Braking, NotLanes(VectorMax(Reversed, ZeroFriction)));
+}
+// Clamp to zero if nearly zero, or if below min threshold and braking. Reversed lanes are already zero.
+const FLaneRegister VSizeSq = RoundLanesToFloat(DotLanes(Velocity, Velocity));
+const FLaneRegister NearlyZero = LaneMask(VectorCompareGE(SplatLanes(UE_KINDA_SMALL_NUMBER), VSizeSq));
+const FLaneRegister BelowStop = VectorMultiply(NotLanes(ZeroBraking), LaneMask(VectorCompareGE(SplatLanes(FMath::Square(UCharacterMovementComponent::BRAKE_TO_STOP_VELOCITY)), VSizeSq)));
+Velocity = SelectLanes(VectorMultiply(Live, VectorMax(NearlyZero, BelowStop)), SplatLanes(FVector::ZeroVector), Velocity);
+}
+// Lane version of CalcVelocity without path following and fluid friction. MaxSpeed is the analog adjusted MaxInputSpeed.
+static void CalcVelocityLanes(FLaneVector& Velocity, const FLaneVector& Acceleration, const FLaneRegister& Friction, const FLaneRegister& BrakingFriction, const FLaneRegister& BrakingDeceleration, const FLaneRegister& MaxInputSpeed, float DeltaTime, float MaxTimeStep)
+{
+const FLaneRegister Zero = VectorZeroDouble();
+const FLaneRegister MaxSpeed = VectorMax(MaxInputSpeed, Zero);
+const FLaneRegister MaxSpeedSquared = RoundLanesToFloat(VectorMultiply(MaxSpeed, MaxSpeed));
+// IsExceedingMaxSpeed threshold. MaxSpeed and MaxInputSpeed clamp to the same value here, so it serves both checks.
+const FLaneRegister OverMaxSquared = RoundLanesToFloat(VectorMultiply(MaxSpeedSquared, SplatLanes(1.01f)));
+const FLaneRegister ZeroAcceleration = IsZeroLanes(Acceleration);
+const FLaneRegister VelocityOverMax = LaneMask(VectorCompareGT(DotLanes(Velocity, Velocity), OverMaxSquared));
+const FLaneRegister Brake = VectorMax(ZeroAcceleration, VelocityOverMax);
+const FLaneVector OldVelocity = Velocity;
+ApplyVelocityBrakingLanes(Velocity, BrakingFriction, BrakingDeceleration, Brake, DeltaTime, MaxTimeStep);
+// Don't allow braking to lower us below max speed if we started above it.
+const FLaneRegister KeepMaxSpeed = VectorMultiply(VectorMultiply(VelocityOverMax, LaneMask(VectorCompareGT(MaxSpeedSquared, DotLanes(Velocity, Velocity)))), LaneMask(VectorCompareGT(DotLanes(Acceleration, OldVelocity), Zero)));
+Velocity = SelectLanes(KeepMaxSpeed, ScaleLanes(GetSafeNormalLanes(OldVelocity), MaxSpeed), Velocity);
+// Friction affects our ability to change direction.
+const FLaneVector AccelDir = GetSafeNormalLanes(Acceleration);
+const FLaneRegister VelSize = RoundLanesToFloat(VectorSqrt(DotLanes(Velocity, Velocity)));
+const FLaneRegister TurnFactor = VectorMin(RoundLanesToFloat(VectorMultiply(SplatLanes(DeltaTime), Friction)), VectorOneDouble());
+const FLaneVector Turned = SubtractLanes(Velocity, ScaleLanes(SubtractLanes(Velocity, ScaleLanes(AccelDir, VelSize)), TurnFactor));
+Velocity = SelectLanes(NotLanes(Brake), Turned, Velocity);
+// Accelerate, clamped to max input speed unless already above it.
+const FLaneRegister SpeedSquared = DotLanes(Velocity, Velocity);
+const FLaneRegister NewMaxInputSpeed = SelectLanes(LaneMask(VectorCompareGT(SpeedSquared, OverMaxSquared)), RoundLanesToFloat(VectorSqrt(SpeedSquared)), MaxInputSpeed);
+const FLaneVector Accelerated = AddLanes(Velocity, ScaleLanes(Acceleration, SplatLanes(DeltaTime)));
+// FVector::GetClampedToMaxSize
+const FLaneRegister AcceleratedSquared = DotLanes(Accelerated, Accelerated);
+const FLaneVector Scaled = ScaleLanes(Accelerated, VectorMultiply(NewMaxInputSpeed, VectorDivide(VectorOneDouble(), VectorSqrt(AcceleratedSquared))));
+FLaneVector Clamped = SelectLanes(LaneMask(VectorCompareGT(AcceleratedSquared, VectorMultiply(NewMaxInputSpeed, NewMaxInputSpeed))), Scaled, Accelerated);
+Clamped = SelectLanes(LaneMask(VectorCompareGT(SplatLanes(UE_KINDA_SMALL_NUMBER), NewMaxInputSpeed)), SplatLanes(FVector::ZeroVector), Clamped);
+Velocity = SelectLanes(NotLanes(ZeroAcceleration), Clamped, Velocity);
+}
+static void ApplyVelocityBrakingBatch(FVectorLanes& Velocities, TArrayView<const float> Friction, TArrayView<const float> BrakingDeceleration, float DeltaTime, float MaxTimeStep)
+{
+for (int32 Index = 0; Index < Velocities.X.Num(); Index += NumLanes)
+{
+FLaneVector Velocity = LoadLanes(Velocities, Index);
+ApplyVelocityBrakingLanes(Velocity, LoadLanes(&Friction[Index]), LoadLanes(&BrakingDeceleration[Index]), VectorOneDouble(), DeltaTime, MaxTimeStep);
+StoreLanes(Velocity, Velocities, Index);
+}
+}
+static void NewFallVelocityBatch(FVectorLanes& Velocities, const FVector& Gravity, float DeltaTime, TArrayView<const float> TerminalLimit)
+{
+if (DeltaTime <= 0.f)
 {
-remainingTime += subTimeTickRemaining;
-ProcessLanded(FloorResult.HitResult, remainingTime, Iterations, Output);
 return;
 }
+const FLaneVector GravityStep = SplatLanes(Gravity * DeltaTime);
+const FLaneVector GravityDir = SplatLanes(CharacterMovementAsyncMath::GetSafeNormal(Gravity));
+for (int32 Index = 0; Index < Velocities.X.Num(); Index += NumLanes)
+{
+const FLaneRegister Limit = LoadLanes(&TerminalLimit[Index]);
+const FLaneVector Result = AddLanes(LoadLanes(Velocities, Index), GravityStep);
+// Don't exceed terminal velocity.
+const FLaneRegister AlongGravity = DotLanes(Result, GravityDir);
+const FLaneRegister OverLimit = VectorMultiply(LaneMask(VectorCompareGT(DotLanes(Result, Result), RoundLanesToFloat(VectorMultiply(Limit, Limit)))), LaneMask(VectorCompareGT(AlongGravity, Limit)));
+const FLaneVector Limited = AddLanes(SubtractLanes(Result, ScaleLanes(GravityDir, AlongGravity)), ScaleLanes(GravityDir, Limit));
+StoreLanes(SelectLanes(OverLimit, Limited, Result), Velocities, Index);
+}
+}
+static void CalcVelocityBatch(FCalcVelocityLanes& Lanes, float DeltaTime, float MaxTimeStep)
+{
+for (int32 Index = 0; Index < Lanes.Velocities.X.Num(); Index += NumLanes)
+{
+FLaneVector Velocity = LoadLanes(Lanes.Velocities, Index);
+CalcVelocityLanes(Velocity, LoadLanes(Lanes.Accelerations, Index), LoadLanes(&Lanes.Friction[Index]), LoadLanes(&Lanes.BrakingFriction[Index]), LoadLanes(&Lanes.BrakingDeceleration[Index]), LoadLanes(&Lanes.MaxInputSpeed[Index]), DeltaTime, MaxTimeStep);
+StoreLanes(Velocity, Lanes.Velocities, Index);
+}
+}
+}
+// A velocity update the batch path already ran through the lane kernels, with every input the result depends on.
+// The scalar code takes Result only when its own inputs are identical, so a prediction can never change the outcome.
+struct FCharacterMovementAsyncVelocityPrediction
+{
+enum class EKind : uint8
+{
+None,
+CalcVelocity,
+NewFallVelocity,
+};
+EKind Kind = EKind::None;
+FVector Velocity = FVector::ZeroVector;
+float DeltaTime = 0.f;
+// CalcVelocity, clamped like FCalcVelocityParams.
+FVector Acceleration = FVector::ZeroVector;
+float Friction = 0.f;
+float BrakingFriction = 0.f;
+float BrakingDeceleration = 0.f;
+float MaxBrakingTimeStep = 0.f;
+float MaxInputSpeed = 0.f;
+// NewFallVelocity
+FVector Gravity = FVector::ZeroVector;
+float TerminalLimit = 0.f;
+FVector Result = FVector::ZeroVector;
+bool MatchesCalcVelocity(const FVector& InVelocity, const FVector& InAcceleration, const CharacterMovementAsyncKernels::FCalcVelocityParams& Params) const
+{
+// The lanes cover neither path following, fluid friction nor closed-form braking.
+return Kind == EKind::CalcVelocity && !Params.bFluid && Params.bZeroRequestedAcceleration && !Params.bClosedFormBraking
+&& Params.DeltaTime == DeltaTime && Params.Friction == Friction && Params.BrakingFriction == BrakingFriction && Params.BrakingDeceleration == BrakingDeceleration
+&& Params.MaxBrakingTimeStep == MaxBrakingTimeStep && Params.MaxInputSpeed == MaxInputSpeed && InVelocity == Velocity && InAcceleration == Acceleration;
+}
+bool MatchesNewFallVelocity(const FVector& InVelocity, const FVector& InGravity, float InDeltaTime, float InTerminalLimit) const
+{
+return Kind == EKind::NewFallVelocity && InDeltaTime == DeltaTime && InTerminalLimit == TerminalLimit && InGravity == Gravity && InVelocity == Velocity;
+}
+};
+static void BenchmarkVelocityKernels(const TArray<FString>& Args)
+{
+using namespace CharacterMovementAsyncKernels;
+const int32 NumCharacters = (Args.Num() > 0) ? FMath::Max(1, FCString::Atoi(*Args[0])) : 1024;
+const int32 NumIterations = (Args.Num() > 1) ? FMath::Max(1, FCString::Atoi(*Args[1])) : 100;
+const float DeltaTime = 1.f / 30.f;
+const float MaxTimeStep = 1.f / 33.f;
+const FVector Gravity(0.f, 0.f, -980.f);
+// A mix of idle, braking, turning and over max speed characters.
+FRandomStream Stream(0x5eed);
+TArray<FVector> Velocities;
+TArray<FCalcVelocityParams> Params;
+TArray<FVector> Accelerations;
+TArray<float> TerminalLimits;
+FCalcVelocityLanes Lanes;
+Lanes.SetNum(NumCharacters);
+TerminalLimits.SetNumZeroed(Align(NumCharacters, NumLanes));
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+FCalcVelocityParams& Param = Params.AddDefaulted_GetRef();
+Param.DeltaTime = DeltaTime;
+Param.Friction = (Stream.FRand() < 0.2f) ? 0.f : Stream.FRandRange(0.f, 8.f);
+Param.BrakingFriction = (Stream.FRand() < 0.2f) ? 0.f : Stream.FRandRange(0.f, 8.f);
+Param.BrakingDeceleration = (Stream.FRand() < 0.2f) ? 0.f : Stream.FRandRange(0.f, 2048.f);
+Param.MaxBrakingTimeStep = MaxTimeStep;
+Param.MaxInputSpeed = 600.f;
+Velocities.Add((Stream.FRand() < 0.2f) ? FVector::ZeroVector : Stream.GetUnitVector() * Stream.FRandRange(0.f, 900.f));
+Accelerations.Add((Stream.FRand() < 0.3f) ? FVector::ZeroVector : Stream.GetUnitVector().GetSafeNormal2D() * 2048.f);
+TerminalLimits[Index] = 4000.f;
+Lanes.Friction[Index] = Param.Friction;
+Lanes.BrakingFriction[Index] = Param.BrakingFriction;
+Lanes.BrakingDeceleration[Index] = Param.BrakingDeceleration;
+Lanes.MaxInputSpeed[Index] = Param.MaxInputSpeed;
+Lanes.Accelerations.Set(Index, Accelerations[Index]);
+}
+TArray<FVector> ScalarResults;
+ScalarResults.SetNumUninitialized(NumCharacters);
+auto LoadLaneVelocities = [&]()
+{
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+Lanes.Velocities.Set(Index, Velocities[Index]);
+}
+};
+auto Report = [&](const TCHAR* Name, uint64 ScalarCycles, uint64 LaneCycles)
+{
+int32 NumMismatches = 0;
+double MaxError = 0.0;
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+const FVector LaneResult = Lanes.Velocities.Get(Index);
+NumMismatches += (LaneResult != ScalarResults[Index]) ? 1 : 0;
+MaxError = FMath::Max(MaxError, (LaneResult - ScalarResults[Index]).GetAbsMax());
+}
+const double Scale = 1000.0 / ((double)NumCharacters * NumIterations);
+const double ScalarUs = FPlatformTime::ToMilliseconds64(ScalarCycles) * 1000.0 * Scale;
+const double LaneUs = FPlatformTime::ToMilliseconds64(LaneCycles) * 1000.0 * Scale;
+UE_LOG(LogCharacterMovement, Log, TEXT("BenchmarkVelocityKernels: %s scalar %.3f us per 1k characters, lanes %.3f us per 1k characters, speedup %.2fx, %d of %d results differ (max error %g)."),
+Name, ScalarUs, LaneUs, (LaneUs > 0.0) ? ScalarUs / LaneUs : 0.0, NumMismatches, NumCharacters, MaxError);
+};
+// CalcVelocity
+uint64 ScalarCycles = 0;
+uint64 LaneCycles = 0;
+for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration)
+{
+ScalarResults = Velocities;
+uint64 Start = FPlatformTime::Cycles64();
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+CalcVelocity(ScalarResults[Index], Accelerations[Index], Params[Index]);
+}
+ScalarCycles += FPlatformTime::Cycles64() - Start;
+LoadLaneVelocities();
+Start = FPlatformTime::Cycles64();
+CalcVelocityBatch(Lanes, DeltaTime, MaxTimeStep);
+LaneCycles += FPlatformTime::Cycles64() - Start;
+}
+Report(TEXT("CalcVelocity"), ScalarCycles, LaneCycles);
+// ApplyVelocityBraking
+ScalarCycles = 0;
+LaneCycles = 0;
+for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration)
+{
+ScalarResults = Velocities;
+uint64 Start = FPlatformTime::Cycles64();
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+ApplyVelocityBraking(ScalarResults[Index], Params[Index].BrakingFriction, Params[Index].BrakingDeceleration, DeltaTime, MaxTimeStep);
+}
+ScalarCycles += FPlatformTime::Cycles64() - Start;
+LoadLaneVelocities();
+Start = FPlatformTime::Cycles64();
+ApplyVelocityBrakingBatch(Lanes.Velocities, Lanes.BrakingFriction, Lanes.BrakingDeceleration, DeltaTime, MaxTimeStep);
+LaneCycles += FPlatformTime::Cycles64() - Start;
+}
+Report(TEXT("ApplyVelocityBraking"), ScalarCycles, LaneCycles);
+// NewFallVelocity
+ScalarCycles = 0;
+LaneCycles = 0;
+for (int32 Iteration = 0; Iteration < NumIterations; ++Iteration)
+{
+uint64 Start = FPlatformTime::Cycles64();
+for (int32 Index = 0; Index < NumCharacters; ++Index)
+{
+ScalarResults[Index] = NewFallVelocity(Velocities[Index], Gravity, DeltaTime, TerminalLimits[Index]);
+}
+ScalarCycles += FPlatformTime::Cycles64() - Start;
+LoadLaneVelocities();
+Start = FPlatformTime::Cycles64();
+NewFallVelocityBatch(Lanes.Velocities, Gravity, DeltaTime, TerminalLimits);
+LaneCycles += FPlatformTime::Cycles64() - Start;
+}
+Report(TEXT("NewFallVelocity"), ScalarCycles, LaneCycles);
+}
+static FAutoConsoleCommand BenchmarkVelocityKernelsCommand(
+TEXT("p.AsyncCharacterMovement.BenchmarkVelocityKernels"),
+TEXT("Runs CalcVelocity, ApplyVelocityBraking and NewFallVelocity on random characters through the scalar and the SIMD lane kernels, and logs the time per 1k characters and how many lane results differ from the scalar ones. Optional arguments: number of characters (default 1024), iterations (default 100)."),
+FConsoleCommandWithArgsDelegate::CreateStatic(&BenchmarkVelocityKernels));
+static void ValidateClosedFormBraking(const TArray<FString>& Args)
+{
+using namespace CharacterMovementAsyncKernels;
+const int32 NumSamples = (Args.Num() > 0) ? FMath::Max(1, FCString::Atoi(*Args[0])) : 1000;
+// Tolerance on the difference to the converged substep loop, as a fraction of the initial speed.
+const double Tolerance = (Args.Num() > 1) ? FCString::Atod(*Args[1]) : 1e-3;
+const float TickRates[] = { 20.f, 30.f, 60.f, 120.f };
+const float DefaultMaxTimeStep = 1.f / 33.f;
+// Small enough that the loop's own integration error stays well below the tolerance.
+const float ReferenceMaxTimeStep = 1.f / 20000.f;
+bool bPassed = true;
+for (const float TickRate : TickRates)
+{
+const float DeltaTime = 1.f / TickRate;
+FRandomStream Stream(0x5eed);
+double MaxReferenceError = 0.0;
+double MaxSubstepError = 0.0;
+int32 NumStopMismatches = 0;
+for (int32 Sample = 0; Sample < NumSamples; ++Sample)
+{
+const float Friction = (Stream.FRand() < 0.2f) ? 0.f : Stream.FRandRange(0.f, 8.f);
+const float BrakingDeceleration = (Stream.FRand() < 0.2f) ? 0.f : Stream.FRandRange(0.f, 2048.f);
+const FVector InitialVelocity = Stream.GetUnitVector() * Stream.FRandRange(0.f, 1200.f);
+FVector ClosedForm = InitialVelocity;
+FVector Substepped = InitialVelocity;
+FVector Reference = InitialVelocity;
+ApplyVelocityBrakingClosedForm(ClosedForm, Friction, BrakingDeceleration, DeltaTime);
+ApplyVelocityBraking(Substepped, Friction, BrakingDeceleration, DeltaTime, DefaultMaxTimeStep);
+ApplyVelocityBraking(Reference, Friction, BrakingDeceleration, DeltaTime, ReferenceMaxTimeStep);
+const double Scale = FMath::Max(1.0, InitialVelocity.Size());
+// Both sides of the brake to stop threshold can legitimately differ by rounding, so stopping is compared separately.
+if (ClosedForm.IsZero() != Reference.IsZero())
+{
+++NumStopMismatches;
+continue;
 }
-HandleImpact(Hit, Output, LastMoveTimeSlice, Adjusted);
-if (!bHasValidData || !IsFalling(Output))
+MaxReferenceError = FMath::Max(MaxReferenceError, (ClosedForm - Reference).Size() / Scale);
+MaxSubstepError = FMath::Max(MaxSubstepError, (ClosedForm - Substepped).Size() / Scale);
+}
+const bool bTickRatePassed = (MaxReferenceError <= Tolerance) && (NumStopMismatches <= NumSamples / 100);
+bPassed &= bTickRatePassed;
+UE_LOG(LogCharacterMovement, Log, TEXT("ValidateClosedFormBraking: %.0f Hz %s. Max relative error to converged loop %g, to default substeps %g, stop mismatches %d of %d."),
+TickRate, bTickRatePassed ? TEXT("passed") : TEXT("FAILED"), MaxReferenceError, MaxSubstepError, NumStopMismatches, NumSamples);
+}
+UE_LOG(LogCharacterMovement, Log, TEXT("ValidateClosedFormBraking: %s."), bPassed ? TEXT("passed") : TEXT("FAILED"));
+}
+static FAutoConsoleCommand ValidateClosedFormBrakingCommand(
+TEXT("p.AsyncCharacterMovement.ValidateClosedFormBraking"),
+TEXT("Compares closed form braking with the substepped loop at 20, 30, 60 and 120 Hz on random characters, and logs the largest difference to both the default and a converged substep size. Optional arguments: samples per tick rate (default 1000), relative tolerance (default 0.001)."),
+FConsoleCommandWithArgsDelegate::CreateStatic(&ValidateClosedFormBraking));
+// Output fields that are expensive to copy, tracked so FCharacterMovementComponentAsyncOutput::Copy can skip the ones that did not change.
+// Everything else is small and always copied.
+enum class ECharacterMovementAsyncOutputDirty : uint8
+{
+None = 0,
+Floor = 1 << 0,
+UpdatedComponent = 1 << 1,
+Character = 1 << 2,
+All = Floor | UpdatedComponent | Character
+};
+ENUM_CLASS_FLAGS(ECharacterMovementAsyncOutputDirty);
+static void MarkOutputDirty(FCharacterMovementComponentAsyncOutput& Output, ECharacterMovementAsyncOutputDirty Fields)
+{
+Output.OutputDirtyMask |= (uint8)Fields;
+}
+// Identifies an output across buffer reuse, so a delta copy never mixes up two characters that lived at the same address.
+static std::atomic<uint32> GAsyncCharacterMovementNextOutputId{ 1 };
+// Starts a new serial on Output. Changes made since the previous serial move into the history, where copies that are a few serials behind can still find them.
+static void AdvanceOutputSerial(FCharacterMovementComponentAsyncOutput& Output)
+{
+if (Output.OutputId == 0)
+{
+Output.OutputId = GAsyncCharacterMovementNextOutputId.fetch_add(1, std::memory_order_relaxed);
+}
+Output.OutputDirtyHistory[Output.OutputSerial % UE_ARRAY_COUNT(Output.OutputDirtyHistory)] = Output.OutputDirtyMask;
+++Output.OutputSerial;
+Output.OutputDirtyMask = 0;
+}
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+// Scene query instrumentation.
+// Sites form a stack per thread: a query counts for its own site and for every site that is active around it, so StepUp or ComputePerchResult
+// report every sweep they trigger through FindFloor and MoveComponent. A site's time is taken by its outermost scope only.
+enum class ECharacterMovementAsyncQuerySite : uint8
+{
+MoveComponent,
+ComputeFloorDist,
+FloorSweepTest,
+StepUp,
+ComputePerchResult,
+ResolvePenetration,
+CheckLedgeDirection,
+PhysWalking,
+PhysFalling,
+FindFloor,
+SimulatedProxy,
+PhysNavWalking,
+PhysFlying,
+PhysSwimming,
+Num
+};
+enum class ECharacterMovementAsyncQueryKind : uint8
+{
+Sweep,
+LineTrace,
+Overlap,
+Num
+};
+static const TCHAR* GAsyncCharacterMovementQuerySiteNames[] = { TEXT("MoveComponent"), TEXT("ComputeFloorDist"), TEXT("FloorSweepTest"), TEXT("StepUp"), TEXT("ComputePerchResult"), TEXT("ResolvePenetration"), TEXT("CheckLedgeDirection"), TEXT("PhysWalking"), TEXT("PhysFalling"), TEXT("FindFloor"), TEXT("SimulatedProxy"), TEXT("PhysNavWalking"), TEXT("PhysFlying"), TEXT("PhysSwimming") };
+static const TCHAR* GAsyncCharacterMovementQueryKindNames[] = { TEXT("Sweeps"), TEXT("LineTraces"), TEXT("Overlaps") };
+static_assert(UE_ARRAY_COUNT(GAsyncCharacterMovementQuerySiteNames) == (int32)ECharacterMovementAsyncQuerySite::Num, "Missing query site name.");
+static_assert(UE_ARRAY_COUNT(GAsyncCharacterMovementQueryKindNames) == (int32)ECharacterMovementAsyncQueryKind::Num, "Missing query kind name.");
+UE_TRACE_CHANNEL_DEFINE(AsyncCharacterMovementChannel);
+CSV_DEFINE_CATEGORY(AsyncCharacterMovement, true);
+struct FCharacterMovementAsyncQueryCounters
+{
+uint32 NumQueries[(int32)ECharacterMovementAsyncQuerySite::Num][(int32)ECharacterMovementAsyncQueryKind::Num] = {};
+uint64 SiteCycles[(int32)ECharacterMovementAsyncQuerySite::Num] = {};
+uint32 NumModeQueries[MOVE_MAX] = {};
+uint64 ModeQueryCycles[MOVE_MAX] = {};
+uint32 NumTotalQueries = 0;
+// Queries avoided by the step up cache.
+uint32 NumStepUpCacheHits = 0;
+uint32 NumStepUpSavedQueries = 0;
+// Movement LOD updates that simulated a whole interval, and ones that only interpolated.
+uint32 NumLODUpdates = 0;
+uint32 NumLODInterpolatedUpdates = 0;
+// Time of the whole PerformMovement.
+uint64 TotalCycles = 0;
+void Add(const FCharacterMovementAsyncQueryCounters& Other)
+{
+for (int32 Site = 0; Site < (int32)ECharacterMovementAsyncQuerySite::Num; ++Site)
+{
+for (int32 Kind = 0; Kind < (int32)ECharacterMovementAsyncQueryKind::Num; ++Kind)
+{
+NumQueries[Site][Kind] += Other.NumQueries[Site][Kind];
+}
+SiteCycles[Site] += Other.SiteCycles[Site];
+}
+for (int32 Mode = 0; Mode < MOVE_MAX; ++Mode)
+{
+NumModeQueries[Mode] += Other.NumModeQueries[Mode];
+ModeQueryCycles[Mode] += Other.ModeQueryCycles[Mode];
+}
+NumTotalQueries += Other.NumTotalQueries;
+NumStepUpCacheHits += Other.NumStepUpCacheHits;
+NumStepUpSavedQueries += Other.NumStepUpSavedQueries;
+NumLODUpdates += Other.NumLODUpdates;
+NumLODInterpolatedUpdates += Other.NumLODInterpolatedUpdates;
+TotalCycles += Other.TotalCycles;
+}
+uint32 GetNumSiteQueries(int32 Site) const
+{
+uint32 Total = 0;
+for (int32 Kind = 0; Kind < (int32)ECharacterMovementAsyncQueryKind::Num; ++Kind)
+{
+Total += NumQueries[Site][Kind];
+}
+return Total;
+}
+};
+// Collects per-character counters during a tick and keeps the last finished tick for export.
+struct FCharacterMovementAsyncQueryStats
+{
+struct FCharacterRecord
+{
+TWeakObjectPtr<const UPrimitiveComponent> Component;
+FCharacterMovementAsyncQueryCounters Counters;
+};
+// Character tick times kept while the benchmark harness records, in microseconds.
+// Site samples only hold the ticks in which the site ran.
+struct FBenchmarkSamples
+{
+TArray<double> TotalMicroseconds;
+TArray<double> SiteMicroseconds[(int32)ECharacterMovementAsyncQuerySite::Num];
+TMap<TWeakObjectPtr<const UPrimitiveComponent>, TArray<double>> CharacterMicroseconds;
+uint64 NumQueries = 0;
+int32 NumTicks = 0;
+};
+FCriticalSection Lock;
+TArray<FCharacterRecord> PendingCharacters;
+TArray<FCharacterRecord> LastTickCharacters;
+FCharacterMovementAsyncQueryCounters LastTickTotals;
+// Estimated time movement LOD saved in the last tick: its updates at the mean cost of a full rate update, minus what they cost.
+double LastTickLODSavedMs = 0.0;
+// Also read outside the lock, to keep characters that issued no query.
+std::atomic<bool> bRecordBenchmark{ false };
+FBenchmarkSamples BenchmarkSamples;
+static FCharacterMovementAsyncQueryStats& Get()
+{
+static FCharacterMovementAsyncQueryStats Stats;
+return Stats;
+}
+void AddCharacter(const UPrimitiveComponent* Component, const FCharacterMovementAsyncQueryCounters& Counters)
+{
+FScopeLock ScopeLock(&Lock);
+PendingCharacters.Add({ Component, Counters });
+}
+void EndTick();
+void DumpCsv(const TArray<FString>& Args);
+void StartBenchmark()
 {
-return;
+FScopeLock ScopeLock(&Lock);
+BenchmarkSamples = FBenchmarkSamples();
+bRecordBenchmark = true;
 }
-// Limit air control based on what we hit.
-// We moved to the impact point using air control, but may want to deflect from there based on a limited air control acceleration.
-FVector VelocityNoAirControl = OldVelocity;
-FVector AirControlAccel = Output.Acceleration;
-if (bHasLimitedAirControl)
+FBenchmarkSamples StopBenchmark()
 {
+FScopeLock ScopeLock(&Lock);
+bRecordBenchmark = false;
+return MoveTemp(BenchmarkSamples);
+}
+};
+// Counters of the character being simulated on this thread, null when instrumentation is off.
+static thread_local FCharacterMovementAsyncQueryCounters* GAsyncCharacterMovementQueryCounters = nullptr;
+static thread_local uint32 GAsyncCharacterMovementActiveQuerySites = 0;
+// Collects the queries of one character's PerformMovement.
+struct FCharacterMovementAsyncQueryCharacterScope
 {
-// Find velocity *without* acceleration.
-TGuardValue<FVector> RestoreAcceleration(Output.Acceleration, FVector::ZeroVector);
-TGuardValue<FVector> RestoreVelocity(Velocity, OldVelocity);
-Velocity.Z = 0.f;
-CalcVelocity(timeTick, FallingLateralFriction, false, MaxDecel, Output);
-VelocityNoAirControl = FVector(Velocity.X, Velocity.Y, OldVelocity.Z);
-VelocityNoAirControl = NewFallVelocity(VelocityNoAirControl, Gravity, GravityTime, Output);
+FCharacterMovementAsyncQueryCounters Counters;
+const UPrimitiveComponent* Component = nullptr;
+uint64 StartCycles = 0;
+bool bActive = false;
+explicit FCharacterMovementAsyncQueryCharacterScope(const FCharacterMovementComponentAsyncInput& Input)
+{
+// Nested PerformMovement calls report into the outer character.
+if (CharacterMovementAsyncCVars::QueryStats != 0 && GAsyncCharacterMovementQueryCounters == nullptr)
+{
+bActive = true;
+Component = Input.UpdatedComponentInput->UpdatedComponent;
+GAsyncCharacterMovementQueryCounters = &Counters;
+GAsyncCharacterMovementActiveQuerySites = 0;
+StartCycles = FPlatformTime::Cycles64();
 }
-const bool bCheckLandingSpot = false; // we already checked above.
-AirControlAccel = (Velocity - VelocityNoAirControl) / timeTick;
-const FVector AirControlDeltaV = LimitAirControl(LastMoveTimeSlice, AirControlAccel, Hit, bCheckLandingSpot, Output) * LastMoveTimeSlice;
-Adjusted = (VelocityNoAirControl + AirControlDeltaV) * LastMoveTimeSlice;
 }
-const FVector OldHitNormal = Hit.Normal;
-const FVector OldHitImpactNormal = Hit.ImpactNormal;
-FVector Delta = ComputeSlideVector(Adjusted, 1.f - Hit.Time, OldHitNormal, Hit, Output);
-// Compute velocity after deflection (only gravity component for RootMotion)
-if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && !Output.bJustTeleported)
+~FCharacterMovementAsyncQueryCharacterScope()
 {
-const FVector NewVelocity = (Delta / subTimeTickRemaining);
-Velocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideWithIgnoreZAccumulate ? FVector(Velocity.X, Velocity.Y, NewVelocity.Z) : NewVelocity;
+if (bActive)
+{
+Counters.TotalCycles = FPlatformTime::Cycles64() - StartCycles;
+GAsyncCharacterMovementQueryCounters = nullptr;
+if (Counters.NumTotalQueries > 0 || Counters.NumLODInterpolatedUpdates > 0 || FCharacterMovementAsyncQueryStats::Get().bRecordBenchmark)
+{
+FCharacterMovementAsyncQueryStats::Get().AddCharacter(Component, Counters);
 }
-if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && (Delta | Adjusted) > 0.f)
+}
+}
+};
+// Times a site. With a query kind, also counts one query for every active site and for the current movement mode.
+struct FCharacterMovementAsyncQueryScope
 {
-// Move in deflected direction.
-SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit, Output);
-if (Hit.bBlockingHit)
+FCharacterMovementAsyncQueryCounters* Counters;
+uint64 StartCycles = 0;
+int32 Site;
+int32 Kind;
+uint8 Mode;
+bool bOutermost = false;
+FCharacterMovementAsyncQueryScope(ECharacterMovementAsyncQuerySite InSite, int32 InKind, EMovementMode InMode)
+: Counters(GAsyncCharacterMovementQueryCounters)
+, Site((int32)InSite)
+, Kind(InKind)
+, Mode((uint8)InMode)
 {
-// hit second wall
-LastMoveTimeSlice = subTimeTickRemaining;
-subTimeTickRemaining = subTimeTickRemaining * (1.f - Hit.Time);
-if (IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output))
+if (Counters)
 {
-remainingTime += subTimeTickRemaining;
-ProcessLanded(Hit, remainingTime, Iterations, Output);
-return;
+const uint32 SiteBit = 1u << Site;
+bOutermost = !(GAsyncCharacterMovementActiveQuerySites & SiteBit);
+GAsyncCharacterMovementActiveQuerySites |= SiteBit;
+StartCycles = FPlatformTime::Cycles64();
 }
-HandleImpact(Hit, Output, LastMoveTimeSlice, Delta);
-if (!bHasValidData || !IsFalling(Output))
+}
+~FCharacterMovementAsyncQueryScope()
+{
+if (Counters == nullptr)
 {
 return;
 }
-// Act as if there was no air control on the last move when computing new deflection.
-if (bHasLimitedAirControl && Hit.Normal.Z > CharacterMovementConstants::VERTICAL_SLOPE_NORMAL_Z)
+const uint64 Cycles = FPlatformTime::Cycles64() - StartCycles;
+if (bOutermost)
 {
-const FVector LastMoveNoAirControl = VelocityNoAirControl * LastMoveTimeSlice;
-Delta = ComputeSlideVector(LastMoveNoAirControl, 1.f, OldHitNormal, Hit, Output);
+Counters->SiteCycles[Site] += Cycles;
+GAsyncCharacterMovementActiveQuerySites &= ~(1u << Site);
 }
-FVector PreTwoWallDelta = Delta;
-TwoWallAdjust(Delta, Hit, OldHitNormal, Output);
-if (bHasLimitedAirControl)
+if (Kind != INDEX_NONE)
 {
-const bool bCheckLandingSpot = false; // we already checked above.
-const FVector AirControlDeltaV = LimitAirControl(subTimeTickRemaining, AirControlAccel, Hit, bCheckLandingSpot, Output) * subTimeTickRemaining;
-// Only allow if not back in to first wall
-if (FVector::DotProduct(AirControlDeltaV, OldHitNormal) > 0.f)
+for (int32 ActiveSite = 0; ActiveSite < (int32)ECharacterMovementAsyncQuerySite::Num; ++ActiveSite)
 {
-Delta += (AirControlDeltaV * subTimeTickRemaining);
+if ((GAsyncCharacterMovementActiveQuerySites & (1u << ActiveSite)) || ActiveSite == Site)
+{
+++Counters->NumQueries[ActiveSite][Kind];
 }
 }
-// Compute velocity after deflection (only gravity component for RootMotion)
-if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && !Output.bJustTeleported)
+++Counters->NumModeQueries[Mode];
+Counters->ModeQueryCycles[Mode] += Cycles;
+++Counters->NumTotalQueries;
+}
+}
+};
+void FCharacterMovementAsyncQueryStats::EndTick()
 {
-const FVector NewVelocity = (Delta / subTimeTickRemaining);
-Velocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideWithIgnoreZAccumulate ? FVector(Velocity.X, Velocity.Y, NewVelocity.Z) : NewVelocity;
+if (CharacterMovementAsyncCVars::QueryStats == 0)
+{
+return;
 }
-// bDitch=true means that pawn is straddling two slopes, neither of which it can stand on
-bool bDitch = ((OldHitImpactNormal.Z > 0.f) && (Hit.ImpactNormal.Z > 0.f) && (FMath::Abs(Delta.Z) <= UE_KINDA_SMALL_NUMBER) && ((Hit.ImpactNormal | OldHitImpactNormal) < 0.f));
-SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit, Output);
-if (Hit.Time == 0.f)
+FScopeLock ScopeLock(&Lock);
+Swap(LastTickCharacters, PendingCharacters);
+PendingCharacters.Reset();
+LastTickTotals = FCharacterMovementAsyncQueryCounters();
+uint64 FullRateCycles = 0;
+uint64 LODCycles = 0;
+int32 NumFullRate = 0;
+for (const FCharacterRecord& Record : LastTickCharacters)
 {
-// if we are stuck then try to side step
-FVector SideDelta = (OldHitNormal + Hit.ImpactNormal).GetSafeNormal2D();
-if (SideDelta.IsNearlyZero())
+LastTickTotals.Add(Record.Counters);
+if (Record.Counters.NumLODUpdates > 0 || Record.Counters.NumLODInterpolatedUpdates > 0)
 {
-SideDelta = FVector(OldHitNormal.Y, -OldHitNormal.X, 0).GetSafeNormal();
+LODCycles += Record.Counters.TotalCycles;
 }
-SafeMoveUpdatedComponent(SideDelta, PawnRotation, true, Hit, Output);
+else
+{
+FullRateCycles += Record.Counters.TotalCycles;
+++NumFullRate;
 }
-if (bDitch || IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output) || Hit.Time == 0.f)
+}
+LastTickLODSavedMs = 0.0;
+if (NumFullRate > 0)
 {
-remainingTime = 0.f;
-ProcessLanded(Hit, remainingTime, Iterations, Output);
-return;
+const double FullRateMs = FPlatformTime::ToMilliseconds64(FullRateCycles) / NumFullRate;
+LastTickLODSavedMs = FullRateMs * (LastTickTotals.NumLODUpdates + LastTickTotals.NumLODInterpolatedUpdates) - FPlatformTime::ToMilliseconds64(LODCycles);
 }
-else if (GetPerchRadiusThreshold() > 0.f && Hit.Time == 1.f && OldHitImpactNormal.Z >= WalkableFloorZ)
+if (bRecordBenchmark)
 {
-// We might be in a virtual 'ditch' within our perch radius. This is rare.
-const FVector PawnLocation = UpdatedComponentInput->GetPosition();
-const float ZMovedDist = FMath::Abs(PawnLocation.Z - OldLocation.Z);
-const float MovedDist2DSq = (PawnLocation - OldLocation).SizeSquared2D();
-if (ZMovedDist <= 0.2f * timeTick && MovedDist2DSq <= 4.f * timeTick)
+for (const FCharacterRecord& Record : LastTickCharacters)
 {
-Velocity.X += 0.25f * GetMaxSpeed(Output) * (RandomStream.FRand() - 0.5f);
-Velocity.Y += 0.25f * GetMaxSpeed(Output) * (RandomStream.FRand() - 0.5f);
-Velocity.Z = FMath::Max<float>(JumpZVelocity * 0.25f, 1.f);
-Delta = Velocity * timeTick;
-SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit,  Output);
+const double Microseconds = FPlatformTime::ToMilliseconds64(Record.Counters.TotalCycles) * 1000.0;
+BenchmarkSamples.TotalMicroseconds.Add(Microseconds);
+BenchmarkSamples.CharacterMicroseconds.FindOrAdd(Record.Component).Add(Microseconds);
+for (int32 Site = 0; Site < (int32)ECharacterMovementAsyncQuerySite::Num; ++Site)
+{
+if (Record.Counters.SiteCycles[Site] > 0)
+{
+BenchmarkSamples.SiteMicroseconds[Site].Add(FPlatformTime::ToMilliseconds64(Record.Counters.SiteCycles[Site]) * 1000.0);
 }
 }
 }
+BenchmarkSamples.NumQueries += LastTickTotals.NumTotalQueries;
+++BenchmarkSamples.NumTicks;
 }
+#if CSV_PROFILER
+static TArray<FName> SiteQueryNames;
+static TArray<FName> SiteTimeNames;
+if (SiteQueryNames.Num() == 0)
+{
+for (const TCHAR* SiteName : GAsyncCharacterMovementQuerySiteNames)
+{
+SiteQueryNames.Add(*FString::Printf(TEXT("%sQueries"), SiteName));
+SiteTimeNames.Add(*FString::Printf(TEXT("%sMs"), SiteName));
 }
 }
-if (Velocity.SizeSquared2D() <= UE_KINDA_SMALL_NUMBER * 10.f)
+for (int32 Site = 0; Site < (int32)ECharacterMovementAsyncQuerySite::Num; ++Site)
 {
-Velocity.X = 0.f;
-Velocity.Y = 0.f;
-}
+FCsvProfiler::RecordCustomStat(SiteQueryNames[Site], CSV_CATEGORY_INDEX(AsyncCharacterMovement), (int32)LastTickTotals.GetNumSiteQueries(Site), ECsvCustomStatOp::Set);
+FCsvProfiler::RecordCustomStat(SiteTimeNames[Site], CSV_CATEGORY_INDEX(AsyncCharacterMovement), (float)FPlatformTime::ToMilliseconds64(LastTickTotals.SiteCycles[Site]), ECsvCustomStatOp::Set);
 }
+CSV_CUSTOM_STAT(AsyncCharacterMovement, TotalQueries, (int32)LastTickTotals.NumTotalQueries, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, WalkingQueries, (int32)LastTickTotals.NumModeQueries[MOVE_Walking], ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, FallingQueries, (int32)LastTickTotals.NumModeQueries[MOVE_Falling], ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, StepUpCacheHits, (int32)LastTickTotals.NumStepUpCacheHits, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, StepUpSavedQueries, (int32)LastTickTotals.NumStepUpSavedQueries, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, LODUpdates, (int32)LastTickTotals.NumLODUpdates, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, LODInterpolatedUpdates, (int32)LastTickTotals.NumLODInterpolatedUpdates, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, LODSavedMs, (float)LastTickLODSavedMs, ECsvCustomStatOp::Set);
+CSV_CUSTOM_STAT(AsyncCharacterMovement, QueryingCharacters, LastTickCharacters.Num(), ECsvCustomStatOp::Set);
+#endif
 }
-void FCharacterMovementComponentAsyncInput::PhysicsRotation(float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementAsyncQueryStats::DumpCsv(const TArray<FString>& Args)
 {
-if (!(bOrientRotationToMovement || bUseControllerDesiredRotation))
+const int32 MaxCharacters = (Args.Num() > 0) ? FMath::Max(1, FCString::Atoi(*Args[0])) : 100;
+TArray<FCharacterRecord> Characters;
+FCharacterMovementAsyncQueryCounters Totals;
 {
-return;
+FScopeLock ScopeLock(&Lock);
+Characters = LastTickCharacters;
+Totals = LastTickTotals;
 }
-if (!bHasValidData)
+// Most expensive characters first.
+Characters.Sort([](const FCharacterRecord& A, const FCharacterRecord& B) { return A.Counters.NumTotalQueries > B.Counters.NumTotalQueries; });
+FString Csv = TEXT("Character,Queries,StepUpCacheHits,StepUpSavedQueries,LODUpdates,LODInterpolatedUpdates");
+for (const TCHAR* SiteName : GAsyncCharacterMovementQuerySiteNames)
 {
-return;
+for (const TCHAR* KindName : GAsyncCharacterMovementQueryKindNames)
+{
+Csv += FString::Printf(TEXT(",%s%s"), SiteName, KindName);
 }
-FRotator CurrentRotation = FRotator(UpdatedComponentInput->GetRotation());
-CurrentRotation.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): CurrentRotation"));
-FRotator DeltaRot = Output.GetDeltaRotation(GetRotationRate(Output), DeltaTime);
-DeltaRot.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): GetDeltaRotation"));
-FRotator DesiredRotation = CurrentRotation;
-if (bOrientRotationToMovement)
+Csv += FString::Printf(TEXT(",%sMs"), SiteName);
+}
+for (int32 Mode = 0; Mode < MOVE_MAX; ++Mode)
 {
-DesiredRotation = ComputeOrientToMovementRotation(CurrentRotation, DeltaTime, DeltaRot, Output);
+Csv += FString::Printf(TEXT(",Mode%dQueries,Mode%dMs"), Mode, Mode);
 }
-else if ( bUseControllerDesiredRotation)
+Csv += LINE_TERMINATOR;
+auto AppendRow = [&Csv](const FString& Name, const FCharacterMovementAsyncQueryCounters& Counters)
 {
-DesiredRotation = CharacterInput->ControllerDesiredRotation;
+Csv += FString::Printf(TEXT("%s,%u,%u,%u,%u,%u"), *Name, Counters.NumTotalQueries, Counters.NumStepUpCacheHits, Counters.NumStepUpSavedQueries, Counters.NumLODUpdates, Counters.NumLODInterpolatedUpdates);
+for (int32 Site = 0; Site < (int32)ECharacterMovementAsyncQuerySite::Num; ++Site)
+{
+for (int32 Kind = 0; Kind < (int32)ECharacterMovementAsyncQueryKind::Num; ++Kind)
+{
+Csv += FString::Printf(TEXT(",%u"), Counters.NumQueries[Site][Kind]);
 }
-else
+Csv += FString::Printf(TEXT(",%.4f"), FPlatformTime::ToMilliseconds64(Counters.SiteCycles[Site]));
+}
+for (int32 Mode = 0; Mode < MOVE_MAX; ++Mode)
 {
-return;
+Csv += FString::Printf(TEXT(",%u,%.4f"), Counters.NumModeQueries[Mode], FPlatformTime::ToMilliseconds64(Counters.ModeQueryCycles[Mode]));
 }
-if (ShouldRemainVertical(Output))
+Csv += LINE_TERMINATOR;
+};
+AppendRow(TEXT("Total"), Totals);
+for (int32 Index = 0; Index < FMath::Min(MaxCharacters, Characters.Num()); ++Index)
 {
-DesiredRotation.Pitch = 0.f;
-DesiredRotation.Yaw = FRotator::NormalizeAxis(DesiredRotation.Yaw);
-DesiredRotation.Roll = 0.f;
+const UPrimitiveComponent* Component = Characters[Index].Component.Get();
+AppendRow(Component ? Component->GetPathName() : TEXT("None"), Characters[Index].Counters);
 }
-else
+const FString Filename = FPaths::ProfilingDir() / TEXT("AsyncCharacterMovementQueries.csv");
+if (FFileHelper::SaveStringToFile(Csv, *Filename))
 {
-DesiredRotation.Normalize();
+UE_LOG(LogCharacterMovement, Log, TEXT("DumpQueryStats: wrote %d of %d characters to %s."), FMath::Min(MaxCharacters, Characters.Num()), Characters.Num(), *Filename);
 }
-// Accumulate a desired new rotation.
-const float AngleTolerance = 1e-3f;
-if (!CurrentRotation.Equals(DesiredRotation, AngleTolerance))
+}
+static FAutoConsoleCommand DumpQueryStatsCommand(
+TEXT("p.AsyncCharacterMovement.DumpQueryStats"),
+TEXT("Writes the scene query counters of the last async movement tick to Saved/Profiling/AsyncCharacterMovementQueries.csv: the tick total, then the characters that issued the most queries. Optional argument: number of characters (default 100). Needs p.AsyncCharacterMovement.QueryStats."),
+FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args) { FCharacterMovementAsyncQueryStats::Get().DumpCsv(Args); }));
+// Adaptive substepping accuracy against fixed substeps, over all compared character ticks since the last reset.
+struct FCharacterMovementAsyncSubstepComparison
 {
-// PITCH
-if (!FMath::IsNearlyEqual(CurrentRotation.Pitch, DesiredRotation.Pitch, AngleTolerance))
+FCriticalSection Lock;
+int64 NumSamples = 0;
+int64 NumFixedSubsteps = 0;
+int64 NumAdaptiveSubsteps = 0;
+int64 NumModeMismatches = 0;
+double SumError = 0.0;
+double SumSquaredError = 0.0;
+double MaxError = 0.0;
+static FCharacterMovementAsyncSubstepComparison& Get()
 {
-DesiredRotation.Pitch = FMath::FixedTurn(CurrentRotation.Pitch, DesiredRotation.Pitch, DeltaRot.Pitch);
+static FCharacterMovementAsyncSubstepComparison Comparison;
+return Comparison;
 }
-// YAW
-if (!FMath::IsNearlyEqual(CurrentRotation.Yaw, DesiredRotation.Yaw, AngleTolerance))
+void Add(double Error, int32 FixedSubsteps, int32 AdaptiveSubsteps, bool bModeMatches)
 {
-DesiredRotation.Yaw = FMath::FixedTurn(CurrentRotation.Yaw, DesiredRotation.Yaw, DeltaRot.Yaw);
+FScopeLock ScopeLock(&Lock);
+++NumSamples;
+NumFixedSubsteps += FixedSubsteps;
+NumAdaptiveSubsteps += AdaptiveSubsteps;
+NumModeMismatches += bModeMatches ? 0 : 1;
+SumError += Error;
+SumSquaredError += Error * Error;
+MaxError = FMath::Max(MaxError, Error);
 }
-// ROLL
-if (!FMath::IsNearlyEqual(CurrentRotation.Roll, DesiredRotation.Roll, AngleTolerance))
+void Reset()
 {
-DesiredRotation.Roll = FMath::FixedTurn(CurrentRotation.Roll, DesiredRotation.Roll, DeltaRot.Roll);
+FScopeLock ScopeLock(&Lock);
+NumSamples = NumFixedSubsteps = NumAdaptiveSubsteps = NumModeMismatches = 0;
+SumError = SumSquaredError = MaxError = 0.0;
 }
-// Set the new rotation.
-DesiredRotation.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): DesiredRotation"));
-MoveUpdatedComponent(FVector::ZeroVector, DesiredRotation.Quaternion(), /*bSweep*/ false, Output);
+TSharedRef<FJsonObject> ToJson()
+{
+FScopeLock ScopeLock(&Lock);
+const double Samples = FMath::Max<double>(NumSamples, 1.0);
+TSharedRef<FJsonObject> Object = MakeShared<FJsonObject>();
+Object->SetNumberField(TEXT("samples"), (double)NumSamples);
+Object->SetNumberField(TEXT("fixed_substeps_per_tick"), NumFixedSubsteps / Samples);
+Object->SetNumberField(TEXT("adaptive_substeps_per_tick"), NumAdaptiveSubsteps / Samples);
+Object->SetNumberField(TEXT("mean_error_cm"), SumError / Samples);
+Object->SetNumberField(TEXT("rms_error_cm"), FMath::Sqrt(SumSquaredError / Samples));
+Object->SetNumberField(TEXT("max_error_cm"), MaxError);
+Object->SetNumberField(TEXT("mode_mismatches"), (double)NumModeMismatches);
+return Object;
 }
+};
+static FAutoConsoleCommand AdaptiveSubstepReportCommand(
+TEXT("p.AsyncCharacterMovement.AdaptiveSubstepReport"),
+TEXT("Logs how far adaptive substeps landed from fixed substeps since the last report, and the substeps each took, then resets. Needs p.AsyncCharacterMovement.AdaptiveSubstepCompare."),
+FConsoleCommandDelegate::CreateLambda([]()
+{
+FCharacterMovementAsyncSubstepComparison& Comparison = FCharacterMovementAsyncSubstepComparison::Get();
+const TSharedRef<FJsonObject> Report = Comparison.ToJson();
+UE_LOG(LogCharacterMovement, Log, TEXT("AdaptiveSubstepReport: %d character ticks, substeps per tick fixed %.2f adaptive %.2f, error mean %.3f cm rms %.3f cm max %.3f cm, %d mode mismatches."),
+(int32)Report->GetNumberField(TEXT("samples")), Report->GetNumberField(TEXT("fixed_substeps_per_tick")), Report->GetNumberField(TEXT("adaptive_substeps_per_tick")),
+Report->GetNumberField(TEXT("mean_error_cm")), Report->GetNumberField(TEXT("rms_error_cm")), Report->GetNumberField(TEXT("max_error_cm")), (int32)Report->GetNumberField(TEXT("mode_mismatches")));
+Comparison.Reset();
+}));
+// Characters the movement budget deferred or degraded since the last report, and how long the movement pass took.
+struct FCharacterMovementAsyncBudgetReport
+{
+struct FCharacter
+{
+uint32 NumDeferred = 0;
+uint32 NumDegraded = 0;
+};
+FCriticalSection Lock;
+TMap<TWeakObjectPtr<const UPrimitiveComponent>, FCharacter> Characters;
+int64 NumTicks = 0;
+int64 NumOverBudgetTicks = 0;
+double SumPassMs = 0.0;
+double MaxPassMs = 0.0;
+bool bTickOverBudget = false;
+static FCharacterMovementAsyncBudgetReport& Get()
+{
+static FCharacterMovementAsyncBudgetReport Report;
+return Report;
+}
+void Add(const UPrimitiveComponent* Component, bool bDeferred)
+{
+FScopeLock ScopeLock(&Lock);
+FCharacter& Character = Characters.FindOrAdd(Component);
+++(bDeferred ? Character.NumDeferred : Character.NumDegraded);
+bTickOverBudget = true;
+}
+void EndTick(double PassMs)
+{
+FScopeLock ScopeLock(&Lock);
+++NumTicks;
+NumOverBudgetTicks += bTickOverBudget ? 1 : 0;
+bTickOverBudget = false;
+SumPassMs += PassMs;
+MaxPassMs = FMath::Max(MaxPassMs, PassMs);
+}
+void LogAndReset(int32 MaxCharacters)
+{
+FScopeLock ScopeLock(&Lock);
+UE_LOG(LogCharacterMovement, Log, TEXT("MovementBudgetReport: %d ticks, %d over budget, movement pass mean %.3f ms max %.3f ms against a budget of %.3f ms, %d characters degraded."),
+(int32)NumTicks, (int32)NumOverBudgetTicks, SumPassMs / FMath::Max<double>(NumTicks, 1.0), MaxPassMs, CharacterMovementAsyncCVars::MovementBudgetMs, Characters.Num());
+// Most often degraded first.
+Characters.ValueSort([](const FCharacter& A, const FCharacter& B) { return A.NumDeferred + A.NumDegraded > B.NumDeferred + B.NumDegraded; });
+int32 NumLogged = 0;
+for (const TPair<TWeakObjectPtr<const UPrimitiveComponent>, FCharacter>& Pair : Characters)
+{
+if (NumLogged++ >= MaxCharacters)
+{
+break;
 }
-void FCharacterMovementComponentAsyncInput::MoveAlongFloor(const FVector& InVelocity, float DeltaSeconds, FStepDownResult* OutStepDownResult, FCharacterMovementComponentAsyncOutput& Output) const
+const UPrimitiveComponent* Component = Pair.Key.Get();
+UE_LOG(LogCharacterMovement, Log, TEXT("MovementBudgetReport:   %s deferred %u, degraded %u."), Component ? *GetNameSafe(Component->GetOwner()) : TEXT("<destroyed>"), Pair.Value.NumDeferred, Pair.Value.NumDegraded);
+}
+Characters.Reset();
+NumTicks = NumOverBudgetTicks = 0;
+SumPassMs = MaxPassMs = 0.0;
+}
+};
+static FAutoConsoleCommand MovementBudgetReportCommand(
+TEXT("p.AsyncCharacterMovement.MovementBudgetReport"),
+TEXT("Logs the movement pass times and the characters the movement budget deferred or degraded since the last report, most often degraded first, then resets. Arguments: [max characters (default 50)]."),
+FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+{
+FCharacterMovementAsyncBudgetReport::Get().LogAndReset((Args.Num() > 0) ? FMath::Max(0, FCString::Atoi(*Args[0])) : 50);
+}));
+// Headless benchmark harness.
+// Builds a synthetic collision course in the current world, spawns characters driven by scripted input and records the instrumented
+// phase times of every character tick at a fixed frame rate. Needs no GPU, e.g. on CI:
+// UnrealEditor-Cmd <Project> <Map> -game -nullrhi -unattended -ExecCmds="p.AsyncCharacterMovement.Benchmark 256 900 -exit"
+struct FCharacterMovementAsyncBenchmark
+{
+static constexpr float FixedDeltaTime = 1.f / 30.f;
+static constexpr int32 WarmupFrames = 60;
+static constexpr int32 DirectionFrames = 45;
+static constexpr float JumpChance = 0.02f;
+static constexpr float CourseExtent = 5000.f;
+static constexpr int32 NumCells = 4;
+static constexpr float PlatformTravel = 400.f;
+static constexpr float PlatformPeriod = 4.f;
+TWeakObjectPtr<UWorld> World;
+TArray<TWeakObjectPtr<AActor>> SpawnedActors;
+TArray<TWeakObjectPtr<ACharacter>> Characters;
+TArray<FRandomStream> Streams;
+TArray<FVector> Directions;
+TArray<TWeakObjectPtr<AActor>> Platforms;
+TArray<FVector> PlatformOrigins;
+FString Filename;
+int32 NumFrames = 0;
+int32 Frame = 0;
+bool bExitWhenDone = false;
+bool bCompareSubsteps = false;
+bool bPreviousUseFixedTimeStep = false;
+double PreviousFixedDeltaTime = 0.0;
+// INDEX_NONE when p.AsyncCharacterMovement does not exist.
+int32 PreviousAsyncMovement = INDEX_NONE;
+int32 PreviousQueryStats = 0;
+int32 PreviousAdaptiveSubstepping = 0;
+int32 PreviousAdaptiveSubstepCompare = 0;
+static TUniquePtr<FCharacterMovementAsyncBenchmark>& GetRunning()
+{
+static TUniquePtr<FCharacterMovementAsyncBenchmark> Running;
+return Running;
+}
+static void Start(const TArray<FString>& Args, UWorld* InWorld);
+AActor* SpawnBlock(UStaticMesh* Mesh, const FVector& Location, const FRotator& Rotation, const FVector& Size, bool bMovable);
+void BuildCourse();
+void SpawnCharacters(int32 NumCharacters);
+bool Tick(float DeltaTime);
+void Finish();
+void RestoreSettings();
+};
+AActor* FCharacterMovementAsyncBenchmark::SpawnBlock(UStaticMesh* Mesh, const FVector& Location, const FRotator& Rotation, const FVector& Size, bool bMovable)
+{
+// The engine cube is 100 units wide. Deferred so static blocks get their scale before they register.
+const FTransform Transform(Rotation, Location, Size / 100.f);
+AStaticMeshActor* Block = World->SpawnActorDeferred<AStaticMeshActor>(AStaticMeshActor::StaticClass(), Transform, nullptr, nullptr, ESpawnActorCollisionHandlingMethod::AlwaysSpawn);
+if (Block == nullptr)
+{
+return nullptr;
+}
+Block->SetMobility(bMovable ? EComponentMobility::Movable : EComponentMobility::Static);
+Block->GetStaticMeshComponent()->SetStaticMesh(Mesh);
+Block->GetStaticMeshComponent()->SetCollisionProfileName(UCollisionProfile::BlockAll_ProfileName);
+Block->FinishSpawning(Transform);
+SpawnedActors.Add(Block);
+return Block;
+}
+void FCharacterMovementAsyncBenchmark::BuildCourse()
+{
+UStaticMesh* Cube = LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube"));
+SpawnBlock(Cube, FVector(0.f, 0.f, -50.f), FRotator::ZeroRotator, FVector(2.f * CourseExtent + 2000.f, 2.f * CourseExtent + 2000.f, 100.f), false);
+// One feature per cell, cycling through the kinds so each appears several times.
+const float CellSize = 2.f * CourseExtent / NumCells;
+for (int32 CellY = 0; CellY < NumCells; ++CellY)
+{
+for (int32 CellX = 0; CellX < NumCells; ++CellX)
+{
+const FVector Center(-CourseExtent + CellSize * (CellX + 0.5f), -CourseExtent + CellSize * (CellY + 0.5f), 0.f);
+switch ((CellX + CellY * NumCells) % 5)
+{
+case 0:
+// Ramps, one walkable and one too steep, with their low edge on the ground.
+SpawnBlock(Cube, Center + FVector(0.f, -300.f, 600.f * FMath::Sin(FMath::DegreesToRadians(25.f))), FRotator(25.f, 0.f, 0.f), FVector(1200.f, 400.f, 20.f), false);
+SpawnBlock(Cube, Center + FVector(0.f, 300.f, 600.f * FMath::Sin(FMath::DegreesToRadians(55.f))), FRotator(55.f, 0.f, 0.f), FVector(1200.f, 400.f, 20.f), false);
+break;
+case 1:
+// Stairs below the max step height, up to a platform whose other edges are ledges to fall from.
+for (int32 Step = 0; Step < 8; ++Step)
 {
-if (!Output.CurrentFloor.IsWalkableFloor())
+SpawnBlock(Cube, Center + FVector(-680.f + Step * 80.f, 0.f, (Step + 1) * 15.f), FRotator::ZeroRotator, FVector(80.f, 400.f, (Step + 1) * 30.f), false);
+}
+SpawnBlock(Cube, Center + FVector(0.f, 0.f, 120.f), FRotator::ZeroRotator, FVector(720.f, 720.f, 240.f), false);
+break;
+case 2:
+// A corridor and an angled wall to slide along.
+SpawnBlock(Cube, Center + FVector(0.f, -300.f, 150.f), FRotator::ZeroRotator, FVector(1200.f, 40.f, 300.f), false);
+SpawnBlock(Cube, Center + FVector(0.f, 300.f, 150.f), FRotator::ZeroRotator, FVector(1200.f, 40.f, 300.f), false);
+SpawnBlock(Cube, Center + FVector(800.f, 0.f, 150.f), FRotator(0.f, 45.f, 0.f), FVector(40.f, 800.f, 300.f), false);
+break;
+case 3:
+// Moving platform low enough to step onto, so characters get based on it.
+if (AActor* Platform = SpawnBlock(Cube, Center + FVector(0.f, 0.f, 20.f), FRotator::ZeroRotator, FVector(600.f, 600.f, 40.f), true))
 {
-return;
+Platforms.Add(Platform);
+PlatformOrigins.Add(Platform->GetActorLocation());
 }
-// Move along the current floor
-const FVector Delta = FVector(InVelocity.X, InVelocity.Y, 0.f) * DeltaSeconds;
-FHitResult Hit(1.f);
-FVector RampVector = ComputeGroundMovementDelta(Delta, Output.CurrentFloor.HitResult, Output.CurrentFloor.bLineTrace, Output);
-SafeMoveUpdatedComponent(RampVector, UpdatedComponentInput->GetRotation(), true, Hit, Output);
-float LastMoveTimeSlice = DeltaSeconds;
-if (Hit.bStartPenetrating)
+break;
+default:
+// Flat ground.
+break;
+}
+}
+}
+}
+void FCharacterMovementAsyncBenchmark::SpawnCharacters(int32 NumCharacters)
 {
-// Allow this hit to be used as an impact we can deflect off, otherwise we do nothing the rest of the update and appear to hitch.
-HandleImpact(Hit, Output);
-SlideAlongSurface(Delta, 1.f, Hit.Normal, Hit, true, Output);
-if (Hit.bStartPenetrating)
+const int32 GridSize = FMath::CeilToInt(FMath::Sqrt((float)NumCharacters));
+const float Spacing = 2.f * CourseExtent / GridSize;
+FActorSpawnParameters Params;
+Params.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AdjustIfPossibleButAlwaysSpawn;
+for (int32 Index = 0; Index < NumCharacters; ++Index)
 {
-OnCharacterStuckInGeometry(&Hit, Output);
+const FVector Location(-CourseExtent + Spacing * (Index % GridSize + 0.5f), -CourseExtent + Spacing * (Index / GridSize + 0.5f), 300.f);
+ACharacter* Character = World->SpawnActor<ACharacter>(Location, FRotator::ZeroRotator, Params);
+if (Character == nullptr)
+{
+continue;
 }
+Character->GetCharacterMovement()->bRunPhysicsWithNoController = true;
+Character->SpawnDefaultController();
+SpawnedActors.Add(Character);
+Characters.Add(Character);
+Streams.Add(FRandomStream(0x5eed + Index));
+Directions.Add(FVector::ForwardVector);
 }
-else if (Hit.IsValidBlockingHit())
+}
+void FCharacterMovementAsyncBenchmark::Start(const TArray<FString>& Args, UWorld* InWorld)
 {
-// We impacted something (most likely another ramp, but possibly a barrier).
-float PercentTimeApplied = Hit.Time;
-if ((Hit.Time > 0.f) && (Hit.Normal.Z > UE_KINDA_SMALL_NUMBER) && IsWalkable(Hit))
+if (InWorld == nullptr || GetRunning().IsValid())
 {
-const float InitialPercentRemaining = 1.f - PercentTimeApplied;
-RampVector = ComputeGroundMovementDelta(Delta * InitialPercentRemaining, Hit, false, Output);
-LastMoveTimeSlice = InitialPercentRemaining * LastMoveTimeSlice;
-SafeMoveUpdatedComponent(RampVector, UpdatedComponentInput->GetRotation(), true, Hit, Output);
-const float SecondHitPercent = Hit.Time * InitialPercentRemaining;
-PercentTimeApplied = FMath::Clamp(PercentTimeApplied + SecondHitPercent, 0.f, 1.f);
+UE_LOG(LogCharacterMovement, Warning, TEXT("Benchmark: no world, or a benchmark is already running."));
+return;
 }
-if (Hit.IsValidBlockingHit())
+TArray<FString> Values;
+TUniquePtr<FCharacterMovementAsyncBenchmark> Benchmark = MakeUnique<FCharacterMovementAsyncBenchmark>();
+for (const FString& Arg : Args)
 {
-if (CanStepUp(Hit, Output) || (Output.NewMovementBase != NULL && Output.NewMovementBaseOwner == Hit.GetActor()))
+if (Arg == TEXT("-exit"))
 {
-// hit a barrier, try to step up
-const FVector PreStepUpLocation = UpdatedComponentInput->GetPosition();
-const FVector GravDir(0.f, 0.f, -1.f);
-if (!StepUp(GravDir, Delta * (1.f - PercentTimeApplied), Hit, Output, OutStepDownResult))
+Benchmark->bExitWhenDone = true;
+}
+else if (Arg == TEXT("-substeps"))
 {
-HandleImpact(Hit, Output, LastMoveTimeSlice, RampVector);
-SlideAlongSurface(Delta, 1.f - PercentTimeApplied, Hit.Normal, Hit, true, Output);
+Benchmark->bCompareSubsteps = true;
 }
 else
 {
-if (!bMaintainHorizontalGroundVelocity)
-{
-// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments. Only consider horizontal movement.
-Output.bJustTeleported = true;
-const float StepUpTimeSlice = (1.f - PercentTimeApplied) * DeltaSeconds;
-if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion && StepUpTimeSlice >= UE_KINDA_SMALL_NUMBER)
-{
-Output.Velocity = (UpdatedComponentInput->GetPosition() - PreStepUpLocation) / StepUpTimeSlice;
-Output.Velocity.Z = 0;
+Values.Add(Arg);
 }
 }
+const int32 NumCharacters = (Values.Num() > 0) ? FMath::Max(1, FCString::Atoi(*Values[0])) : 128;
+Benchmark->NumFrames = (Values.Num() > 1) ? FMath::Max(1, FCString::Atoi(*Values[1])) : 600;
+Benchmark->Filename = (Values.Num() > 2) ? Values[2] : FPaths::ProfilingDir() / TEXT("AsyncCharacterMovementBenchmark.json");
+Benchmark->World = InWorld;
+if (IConsoleVariable* AsyncMovement = IConsoleManager::Get().FindConsoleVariable(TEXT("p.AsyncCharacterMovement")))
+{
+Benchmark->PreviousAsyncMovement = AsyncMovement->GetInt();
+AsyncMovement->Set(1);
 }
+if (!UPhysicsSettings::Get()->bTickPhysicsAsync)
+{
+UE_LOG(LogCharacterMovement, Warning, TEXT("Benchmark: async physics ticking is off for this project, characters will not take the async path."));
 }
+// Fixed frames so every run steps the same simulation regardless of machine speed.
+Benchmark->bPreviousUseFixedTimeStep = FApp::UseFixedTimeStep();
+Benchmark->PreviousFixedDeltaTime = FApp::GetFixedDeltaTime();
+FApp::SetUseFixedTimeStep(true);
+FApp::SetFixedDeltaTime(FixedDeltaTime);
+Benchmark->PreviousQueryStats = CharacterMovementAsyncCVars::QueryStats;
+CharacterMovementAsyncCVars::QueryStats = 1;
+Benchmark->PreviousAdaptiveSubstepping = CharacterMovementAsyncCVars::AdaptiveSubstepping;
+Benchmark->PreviousAdaptiveSubstepCompare = CharacterMovementAsyncCVars::AdaptiveSubstepCompare;
+if (Benchmark->bCompareSubsteps)
+{
+// Characters move adaptively, and each tick is checked against a fixed substep run from the same state.
+CharacterMovementAsyncCVars::AdaptiveSubstepping = 1;
+CharacterMovementAsyncCVars::AdaptiveSubstepCompare = 1;
 }
+Benchmark->BuildCourse();
+Benchmark->SpawnCharacters(NumCharacters);
+UE_LOG(LogCharacterMovement, Log, TEXT("Benchmark: %d characters, %d blocks, %d warmup and %d recorded frames."), Benchmark->Characters.Num(), Benchmark->SpawnedActors.Num() - Benchmark->Characters.Num(), WarmupFrames, Benchmark->NumFrames);
+GetRunning() = MoveTemp(Benchmark);
+FTSTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([](float DeltaTime)
+{
+TUniquePtr<FCharacterMovementAsyncBenchmark>& Running = GetRunning();
+if (Running.IsValid() && Running->Tick(DeltaTime))
+{
+return true;
 }
+Running.Reset();
+return false;
+}));
 }
-FVector FCharacterMovementComponentAsyncInput::ComputeGroundMovementDelta(const FVector& Delta, const FHitResult& RampHit, const bool bHitFromLineTrace, FCharacterMovementComponentAsyncOutput& Output) const
-{
-const FVector FloorNormal = RampHit.ImpactNormal;
-const FVector ContactNormal = RampHit.Normal;
-if (FloorNormal.Z < (1.f - UE_KINDA_SMALL_NUMBER) && FloorNormal.Z > UE_KINDA_SMALL_NUMBER && ContactNormal.Z > UE_KINDA_SMALL_NUMBER && !bHitFromLineTrace && IsWalkable(RampHit))
+bool FCharacterMovementAsyncBenchmark::Tick(float DeltaTime)
 {
-// Compute a vector that moves parallel to the surface, by projecting the horizontal movement direction onto the ramp.
-const float FloorDotDelta = (FloorNormal | Delta);
-FVector RampMovement(Delta.X, Delta.Y, -FloorDotDelta / FloorNormal.Z);
-if (bMaintainHorizontalGroundVelocity)
+if (!World.IsValid())
 {
-return RampMovement;
+FCharacterMovementAsyncQueryStats::Get().StopBenchmark();
+RestoreSettings();
+return false;
 }
-else
+if (Frame == WarmupFrames)
 {
-return RampMovement.GetSafeNormal() * Delta.Size();
-}
+FCharacterMovementAsyncQueryStats::Get().StartBenchmark();
+FCharacterMovementAsyncSubstepComparison::Get().Reset();
 }
-return Delta;
+if (Frame == WarmupFrames + NumFrames)
+{
+Finish();
+return false;
 }
-bool FCharacterMovementComponentAsyncInput::CanCrouchInCurrentState(FCharacterMovementComponentAsyncOutput& Output) const
+const float Time = Frame * FixedDeltaTime;
+for (int32 Index = 0; Index < Platforms.Num(); ++Index)
 {
-if (!bCanEverCrouch)
+if (AActor* Platform = Platforms[Index].Get())
 {
-return false;
+const float Phase = 2.f * UE_PI * (Time / PlatformPeriod + (float)Index / Platforms.Num());
+Platform->SetActorLocation(PlatformOrigins[Index] + FVector(PlatformTravel * FMath::Sin(Phase), 0.f, 0.f));
 }
-return (IsFalling(Output) || IsMovingOnGround(Output)) && UpdatedComponentInput->bIsSimulatingPhysics;
 }
-FVector FCharacterMovementComponentAsyncInput::ConstrainInputAcceleration(FVector InputAcceleration, const FCharacterMovementComponentAsyncOutput& Output) const
+for (int32 Index = 0; Index < Characters.Num(); ++Index)
 {
-// walking or falling pawns ignore up/down sliding
-if (InputAcceleration.Z != 0.f && (IsMovingOnGround(Output) || IsFalling(Output)))
+ACharacter* Character = Characters[Index].Get();
+if (Character == nullptr)
 {
-return FVector(InputAcceleration.X, InputAcceleration.Y, 0.f);
-}
-return InputAcceleration;
+continue;
 }
-FVector FCharacterMovementComponentAsyncInput::ScaleInputAcceleration(FVector InputAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
+FRandomStream& Stream = Streams[Index];
+const FVector Location = Character->GetActorLocation();
+if (FMath::Abs(Location.X) > CourseExtent || FMath::Abs(Location.Y) > CourseExtent)
 {
-return MaxAcceleration * InputAcceleration.GetClampedToMaxSize(1.0f);
+// Head back onto the course.
+Directions[Index] = (-Location).GetSafeNormal2D();
 }
-float FCharacterMovementComponentAsyncInput::ComputeAnalogInputModifier(FVector Acceleration) const
+else if ((Frame + Index) % DirectionFrames == 0)
 {
-const float MaxAccel = MaxAcceleration;
-if (Acceleration.SizeSquared() > 0.f && MaxAccel > UE_SMALL_NUMBER)
-{
-return FMath::Clamp(Acceleration.Size() / MaxAccel, 0.f, 1.f);
+Directions[Index] = FRotator(0.f, Stream.FRandRange(0.f, 360.f), 0.f).Vector();
 }
-return 0.f;
-}
-FVector FCharacterMovementComponentAsyncInput::ConstrainDirectionToPlane(FVector Direction) const
+Character->AddMovementInput(Directions[Index]);
+if (Stream.FRand() < JumpChance)
 {
-if (bConstrainToPlane)
+Character->Jump();
+}
+else
 {
-Direction = FVector::VectorPlaneProject(Direction, PlaneConstraintNormal);
+Character->StopJumping();
 }
-return Direction;
 }
-FVector FCharacterMovementComponentAsyncInput::ConstrainNormalToPlane(FVector Normal) const
+++Frame;
+return true;
+}
+static double GetBenchmarkPercentile(const TArray<double>& SortedSamples, double Percentile)
 {
-if (bConstrainToPlane)
+if (SortedSamples.Num() == 0)
 {
-Normal = FVector::VectorPlaneProject(Normal, PlaneConstraintNormal).GetSafeNormal();
+return 0.0;
 }
-return Normal;
+const int32 Index = FMath::Clamp(FMath::CeilToInt(Percentile * SortedSamples.Num()) - 1, 0, SortedSamples.Num() - 1);
+return SortedSamples[Index];
 }
-FVector FCharacterMovementComponentAsyncInput::ConstrainLocationToPlane(FVector Location) const
+static TSharedRef<FJsonObject> MakeBenchmarkPercentiles(TArray<double>& Samples)
 {
-if (bConstrainToPlane)
+Samples.Sort();
+double Sum = 0.0;
+for (double Sample : Samples)
 {
-Location = FVector::PointPlaneProject(Location, PlaneConstraintOrigin, PlaneConstraintNormal);
+Sum += Sample;
 }
-return Location;
+TSharedRef<FJsonObject> Object = MakeShared<FJsonObject>();
+Object->SetNumberField(TEXT("samples"), Samples.Num());
+Object->SetNumberField(TEXT("mean_us"), (Samples.Num() > 0) ? Sum / Samples.Num() : 0.0);
+Object->SetNumberField(TEXT("p50_us"), GetBenchmarkPercentile(Samples, 0.50));
+Object->SetNumberField(TEXT("p95_us"), GetBenchmarkPercentile(Samples, 0.95));
+Object->SetNumberField(TEXT("p99_us"), GetBenchmarkPercentile(Samples, 0.99));
+Object->SetNumberField(TEXT("max_us"), (Samples.Num() > 0) ? Samples.Last() : 0.0);
+return Object;
 }
-void FCharacterMovementComponentAsyncInput::MaintainHorizontalGroundVelocity(FCharacterMovementComponentAsyncOutput& Output) const
-{
-if (Output.Velocity.Z != 0.f)
+void FCharacterMovementAsyncBenchmark::Finish()
 {
-if (bMaintainHorizontalGroundVelocity)
+FCharacterMovementAsyncQueryStats::FBenchmarkSamples Samples = FCharacterMovementAsyncQueryStats::Get().StopBenchmark();
+TSharedRef<FJsonObject> Root = MakeShared<FJsonObject>();
+Root->SetNumberField(TEXT("version"), 1);
+Root->SetNumberField(TEXT("characters"), Characters.Num());
+Root->SetNumberField(TEXT("frames"), NumFrames);
+Root->SetNumberField(TEXT("frame_delta_time"), FixedDeltaTime);
+Root->SetNumberField(TEXT("ticks"), Samples.NumTicks);
+Root->SetNumberField(TEXT("queries_per_character_tick"), (Samples.TotalMicroseconds.Num() > 0) ? (double)Samples.NumQueries / Samples.TotalMicroseconds.Num() : 0.0);
+TSharedRef<FJsonObject> Phases = MakeShared<FJsonObject>();
+Phases->SetObjectField(TEXT("PerformMovement"), MakeBenchmarkPercentiles(Samples.TotalMicroseconds));
+for (int32 Site = 0; Site < (int32)ECharacterMovementAsyncQuerySite::Num; ++Site)
 {
-// Ramp movement already maintained the velocity, so we just want to remove the vertical component.
-Output.Velocity.Z = 0.f;
+Phases->SetObjectField(GAsyncCharacterMovementQuerySiteNames[Site], MakeBenchmarkPercentiles(Samples.SiteMicroseconds[Site]));
 }
-else
+Root->SetObjectField(TEXT("phases"), Phases);
+if (bCompareSubsteps)
 {
-// Rescale velocity to be horizontal but maintain magnitude of last update.
-Output.Velocity = Output.Velocity.GetSafeNormal2D() * Output.Velocity.Size();
-}
+Root->SetObjectField(TEXT("substepping"), FCharacterMovementAsyncSubstepComparison::Get().ToJson());
 }
+// Per character PerformMovement times, slowest first.
+TArray<TSharedRef<FJsonObject>> CharacterObjects;
+for (TPair<TWeakObjectPtr<const UPrimitiveComponent>, TArray<double>>& Pair : Samples.CharacterMicroseconds)
+{
+TSharedRef<FJsonObject> CharacterObject = MakeBenchmarkPercentiles(Pair.Value);
+const UPrimitiveComponent* Component = Pair.Key.Get();
+CharacterObject->SetStringField(TEXT("name"), (Component && Component->GetOwner()) ? Component->GetOwner()->GetName() : TEXT("None"));
+CharacterObjects.Add(CharacterObject);
 }
-bool FCharacterMovementComponentAsyncInput::MoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FCharacterMovementComponentAsyncOutput& Output, FHitResult* OutHitResult, ETeleportType TeleportType) const
+CharacterObjects.Sort([](const TSharedRef<FJsonObject>& A, const TSharedRef<FJsonObject>& B) { return A->GetNumberField(TEXT("p99_us")) > B->GetNumberField(TEXT("p99_us")); });
+TArray<TSharedPtr<FJsonValue>> CharacterValues;
+for (const TSharedRef<FJsonObject>& CharacterObject : CharacterObjects)
 {
-const FVector NewDelta = ConstrainDirectionToPlane(Delta);
-return UpdatedComponentInput->MoveComponent(Delta, NewRotation, bSweep, OutHitResult, Output.MoveComponentFlags, TeleportType, *this, Output);
+CharacterValues.Add(MakeShared<FJsonValueObject>(CharacterObject));
 }
-bool FCharacterMovementComponentAsyncInput::SafeMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult& OutHit, FCharacterMovementComponentAsyncOutput& Output, ETeleportType Teleport) const
+Root->SetArrayField(TEXT("per_character"), CharacterValues);
+FString Json;
+TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&Json);
+FJsonSerializer::Serialize(Root, Writer);
+if (FFileHelper::SaveStringToFile(Json, *Filename))
 {
-bool bMoveResult = false;
-// Scope for move flags
+UE_LOG(LogCharacterMovement, Log, TEXT("Benchmark: %d character ticks over %d ticks, PerformMovement p50 %.2f us, p99 %.2f us. Wrote %s."),
+Samples.TotalMicroseconds.Num(), Samples.NumTicks, GetBenchmarkPercentile(Samples.TotalMicroseconds, 0.50), GetBenchmarkPercentile(Samples.TotalMicroseconds, 0.99), *Filename);
+}
+else
 {
-// Conditionally ignore blocking overlaps (based on CVar)
-const EMoveComponentFlags IncludeBlockingOverlapsWithoutEvents = (MOVECOMP_NeverIgnoreBlockingOverlaps | MOVECOMP_DisableBlockingOverlapDispatch);
-EMoveComponentFlags& MoveComponentFlags = Output.MoveComponentFlags;
-TGuardValue<EMoveComponentFlags> ScopedFlagRestore(MoveComponentFlags, MovementComponentCVars::MoveIgnoreFirstBlockingOverlap ? MoveComponentFlags : (MoveComponentFlags | IncludeBlockingOverlapsWithoutEvents));
-bMoveResult = MoveUpdatedComponent(Delta, NewRotation, bSweep, Output, &OutHit, Teleport);
+UE_LOG(LogCharacterMovement, Error, TEXT("Benchmark: could not write %s."), *Filename);
 }
-// Handle initial penetrations
-if (OutHit.bStartPenetrating/* && UpdatedComponent*/)
+for (const TWeakObjectPtr<AActor>& Actor : SpawnedActors)
 {
-const FVector RequestedAdjustment = GetPenetrationAdjustment(OutHit);
-if (ResolvePenetration(RequestedAdjustment, OutHit, NewRotation, Output))
+if (Actor.IsValid())
 {
-// Retry original move
-bMoveResult = MoveUpdatedComponent(Delta, NewRotation, bSweep, Output, &OutHit, Teleport);
+Actor->Destroy();
 }
 }
-return bMoveResult;
+RestoreSettings();
+if (bExitWhenDone)
+{
+FPlatformMisc::RequestExit(false);
 }
-void FCharacterMovementComponentAsyncInput::ApplyAccumulatedForces(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+}
+void FCharacterMovementAsyncBenchmark::RestoreSettings()
 {
-if (Output.PendingImpulseToApply.Z != 0.f || Output.PendingForceToApply.Z != 0.f)
+if (PreviousAsyncMovement != INDEX_NONE)
 {
-// check to see if applied momentum is enough to overcome gravity
-if (IsMovingOnGround(Output) && (Output.PendingImpulseToApply.Z + (Output.PendingForceToApply.Z * DeltaSeconds) + (GravityZ * DeltaSeconds) > UE_SMALL_NUMBER))
+if (IConsoleVariable* AsyncMovement = IConsoleManager::Get().FindConsoleVariable(TEXT("p.AsyncCharacterMovement")))
 {
-SetMovementMode(MOVE_Falling, Output);
+AsyncMovement->Set(PreviousAsyncMovement);
 }
 }
-Output.Velocity += Output.PendingImpulseToApply + (Output.PendingForceToApply * DeltaSeconds);
-// Don't call ClearAccumulatedForces() because it could affect launch velocity
-Output.PendingImpulseToApply = FVector::ZeroVector;
-Output.PendingForceToApply = FVector::ZeroVector;
+CharacterMovementAsyncCVars::QueryStats = PreviousQueryStats;
+CharacterMovementAsyncCVars::AdaptiveSubstepping = PreviousAdaptiveSubstepping;
+CharacterMovementAsyncCVars::AdaptiveSubstepCompare = PreviousAdaptiveSubstepCompare;
+FApp::SetUseFixedTimeStep(bPreviousUseFixedTimeStep);
+FApp::SetFixedDeltaTime(PreviousFixedDeltaTime);
 }
-void FCharacterMovementComponentAsyncInput::ClearAccumulatedForces(FCharacterMovementComponentAsyncOutput& Output) const
+static FAutoConsoleCommandWithWorldAndArgs BenchmarkCommand(
+TEXT("p.AsyncCharacterMovement.Benchmark"),
+TEXT("Builds a synthetic course (ground, ramps, stairs, ledges, walls, moving platforms), spawns characters with scripted input and writes the p50/p95/p99 cost of PerformMovement and its phases, overall and per character, as JSON. ")
+TEXT("Arguments: [characters (default 128)] [recorded frames (default 600)] [output file (default Saved/Profiling/AsyncCharacterMovementBenchmark.json)] [-substeps to run adaptive substepping and report its accuracy against fixed substeps] [-exit to quit when done]."),
+FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&FCharacterMovementAsyncBenchmark::Start));
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_CHARACTER_SCOPE(Input) FCharacterMovementAsyncQueryCharacterScope PREPROCESSOR_JOIN(AsyncMovementQueryCharacterScope, __LINE__)(Input)
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, Site) \
+TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL_STR("AsyncCharacterMovement." #Site, AsyncCharacterMovementChannel); \
+FCharacterMovementAsyncQueryScope PREPROCESSOR_JOIN(AsyncMovementQueryScope, __LINE__)(ECharacterMovementAsyncQuerySite::Site, INDEX_NONE, (Output).MovementMode)
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, Site, Kind) \
+TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL_STR("AsyncCharacterMovement." #Site "." #Kind, AsyncCharacterMovementChannel); \
+FCharacterMovementAsyncQueryScope PREPROCESSOR_JOIN(AsyncMovementQueryScope, __LINE__)(ECharacterMovementAsyncQuerySite::Site, (int32)ECharacterMovementAsyncQueryKind::Kind, (Output).MovementMode)
+#else
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_CHARACTER_SCOPE(Input)
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, Site)
+#define ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, Site, Kind)
+#endif
+// Guards the solver's dirty particle list, which characters simulated on different workers share.
+static FCriticalSection GAsyncCharacterMovementDirtyParticlesLock;
+// Working transform of the updated component whose PerformMovement is running on this thread.
+// SetPosition/SetRotation only write here and GetPosition/GetRotation read from here, and the particle is written once when the scope ends.
+// Nothing else reads a character's own particle while it moves: its sweeps ignore it, and other characters only see it after its PerformMovement.
+struct FCharacterMovementAsyncDeferredTransform
 {
-Output.PendingImpulseToApply = FVector::ZeroVector;
-Output.PendingForceToApply = FVector::ZeroVector;
-Output.PendingLaunchVelocity = FVector::ZeroVector;
+const FUpdatedComponentAsyncInput* Owner = nullptr;
+FVector Position = FVector::ZeroVector;
+FQuat Rotation = FQuat::Identity;
+bool bPositionDirty = false;
+bool bRotationDirty = false;
+};
+static thread_local FCharacterMovementAsyncDeferredTransform* GAsyncCharacterMovementDeferredTransform = nullptr;
+static FCharacterMovementAsyncDeferredTransform* FindDeferredTransform(const FUpdatedComponentAsyncInput* UpdatedComponentInput)
+{
+FCharacterMovementAsyncDeferredTransform* Deferred = GAsyncCharacterMovementDeferredTransform;
+return (Deferred && Deferred->Owner == UpdatedComponentInput) ? Deferred : nullptr;
 }
-void FCharacterMovementComponentAsyncInput::SetMovementMode(EMovementMode NewMovementMode, FCharacterMovementComponentAsyncOutput& Output, uint8 NewCustomMode) const
+// Writes a transform to the updated component's particle, as the end of a PerformMovement does.
+static void WriteParticleTransform(const FUpdatedComponentAsyncInput& UpdatedComponentInput, const FVector& Position, const FQuat& Rotation, bool bWritePosition, bool bWriteRotation)
 {
-if (NewMovementMode != MOVE_Custom)
+auto* PhysicsThreadAPI = UpdatedComponentInput.PhysicsHandle->GetPhysicsThreadAPI();
+auto Rigid = UpdatedComponentInput.PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle();
+if (bWritePosition)
 {
-NewCustomMode = 0;
+PhysicsThreadAPI->SetX(Position);
+Rigid->SetP(Position);
 }
-// If trying to use NavWalking but there is no navmesh, use walking instead.
-if (NewMovementMode == MOVE_NavWalking)
+if (bWriteRotation)
 {
-ensure(false);
+PhysicsThreadAPI->SetR(Rotation);
+Rigid->SetQ(Rotation);
 }
-// Do nothing if nothing is changing.
-if (Output.MovementMode == NewMovementMode)
+// Kinematics do not normal marshall changes back to game thread, mark dirty to ensure game thread gets the new transform.
+if (Rigid->ObjectState() == Chaos::EObjectStateType::Kinematic)
 {
-// Allow changes in custom sub-mode.
-if ((NewMovementMode != MOVE_Custom) || (NewCustomMode == Output.CustomMovementMode))
+FScopeLock DirtyParticlesLock(&GAsyncCharacterMovementDirtyParticlesLock);
+UpdatedComponentInput.PhysicsHandle->GetSolver<Chaos::FPBDRigidsSolver>()->GetParticles().MarkTransientDirtyParticle(Rigid);
+}
+}
+struct FCharacterMovementAsyncDeferredTransformScope
+{
+FCharacterMovementAsyncDeferredTransform Transform;
+bool bActive = false;
+explicit FCharacterMovementAsyncDeferredTransformScope(const FUpdatedComponentAsyncInput& UpdatedComponentInput)
+{
+if (CharacterMovementAsyncCVars::DeferredTransformCommit == 0 || GAsyncCharacterMovementDeferredTransform != nullptr)
 {
 return;
 }
-}
-const EMovementMode PrevMovementMode = Output.MovementMode;
-const uint8 PrevCustomMode = Output.CustomMovementMode;
-Output.MovementMode = NewMovementMode;
-Output.CustomMovementMode = NewCustomMode;
-// We allow setting movement mode before we have a component to update, in case this happens at startup.
-if (!bHasValidData)
+const auto* PhysicsThreadAPI = UpdatedComponentInput.PhysicsHandle ? UpdatedComponentInput.PhysicsHandle->GetPhysicsThreadAPI() : nullptr;
+if (PhysicsThreadAPI == nullptr || UpdatedComponentInput.PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle() == nullptr)
 {
 return;
 }
-// Handle change in movement mode
-OnMovementModeChanged(PrevMovementMode, PrevCustomMode, Output);
+Transform.Owner = &UpdatedComponentInput;
+Transform.Position = PhysicsThreadAPI->X();
+Transform.Rotation = PhysicsThreadAPI->R();
+GAsyncCharacterMovementDeferredTransform = &Transform;
+bActive = true;
 }
-void FCharacterMovementComponentAsyncInput::OnMovementModeChanged(EMovementMode PreviousMovementMode, uint8 PreviousCustomMode, FCharacterMovementComponentAsyncOutput& Output) const
+~FCharacterMovementAsyncDeferredTransformScope()
 {
-if (!bHasValidData)
+if (!bActive)
 {
 return;
 }
-// Update collision settings if needed
-if (Output.MovementMode == MOVE_NavWalking)
-{
-ensure(false);
+GAsyncCharacterMovementDeferredTransform = nullptr;
+if (Transform.bPositionDirty || Transform.bRotationDirty)
+{
+WriteParticleTransform(*Transform.Owner, Transform.Position, Transform.Rotation, Transform.bPositionDirty, Transform.bRotationDirty);
+}
+}
+};
+// Movement state of one character entering a physics frame, enough to rewind it there and run Simulate again.
+// Plain data only, so saving is a copy into a ring slot. Scene and input state, such as the movement base transforms, comes with the inputs of the
+// frame being resimulated. Per-character query caches are not saved, and a restore clears them so they cannot point past the rewind.
+// Objects are held weakly, since a snapshot can outlive the floor or base it names by many frames.
+struct FCharacterMovementAsyncSnapshot
+{
+int32 Frame = INDEX_NONE;
+FVector Position = FVector::ZeroVector;
+FQuat Rotation = FQuat::Identity;
+FVector Velocity = FVector::ZeroVector;
+FVector Acceleration = FVector::ZeroVector;
+FVector LastPreAdditiveVelocity = FVector::ZeroVector;
+FVector PendingForceToApply = FVector::ZeroVector;
+FVector PendingImpulseToApply = FVector::ZeroVector;
+FVector PendingLaunchVelocity = FVector::ZeroVector;
+FVector RequestedVelocity = FVector::ZeroVector;
+FVector LastUpdateRequestedVelocity = FVector::ZeroVector;
+FVector AnimRootMotionVelocity = FVector::ZeroVector;
+FVector LastUpdateLocation = FVector::ZeroVector;
+FQuat LastUpdateRotation = FQuat::Identity;
+FVector LastUpdateVelocity = FVector::ZeroVector;
+FRotator CharacterRotation = FRotator::ZeroRotator;
+// Current floor, without the hit fields movement does not read.
+FVector FloorImpactPoint = FVector::ZeroVector;
+FVector FloorImpactNormal = FVector::ZeroVector;
+FVector FloorNormal = FVector::ZeroVector;
+FVector FloorLocation = FVector::ZeroVector;
+FVector FloorTraceStart = FVector::ZeroVector;
+FVector FloorTraceEnd = FVector::ZeroVector;
+float FloorTime = 1.f;
+float FloorHitDistance = 0.f;
+float FloorDist = 0.f;
+float FloorLineDist = 0.f;
+TWeakObjectPtr<UPrimitiveComponent> FloorComponent;
+TWeakObjectPtr<AActor> FloorActor;
+TWeakObjectPtr<UPrimitiveComponent> MovementBase;
+TWeakObjectPtr<AActor> MovementBaseOwner;
+uint32 ProxyStateId = 0;
+float ProxyExtrapolationTime = 0.f;
+float AnalogInputModifier = 0.f;
+float ScaledCapsuleRadius = 0.f;
+float ScaledCapsuleHalfHeight = 0.f;
+float JumpForceTimeRemaining = 0.f;
+float JumpKeyHoldTime = 0.f;
+int32 JumpCurrentCount = 0;
+int32 JumpCurrentCountPreJump = 0;
+int32 NumJumpApexAttempts = 0;
+uint8 MovementMode = MOVE_None;
+uint8 GroundMovementMode = MOVE_None;
+uint8 CustomMovementMode = 0;
+uint8 bFloorBlockingHit : 1;
+uint8 bFloorStartPenetrating : 1;
+uint8 bFloorWalkable : 1;
+uint8 bFloorLineTrace : 1;
+uint8 bIsCrouched : 1;
+uint8 bWantsToCrouch : 1;
+uint8 bCrouchMaintainsBaseLocation : 1;
+uint8 bForceNextFloorCheck : 1;
+uint8 bJustTeleported : 1;
+uint8 bIsAdditiveVelocityApplied : 1;
+uint8 bHasRequestedVelocity : 1;
+uint8 bRequestedMoveWithMaxSpeed : 1;
+uint8 bWasSimulatingRootMotion : 1;
+uint8 bPressedJump : 1;
+uint8 bWasJumping : 1;
+uint8 bClearJumpInput : 1;
+void Save(int32 InFrame, const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output);
+void Restore(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const;
+};
+static_assert(std::is_trivially_copyable_v<FCharacterMovementAsyncSnapshot>, "Snapshots must stay plain data.");
+// The last Capacity frames of one character, indexed by frame number. The slots are allocated once, so saving and restoring never allocate.
+struct FCharacterMovementAsyncSnapshotRing
+{
+TArray<FCharacterMovementAsyncSnapshot> Slots;
+explicit FCharacterMovementAsyncSnapshotRing(int32 Capacity)
+{
+Slots.SetNum(FMath::Max(1, Capacity));
+}
+FCharacterMovementAsyncSnapshot& GetSlot(int32 Frame)
+{
+return Slots[(uint32)Frame % (uint32)Slots.Num()];
+}
+const FCharacterMovementAsyncSnapshot* Find(int32 Frame) const
+{
+const FCharacterMovementAsyncSnapshot& Slot = Slots[(uint32)Frame % (uint32)Slots.Num()];
+return (Slot.Frame == Frame) ? &Slot : nullptr;
+}
+};
+void FCharacterMovementAsyncSnapshot::Save(int32 InFrame, const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output)
+{
+Frame = InFrame;
+Position = Input.UpdatedComponentInput->GetPosition();
+Rotation = Input.UpdatedComponentInput->GetRotation();
+Velocity = Output.Velocity;
+Acceleration = Output.Acceleration;
+LastPreAdditiveVelocity = Output.LastPreAdditiveVelocity;
+PendingForceToApply = Output.PendingForceToApply;
+PendingImpulseToApply = Output.PendingImpulseToApply;
+PendingLaunchVelocity = Output.PendingLaunchVelocity;
+RequestedVelocity = Output.RequestedVelocity;
+LastUpdateRequestedVelocity = Output.LastUpdateRequestedVelocity;
+AnimRootMotionVelocity = Output.AnimRootMotionVelocity;
+LastUpdateLocation = Output.LastUpdateLocation;
+LastUpdateRotation = Output.LastUpdateRotation;
+LastUpdateVelocity = Output.LastUpdateVelocity;
+const FFindFloorResult& Floor = Output.CurrentFloor;
+FloorImpactPoint = Floor.HitResult.ImpactPoint;
+FloorImpactNormal = Floor.HitResult.ImpactNormal;
+FloorNormal = Floor.HitResult.Normal;
+FloorLocation = Floor.HitResult.Location;
+FloorTraceStart = Floor.HitResult.TraceStart;
+FloorTraceEnd = Floor.HitResult.TraceEnd;
+FloorTime = Floor.HitResult.Time;
+FloorHitDistance = Floor.HitResult.Distance;
+FloorDist = Floor.FloorDist;
+FloorLineDist = Floor.LineDist;
+FloorComponent = Floor.HitResult.Component;
+FloorActor = Floor.HitResult.GetActor();
+bFloorBlockingHit = Floor.bBlockingHit;
+bFloorStartPenetrating = Floor.HitResult.bStartPenetrating;
+bFloorWalkable = Floor.bWalkableFloor;
+bFloorLineTrace = Floor.bLineTrace;
+MovementBase = Output.NewMovementBase;
+MovementBaseOwner = Output.NewMovementBaseOwner;
+ProxyStateId = Output.ProxyStateId;
+ProxyExtrapolationTime = Output.ProxyExtrapolationTime;
+AnalogInputModifier = Output.AnalogInputModifier;
+ScaledCapsuleRadius = Output.ScaledCapsuleRadius;
+ScaledCapsuleHalfHeight = Output.ScaledCapsuleHalfHeight;
+NumJumpApexAttempts = Output.NumJumpApexAttempts;
+MovementMode = Output.MovementMode;
+GroundMovementMode = Output.GroundMovementMode;
+CustomMovementMode = Output.CustomMovementMode;
+bIsCrouched = Output.bIsCrouched;
+bWantsToCrouch = Output.bWantsToCrouch;
+bCrouchMaintainsBaseLocation = Output.bCrouchMaintainsBaseLocation;
+bForceNextFloorCheck = Output.bForceNextFloorCheck;
+bJustTeleported = Output.bJustTeleported;
+bIsAdditiveVelocityApplied = Output.bIsAdditiveVelocityApplied;
+bHasRequestedVelocity = Output.bHasRequestedVelocity;
+bRequestedMoveWithMaxSpeed = Output.bRequestedMoveWithMaxSpeed;
+bWasSimulatingRootMotion = Output.bWasSimulatingRootMotion;
+const FCharacterAsyncOutput& CharacterOutput = *Output.CharacterOutput;
+CharacterRotation = CharacterOutput.Rotation;
+JumpForceTimeRemaining = CharacterOutput.JumpForceTimeRemaining;
+JumpKeyHoldTime = CharacterOutput.JumpKeyHoldTime;
+JumpCurrentCount = CharacterOutput.JumpCurrentCount;
+JumpCurrentCountPreJump = CharacterOutput.JumpCurrentCountPreJump;
+bPressedJump = CharacterOutput.bPressedJump;
+bWasJumping = CharacterOutput.bWasJumping;
+bClearJumpInput = CharacterOutput.bClearJumpInput;
+}
+void FCharacterMovementAsyncSnapshot::Restore(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (Input.UpdatedComponentInput->PhysicsHandle != nullptr && Input.UpdatedComponentInput->PhysicsHandle->GetPhysicsThreadAPI() != nullptr)
+{
+WriteParticleTransform(*Input.UpdatedComponentInput, Position, Rotation, true, true);
+}
+Output.Velocity = Velocity;
+Output.Acceleration = Acceleration;
+Output.LastPreAdditiveVelocity = LastPreAdditiveVelocity;
+Output.PendingForceToApply = PendingForceToApply;
+Output.PendingImpulseToApply = PendingImpulseToApply;
+Output.PendingLaunchVelocity = PendingLaunchVelocity;
+Output.RequestedVelocity = RequestedVelocity;
+Output.LastUpdateRequestedVelocity = LastUpdateRequestedVelocity;
+Output.AnimRootMotionVelocity = AnimRootMotionVelocity;
+Output.LastUpdateLocation = LastUpdateLocation;
+Output.LastUpdateRotation = LastUpdateRotation;
+Output.LastUpdateVelocity = LastUpdateVelocity;
+FFindFloorResult& Floor = Output.CurrentFloor;
+Floor.Clear();
+Floor.bBlockingHit = bFloorBlockingHit;
+Floor.bWalkableFloor = bFloorWalkable;
+Floor.bLineTrace = bFloorLineTrace;
+Floor.FloorDist = FloorDist;
+Floor.LineDist = FloorLineDist;
+Floor.HitResult.bBlockingHit = bFloorBlockingHit;
+Floor.HitResult.bStartPenetrating = bFloorStartPenetrating;
+Floor.HitResult.ImpactPoint = FloorImpactPoint;
+Floor.HitResult.ImpactNormal = FloorImpactNormal;
+Floor.HitResult.Normal = FloorNormal;
+Floor.HitResult.Location = FloorLocation;
+Floor.HitResult.TraceStart = FloorTraceStart;
+Floor.HitResult.TraceEnd = FloorTraceEnd;
+Floor.HitResult.Time = FloorTime;
+Floor.HitResult.Distance = FloorHitDistance;
+Floor.HitResult.Component = FloorComponent;
+Floor.HitResult.HitObjectHandle = FActorInstanceHandle(FloorActor.Get());
+// A base destroyed since the snapshot restores as no base, and the resimulated move finds the floor again.
+Output.NewMovementBase = MovementBase.Get();
+Output.NewMovementBaseOwner = Output.NewMovementBase ? MovementBaseOwner.Get() : nullptr;
+Output.ProxyStateId = ProxyStateId;
+Output.ProxyExtrapolationTime = ProxyExtrapolationTime;
+Output.AnalogInputModifier = AnalogInputModifier;
+Output.ScaledCapsuleRadius = ScaledCapsuleRadius;
+Output.ScaledCapsuleHalfHeight = ScaledCapsuleHalfHeight;
+Output.NumJumpApexAttempts = NumJumpApexAttempts;
+Output.MovementMode = (EMovementMode)MovementMode;
+Output.GroundMovementMode = (EMovementMode)GroundMovementMode;
+Output.CustomMovementMode = CustomMovementMode;
+Output.bIsCrouched = bIsCrouched;
+Output.bWantsToCrouch = bWantsToCrouch;
+Output.bCrouchMaintainsBaseLocation = bCrouchMaintainsBaseLocation;
+Output.bForceNextFloorCheck = bForceNextFloorCheck;
+Output.bJustTeleported = bJustTeleported;
+Output.bIsAdditiveVelocityApplied = bIsAdditiveVelocityApplied;
+Output.bHasRequestedVelocity = bHasRequestedVelocity;
+Output.bRequestedMoveWithMaxSpeed = bRequestedMoveWithMaxSpeed;
+Output.bWasSimulatingRootMotion = bWasSimulatingRootMotion;
+FCharacterAsyncOutput& CharacterOutput = *Output.CharacterOutput;
+CharacterOutput.Rotation = CharacterRotation;
+CharacterOutput.JumpForceTimeRemaining = JumpForceTimeRemaining;
+CharacterOutput.JumpKeyHoldTime = JumpKeyHoldTime;
+CharacterOutput.JumpCurrentCount = JumpCurrentCount;
+CharacterOutput.JumpCurrentCountPreJump = JumpCurrentCountPreJump;
+CharacterOutput.bPressedJump = bPressedJump;
+CharacterOutput.bWasJumping = bWasJumping;
+CharacterOutput.bClearJumpInput = bClearJumpInput;
+// Caches describe the timeline being discarded.
+Output.CachedFloorLocation = FVector(UE_BIG_NUMBER);
+Output.MovementSleepCounter = 0;
+Output.CachedNavTriangle = INDEX_NONE;
+Output.StepUpCacheComponent = nullptr;
+Output.LedgeProbeComponent = nullptr;
+Output.bSubstepBlockingHit = true;
+Output.MovementLODTick = 0;
+Output.MovementBudgetDeferredTime = 0.f;
+Output.MovementBudgetDeferredTicks = 0;
+// Everything above may have changed, the next copy to the game thread must take it all.
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::All);
+}
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+// Record and replay.
+// A capture holds, per physics tick and character, the input, the output and transform before Simulate, the result of every scene query
+// Simulate issued, and the output bytes after it. The collision world is captured through those query results, so a replay needs no
+// level: it serves the recorded results back in order and compares the new output bytes with the recorded ones.
+// Objects are written as indices into a table of path names. Replay resolves them by path, and falls back to stand-ins of the nearest
+// native class, which keep the pointer identity, null and pawn checks movement does on them.
+static constexpr uint32 AsyncCharacterMovementCaptureMagic = 0x434d4341;
+static constexpr int32 AsyncCharacterMovementCaptureVersion = 1;
+#define ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Value) { bool bCaptured = !!(Value); Ar << bCaptured; Value = bCaptured; }
+template <typename StorageType, typename EnumType>
+static void SerializeCaptureEnum(FArchive& Ar, EnumType& Value)
+{
+StorageType Captured = (StorageType)Value;
+Ar << Captured;
+Value = static_cast<EnumType>(Captured);
+}
+struct FCharacterMovementAsyncCaptureObjects
+{
+struct FNewObject
+{
+FString Path;
+FString ClassPath;
+};
+// Saving: index of every object written so far, and the entries that still have to be written before the tick that uses them.
+TMap<FObjectKey, int32> Indices;
+TArray<FNewObject> NewObjects;
+// Loading: resolved objects by index. Stand-in actors are destroyed when the replay ends.
+TArray<UObject*> Objects;
+TArray<TWeakObjectPtr<AActor>> StandInActors;
+void Serialize(FArchive& Ar, UObject*& Object)
+{
+int32 Index = INDEX_NONE;
+if (Ar.IsSaving() && Object)
+{
+if (const int32* Found = Indices.Find(Object))
+{
+Index = *Found;
 }
-else if (PreviousMovementMode == MOVE_NavWalking)
+else
 {
-ensure(false);
+// Path names are immutable once an object exists, so reading them off the game thread is fine for a debug capture.
+Index = Indices.Num();
+Indices.Add(Object, Index);
+NewObjects.Add({ Object->GetPathName(), Object->GetClass()->GetPathName() });
 }
-// React to changes in the movement mode.
-if (Output.MovementMode == MOVE_Walking)
+}
+Ar << Index;
+if (Ar.IsLoading())
 {
-// Walking uses only XY velocity, and must be on a walkable floor, with a Base.
-Output.Velocity.Z = 0.f;
-Output.bCrouchMaintainsBaseLocation = true;
-Output.GroundMovementMode = Output.MovementMode;
-// make sure we update our new floor/base on initial entry of the walking physics
-FindFloor(UpdatedComponentInput->GetPosition(), Output.CurrentFloor, false, Output);
-AdjustFloorHeight(Output);
-SetBaseFromFloor(Output.CurrentFloor, Output);
+Object = Objects.IsValidIndex(Index) ? Objects[Index] : nullptr;
 }
-else
+}
+template <typename ObjectType>
+void Serialize(FArchive& Ar, ObjectType*& Object)
 {
-Output.CurrentFloor.Clear();
-Output.bCrouchMaintainsBaseLocation = false;
-if (Output.MovementMode == MOVE_Falling)
+UObject* Captured = const_cast<UObject*>(static_cast<const UObject*>(Object));
+Serialize(Ar, Captured);
+Object = Cast<std::remove_const_t<ObjectType>>(Captured);
+}
+template <typename ObjectType>
+void Serialize(FArchive& Ar, TWeakObjectPtr<ObjectType>& Object)
 {
+ObjectType* Captured = Object.Get();
+Serialize(Ar, Captured);
+Object = Captured;
 }
-//SetBase(NULL);
-Output.NewMovementBase = nullptr;
-Output.NewMovementBaseOwner = nullptr;
-if (Output.MovementMode == MOVE_None)
+void SerializeNewObjects(FArchive& Ar, UWorld* World)
 {
-ensure(false);
+int32 NumNewObjects = NewObjects.Num();
+Ar << NumNewObjects;
+for (int32 Index = 0; Index < NumNewObjects; ++Index)
+{
+FNewObject Entry = Ar.IsSaving() ? NewObjects[Index] : FNewObject();
+Ar << Entry.Path << Entry.ClassPath;
+if (Ar.IsLoading())
+{
+UObject* Object = Resolve(Entry, World);
+if (Object)
+{
+Indices.Add(Object, Objects.Num());
 }
+Objects.Add(Object);
 }
-if (Output.MovementMode == MOVE_Falling && PreviousMovementMode != MOVE_Falling)
-{
 }
-CharacterInput->OnMovementModeChanged(PreviousMovementMode, *this, Output, PreviousCustomMode);
+NewObjects.Reset();
 }
-void FCharacterMovementComponentAsyncInput::FindFloor(const FVector& CapsuleLocation, FFindFloorResult& OutFloorResult, bool bCanUseCachedLocation, FCharacterMovementComponentAsyncOutput& Output, const FHitResult* DownwardSweepResult) const
+UObject* Resolve(const FNewObject& Entry, UWorld* World)
 {
-// No collision, no floor...
-if (!bHasValidData || !UpdatedComponentInput->bIsQueryCollisionEnabled)
+if (UObject* Object = FSoftObjectPath(Entry.Path).ResolveObject())
 {
-OutFloorResult.Clear();
-return;
+return Object;
 }
-// Increase height check slightly if walking, to prevent floor height adjustment from later invalidating the floor result.
-const float MaxFloorDist = UCharacterMovementComponent::MAX_FLOOR_DIST;
-const float MinFloorDist = UCharacterMovementComponent::MIN_FLOOR_DIST;
-const float HeightCheckAdjust = (IsMovingOnGround(Output) ? MaxFloorDist + UE_KINDA_SMALL_NUMBER : -MaxFloorDist);
-float FloorSweepTraceDist = FMath::Max(MaxFloorDist, MaxStepHeight + HeightCheckAdjust);
-float FloorLineTraceDist = FloorSweepTraceDist;
-bool bNeedToValidateFloor = true;
-// Sweep floor
-if (FloorLineTraceDist > 0.f || FloorSweepTraceDist > 0.f)
+UClass* Class = Cast<UClass>(FSoftObjectPath(Entry.ClassPath).ResolveObject());
+while (Class && !Class->HasAnyClassFlags(CLASS_Native))
 {
-if (bAlwaysCheckFloor || !bCanUseCachedLocation || Output.bForceNextFloorCheck || Output.bJustTeleported)
+Class = Class->GetSuperClass();
+}
+if (Class == nullptr)
 {
-Output.bForceNextFloorCheck = false;
-ComputeFloorDist(CapsuleLocation, FloorLineTraceDist, FloorSweepTraceDist, OutFloorResult, Output.ScaledCapsuleRadius, Output, DownwardSweepResult);
+return nullptr;
 }
-else
+if (Class->IsChildOf<AActor>())
 {
-// Force floor check if base has collision disabled or if it does not block us.
-UPrimitiveComponent* MovementBase = Output.NewMovementBase;
-//const AActor* BaseActor = MovementBase ? MovementBase->GetOwner() : NULL;
-if (MovementBase != NULL)
+FActorSpawnParameters Params;
+Params.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AlwaysSpawn;
+AActor* StandIn = World ? World->SpawnActor<AActor>(Class->IsChildOf<APawn>() ? APawn::StaticClass() : AActor::StaticClass(), FTransform::Identity, Params) : nullptr;
+StandInActors.Add(StandIn);
+return StandIn;
+}
+if (Class->HasAnyClassFlags(CLASS_Abstract))
+{
+Class = Class->IsChildOf<UPrimitiveComponent>() ? UStaticMeshComponent::StaticClass() : nullptr;
+}
+return Class ? NewObject<UObject>(GetTransientPackage(), Class) : nullptr;
+}
+};
+static void SerializeCaptureHit(FArchive& Ar, FHitResult& Hit, FCharacterMovementAsyncCaptureObjects& Objects)
+{
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Hit.bBlockingHit);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Hit.bStartPenetrating);
+Ar << Hit.FaceIndex << Hit.Time << Hit.Distance << Hit.PenetrationDepth << Hit.MyItem << Hit.Item << Hit.ElementIndex;
+Ar << Hit.Location << Hit.ImpactPoint << Hit.Normal << Hit.ImpactNormal << Hit.TraceStart << Hit.TraceEnd;
+Ar << Hit.BoneName << Hit.MyBoneName;
+Objects.Serialize(Ar, Hit.PhysMaterial);
+Objects.Serialize(Ar, Hit.Component);
+AActor* Actor = Hit.GetActor();
+Objects.Serialize(Ar, Actor);
+Hit.HitObjectHandle = FActorInstanceHandle(Actor);
+}
+static void SerializeCaptureFloor(FArchive& Ar, FFindFloorResult& Floor, FCharacterMovementAsyncCaptureObjects& Objects)
+{
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Floor.bBlockingHit);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Floor.bWalkableFloor);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Floor.bLineTrace);
+Ar << Floor.FloorDist << Floor.LineDist;
+SerializeCaptureHit(Ar, Floor.HitResult, Objects);
+}
+static void SerializeCaptureShape(FArchive& Ar, FCollisionShape& Shape)
+{
+uint8 ShapeType = (uint8)Shape.ShapeType;
+FVector Extent = Shape.GetExtent();
+Ar << ShapeType << Extent;
+if (Ar.IsLoading())
+{
+switch ((ECollisionShape::Type)ShapeType)
+{
+case ECollisionShape::Box: Shape = FCollisionShape::MakeBox(Extent); break;
+case ECollisionShape::Sphere: Shape = FCollisionShape::MakeSphere(Extent.X); break;
+case ECollisionShape::Capsule: Shape = FCollisionShape::MakeCapsule(Extent.X, Extent.Z); break;
+default: Shape = FCollisionShape(); break;
+}
+}
+}
+// Everything Simulate reads from the input outside of scene queries. Query parameters are not needed, replay serves the results.
+static void SerializeCaptureInput(FArchive& Ar, FCharacterMovementComponentAsyncInput& Input, FCharacterMovementAsyncCaptureObjects& Objects)
+{
+Ar << Input.InputVector << Input.GravityZ << Input.PhysicsVolumeTerminalVelocity << Input.PlaneConstraintNormal << Input.PlaneConstraintOrigin << Input.RotationRate;
+Ar << Input.MaxAcceleration << Input.MinAnalogWalkSpeed << Input.MaxWalkSpeed << Input.MaxWalkSpeedCrouched << Input.MaxSwimSpeed << Input.MaxFlySpeed << Input.MaxCustomMovementSpeed;
+Ar << Input.GroundFriction << Input.BrakingFriction << Input.BrakingFrictionFactor << Input.BrakingSubStepTime;
+Ar << Input.BrakingDecelerationWalking << Input.BrakingDecelerationFalling << Input.BrakingDecelerationSwimming << Input.BrakingDecelerationFlying;
+Ar << Input.AirControl << Input.AirControlBoostMultiplier << Input.AirControlBoostVelocityThreshold << Input.FallingLateralFriction << Input.JumpZVelocity;
+Ar << Input.MaxStepHeight << Input.WalkableFloorZ << Input.PerchRadiusThreshold << Input.PerchAdditionalHeight << Input.LedgeCheckThreshold;
+Ar << Input.MaxDepenetrationWithGeometry << Input.MaxDepenetrationWithGeometryAsProxy << Input.MaxDepenetrationWithPawn << Input.MaxDepenetrationWithPawnAsProxy;
+Ar << Input.MaxSimulationTimeStep << Input.MaxSimulationIterations << Input.MaxJumpApexAttemptsPerSimulation;
+SerializeCaptureEnum<uint8>(Ar, Input.DefaultLandMovementMode);
+Ar << Input.Buoyancy << Input.PhysicsVolumeFluidFriction << Input.PhysicsVolumeWaterBounds;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bPhysicsVolumeIsWater);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bNavAgentPropsCanSwim);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bCheatFlying);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bSweepWhileNavWalking);
+Ar << Input.NavAgentRadius << Input.NavAgentHeight << Input.NavWalkingSearchHeightScale;
+Ar << Input.ReplicatedProxyStateId << Input.ReplicatedProxyLocation << Input.ReplicatedProxyVelocity << Input.ReplicatedProxyAge;
+SerializeCaptureEnum<uint8>(Ar, Input.ReplicatedProxyMovementMode);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bHasValidData);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bIsNetModeClient);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bConstrainToPlane);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bForceMaxAccel);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bRunPhysicsWithNoController);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bUseSeparateBrakingFriction);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bApplyGravityWhileJumping);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bUseControllerDesiredRotation);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bOrientRotationToMovement);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bCanWalkOffLedges);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bCanWalkOffLedgesWhenCrouching);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bIsMovementLODViewer);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bIsMovementLODRelevant);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bMaintainHorizontalGroundVelocity);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bIgnoreBaseRotation);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bAlwaysCheckFloor);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bUseFlatBaseForFloorChecks);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bRequestedMoveUseAcceleration);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bAllowPhysicsRotationDuringAnimRootMotion);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bDeferUpdateMoveComponent);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bCanEverCrouch);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bNavAgentPropsCanJump);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Input.bMovementStateCanJump);
+auto& RootMotion = Input.RootMotion;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, RootMotion.bHasAnimRootMotion);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, RootMotion.bHasOverrideRootMotion);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, RootMotion.bHasOverrideWithIgnoreZAccumulate);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, RootMotion.bHasAdditiveRootMotion);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, RootMotion.bUseSensitiveLiftoff);
+Ar << RootMotion.AdditiveVelocity << RootMotion.OverrideVelocity << RootMotion.OverrideRotation << RootMotion.AnimTransform << RootMotion.TimeAccumulated;
+auto& BaseData = Input.MovementBaseAsyncData;
+Objects.Serialize(Ar, BaseData.CachedMovementBase);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, BaseData.bMovementBaseUsesRelativeLocationCached);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, BaseData.bMovementBaseIsSimulatedCached);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, BaseData.bMovementBaseIsValidCached);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, BaseData.bMovementBaseOwnerIsValidCached);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, BaseData.bIsBaseTransformValid);
+Ar << BaseData.BaseLocation << BaseData.BaseQuat << BaseData.OldBaseLocation << BaseData.OldBaseQuat;
+FUpdatedComponentAsyncInput& UpdatedComponentInput = *Input.UpdatedComponentInput;
+Objects.Serialize(Ar, UpdatedComponentInput.UpdatedComponent);
+SerializeCaptureShape(Ar, UpdatedComponentInput.CollisionShape);
+Ar << UpdatedComponentInput.Scale;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, UpdatedComponentInput.bIsQueryCollisionEnabled);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, UpdatedComponentInput.bIsSimulatingPhysics);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, UpdatedComponentInput.bGatherOverlaps);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, UpdatedComponentInput.bForceGatherOverlaps);
+FCharacterAsyncInput& CharacterInput = *Input.CharacterInput;
+SerializeCaptureEnum<uint8>(Ar, CharacterInput.LocalRole);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterInput.bIsLocallyControlled);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterInput.bUseControllerRotationPitch);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterInput.bUseControllerRotationYaw);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterInput.bUseControllerRotationRoll);
+Ar << CharacterInput.JumpMaxHoldTime << CharacterInput.JumpMaxCount << CharacterInput.ControllerDesiredRotation;
+}
+// Mirrors FCharacterMovementComponentAsyncOutput::Copy. Copy bookkeeping and the scene query region are left out, they are not simulation state.
+static void SerializeCaptureOutput(FArchive& Ar, FCharacterMovementComponentAsyncOutput& Output, FCharacterMovementAsyncCaptureObjects& Objects)
+{
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bIsValid);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bWasSimulatingRootMotion);
+SerializeCaptureEnum<uint8>(Ar, Output.MovementMode);
+SerializeCaptureEnum<uint8>(Ar, Output.GroundMovementMode);
+Ar << Output.CustomMovementMode;
+Ar << Output.Acceleration << Output.AnalogInputModifier << Output.LastUpdateLocation << Output.LastUpdateRotation << Output.LastUpdateVelocity;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bForceNextFloorCheck);
+Ar << Output.Velocity << Output.LastPreAdditiveVelocity;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bIsAdditiveVelocityApplied);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bDeferUpdateBasedMovement);
+SerializeCaptureEnum<int32>(Ar, Output.MoveComponentFlags);
+Ar << Output.PendingForceToApply << Output.PendingImpulseToApply << Output.PendingLaunchVelocity;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bCrouchMaintainsBaseLocation);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bJustTeleported);
+Ar << Output.ScaledCapsuleRadius << Output.ScaledCapsuleHalfHeight;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bIsCrouched);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bWantsToCrouch);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bMovementInProgress);
+SerializeCaptureFloor(Ar, Output.CurrentFloor, Objects);
+Ar << Output.CachedFloorLocation << Output.MovementSleepCounter << Output.ProxyStateId << Output.ProxyExtrapolationTime;
+Ar << Output.CachedNavSnapshotId << Output.CachedNavTriangle << Output.CachedNavLocation;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bNavWalkingFallback);
+Ar << Output.StepUpCacheNormal << Output.StepUpCacheHeight << Output.StepUpCacheTopNormal;
+Ar << Output.LedgeProbeDirection << Output.LedgeProbeLocation << Output.LedgeProbeSide;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bSubstepBlockingHit);
+SerializeCaptureEnum<uint8>(Ar, Output.SubstepMovementMode);
+Ar << Output.MovementLODLevel << Output.MovementLODTick << Output.MovementLODInterval << Output.MovementLODPosition;
+Ar << Output.MovementLODStartPosition << Output.MovementLODStartRotation << Output.MovementLODTargetPosition << Output.MovementLODTargetRotation;
+Ar << Output.MovementBudgetCostMs << Output.MovementBudgetDeferredTime << Output.MovementBudgetDeferredTicks;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bMovementBudgetGuaranteed);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bMovementBudgetExceeded);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bHasRequestedVelocity);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bRequestedMoveWithMaxSpeed);
+Ar << Output.RequestedVelocity << Output.LastUpdateRequestedVelocity << Output.NumJumpApexAttempts << Output.AnimRootMotionVelocity;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bShouldApplyDeltaToMeshPhysicsTransforms);
+Ar << Output.DeltaPosition << Output.DeltaQuat << Output.DeltaTime << Output.OldVelocity << Output.OldLocation << Output.ModifiedRotationRate;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bUsingModifiedRotationRate);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bShouldDisablePostPhysicsTick);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bShouldEnablePostPhysicsTick);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bShouldAddMovementBaseTickDependency);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Output.bShouldRemoveMovementBaseTickDependency);
+Objects.Serialize(Ar, Output.NewMovementBase);
+Objects.Serialize(Ar, Output.NewMovementBaseOwner);
+Objects.Serialize(Ar, Output.StepUpCacheComponent);
+Objects.Serialize(Ar, Output.LedgeProbeComponent);
+TArray<FOverlapInfo>& Overlaps = Output.UpdatedComponentOutput.SpeculativeOverlaps;
+int32 NumOverlaps = Overlaps.Num();
+Ar << NumOverlaps;
+Overlaps.SetNum(NumOverlaps);
+for (FOverlapInfo& Overlap : Overlaps)
+{
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Overlap.bFromSweep);
+SerializeCaptureHit(Ar, Overlap.OverlapInfo, Objects);
+}
+if (!Output.CharacterOutput.IsValid())
+{
+Output.CharacterOutput = MakeUnique<FCharacterAsyncOutput>();
+}
+FCharacterAsyncOutput& CharacterOutput = *Output.CharacterOutput;
+Ar << CharacterOutput.Rotation << CharacterOutput.JumpCurrentCount << CharacterOutput.JumpCurrentCountPreJump << CharacterOutput.JumpForceTimeRemaining << CharacterOutput.JumpKeyHoldTime;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterOutput.bClearJumpInput);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterOutput.bPressedJump);
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, CharacterOutput.bWasJumping);
+}
+// Scene queries of the character being recorded or replayed on this thread.
+struct FCharacterMovementAsyncCaptureQueries
+{
+struct FQuery
+{
+FVector Start = FVector::ZeroVector;
+FVector End = FVector::ZeroVector;
+bool bResult = false;
+TArray<FHitResult> Hits;
+};
+TArray<FQuery> Queries;
+int32 NextQuery = 0;
+int32 NumMismatches = 0;
+bool bReplaying = false;
+template <typename QueryFunc>
+bool Run(const FVector& Start, const FVector& End, FHitResult* OutHit, TArray<FHitResult>* OutHits, QueryFunc&& Query)
+{
+if (!bReplaying)
+{
+const bool bResult = Query();
+FQuery& Record = Queries.AddDefaulted_GetRef();
+Record.Start = Start;
+Record.End = End;
+Record.bResult = bResult;
+if (OutHit)
 {
-// For now used cached values from original movement base, it could have changed, so this is wrong if so.
-MovementBaseAsyncData.Validate(Output);
-ensure(false);
+Record.Hits.Add(*OutHit);
 }
-if (false)
+else if (OutHits)
 {
-OutFloorResult = Output.CurrentFloor;
-bNeedToValidateFloor = false;
+Record.Hits = *OutHits;
 }
-else
+return bResult;
+}
+// A replay that asks for different queries than were recorded has diverged. Keep serving results so it still finishes.
+if (!Queries.IsValidIndex(NextQuery))
 {
-Output.bForceNextFloorCheck = false;
-ComputeFloorDist(CapsuleLocation, FloorLineTraceDist, FloorSweepTraceDist, OutFloorResult, Output.ScaledCapsuleRadius, Output, DownwardSweepResult);
+++NumMismatches;
+if (OutHits)
+{
+OutHits->Reset();
 }
+return false;
 }
+const FQuery& Record = Queries[NextQuery++];
+NumMismatches += (Record.Start != Start || Record.End != End) ? 1 : 0;
+if (OutHit && Record.Hits.Num() > 0)
+{
+*OutHit = Record.Hits[0];
 }
-if (bNeedToValidateFloor && OutFloorResult.bBlockingHit && !OutFloorResult.bLineTrace)
+if (OutHits)
 {
-const bool bCheckRadius = true;
-if (ShouldComputePerchResult(OutFloorResult.HitResult, Output, bCheckRadius))
+*OutHits = Record.Hits;
+}
+return Record.bResult;
+}
+void Serialize(FArchive& Ar, FCharacterMovementAsyncCaptureObjects& Objects)
 {
-float MaxPerchFloorDist = FMath::Max(MaxFloorDist, MaxStepHeight + HeightCheckAdjust);
-if (IsMovingOnGround(Output))
+int32 NumQueries = Queries.Num();
+Ar << NumQueries;
+Queries.SetNum(NumQueries);
+for (FQuery& Record : Queries)
 {
-MaxPerchFloorDist += FMath::Max(0.f, PerchAdditionalHeight);
+Ar << Record.Start << Record.End;
+ASYNC_CHARACTER_MOVEMENT_CAPTURE_BOOL(Ar, Record.bResult);
+int32 NumHits = Record.Hits.Num();
+Ar << NumHits;
+Record.Hits.SetNum(NumHits);
+for (FHitResult& Hit : Record.Hits)
+{
+SerializeCaptureHit(Ar, Hit, Objects);
 }
-FFindFloorResult PerchFloorResult;
-if (ComputePerchResult(GetValidPerchRadius(Output), OutFloorResult.HitResult, MaxPerchFloorDist, PerchFloorResult, Output))
+}
+}
+};
+static thread_local FCharacterMovementAsyncCaptureQueries* GAsyncCharacterMovementCaptureQueries = nullptr;
+template <typename QueryFunc>
+static FORCEINLINE bool RunCapturedSceneQuery(const FVector& Start, const FVector& End, FHitResult* OutHit, TArray<FHitResult>* OutHits, QueryFunc&& Query)
 {
-// Don't allow the floor distance adjustment to push us up too high, or we will move beyond the perch distance and fall next time.
-const float AvgFloorDist = (MinFloorDist + MaxFloorDist) * 0.5f;
-const float MoveUpDist = (AvgFloorDist - OutFloorResult.FloorDist);
-if (MoveUpDist + PerchFloorResult.FloorDist >= MaxPerchFloorDist)
+FCharacterMovementAsyncCaptureQueries* CaptureQueries = GAsyncCharacterMovementCaptureQueries;
+return CaptureQueries ? CaptureQueries->Run(Start, End, OutHit, OutHits, Query) : Query();
+}
+// Writes the capture file. Characters are recorded from Simulate, which runs serially on the physics thread while a capture is on.
+struct FCharacterMovementAsyncCaptureRecorder
 {
-OutFloorResult.FloorDist = AvgFloorDist;
+FCriticalSection Lock;
+TUniquePtr<FArchive> File;
+FString Filename;
+std::atomic<bool> bRecording{ false };
+FCharacterMovementAsyncCaptureObjects Objects;
+TArray<uint8> TickCharacters;
+int32 NumTickCharacters = 0;
+int32 NumTicks = 0;
+static FCharacterMovementAsyncCaptureRecorder& Get()
+{
+static FCharacterMovementAsyncCaptureRecorder Recorder;
+return Recorder;
 }
-// If the regular capsule is on an unwalkable surface but the perched one would allow us to stand, override the normal to be one that is walkable.
-if (!OutFloorResult.bWalkableFloor)
+void Start(const TArray<FString>& Args)
 {
-// Floor distances are used as the distance of the regular capsule to the point of collision, to make sure AdjustFloorHeight() behaves correctly.
-OutFloorResult.SetFromLineTrace(PerchFloorResult.HitResult, OutFloorResult.FloorDist, FMath::Max(OutFloorResult.FloorDist, MinFloorDist), true);
+FScopeLock ScopeLock(&Lock);
+if (bRecording)
+{
+UE_LOG(LogCharacterMovement, Warning, TEXT("Capture: already recording to %s."), *Filename);
+return;
 }
+Filename = (Args.Num() > 0) ? Args[0] : FPaths::ProfilingDir() / TEXT("AsyncCharacterMovement.capture");
+File.Reset(IFileManager::Get().CreateFileWriter(*Filename));
+if (!File.IsValid())
+{
+UE_LOG(LogCharacterMovement, Error, TEXT("Capture: could not open %s."), *Filename);
+return;
 }
-else
+uint32 Magic = AsyncCharacterMovementCaptureMagic;
+int32 Version = AsyncCharacterMovementCaptureVersion;
+// Settings that change simulation results, so a replay can tell a regression from a different configuration.
+int32 ClosedFormBraking = CharacterMovementAsyncCVars::ClosedFormBraking;
+int32 FloorCache = CharacterMovementAsyncCVars::FloorCache;
+int32 MovementSleep = CharacterMovementAsyncCVars::MovementSleep;
+*File << Magic << Version << ClosedFormBraking << FloorCache << MovementSleep;
+Objects = FCharacterMovementAsyncCaptureObjects();
+TickCharacters.Reset();
+NumTickCharacters = 0;
+NumTicks = 0;
+bRecording = true;
+UE_LOG(LogCharacterMovement, Log, TEXT("Capture: recording to %s."), *Filename);
+}
+void Stop()
+{
+FScopeLock ScopeLock(&Lock);
+if (!bRecording)
 {
-// We had no floor (or an invalid one because it was unwalkable), and couldn't perch here, so invalidate floor (which will cause us to start falling).
-OutFloorResult.bWalkableFloor = false;
+return;
 }
+bRecording = false;
+File->Close();
+File.Reset();
+UE_LOG(LogCharacterMovement, Log, TEXT("Capture: wrote %d ticks to %s."), NumTicks, *Filename);
 }
+// Appends the tick: objects first seen this tick, then the characters, which refer to them by index.
+void EndTick()
+{
+FScopeLock ScopeLock(&Lock);
+if (File.IsValid() && NumTickCharacters > 0)
+{
+Objects.SerializeNewObjects(*File, nullptr);
+*File << NumTickCharacters << TickCharacters;
+++NumTicks;
 }
+TickCharacters.Reset();
+NumTickCharacters = 0;
 }
-void FCharacterMovementComponentAsyncInput::ComputeFloorDist(const FVector& CapsuleLocation, float LineDistance, float SweepDistance, FFindFloorResult& OutFloorResult, float SweepRadius, FCharacterMovementComponentAsyncOutput& Output, const FHitResult* DownwardSweepResult) const
+};
+// Records one character's Simulate.
+struct FCharacterMovementAsyncCaptureScope
 {
-OutFloorResult.Clear();
-float PawnRadius = Output.ScaledCapsuleRadius;
-float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
-bool bSkipSweep = false;
-if (DownwardSweepResult != NULL && DownwardSweepResult->IsValidBlockingHit())
+FCharacterMovementAsyncCaptureQueries Queries;
+const FCharacterMovementComponentAsyncInput* Input = nullptr;
+FCharacterMovementComponentAsyncOutput* Output = nullptr;
+FCharacterMovementAsyncCaptureScope(const FCharacterMovementComponentAsyncInput& InInput, float DeltaSeconds, FCharacterMovementComponentAsyncOutput& InOutput)
 {
-// Only if the supplied sweep was vertical and downward.
-if ((DownwardSweepResult->TraceStart.Z > DownwardSweepResult->TraceEnd.Z) &&
-(DownwardSweepResult->TraceStart - DownwardSweepResult->TraceEnd).SizeSquared2D() <= UE_KINDA_SMALL_NUMBER)
+FCharacterMovementAsyncCaptureRecorder& Recorder = FCharacterMovementAsyncCaptureRecorder::Get();
+if (!Recorder.bRecording || GAsyncCharacterMovementCaptureQueries != nullptr)
 {
-// Reject hits that are barely on the cusp of the radius of the capsule
-if (IsWithinEdgeTolerance(DownwardSweepResult->Location, DownwardSweepResult->ImpactPoint, PawnRadius))
+return;
+}
+Input = &InInput;
+Output = &InOutput;
+FMemoryWriter Writer(Recorder.TickCharacters);
+Writer.Seek(Recorder.TickCharacters.Num());
+uint32 CharacterId = InOutput.OutputId;
+FVector Position = InInput.UpdatedComponentInput->GetPosition();
+FQuat Rotation = InInput.UpdatedComponentInput->GetRotation();
+Writer << CharacterId << DeltaSeconds << Position << Rotation;
+// Saving archives only read, the input stays untouched.
+SerializeCaptureInput(Writer, const_cast<FCharacterMovementComponentAsyncInput&>(InInput), Recorder.Objects);
+SerializeCaptureOutput(Writer, InOutput, Recorder.Objects);
+GAsyncCharacterMovementCaptureQueries = &Queries;
+}
+~FCharacterMovementAsyncCaptureScope()
 {
-// Don't try a redundant sweep, regardless of whether this sweep is usable.
-bSkipSweep = true;
-const bool bIsWalkable = IsWalkable(*DownwardSweepResult);
-const float FloorDist = (CapsuleLocation.Z - DownwardSweepResult->Location.Z);
-OutFloorResult.SetFromSweep(*DownwardSweepResult, FloorDist, bIsWalkable);
-if (bIsWalkable)
+if (Input == nullptr)
 {
-// Use the supplied downward sweep as the floor hit result.
 return;
 }
+GAsyncCharacterMovementCaptureQueries = nullptr;
+FCharacterMovementAsyncCaptureRecorder& Recorder = FCharacterMovementAsyncCaptureRecorder::Get();
+FMemoryWriter Writer(Recorder.TickCharacters);
+Writer.Seek(Recorder.TickCharacters.Num());
+Queries.Serialize(Writer, Recorder.Objects);
+TArray<uint8> OutputBytes;
+FMemoryWriter OutputWriter(OutputBytes);
+FVector Position = Input->UpdatedComponentInput->GetPosition();
+FQuat Rotation = Input->UpdatedComponentInput->GetRotation();
+OutputWriter << Position << Rotation;
+SerializeCaptureOutput(OutputWriter, *Output, Recorder.Objects);
+Writer << OutputBytes;
+++Recorder.NumTickCharacters;
+}
+};
+// Re-runs Simulate for every recorded character against the recorded query results, and compares output bytes.
+static void ReplayCapture(const TArray<FString>& Args, UWorld* World)
+{
+if (Args.Num() < 1)
+{
+UE_LOG(LogCharacterMovement, Warning, TEXT("ReplayCapture: missing file name."));
+return;
+}
+const int32 NumRepeats = (Args.Num() > 1) ? FMath::Max(1, FCString::Atoi(*Args[1])) : 1;
+TArray<uint8> Bytes;
+if (!FFileHelper::LoadFileToArray(Bytes, *Args[0]))
+{
+UE_LOG(LogCharacterMovement, Error, TEXT("ReplayCapture: could not read %s."), *Args[0]);
+return;
 }
+// Persistent per character, like AsyncSimState, so repeated replays reuse the allocations.
+struct FReplayCharacter
+{
+FCharacterMovementComponentAsyncInput Input;
+FCharacterMovementComponentAsyncOutput Output;
+};
+TMap<uint32, TUniquePtr<FReplayCharacter>> Characters;
+TArray<TWeakObjectPtr<AActor>> StandInActors;
+int32 NumTicks = 0;
+int32 NumCharacterTicks = 0;
+int32 NumOutputMismatches = 0;
+int32 NumQueryMismatches = 0;
+uint64 TotalCycles = 0;
+uint64 SlowestTickCycles = 0;
+int32 SlowestTick = INDEX_NONE;
+uint64 SlowestCharacterCycles = 0;
+uint32 SlowestCharacterId = 0;
+for (int32 Repeat = 0; Repeat < NumRepeats; ++Repeat)
+{
+// Every pass reads the object table from the start again.
+FCharacterMovementAsyncCaptureObjects Objects;
+FMemoryReader Reader(Bytes);
+uint32 Magic = 0;
+int32 Version = 0;
+int32 ClosedFormBraking = 0;
+int32 FloorCache = 0;
+int32 MovementSleep = 0;
+Reader << Magic << Version << ClosedFormBraking << FloorCache << MovementSleep;
+if (Magic != AsyncCharacterMovementCaptureMagic || Version != AsyncCharacterMovementCaptureVersion)
+{
+UE_LOG(LogCharacterMovement, Error, TEXT("ReplayCapture: %s is not a version %d capture."), *Args[0], AsyncCharacterMovementCaptureVersion);
+return;
 }
+if (Repeat == 0 && (ClosedFormBraking != CharacterMovementAsyncCVars::ClosedFormBraking || FloorCache != CharacterMovementAsyncCVars::FloorCache || MovementSleep != CharacterMovementAsyncCVars::MovementSleep))
+{
+UE_LOG(LogCharacterMovement, Warning, TEXT("ReplayCapture: recorded with ClosedFormBraking %d, FloorCache %d, MovementSleep %d, outputs may differ."), ClosedFormBraking, FloorCache, MovementSleep);
+}
+for (int32 Tick = 0; !Reader.AtEnd() && !Reader.IsError(); ++Tick)
+{
+Objects.SerializeNewObjects(Reader, World);
+int32 NumTickCharacters = 0;
+TArray<uint8> TickCharacters;
+Reader << NumTickCharacters << TickCharacters;
+FMemoryReader CharacterReader(TickCharacters);
+uint64 TickCycles = 0;
+for (int32 CharacterIndex = 0; CharacterIndex < NumTickCharacters; ++CharacterIndex)
+{
+uint32 CharacterId = 0;
+float DeltaSeconds = 0.f;
+FCharacterMovementAsyncDeferredTransform Transform;
+CharacterReader << CharacterId << DeltaSeconds << Transform.Position << Transform.Rotation;
+TUniquePtr<FReplayCharacter>& Character = Characters.FindOrAdd(CharacterId);
+if (!Character.IsValid())
+{
+Character = MakeUnique<FReplayCharacter>();
+Character->Input.UpdatedComponentInput = MakeUnique<FUpdatedComponentAsyncInput>();
+Character->Input.CharacterInput = MakeUnique<FCharacterAsyncInput>();
+}
+FCharacterMovementComponentAsyncInput& Input = Character->Input;
+FCharacterMovementComponentAsyncOutput& Output = Character->Output;
+Input.World = World;
+SerializeCaptureInput(CharacterReader, Input, Objects);
+SerializeCaptureOutput(CharacterReader, Output, Objects);
+FCharacterMovementAsyncCaptureQueries Queries;
+Queries.Serialize(CharacterReader, Objects);
+Queries.bReplaying = true;
+TArray<uint8> RecordedOutput;
+CharacterReader << RecordedOutput;
+// The updated component has no particle here: its transform lives in a deferred transform for the whole Simulate.
+Transform.Owner = Input.UpdatedComponentInput.Get();
+GAsyncCharacterMovementDeferredTransform = &Transform;
+GAsyncCharacterMovementCaptureQueries = &Queries;
+const uint64 StartCycles = FPlatformTime::Cycles64();
+Input.Simulate(DeltaSeconds, Output);
+const uint64 Cycles = FPlatformTime::Cycles64() - StartCycles;
+GAsyncCharacterMovementCaptureQueries = nullptr;
+GAsyncCharacterMovementDeferredTransform = nullptr;
+TickCycles += Cycles;
+if (Cycles > SlowestCharacterCycles)
+{
+SlowestCharacterCycles = Cycles;
+SlowestCharacterId = CharacterId;
+}
+TArray<uint8> ReplayedOutput;
+FMemoryWriter OutputWriter(ReplayedOutput);
+OutputWriter << Transform.Position << Transform.Rotation;
+SerializeCaptureOutput(OutputWriter, Output, Objects);
+const bool bOutputMatches = (ReplayedOutput == RecordedOutput);
+NumOutputMismatches += bOutputMatches ? 0 : 1;
+NumQueryMismatches += Queries.NumMismatches + (Queries.NextQuery != Queries.Queries.Num() ? 1 : 0);
+if (!bOutputMatches && Repeat == 0)
+{
+UE_LOG(LogCharacterMovement, Verbose, TEXT("ReplayCapture: tick %d character %u output differs."), Tick, CharacterId);
+}
+++NumCharacterTicks;
+}
+TotalCycles += TickCycles;
+if (TickCycles > SlowestTickCycles)
+{
+SlowestTickCycles = TickCycles;
+SlowestTick = Tick;
+}
+++NumTicks;
+}
+StandInActors.Append(Objects.StandInActors);
+}
+for (const TWeakObjectPtr<AActor>& StandIn : StandInActors)
+{
+if (StandIn.IsValid())
+{
+StandIn->Destroy();
+}
+}
+UE_LOG(LogCharacterMovement, Log, TEXT("ReplayCapture: %d ticks, %d character updates in %.3f ms. Slowest tick %d (%.3f ms), slowest character %u (%.3f ms). %d outputs differ, %d query mismatches."),
+NumTicks, NumCharacterTicks, FPlatformTime::ToMilliseconds64(TotalCycles), SlowestTick, FPlatformTime::ToMilliseconds64(SlowestTickCycles), SlowestCharacterId, FPlatformTime::ToMilliseconds64(SlowestCharacterCycles), NumOutputMismatches, NumQueryMismatches);
+}
+static FAutoConsoleCommand StartCaptureCommand(
+TEXT("p.AsyncCharacterMovement.Capture.Start"),
+TEXT("Records every async character Simulate to a capture file that p.AsyncCharacterMovement.Capture.Replay can re-run. Optional argument: file name (default Saved/Profiling/AsyncCharacterMovement.capture). Batched and parallel simulation are bypassed while recording."),
+FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args) { FCharacterMovementAsyncCaptureRecorder::Get().Start(Args); }));
+static FAutoConsoleCommand StopCaptureCommand(
+TEXT("p.AsyncCharacterMovement.Capture.Stop"),
+TEXT("Stops recording and closes the capture file."),
+FConsoleCommandDelegate::CreateLambda([]() { FCharacterMovementAsyncCaptureRecorder::Get().Stop(); }));
+static FAutoConsoleCommandWithWorldAndArgs ReplayCaptureCommand(
+TEXT("p.AsyncCharacterMovement.Capture.Replay"),
+TEXT("Re-runs a capture file against its recorded scene query results, logs timings and the number of outputs that differ bitwise from the recording. Arguments: file name, optional repeat count for profiling (default 1)."),
+FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&ReplayCapture));
+#else
+template <typename QueryFunc>
+static FORCEINLINE bool RunCapturedSceneQuery(const FVector& Start, const FVector& End, FHitResult* OutHit, TArray<FHitResult>* OutHits, QueryFunc&& Query)
+{
+return Query();
 }
-// We require the sweep distance to be >= the line distance, otherwise the HitResult can't be interpreted as the sweep result.
-if (SweepDistance < LineDistance)
+#endif
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+// Accuracy check for adaptive substepping. Once the character's Simulate has run and committed its transform, simulates it again with fixed
+// substeps from the state it started with. The reference run writes to a copy of the output and a transform that is never committed,
+// and its scene queries are kept out of the query stats.
+struct FCharacterMovementAsyncSubstepComparisonScope
+{
+const FCharacterMovementComponentAsyncInput* Input = nullptr;
+TUniquePtr<FCharacterMovementComponentAsyncOutput> StartOutput;
+FVector StartPosition = FVector::ZeroVector;
+FQuat StartRotation = FQuat::Identity;
+float DeltaSeconds = 0.f;
+FCharacterMovementComponentAsyncOutput* Output = nullptr;
+FCharacterMovementAsyncSubstepComparisonScope(const FCharacterMovementComponentAsyncInput& InInput, float InDeltaSeconds, FCharacterMovementComponentAsyncOutput& InOutput)
+{
+if (CharacterMovementAsyncCVars::AdaptiveSubstepping == 0 || CharacterMovementAsyncCVars::AdaptiveSubstepCompare == 0 || GAsyncCharacterMovementFixedSubsteps
+|| InInput.CharacterInput->LocalRole <= ROLE_SimulatedProxy || !InInput.CharacterInput->bIsLocallyControlled)
 {
-ensure(SweepDistance >= LineDistance);
 return;
 }
-bool bBlockingHit = false;
-// Sweep test
-if (!bSkipSweep && SweepDistance > 0.f && SweepRadius > 0.f)
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+// A second Simulate would end up in the capture, or consume recorded query results.
+if (FCharacterMovementAsyncCaptureRecorder::Get().bRecording || GAsyncCharacterMovementCaptureQueries != nullptr)
 {
-const float ShrinkScale = 0.9f;
-const float ShrinkScaleOverlap = 0.1f;
-float ShrinkHeight = (PawnHalfHeight - PawnRadius) * (1.f - ShrinkScale);
-float TraceDist = SweepDistance + ShrinkHeight;
-FCollisionShape CapsuleShape = FCollisionShape::MakeCapsule(SweepRadius, PawnHalfHeight - ShrinkHeight);
-FHitResult Hit(1.f);
-bBlockingHit = FloorSweepTest(Hit, CapsuleLocation, CapsuleLocation + FVector(0.f, 0.f, -TraceDist), CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams, Output);
-if (bBlockingHit)
+return;
+}
+#endif
+Input = &InInput;
+Output = &InOutput;
+DeltaSeconds = InDeltaSeconds;
+StartOutput = MakeUnique<FCharacterMovementComponentAsyncOutput>();
+if (!StartOutput->CharacterOutput.IsValid())
 {
-// Reject hits adjacent to us, we only care about hits on the bottom portion of our capsule.
-// Check 2D distance to impact point, reject if within a tolerance from radius.
-if (Hit.bStartPenetrating || !IsWithinEdgeTolerance(CapsuleLocation, Hit.ImpactPoint, CapsuleShape.Capsule.Radius))
+StartOutput->CharacterOutput = MakeUnique<FCharacterAsyncOutput>();
+}
+StartOutput->Copy(InOutput);
+StartOutput->MovementBaseTable = InOutput.MovementBaseTable;
+StartOutput->PawnHash = InOutput.PawnHash;
+StartPosition = InInput.UpdatedComponentInput->GetPosition();
+StartRotation = InInput.UpdatedComponentInput->GetRotation();
+GAsyncCharacterMovementSubsteps = 0;
+}
+~FCharacterMovementAsyncSubstepComparisonScope()
 {
-// Use a capsule with a slightly smaller radius and shorter height to avoid the adjacent object.
-// Capsule must not be nearly zero or the trace will fall back to a line trace from the start point and have the wrong length.
-CapsuleShape.Capsule.Radius = FMath::Max(0.f, CapsuleShape.Capsule.Radius - UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE - UE_KINDA_SMALL_NUMBER);
-if (!CapsuleShape.IsNearlyZero())
+if (Input == nullptr)
 {
-ShrinkHeight = (PawnHalfHeight - PawnRadius) * (1.f - ShrinkScaleOverlap);
-TraceDist = SweepDistance + ShrinkHeight;
-CapsuleShape.Capsule.HalfHeight = FMath::Max(PawnHalfHeight - ShrinkHeight, CapsuleShape.Capsule.Radius);
-Hit.Reset(1.f, false);
-bBlockingHit = FloorSweepTest(Hit, CapsuleLocation, CapsuleLocation + FVector(0.f, 0.f, -TraceDist), CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams, Output);
+return;
 }
+const int32 AdaptiveSubsteps = GAsyncCharacterMovementSubsteps;
+const FVector AdaptivePosition = Input->UpdatedComponentInput->GetPosition();
+FCharacterMovementAsyncDeferredTransform Transform;
+Transform.Owner = Input->UpdatedComponentInput.Get();
+Transform.Position = StartPosition;
+Transform.Rotation = StartRotation;
+FCharacterMovementAsyncQueryCounters DiscardedCounters;
+TGuardValue<FCharacterMovementAsyncDeferredTransform*> TransformGuard(GAsyncCharacterMovementDeferredTransform, &Transform);
+TGuardValue<FCharacterMovementAsyncQueryCounters*> CountersGuard(GAsyncCharacterMovementQueryCounters, &DiscardedCounters);
+TGuardValue<bool> FixedGuard(GAsyncCharacterMovementFixedSubsteps, true);
+GAsyncCharacterMovementSubsteps = 0;
+Input->Simulate(DeltaSeconds, *StartOutput);
+FCharacterMovementAsyncSubstepComparison::Get().Add(FVector::Dist(Transform.Position, AdaptivePosition), GAsyncCharacterMovementSubsteps, AdaptiveSubsteps, StartOutput->MovementMode == Output->MovementMode);
+}
+};
+#endif
+// Simulated proxies are not simulated. They extrapolate the last replicated state the game thread handed in, then optionally sweep
+// along the extrapolated move and snap to the floor with one line trace, which keeps them cheap enough to run for every remote character.
+// Returns the extrapolated location, starting over from the replicated state whenever the game thread received a newer one.
+static FVector ExtrapolateSimulatedProxy(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output, const FVector& Location, float DeltaSeconds)
+{
+FVector NewLocation = Location;
+float ExtrapolationTime = DeltaSeconds;
+if (Input.ReplicatedProxyStateId != Output.ProxyStateId)
+{
+Output.ProxyStateId = Input.ReplicatedProxyStateId;
+Output.ProxyExtrapolationTime = 0.f;
+Output.Velocity = Input.ReplicatedProxyVelocity;
+Output.MovementMode = Input.ReplicatedProxyMovementMode;
+NewLocation = Input.ReplicatedProxyLocation;
+// Catch up on the time between the state arriving on the game thread and this update.
+ExtrapolationTime += Input.ReplicatedProxyAge;
+}
+// Hold position once the state is too old to trust, the next replicated state corrects the rest.
+const float Step = FMath::Clamp(CharacterMovementAsyncCVars::SimulatedProxyMaxExtrapolationTime - Output.ProxyExtrapolationTime, 0.f, ExtrapolationTime);
+Output.ProxyExtrapolationTime += ExtrapolationTime;
+if (Step <= 0.f)
+{
+return NewLocation;
 }
-// Reduce hit distance by ShrinkHeight because we shrank the capsule for the trace.
-// We allow negative distances here, because this allows us to pull out of penetrations.
-const float MaxPenetrationAdjust = FMath::Max(UCharacterMovementComponent::MAX_FLOOR_DIST, PawnRadius);
-const float SweepResult = FMath::Max(-MaxPenetrationAdjust, Hit.Time * TraceDist - ShrinkHeight);
-OutFloorResult.SetFromSweep(Hit, SweepResult, false);
-if (Hit.IsValidBlockingHit() && IsWalkable(Hit))
-{
-if (SweepResult <= SweepDistance)
+if (Output.MovementMode == MOVE_Falling)
 {
-// Hit within test distance.
-OutFloorResult.bWalkableFloor = true;
-return;
-}
+const FVector OldVelocity = Output.Velocity;
+Output.Velocity = CharacterMovementAsyncKernels::NewFallVelocity(OldVelocity, FVector(0.f, 0.f, Input.GravityZ), Step, FMath::Abs(Input.PhysicsVolumeTerminalVelocity));
+NewLocation += 0.5f * (OldVelocity + Output.Velocity) * Step;
 }
+else
+{
+NewLocation += Output.Velocity * Step;
 }
+return NewLocation;
 }
-// Since we require a longer sweep than line trace, we don't want to run the line trace if the sweep missed everything.
-// We do however want to try a line trace if the sweep was stuck in penetration.
-if (!OutFloorResult.bBlockingHit && !OutFloorResult.HitResult.bStartPenetrating)
+// Collision and floor for an extrapolated proxy move from OldLocation to NewLocation. Only reads the world, so proxies can resolve in parallel.
+static void ResolveSimulatedProxyMove(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output, const FVector& OldLocation, FVector& NewLocation)
+{
+const FUpdatedComponentAsyncInput& UpdatedComponentInput = *Input.UpdatedComponentInput;
+if (!UpdatedComponentInput.bIsQueryCollisionEnabled)
 {
-OutFloorResult.FloorDist = SweepDistance;
 return;
 }
-// Line trace
-if (LineDistance > 0.f)
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, SimulatedProxy);
+if (CharacterMovementAsyncCVars::SimulatedProxyCollision != 0 && !OldLocation.Equals(NewLocation))
 {
-const float ShrinkHeight = PawnHalfHeight;
-const FVector LineTraceStart = CapsuleLocation;
-const float TraceDist = LineDistance + ShrinkHeight;
-const FVector Down = FVector(0.f, 0.f, -TraceDist);
 FHitResult Hit(1.f);
-bBlockingHit = World->LineTraceSingleByChannel(Hit, LineTraceStart, LineTraceStart + Down, CollisionChannel, QueryParams, CollisionResponseParams);
-if (bBlockingHit)
-{
-if (Hit.Time > 0.f)
-{
-// Reduce hit distance by ShrinkHeight because we started the trace higher than the base.
-// We allow negative distances here, because this allows us to pull out of penetrations.
-const float MaxPenetrationAdjust = FMath::Max(UCharacterMovementComponent::MAX_FLOOR_DIST, PawnRadius);
-const float LineResult = FMath::Max(-MaxPenetrationAdjust, Hit.Time * TraceDist - ShrinkHeight);
-OutFloorResult.bBlockingHit = true;
-if (LineResult <= LineDistance && IsWalkable(Hit))
+bool bBlockingHit = false;
 {
-OutFloorResult.SetFromLineTrace(Hit, OutFloorResult.FloorDist, LineResult, true);
-return;
-}
-}
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, SimulatedProxy, Sweep);
+bBlockingHit = RunCapturedSceneQuery(OldLocation, NewLocation, &Hit, nullptr, [&]() { return Input.World->SweepSingleByChannel(Hit, OldLocation, NewLocation, UpdatedComponentInput.GetRotation(), Input.CollisionChannel, UpdatedComponentInput.CollisionShape, UpdatedComponentInput.MoveComponentQueryParams, UpdatedComponentInput.MoveComponentCollisionResponseParams); });
 }
+if (bBlockingHit && !Hit.bStartPenetrating)
+{
+NewLocation = Hit.Location;
+// Slide along what was hit rather than pushing into it every update until the next replicated state.
+Output.Velocity = CharacterMovementAsyncMath::VectorPlaneProject(Output.Velocity, Hit.Normal);
 }
-OutFloorResult.bWalkableFloor = false;
 }
-bool FCharacterMovementComponentAsyncInput::FloorSweepTest(FHitResult& OutHit, const FVector& Start, const FVector& End, ECollisionChannel TraceChannel, const FCollisionShape& CollisionShape, const FCollisionQueryParams& Params, const FCollisionResponseParams& ResponseParam, FCharacterMovementComponentAsyncOutput& Output) const
+// Walking proxies look for a floor within step height, falling ones only land on a floor they reached on the way down.
+const bool bWalking = Input.IsMovingOnGround(Output);
+const bool bLanding = (Output.MovementMode == MOVE_Falling && Output.Velocity.Z <= 0.f);
+if (CharacterMovementAsyncCVars::SimulatedProxyFloorSnap == 0 || !(bWalking || bLanding))
 {
+return;
+}
+const float HalfHeight = Output.ScaledCapsuleHalfHeight;
+const float FloorDistance = bWalking ? FMath::Max(Input.MaxStepHeight, UCharacterMovementComponent::MAX_FLOOR_DIST) : UCharacterMovementComponent::MAX_FLOOR_DIST;
+const FVector TraceEnd = NewLocation - FVector(0.f, 0.f, HalfHeight + FloorDistance);
+FHitResult Hit(1.f);
 bool bBlockingHit = false;
-if (!bUseFlatBaseForFloorChecks)
 {
-bBlockingHit = World->SweepSingleByChannel(OutHit, Start, End, FQuat::Identity, TraceChannel, CollisionShape, Params, ResponseParam);
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, SimulatedProxy, LineTrace);
+bBlockingHit = RunCapturedSceneQuery(NewLocation, TraceEnd, &Hit, nullptr, [&]() { return Input.World->LineTraceSingleByChannel(Hit, NewLocation, TraceEnd, Input.CollisionChannel, Input.QueryParams, Input.CollisionResponseParams); });
 }
-else
+if (bBlockingHit && Hit.Time > 0.f && Input.IsWalkable(Hit))
 {
-// Test with a box that is enclosed by the capsule.
-const float CapsuleRadius = CollisionShape.GetCapsuleRadius();
-const float CapsuleHeight = CollisionShape.GetCapsuleHalfHeight();
-const FCollisionShape BoxShape = FCollisionShape::MakeBox(FVector(CapsuleRadius * 0.707f, CapsuleRadius * 0.707f, CapsuleHeight));
-// First test with the box rotated so the corners are along the major axes (ie rotated 45 degrees).
-bBlockingHit = World->SweepSingleByChannel(OutHit, Start, End, FQuat(FVector(0.f, 0.f, -1.f), UE_PI * 0.25f), TraceChannel, BoxShape, Params, ResponseParam);
-if (!bBlockingHit)
+// Rest at the same height above the floor as a simulated character would.
+const float FloorDist = 0.5f * (UCharacterMovementComponent::MIN_FLOOR_DIST + UCharacterMovementComponent::MAX_FLOOR_DIST);
+NewLocation.Z = Hit.ImpactPoint.Z + HalfHeight + FloorDist;
+Output.CurrentFloor.Clear();
+Output.CurrentFloor.SetFromSweep(Hit, FloorDist, true);
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+if (!bWalking)
 {
-// Test again with the same box, not rotated.
-OutHit.Reset(1.f, false);
-bBlockingHit = World->SweepSingleByChannel(OutHit, Start, End, FQuat::Identity, TraceChannel, BoxShape, Params, ResponseParam);
-}
+Output.MovementMode = MOVE_Walking;
+Output.Velocity.Z = 0.f;
 }
-return bBlockingHit;
 }
-bool FCharacterMovementComponentAsyncInput::IsWithinEdgeTolerance(const FVector& CapsuleLocation, const FVector& TestImpactPoint, const float CapsuleRadius) const
+else if (bWalking)
 {
-const float DistFromCenterSq = (TestImpactPoint - CapsuleLocation).SizeSquared2D();
-const float ReducedRadiusSq = FMath::Square(FMath::Max(UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE + UE_KINDA_SMALL_NUMBER, CapsuleRadius - UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE));
-return DistFromCenterSq < ReducedRadiusSq;
+// Walked off a ledge. Fall until the next replicated state says otherwise.
+Output.CurrentFloor.Clear();
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+Output.MovementMode = MOVE_Falling;
 }
-bool FCharacterMovementComponentAsyncInput::IsWalkable(const FHitResult& Hit) const
-{
-if (!Hit.IsValidBlockingHit())
-{
-// No hit, or starting in penetration
-return false;
 }
-// Never walk up vertical surfaces.
-if (Hit.ImpactNormal.Z < UE_KINDA_SMALL_NUMBER)
+static void SimulatedProxyMove(const FCharacterMovementComponentAsyncInput& Input, float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output)
 {
-return false;
-}
-float TestWalkableZ = WalkableFloorZ;
-// Can't walk on this surface if it is too steep.
-if (Hit.ImpactNormal.Z < TestWalkableZ)
+ASYNC_CHARACTER_MOVEMENT_QUERY_CHARACTER_SCOPE(Input);
+const FVector OldLocation = Input.UpdatedComponentInput->GetPosition();
+FVector NewLocation = ExtrapolateSimulatedProxy(Input, Output, OldLocation, DeltaSeconds);
+ResolveSimulatedProxyMove(Input, Output, OldLocation, NewLocation);
+if (NewLocation != OldLocation)
 {
-return false;
+Input.UpdatedComponentInput->SetPosition(NewLocation);
 }
-return true;
 }
-void FCharacterMovementComponentAsyncInput::UpdateCharacterStateAfterMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::Simulate(const float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Proxies get replicated crouch state.
-if (CharacterInput->LocalRole != ROLE_SimulatedProxy)
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncSubstepComparisonScope SubstepComparison(*this, DeltaSeconds, Output);
+#endif
+AdvanceOutputSerial(Output);
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+FCharacterMovementAsyncCaptureScope CaptureScope(*this, DeltaSeconds, Output);
+#endif
+Output.DeltaTime = DeltaSeconds;
+if (CharacterInput->LocalRole > ROLE_SimulatedProxy)
 {
-// Uncrouch if no longer allowed to be crouched
-if (Output.bIsCrouched && !CanCrouchInCurrentState(Output))
+const bool bIsClient = (CharacterInput->LocalRole == ROLE_AutonomousProxy && bIsNetModeClient);
+if (CharacterInput->bIsLocallyControlled)
 {
+ControlledCharacterMove(DeltaSeconds, Output);
 }
 }
-}
-float FCharacterMovementComponentAsyncInput::GetSimulationTimeStep(float RemainingTime, int32 Iterations) const
-{
-static uint32 s_WarningCount = 0;
-if (RemainingTime > MaxSimulationTimeStep)
+else if (CharacterInput->LocalRole == ROLE_SimulatedProxy)
 {
-if (Iterations < MaxSimulationIterations)
+if (CharacterMovementAsyncCVars::SimulatedProxy != 0)
 {
-// Subdivide moves to be no longer than MaxSimulationTimeStep seconds
-RemainingTime = FMath::Min(MaxSimulationTimeStep, RemainingTime * 0.5f);
+SimulatedProxyMove(*this, DeltaSeconds, Output);
 }
 else
 {
+ensure(false);
 }
 }
-// no less than MIN_TICK_TIME (to avoid potential divide-by-zero during simulation).
-return FMath::Max(UCharacterMovementComponent::MIN_TICK_TIME, RemainingTime);
 }
-void FCharacterMovementComponentAsyncInput::CalcVelocity(float DeltaTime, float Friction, bool bFluid, float BrakingDeceleration, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::ControlledCharacterMove(const float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Do not update velocity when using root motion or when SimulatedProxy and not simulating root motion - SimulatedProxy are repped their Velocity
-if (!bHasValidData || RootMotion.bHasAnimRootMotion || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME
-|| (CharacterInput->LocalRole == ROLE_SimulatedProxy && !bWasSimulatingRootMotion))
 {
-return;
+// We need to check the jump state before adjusting input acceleration, to minimize latency
+// and to make sure acceleration respects our potentially new falling state.
+CharacterInput->CheckJumpInput(DeltaSeconds, *this, Output);
+// apply input to acceleration
+Output.Acceleration = ScaleInputAcceleration(ConstrainInputAcceleration(InputVector, Output), Output);
+Output.AnalogInputModifier = ComputeAnalogInputModifier(Output.Acceleration);
 }
-Friction = FMath::Max(0.f, Friction);
-const float MaxAccel = MaxAcceleration;
-float MaxSpeed = GetMaxSpeed(Output);
-// Check if path following requested movement
-bool bZeroRequestedAcceleration = true;
-FVector RequestedAcceleration = FVector::ZeroVector;
-float RequestedSpeed = 0.0f;
-if (ApplyRequestedMove(DeltaTime, MaxAccel, MaxSpeed, Friction, BrakingDeceleration, RequestedAcceleration, RequestedSpeed, Output))
 {
-bZeroRequestedAcceleration = false;
+PerformMovement(DeltaSeconds, Output);
 }
-FVector& Acceleration = Output.Acceleration;
-FVector& Velocity = Output.Velocity;
-if (bForceMaxAccel)
+}
+// Start of the current tick's movement pass while the movement budget is on, 0 otherwise.
+static std::atomic<uint64> GAsyncCharacterMovementBudgetStartCycles{ 0 };
+// Decides this update under the movement budget. Returns true when it is deferred to a later tick,
+// otherwise adds the time deferred so far to DeltaSeconds and tells whether to run it with fewer iterations.
+static bool DeferForMovementBudget(const FCharacterMovementComponentAsyncInput& Input, float& DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output, bool& bOutDegraded)
 {
-// Force acceleration at full speed.
-// In consideration order for direction: Acceleration, then Velocity, then Pawn's rotation.
-if (Acceleration.SizeSquared() > UE_SMALL_NUMBER)
+bOutDegraded = false;
+const uint64 StartCycles = GAsyncCharacterMovementBudgetStartCycles.load(std::memory_order_relaxed);
+// Over budget as scheduled, or because the pass has already run longer than predicted.
+const bool bOverBudget = (CharacterMovementAsyncCVars::MovementBudget != 0) && !Output.bMovementBudgetGuaranteed
+&& (Output.bMovementBudgetExceeded || (StartCycles != 0 && FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles) > CharacterMovementAsyncCVars::MovementBudgetMs));
+if (bOverBudget)
 {
-Acceleration = Acceleration.GetSafeNormal() * MaxAccel;
-}
-else
+// Movement LOD intervals are already spread over several ticks, and deferring one would stretch it.
+const bool bInLODInterval = (Output.MovementLODTick > 0) || (CharacterMovementAsyncCVars::MovementLOD != 0 && Output.MovementLODLevel > 0);
+if (!bInLODInterval && Output.MovementBudgetDeferredTicks < CharacterMovementAsyncCVars::MovementBudgetMaxDeferTicks)
 {
-Acceleration = MaxAccel * (Velocity.SizeSquared() < UE_SMALL_NUMBER ? UpdatedComponentInput->GetForwardVector() : Velocity.GetSafeNormal());
+++Output.MovementBudgetDeferredTicks;
+Output.MovementBudgetDeferredTime += DeltaSeconds;
+// Consume per-update input the same way a full update would.
+Input.CharacterInput->ClearJumpInput(DeltaSeconds, Input, Output);
+Output.NumJumpApexAttempts = 0;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementBudgetDeferredUpdates);
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncBudgetReport::Get().Add(Input.UpdatedComponentInput->UpdatedComponent, true);
+#endif
+return true;
 }
-Output.AnalogInputModifier = 1.f;
+bOutDegraded = true;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementBudgetDegradedUpdates);
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncBudgetReport::Get().Add(Input.UpdatedComponentInput->UpdatedComponent, false);
+#endif
 }
-// Path following above didn't care about the analog modifier, but we do for everything else below, so get the fully modified value.
-// Use max of requested speed and max speed if we modified the speed in ApplyRequestedMove above.
-const float MaxInputSpeed = FMath::Max(MaxSpeed * Output.AnalogInputModifier, GetMinAnalogSpeed(Output));
-MaxSpeed = FMath::Max(RequestedSpeed, MaxInputSpeed);
-// Apply braking or deceleration
-const bool bZeroAcceleration = Acceleration.IsZero();
-const bool bVelocityOverMax = IsExceedingMaxSpeed(MaxSpeed, Output);
-// Only apply braking if there is no acceleration, or we are over our max speed and need to slow down to it.
-if ((bZeroAcceleration && bZeroRequestedAcceleration) || bVelocityOverMax)
+DeltaSeconds += Output.MovementBudgetDeferredTime;
+Output.MovementBudgetDeferredTime = 0.f;
+Output.MovementBudgetDeferredTicks = 0;
+return false;
+}
+// Tracks the recent peak cost of a character's updates, which the budget schedule predicts with. The peak decays by an eighth per update.
+struct FCharacterMovementAsyncBudgetCostScope
 {
-const FVector OldVelocity = Velocity;
-const float ActualBrakingFriction = (bUseSeparateBrakingFriction ? BrakingFriction : Friction);
-ApplyVelocityBraking(DeltaTime, ActualBrakingFriction, BrakingDeceleration, Output);
-// Don't allow braking to lower us below max speed if we started above it.
-if (bVelocityOverMax && Velocity.SizeSquared() < FMath::Square(MaxSpeed) && FVector::DotProduct(Acceleration, OldVelocity) > 0.0f)
+FCharacterMovementComponentAsyncOutput& Output;
+uint64 StartCycles = 0;
+FCharacterMovementAsyncBudgetCostScope(FCharacterMovementComponentAsyncOutput& InOutput, bool bActive)
+: Output(InOutput)
+, StartCycles(bActive ? FPlatformTime::Cycles64() : 0)
 {
-Velocity = OldVelocity.GetSafeNormal() * MaxSpeed;
 }
-}
-else if (!bZeroAcceleration)
+~FCharacterMovementAsyncBudgetCostScope()
 {
-// Friction affects our ability to change direction. This is only done for input acceleration, not path following.
-const FVector AccelDir = Acceleration.GetSafeNormal();
-const float VelSize = Velocity.Size();
-Velocity = Velocity - (Velocity - AccelDir * VelSize) * FMath::Min(DeltaTime * Friction, 1.f);
+if (StartCycles != 0)
+{
+const float CostMs = (float)FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles);
+Output.MovementBudgetCostMs = FMath::Max(CostMs, Output.MovementBudgetCostMs * 0.875f);
+}
 }
-if (bFluid)
+};
+// Movement LOD: a character at level L simulates once every 2^L ticks, a whole interval ahead with the accumulated time,
+// and its transform is interpolated towards the result over the ticks of that interval. Returns false when this tick runs a full rate update.
+static bool PerformMovementLOD(const FCharacterMovementComponentAsyncInput& Input, float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output)
 {
-Velocity = Velocity * (1.f - FMath::Min(Friction * DeltaTime, 1.f));
+if (GAsyncCharacterMovementLODUpdate)
+{
+return false;
 }
-if (!bZeroAcceleration)
+const FUpdatedComponentAsyncInput& UpdatedComponentInput = *Input.UpdatedComponentInput;
+// Moved by something else since the last interpolated tick, such as a teleport: start over from where it is.
+if (Output.MovementLODTick > 0 && UpdatedComponentInput.GetPosition() != Output.MovementLODPosition)
 {
-const float NewMaxInputSpeed = IsExceedingMaxSpeed(MaxInputSpeed, Output) ? Velocity.Size() : MaxInputSpeed;
-Velocity += Acceleration * DeltaTime;
-Velocity = Velocity.GetClampedToMaxSize(NewMaxInputSpeed);
+Output.MovementLODTick = 0;
 }
-// Apply additional requested acceleration
-if (!bZeroRequestedAcceleration)
+FCharacterMovementAsyncDeferredTransformScope DeferredTransform(UpdatedComponentInput);
+if (Output.MovementLODTick == 0)
+{
+const int32 Interval = (CharacterMovementAsyncCVars::MovementLOD != 0) ? (1 << Output.MovementLODLevel) : 1;
+if (Interval <= 1)
 {
-const float NewMaxRequestedSpeed = IsExceedingMaxSpeed(RequestedSpeed, Output) ? Velocity.Size() : RequestedSpeed;
-Velocity += RequestedAcceleration * DeltaTime;
-Velocity = Velocity.GetClampedToMaxSize(NewMaxRequestedSpeed);
+return false;
 }
+Output.MovementLODInterval = (uint8)Interval;
+Output.MovementLODStartPosition = UpdatedComponentInput.GetPosition();
+Output.MovementLODStartRotation = UpdatedComponentInput.GetRotation();
+{
+TGuardValue<bool> LODGuard(GAsyncCharacterMovementLODUpdate, true);
+Input.PerformMovement(DeltaSeconds * Interval, Output);
 }
-bool FCharacterMovementComponentAsyncInput::ApplyRequestedMove(float DeltaTime, float MaxAccel, float MaxSpeed, float Friction, float BrakingDeceleration, FVector& OutAcceleration, float& OutRequestedSpeed, FCharacterMovementComponentAsyncOutput& Output) const
+Output.MovementLODTargetPosition = UpdatedComponentInput.GetPosition();
+Output.MovementLODTargetRotation = UpdatedComponentInput.GetRotation();
+INC_DWORD_STAT(STAT_AsyncCharacterMovementLODUpdates);
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+if (GAsyncCharacterMovementQueryCounters)
 {
-if (Output.bHasRequestedVelocity)
+++GAsyncCharacterMovementQueryCounters->NumLODUpdates;
+}
+#endif
+}
+else
 {
-const float RequestedSpeedSquared = Output.RequestedVelocity.SizeSquared();
-if (RequestedSpeedSquared < UE_KINDA_SMALL_NUMBER)
+INC_DWORD_STAT(STAT_AsyncCharacterMovementLODInterpolatedUpdates);
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+if (GAsyncCharacterMovementQueryCounters)
 {
-return false;
+++GAsyncCharacterMovementQueryCounters->NumLODInterpolatedUpdates;
 }
-// Compute requested speed from path following
-float RequestedSpeed = FMath::Sqrt(RequestedSpeedSquared);
-const FVector RequestedMoveDir = Output.RequestedVelocity / RequestedSpeed;
-RequestedSpeed = (Output.bRequestedMoveWithMaxSpeed ? MaxSpeed : FMath::Min(MaxSpeed, RequestedSpeed));
-// Compute actual requested velocity
-const FVector MoveVelocity = RequestedMoveDir * RequestedSpeed;
-// Compute acceleration. Use MaxAccel to limit speed increase, 1% buffer.
-FVector NewAcceleration = FVector::ZeroVector;
-const float CurrentSpeedSq = Output.Velocity.SizeSquared();
-if (ShouldComputeAccelerationToReachRequestedVelocity(RequestedSpeed, Output))
+#endif
+}
+++Output.MovementLODTick;
+const float Alpha = (float)Output.MovementLODTick / (float)Output.MovementLODInterval;
+Output.MovementLODPosition = FMath::Lerp(Output.MovementLODStartPosition, Output.MovementLODTargetPosition, Alpha);
+if (Output.MovementLODTick >= Output.MovementLODInterval)
 {
-// Turn in the same manner as with input acceleration.
-const float VelSize = FMath::Sqrt(CurrentSpeedSq);
-Output.Velocity = Output.Velocity - (Output.Velocity - RequestedMoveDir * VelSize) * FMath::Min(DeltaTime * Friction, 1.f);
-// How much do we need to accelerate to get to the new velocity?
-NewAcceleration = ((MoveVelocity - Output.Velocity) / DeltaTime);
-NewAcceleration = NewAcceleration.GetClampedToMaxSize(MaxAccel);
+Output.MovementLODTick = 0;
 }
-else
+// Characters at rest keep their particle untouched.
+if (Output.MovementLODStartPosition != Output.MovementLODTargetPosition || !Output.MovementLODStartRotation.Equals(Output.MovementLODTargetRotation, 0.f))
 {
-// Just set velocity directly.
-// If decelerating we do so instantly, so we don't slide through the destination if we can't brake fast enough.
-Output.Velocity = MoveVelocity;
+UpdatedComponentInput.SetPosition(Output.MovementLODPosition);
+UpdatedComponentInput.SetRotation(FQuat::Slerp(Output.MovementLODStartRotation, Output.MovementLODTargetRotation, Alpha));
 }
-OutRequestedSpeed = RequestedSpeed;
-OutAcceleration = NewAcceleration;
 return true;
 }
-return false;
-}
-bool FCharacterMovementComponentAsyncInput::ShouldComputeAccelerationToReachRequestedVelocity(const float RequestedSpeed, FCharacterMovementComponentAsyncOutput& Output) const
+// Soft pawn-vs-pawn separation: pushes the character sideways out of the characters it overlaps at the start of the tick.
+// Each character of an overlapping pair resolves its own half, so the pair separates symmetrically whatever order they simulate in.
+static void ApplyPawnSeparation(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output)
 {
-return bRequestedMoveUseAcceleration && Output.Velocity.SizeSquared() < FMath::Square(RequestedSpeed * 1.01f);
+const UPrimitiveComponent* Component = Input.UpdatedComponentInput->UpdatedComponent;
+const FVector Location = Input.UpdatedComponentInput->GetPosition();
+const float Radius = Output.ScaledCapsuleRadius;
+const float HalfHeight = Output.ScaledCapsuleHalfHeight;
+const FVector Extent(Radius, Radius, HalfHeight);
+const float Stiffness = FMath::Clamp(CharacterMovementAsyncCVars::PawnSeparationStiffness, 0.f, 1.f);
+FVector Push = FVector::ZeroVector;
+Output.PawnHash->ForEachCandidate(FBox(Location - Extent, Location + Extent), [&](const FCharacterMovementAsyncPawnHash::FEntry& Other)
+{
+if (Other.Component == Component || FCharacterMovementAsyncPawnHash::GetPairResponse(Input, Other) != ECR_Block)
+{
+return;
 }
-float FCharacterMovementComponentAsyncInput::GetMinAnalogSpeed(FCharacterMovementComponentAsyncOutput& Output) const
+// Stacked characters are left to floor and base handling.
+if (FMath::Abs(Location.Z - Other.Location.Z) >= HalfHeight + Other.HalfHeight - FMath::Min(Radius, Other.Radius))
 {
-switch (Output.MovementMode)
+return;
+}
+FVector Offset(Location.X - Other.Location.X, Location.Y - Other.Location.Y, 0.f);
+const double DistanceSquared = Offset.SizeSquared();
+const double SumRadius = (double)Radius + Other.Radius;
+if (DistanceSquared >= SumRadius * SumRadius)
 {
-case MOVE_Walking:
-case MOVE_NavWalking:
-case MOVE_Falling:
-return MinAnalogWalkSpeed;
-default:
-return 0.f;
+return;
 }
+const double Distance = CharacterMovementAsyncMath::Sqrt(DistanceSquared);
+if (Distance > UE_KINDA_SMALL_NUMBER)
+{
+Offset /= Distance;
 }
-float FCharacterMovementComponentAsyncInput::GetMaxBrakingDeceleration(FCharacterMovementComponentAsyncOutput& Output) const
+else
 {
-switch (Output.MovementMode)
+// Co-located, both sides pick opposite directions from the component ids.
+Offset = (Component->GetUniqueID() < Other.Component->GetUniqueID()) ? FVector::ForwardVector : FVector::BackwardVector;
+}
+Push += Offset * (0.5 * Stiffness * (SumRadius - Distance));
+});
+if (Push.IsNearlyZero())
 {
-case MOVE_Walking:
-case MOVE_NavWalking:
-return BrakingDecelerationWalking;
-case MOVE_Falling:
-return BrakingDecelerationFalling;
-case MOVE_Swimming:
-return BrakingDecelerationSwimming;
-case MOVE_Flying:
-return BrakingDecelerationFlying;
-case MOVE_Custom:
-return 0.f;
-case MOVE_None:
-default:
-return 0.f;
+return;
 }
+const bool bIsProxy = (Input.CharacterInput->LocalRole == ROLE_SimulatedProxy);
+Push = CharacterMovementAsyncMath::GetClampedToMaxSize(Push, bIsProxy ? Input.MaxDepenetrationWithPawnAsProxy : Input.MaxDepenetrationWithPawn);
+INC_DWORD_STAT(STAT_AsyncCharacterMovementPawnSeparations);
+// The push itself only collides with the world, the other characters are resolving their side.
+TGuardValue<bool> SkipPawnHashGuard(GAsyncCharacterMovementSkipPawnHash, true);
+Input.MoveUpdatedComponent(Push, Input.UpdatedComponentInput->GetRotation(), true, Output);
 }
-void FCharacterMovementComponentAsyncInput::ApplyVelocityBraking(float DeltaTime, float Friction, float BrakingDeceleration, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::PerformMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
 {
-FVector& Velocity = Output.Velocity;
-if (Velocity.IsZero() || !bHasValidData || RootMotion.bHasAnimRootMotion || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+ASYNC_CHARACTER_MOVEMENT_QUERY_CHARACTER_SCOPE(*this);
+// Movement budget, once per character update. Reduced rate LOD updates run nested and are part of the outer one.
+bool bBudgetDegraded = false;
+const bool bBudgeted = !GAsyncCharacterMovementLODUpdate && (CharacterMovementAsyncCVars::MovementBudget != 0 || Output.MovementBudgetDeferredTime > 0.f);
+if (bBudgeted && DeferForMovementBudget(*this, DeltaSeconds, Output, bBudgetDegraded))
 {
 return;
 }
-const float FrictionFactor = FMath::Max(0.f, BrakingFrictionFactor);
-Friction = FMath::Max(0.f, Friction * FrictionFactor);
-BrakingDeceleration = FMath::Max(0.f, BrakingDeceleration);
-const bool bZeroFriction = (Friction == 0.f);
-const bool bZeroBraking = (BrakingDeceleration == 0.f);
-if (bZeroFriction && bZeroBraking)
+TGuardValue<int32> BudgetIterationsGuard(GAsyncCharacterMovementBudgetIterations, bBudgetDegraded ? FMath::Max(1, CharacterMovementAsyncCVars::MovementBudgetDegradedIterations) : GAsyncCharacterMovementBudgetIterations);
+FCharacterMovementAsyncBudgetCostScope BudgetCost(Output, bBudgeted);
+if ((CharacterMovementAsyncCVars::MovementLOD != 0 || Output.MovementLODTick > 0) && PerformMovementLOD(*this, DeltaSeconds, Output))
 {
 return;
 }
-const FVector OldVel = Velocity;
-// subdivide braking to get reasonably consistent results at lower frame rates
-float RemainingTime = DeltaTime;
-const float MaxTimeStep = FMath::Clamp(BrakingSubStepTime, 1.0f / 75.0f, 1.0f / 20.0f);
-// Decelerate to brake to a stop
-const FVector RevAccel = (bZeroBraking ? FVector::ZeroVector : (-BrakingDeceleration * Velocity.GetSafeNormal()));
-while (RemainingTime >= UCharacterMovementComponent::MIN_TICK_TIME)
+FCharacterMovementAsyncDeferredTransformScope DeferredTransform(*UpdatedComponentInput);
+if (Output.PawnHash != nullptr && CharacterMovementAsyncCVars::PawnSeparationStiffness > 0.f)
 {
-// Zero friction uses constant deceleration, so no need for iteration.
-const float dt = ((RemainingTime > MaxTimeStep && !bZeroFriction) ? FMath::Min(MaxTimeStep, RemainingTime * 0.5f) : RemainingTime);
-RemainingTime -= dt;
-// apply friction and braking
-Velocity = Velocity + ((-Friction) * Velocity + RevAccel) * dt;
-// Don't reverse direction
-if ((Velocity | OldVel) <= 0.f)
+ApplyPawnSeparation(*this, Output);
+}
+// Movement sleep: count idle updates, and skip the whole pipeline once we've been at rest long enough.
+const bool bAtRest = (CharacterMovementAsyncCVars::MovementSleep != 0) && IsMovementAtRest(*this, Output);
+Output.MovementSleepCounter = bAtRest ? Output.MovementSleepCounter + 1 : 0;
+if (bAtRest && Output.MovementSleepCounter > CharacterMovementAsyncCVars::MovementSleepDelay)
+{
+INC_DWORD_STAT(STAT_AsyncCharacterMovementSleepingCharacters);
+// Consume per-update state the same way a full update would.
+CharacterInput->ClearJumpInput(DeltaSeconds, *this, Output);
+Output.NumJumpApexAttempts = 0;
+Output.LastUpdateRequestedVelocity = FVector::ZeroVector;
+Output.bHasRequestedVelocity = false;
+return;
+}
+EMovementMode& MovementMode = Output.MovementMode;
+FVector& LastUpdateLocation = Output.LastUpdateLocation;
+const FVector UpdatedComponentLocation = UpdatedComponentInput->GetPosition();
+bool& bForceNextFloorCheck = Output.bForceNextFloorCheck;
+const FVector& Velocity = Output.Velocity;
+const FVector& LastUpdateVelocity = Output.LastUpdateVelocity;
+// Force floor update if we've moved outside of CharacterMovement since last update.
+bForceNextFloorCheck |= (IsMovingOnGround(Output) && UpdatedComponentLocation != LastUpdateLocation);
+// Update saved LastPreAdditiveVelocity with any external changes to character Velocity that happened since last update.
+if (RootMotion.bHasAdditiveRootMotion)
+{
+FVector Adjustment = (Velocity - LastUpdateVelocity);
+Output.LastPreAdditiveVelocity += Adjustment;
+}
+{
+MaybeUpdateBasedMovement(DeltaSeconds, Output);
+const bool bHasRootMotionSources = Output.bWasSimulatingRootMotion;
+Output.OldVelocity = Velocity;
+Output.OldLocation = UpdatedComponentLocation;
+ApplyAccumulatedForces(DeltaSeconds, Output);
+ClearAccumulatedForces(Output);
+// Update saved LastPreAdditiveVelocity with any external changes to character Velocity that happened due to ApplyAccumulatedForces/HandlePendingLaunch
+if (RootMotion.bHasAdditiveRootMotion)
+{
+const FVector Adjustment = (Velocity - Output.OldVelocity);
+Output.LastPreAdditiveVelocity += Adjustment;
+}
+// Apply Root Motion to Velocity
+if (RootMotion.bHasOverrideRootMotion || RootMotion.bHasAnimRootMotion)
+{
+// Animation root motion overrides Velocity and currently doesn't allow any other root motion sources
+if (RootMotion.bHasAnimRootMotion)
+{
+// Turn root motion to velocity to be used by various physics modes.
+if (RootMotion.TimeAccumulated > 0.f)
+{
+Output.AnimRootMotionVelocity = CalcAnimRootMotionVelocity(RootMotion.AnimTransform.GetTranslation(), RootMotion.TimeAccumulated, Velocity);
+Output.Velocity = ConstrainAnimRootMotionVelocity(Output.AnimRootMotionVelocity, Output.Velocity, Output);
+}
+}
+else
+{
+// We don't have animation root motion so we apply other sources
+if (DeltaSeconds > 0.f)
+{
+Output.Velocity = RootMotion.OverrideVelocity;
+}
+}
+}
+// Clear jump input now, to allow movement events to trigger it for next update.
+CharacterInput->ClearJumpInput(DeltaSeconds, *this, Output);
+Output.NumJumpApexAttempts = 0;
+UpdateSwimmingFromPhysicsVolume(Output);
+StartNewPhysics(DeltaSeconds, 0, Output);
+if (!bHasValidData)
+{
+return;
+}
+UpdateCharacterStateAfterMovement(DeltaSeconds, Output);
+if ((bAllowPhysicsRotationDuringAnimRootMotion || !RootMotion.bHasAnimRootMotion))
+{
+PhysicsRotation(DeltaSeconds, Output);
+}
+// Apply Root Motion rotation after movement is complete.
+if (RootMotion.bHasAnimRootMotion)
+{
+const FQuat OldActorRotationQuat = UpdatedComponentInput->GetRotation();
+const FQuat RootMotionRotationQuat = RootMotion.AnimTransform.GetRotation();
+if (!RootMotionRotationQuat.IsIdentity())
+{
+const FQuat NewActorRotationQuat = RootMotionRotationQuat * OldActorRotationQuat;
+MoveUpdatedComponent(FVector::ZeroVector, NewActorRotationQuat, true, Output);
+}
+}
+else if (RootMotion.bHasOverrideRootMotion)
+{
+if (UpdatedComponentInput && !RootMotion.OverrideRotation.IsIdentity())
+{
+const FQuat OldActorRotationQuat = UpdatedComponentInput->GetRotation();
+const FQuat NewActorRotationQuat = RootMotion.OverrideRotation * OldActorRotationQuat;
+MoveUpdatedComponent(FVector::ZeroVector, NewActorRotationQuat, true, Output);
+}
+}
+// consume path following requested velocity
+Output.LastUpdateRequestedVelocity = Output.bHasRequestedVelocity ? Output.RequestedVelocity : FVector::ZeroVector;
+Output.bHasRequestedVelocity = false;
+} // End scoped movement update
+const FVector NewLocation = UpdatedComponentInput->GetPosition();
+const FQuat NewRotation = UpdatedComponentInput->GetRotation();
+Output.LastUpdateLocation = NewLocation;
+Output.LastUpdateRotation = NewRotation;
+Output.LastUpdateVelocity = Velocity;
+}
+void FCharacterMovementComponentAsyncInput::MaybeUpdateBasedMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+{
+bool& bDeferUpdateBasedMovement = Output.bDeferUpdateBasedMovement;
+// Bases nobody started the tick on have no transforms yet, and are treated like bases without relative location until the next input.
+FCharacterMovementAsyncBaseTable::FEntry MovementBase;
+const bool bHasMovementBase = FindMovementBase(*this, Output, MovementBase);
+const bool bMovementBaseUsesRelativeLocation = bHasMovementBase && MovementBase.bUsesRelativeLocation;
+const bool bMovementBaseIsSimulated = MovementBase.bIsSimulated;
+bDeferUpdateBasedMovement = false;
+if (bMovementBaseUsesRelativeLocation) 
+{
+// Need to see if anything we're on is simulating physics or has a parent that is.
+if (bMovementBaseIsSimulated == false)
+{
+bDeferUpdateBasedMovement = false;
+UpdateBasedMovement(DeltaSeconds, Output);
+Output.bShouldDisablePostPhysicsTick = true;
+Output.bShouldAddMovementBaseTickDependency = true;
+}
+else
+{
+// defer movement base update until after physics
+bDeferUpdateBasedMovement = true;
+Output.bShouldEnablePostPhysicsTick = true;
+Output.bShouldRemoveMovementBaseTickDependency = true;
+}
+}
+else
+{
+Output.bShouldEnablePostPhysicsTick = true;
+}
+}
+void FCharacterMovementComponentAsyncInput::UpdateBasedMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+{
+FCharacterMovementAsyncBaseTable::FEntry MovementBase;
+if (!FindMovementBase(*this, Output, MovementBase))
+{
+return;
+}
+const bool bMovementBaseUsesRelativeLocation = MovementBase.bUsesRelativeLocation;
+const bool bIsMovementBaseValid = MovementBase.bIsValid;
+const bool bIsMovementBaseOwnerValid = MovementBase.bOwnerIsValid;
+EMoveComponentFlags& MoveComponentFlags = Output.MoveComponentFlags;
+const FQuat& OldBaseQuat = MovementBase.OldBaseQuat;
+const FVector& OldBaseLocation = MovementBase.OldBaseLocation;
+if (bMovementBaseUsesRelativeLocation == false)
+{
+return;
+}
+if (!bIsMovementBaseValid || !bIsMovementBaseOwnerValid)
+{
+Output.NewMovementBase = nullptr; 
+Output.NewMovementBaseOwner = nullptr;
+return;
+}
+// Ignore collision with bases during these movements.
+TGuardValue<EMoveComponentFlags> ScopedFlagRestore(MoveComponentFlags, MoveComponentFlags | MOVECOMP_IgnoreBases);
+Output.DeltaQuat = FQuat::Identity;
+Output.DeltaPosition = FVector::ZeroVector;
+if (!MovementBase.bIsBaseTransformValid)
+{
+return;
+}
+FQuat NewBaseQuat = MovementBase.BaseQuat;
+FVector NewBaseLocation = MovementBase.BaseLocation;
+// Find change in rotation
+const bool bRotationChanged = !OldBaseQuat.Equals(NewBaseQuat, 1e-8f);
+if (bRotationChanged)
+{
+Output.DeltaQuat = NewBaseQuat * OldBaseQuat.Inverse();
+}
+// only if base moved
+if (bRotationChanged || (OldBaseLocation != NewBaseLocation))
+{
+// Calculate new transform matrix of base actor (ignoring scale).
+const FQuatRotationTranslationMatrix OldLocalToWorld(OldBaseQuat, OldBaseLocation);
+const FQuatRotationTranslationMatrix NewLocalToWorld(NewBaseQuat, NewBaseLocation);
+FQuat FinalQuat = UpdatedComponentInput->GetRotation();
+if (bRotationChanged && !bIgnoreBaseRotation)
+{
+// Apply change in rotation and pipe through FaceRotation to maintain axis restrictions
+const FQuat PawnOldQuat = UpdatedComponentInput->GetRotation();
+const FQuat TargetQuat = Output.DeltaQuat * FinalQuat;
+FRotator TargetRotator(TargetQuat);
+CharacterInput->FaceRotation(TargetRotator, 0.0f, *this, Output);
+FinalQuat =  Output.CharacterOutput->Rotation.Quaternion();
+if (PawnOldQuat.Equals(FinalQuat, 1e-6f))
+{
+// Nothing changed. This means we probably are using another rotation mechanism (bOrientToMovement etc). We should still follow the base object.
+// @todo: This assumes only Yaw is used, currently a valid assumption. This is the only reason FaceRotation() is used above really, aside from being a virtual hook.
+if (bOrientRotationToMovement || (bUseControllerDesiredRotation /*&& CharacterOwner->Controller*/))
+{
+TargetRotator.Pitch = 0.f;
+TargetRotator.Roll = 0.f;
+MoveUpdatedComponent(FVector::ZeroVector, FQuat(TargetRotator), false, Output);
+FinalQuat = UpdatedComponentInput->GetRotation();
+}
+}
+}
+// We need to offset the base of the character here, not its origin, so offset by half height
+float HalfHeight = Output.ScaledCapsuleHalfHeight;
+float Radius = Output.ScaledCapsuleRadius;
+FVector const BaseOffset(0.0f, 0.0f, HalfHeight);
+FVector const LocalBasePos = OldLocalToWorld.InverseTransformPosition(UpdatedComponentInput->GetPosition() - BaseOffset);
+FVector const NewWorldPos = ConstrainLocationToPlane(NewLocalToWorld.TransformPosition(LocalBasePos) + BaseOffset);
+Output.DeltaPosition = ConstrainDirectionToPlane(NewWorldPos - UpdatedComponentInput->GetPosition());
+// move attached actor
+if (false)
+{
+UpdatedComponentInput->SetPosition(NewWorldPos);
+UpdatedComponentInput->SetRotation(FinalQuat);
+}
+else
+{
+// hack - transforms between local and world space introducing slight error FIXMESTEVE - discuss with engine team: just skip the transforms if no rotation?
+FVector BaseMoveDelta = NewBaseLocation - OldBaseLocation;
+if (!bRotationChanged && (BaseMoveDelta.X == 0.f) && (BaseMoveDelta.Y == 0.f))
+{
+Output.DeltaPosition.X = 0.f;
+Output.DeltaPosition.Y = 0.f;
+}
+FHitResult MoveOnBaseHit(1.f);
+const FVector OldLocation = UpdatedComponentInput->GetPosition();
+MoveUpdatedComponent(Output.DeltaPosition, FinalQuat, true, Output, &MoveOnBaseHit);
+if ((UpdatedComponentInput->GetPosition() - (OldLocation + Output.DeltaPosition)).IsNearlyZero() == false)
+{
+}
+}
+if (MovementBase.bIsSimulated)
+{
+// If we hit this multiple times, our DeltaPostion/DeltaQuat is being stomped. Do we need to call for each, or just latest?
+ensure(Output.bShouldApplyDeltaToMeshPhysicsTransforms == false);
+Output.bShouldApplyDeltaToMeshPhysicsTransforms = true;
+}
+}
+}
+void FCharacterMovementComponentAsyncInput::StartNewPhysics(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if ((deltaTime < UCharacterMovementComponent::MIN_TICK_TIME) || (Iterations >= GetMaxSimulationIterations()) || !bHasValidData)
+{
+return;
+}
+if (UpdatedComponentInput->bIsSimulatingPhysics)
+{
+return;
+}
+const bool bSavedMovementInProgress = Output.bMovementInProgress;
+Output.bMovementInProgress = true;
+switch (Output.MovementMode)
+{
+case MOVE_None:
+break;
+case MOVE_Walking:
+PhysWalking(deltaTime, Iterations, Output);
+break;
+case MOVE_Falling:
+PhysFalling(deltaTime, Iterations, Output);
+break;
+case MOVE_NavWalking:
+PhysNavWalking(deltaTime, Iterations, Output);
+break;
+case MOVE_Flying:
+PhysFlying(deltaTime, Iterations, Output);
+break;
+case MOVE_Swimming:
+PhysSwimming(deltaTime, Iterations, Output);
+break;
+case MOVE_Custom:
+PhysCustom(deltaTime, Iterations, Output);
+break;
+default:
+SetMovementMode(MOVE_None, Output);
+break;
+}
+Output.bMovementInProgress = bSavedMovementInProgress;
+if (bDeferUpdateMoveComponent)
+{
+ensure(false);
+}
+}
+void FCharacterMovementComponentAsyncInput::PhysWalking(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, PhysWalking);
+const FCharacterMovementComponentAsyncInput& Input = *this;
+if (deltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+FVector& Acceleration = Output.Acceleration;
+if (false)
+{
+Acceleration = FVector::ZeroVector;
+Velocity = FVector::ZeroVector;
+return;
+}
+if (!UpdatedComponentInput->bIsQueryCollisionEnabled)
+{
+SetMovementMode(MOVE_Walking, Output);
+return;
+}
+// Characters that only walk because they left the navmesh snapshot go back to NavWalking once they are over it again.
+if (Output.bNavWalkingFallback)
+{
+FVector NavFloorLocation;
+if (FindNavFloor(UpdatedComponentInput->GetPosition() - FVector(0.f, 0.f, Output.ScaledCapsuleHalfHeight), Output, NavFloorLocation))
+{
+SetMovementMode(MOVE_NavWalking, Output);
+PhysNavWalking(deltaTime, Iterations, Output);
+return;
+}
+}
+Output.bJustTeleported = false;
+bool bCheckedFall = false;
+bool bTriedLedgeMove = false;
+float remainingTime = deltaTime;
+// Perform the move
+while ((remainingTime >= UCharacterMovementComponent::MIN_TICK_TIME) && (Iterations < GetMaxSimulationIterations())  && ( bRunPhysicsWithNoController
+|| RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideRootMotion || (true)))
+{
+Iterations++;
+Output.bJustTeleported = false;
+const float timeTick = GetSimulationTimeStep(remainingTime, Iterations, Output);
+remainingTime -= timeTick;
+// Save current values
+UPrimitiveComponent* const OldBase = Output.NewMovementBase;
+FCharacterMovementAsyncBaseTable::FEntry OldBaseEntry;
+const FVector PreviousBaseLocation = FindMovementBase(*this, Output, OldBaseEntry) ? OldBaseEntry.BaseLocation : FVector::ZeroVector;
+const FVector OldLocation = UpdatedComponentInput->GetPosition();
+const FFindFloorResult OldFloor = Output.CurrentFloor;
+RestorePreAdditiveRootMotionVelocity(Output);
+// Ensure velocity is horizontal.
+MaintainHorizontalGroundVelocity(Output);
+const FVector OldVelocity = Velocity;
+Acceleration.Z = 0.f;
+// Apply acceleration
+if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+CalcVelocity(timeTick, GroundFriction, false, GetMaxBrakingDeceleration(Output), Output);
+}
+ApplyRootMotionToVelocity(timeTick, Output);
+if (IsFalling(Output))
+{
+StartNewPhysics(remainingTime + timeTick, Iterations - 1, Output);
+return;
+}
+// Compute move parameters
+const FVector MoveVelocity = Velocity;
+const FVector Delta = timeTick * MoveVelocity;
+const bool bZeroDelta = Delta.IsNearlyZero();
+FStepDownResult StepDownResult;
+if (bZeroDelta)
+{
+remainingTime = 0.f;
+}
+else
+{
+// try to move forward
+MoveAlongFloor(MoveVelocity, timeTick, &StepDownResult, Output);
+if (IsFalling(Output))
+{
+// pawn decided to jump up
+const float DesiredDist = Delta.Size();
+if (DesiredDist > UE_KINDA_SMALL_NUMBER)
+{
+const float ActualDist = (UpdatedComponentInput->GetPosition() - OldLocation).Size2D();
+remainingTime += timeTick * (1.f - FMath::Min(1.f, ActualDist / DesiredDist));
+}
+StartNewPhysics(remainingTime, Iterations, Output);
+return;
+}
+}
+// Update floor.
+// StepUp might have already done it for us.
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+if (StepDownResult.bComputedFloor)
+{
+Output.CurrentFloor = StepDownResult.FloorResult;
+}
+else
+{
+// Small moves may still reuse the floor, FindFloor checks how far we are from where it was computed.
+const bool bCanUseCachedFloor = bZeroDelta || (CharacterMovementAsyncCVars::FloorCacheTolerance > 0.f);
+FindFloor(UpdatedComponentInput->GetPosition(), Output.CurrentFloor, bCanUseCachedFloor, Output);
+}
+// check for ledges here
+const bool bCheckLedges = !CanWalkOffLedges(Output);
+if (bCheckLedges && !Output.CurrentFloor.IsWalkableFloor())
+{
+// calculate possible alternate movement
+const FVector GravDir = FVector(0.f, 0.f, -1.f);
+const FVector NewDelta = bTriedLedgeMove ? FVector::ZeroVector : GetLedgeMove(OldLocation, Delta, GravDir, Output);
+if (!NewDelta.IsZero())
+{
+// first revert this move
+RevertMove(OldLocation, OldBase, PreviousBaseLocation, OldFloor, false, Output);
+// avoid repeated ledge moves if the first one fails
+bTriedLedgeMove = true;
+// Try new movement direction
+Velocity = NewDelta / timeTick;
+remainingTime += timeTick;
+continue;
+}
+else
+{
+// See if it is OK to jump. Collision and mobility of the old base are game thread state, so only a missing base forces the fall here.
+const bool bMustJump = bZeroDelta || (OldBase == NULL);
+if ((bMustJump || !bCheckedFall) && CheckFall(OldFloor, Output.CurrentFloor.HitResult, Delta, OldLocation, remainingTime, timeTick, Iterations, bMustJump, Output))
+{
+return;
+}
+bCheckedFall = true;
+// The side step did not keep us on the floor either, so the cached probe no longer describes this edge.
+if (bTriedLedgeMove)
+{
+Output.LedgeProbeComponent = nullptr;
+}
+// revert this move
+RevertMove(OldLocation, OldBase, PreviousBaseLocation, OldFloor, true, Output);
+remainingTime = 0.f;
+break;
+}
+}
+else
+{
+// Validate the floor check
+if (Output.CurrentFloor.IsWalkableFloor())
+{
+if (ShouldCatchAir(OldFloor, Output.CurrentFloor))
+{
+HandleWalkingOffLedge(OldFloor.HitResult.ImpactNormal, OldFloor.HitResult.Normal, OldLocation, timeTick);
+if (IsMovingOnGround(Output))
+{
+// If still walking, then fall. If not, assume the user set a different mode they want to keep.
+StartFalling(Iterations, remainingTime, timeTick, Delta, OldLocation, Output);
+}
+return;
+}
+AdjustFloorHeight(Output);
+Output.NewMovementBase = Output.CurrentFloor.HitResult.Component.Get();
+Output.NewMovementBaseOwner = Output.CurrentFloor.HitResult.GetActor();
+}
+else if (Output.CurrentFloor.HitResult.bStartPenetrating && remainingTime <= 0.f)
+{
+// The floor check failed because it started in penetration
+// We do not want to try to move downward because the downward sweep failed, rather we'd like to try to pop out of the floor.
+FHitResult Hit(Output.CurrentFloor.HitResult);
+Hit.TraceEnd = Hit.TraceStart + FVector(0.f, 0.f, UCharacterMovementComponent::MAX_FLOOR_DIST);
+const FVector RequestedAdjustment = GetPenetrationAdjustment(Hit);
+ResolvePenetration(RequestedAdjustment, Hit, UpdatedComponentInput->GetRotation(), Output);
+Output.bForceNextFloorCheck = true;
+}
+// See if we need to start falling.
+if (!Output.CurrentFloor.IsWalkableFloor() && !Output.CurrentFloor.HitResult.bStartPenetrating)
+{
+const bool bMustJump = Output.bJustTeleported || bZeroDelta;// || (OldBase == NULL || (!OldBase->IsQueryCollisionEnabled() && MovementBaseUtility::IsDynamicBase(OldBase)));
+if ((bMustJump || !bCheckedFall) && CheckFall(OldFloor, Output.CurrentFloor.HitResult, Delta, OldLocation, remainingTime, timeTick, Iterations, bMustJump, Output))
+{
+return;
+}
+bCheckedFall = true;
+}
+}
+// Allow overlap events and such to change physics state and velocity
+if (IsMovingOnGround(Output))
+{
+// Make velocity reflect actual move
+if (!Output.bJustTeleported && !RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion && timeTick >= UCharacterMovementComponent::MIN_TICK_TIME)
+{
+Velocity = (UpdatedComponentInput->GetPosition() - OldLocation) / timeTick;
+MaintainHorizontalGroundVelocity(Output);
+}
+}
+// If we didn't move at all this iteration then abort (since future iterations will also be stuck).
+if (UpdatedComponentInput->GetPosition() == OldLocation)
+{
+remainingTime = 0.f;
+break;
+}
+}
+if (IsMovingOnGround(Output))
+{
+MaintainHorizontalGroundVelocity(Output);
+}
+}
+// Read-only copy of navmesh triangles that NavWalking characters project onto on the physics thread.
+// Game code that owns the navigation data builds one whenever the navmesh changes (for example from ARecastNavMesh::GetDebugGeometry) and publishes it with SetForWorld.
+// Inputs hold a reference, and a snapshot is never modified after Create, so the physics thread reads it without locking.
+// Game code publishes snapshots, so the public header carries this definition. It is repeated here because that header is not part of this tree.
+struct FCharacterMovementAsyncNavMeshSnapshot
+{
+// Changes with every snapshot, so outputs can tell their cached triangle belongs to an older one.
+uint32 Id = 0;
+float CellSize = 0.f;
+TArray<FVector> Vertices;
+TArray<FIntVector> Triangles;
+// Triangles whose XY bounds overlap each grid cell.
+TMap<FIntPoint, TArray<int32>> Cells;
+static TSharedRef<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> Create(TConstArrayView<FVector> InVertices, TConstArrayView<int32> InIndices, float InCellSize = 500.f);
+static void SetForWorld(const UWorld* World, TSharedPtr<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> Snapshot);
+static TSharedPtr<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> GetForWorld(const UWorld* World);
+FIntPoint GetCell(const FVector& Location) const;
+// Height of the triangle below or above Point, if Point lies on it in XY and within MaxHeight.
+bool ProjectOnTriangle(int32 TriangleIndex, const FVector& Point, float MaxHeight, FVector& OutLocation) const;
+bool ProjectPoint(const FVector& Point, const FVector& Extent, int32 HintTriangle, FVector& OutLocation, int32& OutTriangle) const;
+};
+static std::atomic<uint32> GAsyncCharacterMovementNextNavMeshSnapshotId{ 1 };
+TSharedRef<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> FCharacterMovementAsyncNavMeshSnapshot::Create(TConstArrayView<FVector> InVertices, TConstArrayView<int32> InIndices, float InCellSize)
+{
+TSharedRef<FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> Snapshot = MakeShared<FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe>();
+Snapshot->Id = GAsyncCharacterMovementNextNavMeshSnapshotId.fetch_add(1);
+Snapshot->CellSize = FMath::Max(InCellSize, 1.f);
+Snapshot->Vertices.Append(InVertices.GetData(), InVertices.Num());
+Snapshot->Triangles.Reserve(InIndices.Num() / 3);
+for (int32 Index = 0; Index + 2 < InIndices.Num(); Index += 3)
+{
+const int32 TriangleIndex = Snapshot->Triangles.Add(FIntVector(InIndices[Index], InIndices[Index + 1], InIndices[Index + 2]));
+FBox Bounds(ForceInit);
+Bounds += InVertices[InIndices[Index]];
+Bounds += InVertices[InIndices[Index + 1]];
+Bounds += InVertices[InIndices[Index + 2]];
+const FIntPoint MinCell = Snapshot->GetCell(Bounds.Min);
+const FIntPoint MaxCell = Snapshot->GetCell(Bounds.Max);
+for (int32 CellX = MinCell.X; CellX <= MaxCell.X; ++CellX)
+{
+for (int32 CellY = MinCell.Y; CellY <= MaxCell.Y; ++CellY)
+{
+Snapshot->Cells.FindOrAdd(FIntPoint(CellX, CellY)).Add(TriangleIndex);
+}
+}
+}
+return Snapshot;
+}
+FIntPoint FCharacterMovementAsyncNavMeshSnapshot::GetCell(const FVector& Location) const
+{
+return FIntPoint(FMath::FloorToInt32(Location.X / CellSize), FMath::FloorToInt32(Location.Y / CellSize));
+}
+bool FCharacterMovementAsyncNavMeshSnapshot::ProjectOnTriangle(int32 TriangleIndex, const FVector& Point, float MaxHeight, FVector& OutLocation) const
+{
+const FIntVector& Triangle = Triangles[TriangleIndex];
+const FVector& A = Vertices[Triangle.X];
+const FVector& B = Vertices[Triangle.Y];
+const FVector& C = Vertices[Triangle.Z];
+// Barycentric coordinates in XY.
+const double Denominator = (B.Y - C.Y) * (A.X - C.X) + (C.X - B.X) * (A.Y - C.Y);
+if (FMath::IsNearlyZero(Denominator))
+{
+return false;
+}
+const double WeightA = ((B.Y - C.Y) * (Point.X - C.X) + (C.X - B.X) * (Point.Y - C.Y)) / Denominator;
+const double WeightB = ((C.Y - A.Y) * (Point.X - C.X) + (A.X - C.X) * (Point.Y - C.Y)) / Denominator;
+const double WeightC = 1.0 - WeightA - WeightB;
+if (WeightA < 0.0 || WeightB < 0.0 || WeightC < 0.0)
+{
+return false;
+}
+OutLocation = FVector(Point.X, Point.Y, WeightA * A.Z + WeightB * B.Z + WeightC * C.Z);
+return FMath::Abs(OutLocation.Z - Point.Z) <= MaxHeight;
+}
+bool FCharacterMovementAsyncNavMeshSnapshot::ProjectPoint(const FVector& Point, const FVector& Extent, int32 HintTriangle, FVector& OutLocation, int32& OutTriangle) const
+{
+// Characters mostly stay on the triangle they were on last time, which costs a single test.
+if (Triangles.IsValidIndex(HintTriangle) && ProjectOnTriangle(HintTriangle, Point, Extent.Z, OutLocation))
+{
+OutTriangle = HintTriangle;
+return true;
+}
+// Then the triangles of the point's cell, taking the one closest in height.
+OutTriangle = INDEX_NONE;
+double BestDistSq = TNumericLimits<double>::Max();
+if (const TArray<int32>* CellTriangles = Cells.Find(GetCell(Point)))
+{
+for (const int32 TriangleIndex : *CellTriangles)
+{
+FVector Location;
+if (ProjectOnTriangle(TriangleIndex, Point, Extent.Z, Location) && FMath::Square(Location.Z - Point.Z) < BestDistSq)
+{
+BestDistSq = FMath::Square(Location.Z - Point.Z);
+OutLocation = Location;
+OutTriangle = TriangleIndex;
+}
+}
+}
+if (OutTriangle != INDEX_NONE)
+{
+return true;
+}
+// Off the mesh in XY, so take the closest point within the extent, like a navmesh projection.
+const FIntPoint MinCell = GetCell(Point - Extent);
+const FIntPoint MaxCell = GetCell(Point + Extent);
+for (int32 CellX = MinCell.X; CellX <= MaxCell.X; ++CellX)
+{
+for (int32 CellY = MinCell.Y; CellY <= MaxCell.Y; ++CellY)
+{
+const TArray<int32>* CellTriangles = Cells.Find(FIntPoint(CellX, CellY));
+if (CellTriangles == nullptr)
+{
+continue;
+}
+for (const int32 TriangleIndex : *CellTriangles)
+{
+const FIntVector& Triangle = Triangles[TriangleIndex];
+const FVector Location = FMath::ClosestPointOnTriangleToPoint(Point, Vertices[Triangle.X], Vertices[Triangle.Y], Vertices[Triangle.Z]);
+const FVector Offset = (Location - Point).GetAbs();
+const double DistSq = FVector::DistSquared(Location, Point);
+if (Offset.X <= Extent.X && Offset.Y <= Extent.Y && Offset.Z <= Extent.Z && DistSq < BestDistSq)
+{
+BestDistSq = DistSq;
+OutLocation = Location;
+OutTriangle = TriangleIndex;
+}
+}
+}
+}
+return OutTriangle != INDEX_NONE;
+}
+static TMap<FObjectKey, TSharedPtr<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe>> GAsyncCharacterMovementNavMeshSnapshots;
+void FCharacterMovementAsyncNavMeshSnapshot::SetForWorld(const UWorld* World, TSharedPtr<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> Snapshot)
+{
+check(IsInGameThread());
+if (Snapshot.IsValid())
+{
+GAsyncCharacterMovementNavMeshSnapshots.Add(FObjectKey(World), MoveTemp(Snapshot));
+}
+else
+{
+GAsyncCharacterMovementNavMeshSnapshots.Remove(FObjectKey(World));
+}
+}
+TSharedPtr<const FCharacterMovementAsyncNavMeshSnapshot, ESPMode::ThreadSafe> FCharacterMovementAsyncNavMeshSnapshot::GetForWorld(const UWorld* World)
+{
+check(IsInGameThread());
+return GAsyncCharacterMovementNavMeshSnapshots.FindRef(FObjectKey(World));
+}
+bool FCharacterMovementComponentAsyncInput::FindNavFloor(const FVector& TestLocation, FCharacterMovementComponentAsyncOutput& Output, FVector& OutNavFloorLocation) const
+{
+if (!NavMeshSnapshot.IsValid())
+{
+return false;
+}
+const float SearchRadius = NavAgentRadius * 2.0f;
+const float SearchHeight = NavAgentHeight * NavWalkingSearchHeightScale;
+const int32 HintTriangle = (Output.CachedNavSnapshotId == NavMeshSnapshot->Id) ? Output.CachedNavTriangle : INDEX_NONE;
+int32 Triangle = INDEX_NONE;
+if (!NavMeshSnapshot->ProjectPoint(TestLocation, FVector(SearchRadius, SearchRadius, SearchHeight), HintTriangle, OutNavFloorLocation, Triangle))
+{
+return false;
+}
+Output.CachedNavSnapshotId = NavMeshSnapshot->Id;
+Output.CachedNavTriangle = Triangle;
+Output.CachedNavLocation = OutNavFloorLocation;
+return true;
+}
+void FCharacterMovementComponentAsyncInput::PhysNavWalking(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, PhysNavWalking);
+if (deltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+const EMovementMode StartingMovementMode = Output.MovementMode;
+const uint8 StartingCustomMovementMode = Output.CustomMovementMode;
+RestorePreAdditiveRootMotionVelocity(Output);
+// Ensure velocity is horizontal.
+MaintainHorizontalGroundVelocity(Output);
+//bound acceleration
+Output.Acceleration.Z = 0.f;
+if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+CalcVelocity(deltaTime, GroundFriction, false, GetMaxBrakingDeceleration(Output), Output);
+}
+ApplyRootMotionToVelocity(deltaTime, Output);
+if (Output.MovementMode != StartingMovementMode || Output.CustomMovementMode != StartingCustomMovementMode)
+{
+// Root motion could have taken us out of our current mode
+StartNewPhysics(deltaTime, Iterations, Output);
+return;
+}
+Iterations++;
+FVector DesiredMove = Velocity;
+DesiredMove.Z = 0.f;
+const FVector FeetOffset(0.f, 0.f, Output.ScaledCapsuleHalfHeight);
+const FVector OldLocation = UpdatedComponentInput->GetPosition() - FeetOffset;
+const FVector DeltaMove = DesiredMove * deltaTime;
+const FVector AdjustedDest = OldLocation + DeltaMove;
+FVector DestNavLocation;
+if (DeltaMove.IsNearlyZero() && Output.CachedNavTriangle != INDEX_NONE && NavMeshSnapshot.IsValid() && Output.CachedNavSnapshotId == NavMeshSnapshot->Id && Output.CachedNavLocation.Equals(OldLocation))
+{
+DestNavLocation = Output.CachedNavLocation;
+}
+else if (!FindNavFloor(AdjustedDest, Output, DestNavLocation))
+{
+// Off the snapshot, so walk on collision until the character is back on the navmesh.
+Output.CachedNavTriangle = INDEX_NONE;
+SetMovementMode(MOVE_Walking, Output);
+Output.bNavWalkingFallback = true;
+StartNewPhysics(deltaTime, Iterations - 1, Output);
+return;
+}
+const FVector NewLocation(AdjustedDest.X, AdjustedDest.Y, DestNavLocation.Z);
+const FVector AdjustedDelta = NewLocation - OldLocation;
+if (!AdjustedDelta.IsNearlyZero())
+{
+FHitResult HitResult;
+SafeMoveUpdatedComponent(AdjustedDelta, UpdatedComponentInput->GetRotation(), bSweepWhileNavWalking, HitResult, Output);
+}
+// Update velocity to reflect actual move
+if (!Output.bJustTeleported && !RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+Velocity = ((UpdatedComponentInput->GetPosition() - FeetOffset) - OldLocation) / deltaTime;
+MaintainHorizontalGroundVelocity(Output);
+}
+Output.bJustTeleported = false;
+}
+void FCharacterMovementComponentAsyncInput::PhysFalling(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, PhysFalling);
+const float MIN_TICK_TIME = UCharacterMovementComponent::MIN_TICK_TIME;
+if (deltaTime < MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+FVector FallAcceleration = GetFallingLateralAcceleration(deltaTime, Output);
+FallAcceleration.Z = 0.f;
+const bool bHasLimitedAirControl = ShouldLimitAirControl(deltaTime, FallAcceleration, Output);
+float remainingTime = deltaTime;
+while ((remainingTime >= MIN_TICK_TIME) && (Iterations < GetMaxSimulationIterations()))
+{
+Iterations++;
+float timeTick = GetSimulationTimeStep(remainingTime, Iterations, Output);
+remainingTime -= timeTick;
+const FVector OldLocation = UpdatedComponentInput->GetPosition();
+const FQuat PawnRotation = UpdatedComponentInput->GetRotation();
+Output.bJustTeleported = false;
+RestorePreAdditiveRootMotionVelocity(Output);
+const FVector OldVelocity = Velocity;
+const float MaxDecel = GetMaxBrakingDeceleration(Output);
+if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+{
+TGuardValue<FVector> RestoreAcceleration(Output.Acceleration, FallAcceleration);
+Velocity.Z = 0.f;
+CalcVelocity(timeTick, FallingLateralFriction, false, MaxDecel, Output);
+Velocity.Z = OldVelocity.Z;
+}
+}
+const FVector Gravity(0.f, 0.f, GravityZ);
+float GravityTime = timeTick;
+// If jump is providing force, gravity may be affected.
+bool bEndingJumpForce = false;
+if (Output.CharacterOutput->JumpForceTimeRemaining > 0.0f)
+{
+// Consume some of the force time. Only the remaining time (if any) is affected by gravity when bApplyGravityWhileJumping=false.
+const float JumpForceTime = FMath::Min(Output.CharacterOutput->JumpForceTimeRemaining, timeTick);
+GravityTime = bApplyGravityWhileJumping ? timeTick : FMath::Max(0.0f, timeTick - JumpForceTime);
+Output.CharacterOutput->JumpForceTimeRemaining -= JumpForceTime;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
+if (Output.CharacterOutput->JumpForceTimeRemaining <= 0.0f)
+{
+CharacterInput->ResetJumpState(*this, Output);
+bEndingJumpForce = true;
+}
+}
+Velocity = NewFallVelocity(Velocity, Gravity, GravityTime, Output);
+// See if we need to sub-step to exactly reach the apex. This is important for avoiding "cutting off the top" of the trajectory as framerate varies.
+if (CharacterMovementCVars::ForceJumpPeakSubstep && OldVelocity.Z > 0.f && Velocity.Z <= 0.f && Output.NumJumpApexAttempts < MaxJumpApexAttemptsPerSimulation)
+{
+const FVector DerivedAccel = (Velocity - OldVelocity) / timeTick;
+if (!FMath::IsNearlyZero(DerivedAccel.Z))
+{
+const float TimeToApex = -OldVelocity.Z / DerivedAccel.Z;
+// The time-to-apex calculation should be precise, and we want to avoid adding a substep when we are basically already at the apex from the previous iteration's work.
+const float ApexTimeMinimum = 0.0001f;
+if (TimeToApex >= ApexTimeMinimum && TimeToApex < timeTick)
+{
+const FVector ApexVelocity = OldVelocity + DerivedAccel * TimeToApex;
+Velocity = ApexVelocity;
+Velocity.Z = 0.f; // Should be nearly zero anyway, but this makes apex notifications consistent.
+// We only want to move the amount of time it takes to reach the apex, and refund the unused time for next iteration.
+remainingTime += (timeTick - TimeToApex);
+timeTick = TimeToApex;
+Iterations--;
+Output.NumJumpApexAttempts++;
+}
+}
+}
+// Compute change in position (using midpoint integration method).
+FVector Adjusted = 0.5f * (OldVelocity + Velocity) * timeTick;
+// Special handling if ending the jump force where we didn't apply gravity during the jump.
+if (bEndingJumpForce && !bApplyGravityWhileJumping)
+{
+// We had a portion of the time at constant speed then a portion with acceleration due to gravity.
+// Account for that here with a more correct change in position.
+const float NonGravityTime = FMath::Max(0.f, timeTick - GravityTime);
+Adjusted = (OldVelocity * NonGravityTime) + (0.5f * (OldVelocity + Velocity) * GravityTime);
+}
+FHitResult Hit(1.f);
+SafeMoveUpdatedComponent(Adjusted, PawnRotation, true, Hit, Output);
+if (!bHasValidData)
+{
+return;
+}
+float LastMoveTimeSlice = timeTick;
+float subTimeTickRemaining = timeTick * (1.f - Hit.Time);
+UpdateSwimmingFromPhysicsVolume(Output);
+if (IsSwimming(Output)) //just entered water
+{
+remainingTime += subTimeTickRemaining;
+StartSwimming(OldLocation, OldVelocity, timeTick, remainingTime, Iterations, Output);
+return;
+}
+else if (Hit.bBlockingHit)
+{
+if (IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output))
+{
+remainingTime += subTimeTickRemaining;
+ProcessLanded(Hit, remainingTime, Iterations, Output);
+return;
+}
+else
+{
+// Compute impact deflection based on final velocity, not integration step.
+// This allows us to compute a new velocity from the deflected vector, and ensures the full gravity effect is included in the slide result.
+Adjusted = Velocity * timeTick;
+// See if we can convert a normally invalid landing spot (based on the hit result) to a usable one.
+if (!Hit.bStartPenetrating && ShouldCheckForValidLandingSpot(timeTick, Adjusted, Hit, Output))
+{
+const FVector PawnLocation = UpdatedComponentInput->GetPosition();
+FFindFloorResult FloorResult;
+FindFloor(PawnLocation, FloorResult, false, Output);
+if (FloorResult.IsWalkableFloor() && IsValidLandingSpot(PawnLocation, FloorResult.HitResult, Output))
+{
+remainingTime += subTimeTickRemaining;
+ProcessLanded(FloorResult.HitResult, remainingTime, Iterations, Output);
+return;
+}
+}
+HandleImpact(Hit, Output, LastMoveTimeSlice, Adjusted);
+if (!bHasValidData || !IsFalling(Output))
+{
+return;
+}
+// Limit air control based on what we hit.
+// We moved to the impact point using air control, but may want to deflect from there based on a limited air control acceleration.
+FVector VelocityNoAirControl = OldVelocity;
+FVector AirControlAccel = Output.Acceleration;
+if (bHasLimitedAirControl)
+{
+{
+// Find velocity *without* acceleration.
+TGuardValue<FVector> RestoreAcceleration(Output.Acceleration, FVector::ZeroVector);
+TGuardValue<FVector> RestoreVelocity(Velocity, OldVelocity);
+Velocity.Z = 0.f;
+CalcVelocity(timeTick, FallingLateralFriction, false, MaxDecel, Output);
+VelocityNoAirControl = FVector(Velocity.X, Velocity.Y, OldVelocity.Z);
+VelocityNoAirControl = NewFallVelocity(VelocityNoAirControl, Gravity, GravityTime, Output);
+}
+const bool bCheckLandingSpot = false; // we already checked above.
+AirControlAccel = (Velocity - VelocityNoAirControl) / timeTick;
+const FVector AirControlDeltaV = LimitAirControl(LastMoveTimeSlice, AirControlAccel, Hit, bCheckLandingSpot, Output) * LastMoveTimeSlice;
+Adjusted = (VelocityNoAirControl + AirControlDeltaV) * LastMoveTimeSlice;
+}
+const FVector OldHitNormal = Hit.Normal;
+const FVector OldHitImpactNormal = Hit.ImpactNormal;
+FVector Delta = ComputeSlideVector(Adjusted, 1.f - Hit.Time, OldHitNormal, Hit, Output);
+// Compute velocity after deflection (only gravity component for RootMotion)
+if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && !Output.bJustTeleported)
+{
+const FVector NewVelocity = (Delta / subTimeTickRemaining);
+Velocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideWithIgnoreZAccumulate ? FVector(Velocity.X, Velocity.Y, NewVelocity.Z) : NewVelocity;
+}
+if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && (Delta | Adjusted) > 0.f)
+{
+// Move in deflected direction.
+SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit, Output);
+if (Hit.bBlockingHit)
+{
+// hit second wall
+LastMoveTimeSlice = subTimeTickRemaining;
+subTimeTickRemaining = subTimeTickRemaining * (1.f - Hit.Time);
+if (IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output))
+{
+remainingTime += subTimeTickRemaining;
+ProcessLanded(Hit, remainingTime, Iterations, Output);
+return;
+}
+HandleImpact(Hit, Output, LastMoveTimeSlice, Delta);
+if (!bHasValidData || !IsFalling(Output))
+{
+return;
+}
+// Act as if there was no air control on the last move when computing new deflection.
+if (bHasLimitedAirControl && Hit.Normal.Z > CharacterMovementConstants::VERTICAL_SLOPE_NORMAL_Z)
+{
+const FVector LastMoveNoAirControl = VelocityNoAirControl * LastMoveTimeSlice;
+Delta = ComputeSlideVector(LastMoveNoAirControl, 1.f, OldHitNormal, Hit, Output);
+}
+FVector PreTwoWallDelta = Delta;
+TwoWallAdjust(Delta, Hit, OldHitNormal, Output);
+if (bHasLimitedAirControl)
+{
+const bool bCheckLandingSpot = false; // we already checked above.
+const FVector AirControlDeltaV = LimitAirControl(subTimeTickRemaining, AirControlAccel, Hit, bCheckLandingSpot, Output) * subTimeTickRemaining;
+// Only allow if not back in to first wall
+if (FVector::DotProduct(AirControlDeltaV, OldHitNormal) > 0.f)
+{
+Delta += (AirControlDeltaV * subTimeTickRemaining);
+}
+}
+// Compute velocity after deflection (only gravity component for RootMotion)
+if (subTimeTickRemaining > UE_KINDA_SMALL_NUMBER && !Output.bJustTeleported)
+{
+const FVector NewVelocity = (Delta / subTimeTickRemaining);
+Velocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideWithIgnoreZAccumulate ? FVector(Velocity.X, Velocity.Y, NewVelocity.Z) : NewVelocity;
+}
+// bDitch=true means that pawn is straddling two slopes, neither of which it can stand on
+bool bDitch = ((OldHitImpactNormal.Z > 0.f) && (Hit.ImpactNormal.Z > 0.f) && (FMath::Abs(Delta.Z) <= UE_KINDA_SMALL_NUMBER) && ((Hit.ImpactNormal | OldHitImpactNormal) < 0.f));
+SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit, Output);
+if (Hit.Time == 0.f)
+{
+// if we are stuck then try to side step
+FVector SideDelta = CharacterMovementAsyncMath::GetSafeNormal2D(OldHitNormal + Hit.ImpactNormal);
+if (SideDelta.IsNearlyZero())
+{
+SideDelta = CharacterMovementAsyncMath::GetSafeNormal(FVector(OldHitNormal.Y, -OldHitNormal.X, 0));
+}
+SafeMoveUpdatedComponent(SideDelta, PawnRotation, true, Hit, Output);
+}
+if (bDitch || IsValidLandingSpot(UpdatedComponentInput->GetPosition(), Hit, Output) || Hit.Time == 0.f)
+{
+remainingTime = 0.f;
+ProcessLanded(Hit, remainingTime, Iterations, Output);
+return;
+}
+else if (GetPerchRadiusThreshold() > 0.f && Hit.Time == 1.f && OldHitImpactNormal.Z >= WalkableFloorZ)
+{
+// We might be in a virtual 'ditch' within our perch radius. This is rare.
+const FVector PawnLocation = UpdatedComponentInput->GetPosition();
+const float ZMovedDist = FMath::Abs(PawnLocation.Z - OldLocation.Z);
+const float MovedDist2DSq = (PawnLocation - OldLocation).SizeSquared2D();
+if (ZMovedDist <= 0.2f * timeTick && MovedDist2DSq <= 4.f * timeTick)
+{
+Velocity.X += 0.25f * GetMaxSpeed(Output) * (RandomStream.FRand() - 0.5f);
+Velocity.Y += 0.25f * GetMaxSpeed(Output) * (RandomStream.FRand() - 0.5f);
+Velocity.Z = FMath::Max<float>(JumpZVelocity * 0.25f, 1.f);
+Delta = Velocity * timeTick;
+SafeMoveUpdatedComponent(Delta, PawnRotation, true, Hit,  Output);
+}
+}
+}
+}
+}
+}
+if (Velocity.SizeSquared2D() <= UE_KINDA_SMALL_NUMBER * 10.f)
+{
+Velocity.X = 0.f;
+Velocity.Y = 0.f;
+}
+}
+}
+void FCharacterMovementComponentAsyncInput::PhysFlying(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, PhysFlying);
+if (deltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+RestorePreAdditiveRootMotionVelocity(Output);
+if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+if (bCheatFlying && Output.Acceleration.IsZero())
+{
+Velocity = FVector::ZeroVector;
+}
+const float Friction = 0.5f * PhysicsVolumeFluidFriction;
+CalcVelocity(deltaTime, Friction, true, GetMaxBrakingDeceleration(Output), Output);
+}
+ApplyRootMotionToVelocity(deltaTime, Output);
+Iterations++;
+Output.bJustTeleported = false;
+FVector OldLocation = UpdatedComponentInput->GetPosition();
+const FVector Adjusted = Velocity * deltaTime;
+FHitResult Hit(1.f);
+SafeMoveUpdatedComponent(Adjusted, UpdatedComponentInput->GetRotation(), true, Hit, Output);
+if (Hit.Time < 1.f)
+{
+const FVector GravDir = FVector(0.f, 0.f, -1.f);
+const FVector VelDir = CharacterMovementAsyncMath::GetSafeNormal(Velocity);
+const float UpDown = GravDir | VelDir;
+bool bSteppedUp = false;
+if ((FMath::Abs(Hit.ImpactNormal.Z) < 0.2f) && (UpDown < 0.5f) && (UpDown > -0.2f) && CanStepUp(Hit, Output))
+{
+const float StepZ = UpdatedComponentInput->GetPosition().Z;
+bSteppedUp = StepUp(GravDir, Adjusted * (1.f - Hit.Time), Hit, Output);
+if (bSteppedUp)
+{
+OldLocation.Z = UpdatedComponentInput->GetPosition().Z + (OldLocation.Z - StepZ);
+}
+}
+if (!bSteppedUp)
+{
+//adjust and try again
+HandleImpact(Hit, Output, deltaTime, Adjusted);
+SlideAlongSurface(Adjusted, (1.f - Hit.Time), Hit.Normal, Hit, true, Output);
+}
+}
+if (!Output.bJustTeleported && !RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion)
+{
+Velocity = (UpdatedComponentInput->GetPosition() - OldLocation) / deltaTime;
+}
+}
+void FCharacterMovementComponentAsyncInput::PhysSwimming(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, PhysSwimming);
+if (deltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+FVector& Acceleration = Output.Acceleration;
+RestorePreAdditiveRootMotionVelocity(Output);
+const bool bRootMotionVelocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideRootMotion;
+const float Depth = ImmersionDepth(Output);
+const float NetBuoyancy = Buoyancy * Depth;
+const float OriginalAccelZ = Acceleration.Z;
+bool bLimitedUpAccel = false;
+if (!bRootMotionVelocity && (Velocity.Z > 0.33f * MaxSwimSpeed) && (NetBuoyancy != 0.f))
+{
+//damp positive Z out of water
+Velocity.Z = FMath::Max<FVector::FReal>(0.33f * MaxSwimSpeed, Velocity.Z * Depth * Depth);
+}
+else if (Depth < 0.65f)
+{
+bLimitedUpAccel = (Acceleration.Z > 0.f);
+Acceleration.Z = FMath::Min<FVector::FReal>(0.1f, Acceleration.Z);
+}
+Iterations++;
+FVector OldLocation = UpdatedComponentInput->GetPosition();
+Output.bJustTeleported = false;
+if (!bRootMotionVelocity)
+{
+const float Friction = 0.5f * PhysicsVolumeFluidFriction * Depth;
+CalcVelocity(deltaTime, Friction, true, GetMaxBrakingDeceleration(Output), Output);
+Velocity.Z += GravityZ * deltaTime * (1.f - NetBuoyancy);
+}
+ApplyRootMotionToVelocity(deltaTime, Output);
+FVector Adjusted = Velocity * deltaTime;
+FHitResult Hit(1.f);
+const float remainingTime = deltaTime * Swim(Adjusted, Hit, Output);
+//may have left water
+UpdateSwimmingFromPhysicsVolume(Output);
+if (!IsSwimming(Output))
+{
+StartNewPhysics(remainingTime, Iterations, Output);
+return;
+}
+if (Hit.Time < 1.f)
+{
+if (bLimitedUpAccel && (Velocity.Z >= 0.f))
+{
+// allow upward velocity at surface if against obstacle
+Velocity.Z += OriginalAccelZ * deltaTime;
+Adjusted = Velocity * (1.f - Hit.Time) * deltaTime;
+Swim(Adjusted, Hit, Output);
+UpdateSwimmingFromPhysicsVolume(Output);
+if (!IsSwimming(Output))
+{
+StartNewPhysics(remainingTime, Iterations, Output);
+return;
+}
+}
+const FVector GravDir = FVector(0.f, 0.f, -1.f);
+const FVector VelDir = CharacterMovementAsyncMath::GetSafeNormal(Velocity);
+const float UpDown = GravDir | VelDir;
+bool bSteppedUp = false;
+if ((FMath::Abs(Hit.ImpactNormal.Z) < 0.2f) && (UpDown < 0.5f) && (UpDown > -0.2f) && CanStepUp(Hit, Output))
+{
+const float StepZ = UpdatedComponentInput->GetPosition().Z;
+const FVector RealVelocity = Velocity;
+Velocity.Z = 1.f; // HACK: since will be moving up, in case pawn leaves the water
+bSteppedUp = StepUp(GravDir, Adjusted * (1.f - Hit.Time), Hit, Output);
+if (bSteppedUp)
+{
+//may have left water
+UpdateSwimmingFromPhysicsVolume(Output);
+if (!IsSwimming(Output))
+{
+StartNewPhysics(remainingTime, Iterations, Output);
+return;
+}
+OldLocation.Z = UpdatedComponentInput->GetPosition().Z + (OldLocation.Z - StepZ);
+}
+Velocity = RealVelocity;
+}
+if (!bSteppedUp)
+{
+//adjust and try again
+HandleImpact(Hit, Output, deltaTime, Adjusted);
+SlideAlongSurface(Adjusted, (1.f - Hit.Time), Hit.Normal, Hit, true, Output);
+}
+}
+if (!bRootMotionVelocity && !Output.bJustTeleported && ((deltaTime - remainingTime) > UE_KINDA_SMALL_NUMBER))
+{
+const bool bWaterJump = !IsInWater(Output);
+const float VelZ = Velocity.Z;
+Velocity = (UpdatedComponentInput->GetPosition() - OldLocation) / (deltaTime - remainingTime);
+if (bWaterJump)
+{
+Velocity.Z = VelZ;
+}
+}
+UpdateSwimmingFromPhysicsVolume(Output);
+//may have left water
+if (!IsSwimming(Output))
+{
+StartNewPhysics(remainingTime, Iterations, Output);
+}
+}
+void FCharacterMovementComponentAsyncInput::StartSwimming(const FVector& OldLocation, const FVector& OldVelocity, float timeTick, float remainingTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (remainingTime < UCharacterMovementComponent::MIN_TICK_TIME || timeTick < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+FVector& Velocity = Output.Velocity;
+const bool bRootMotionVelocity = RootMotion.bHasAnimRootMotion || RootMotion.bHasOverrideRootMotion;
+if (!bRootMotionVelocity && !Output.bJustTeleported)
+{
+Velocity = (UpdatedComponentInput->GetPosition() - OldLocation) / timeTick; //actual average velocity
+Velocity = 2.f * Velocity - OldVelocity; //end velocity has 2* accel of avg
+Velocity = CharacterMovementAsyncMath::GetClampedToMaxSize(Velocity, PhysicsVolumeTerminalVelocity);
+}
+const FVector Location = UpdatedComponentInput->GetPosition();
+const FVector End = FindWaterLine(Location, OldLocation);
+if (End != Location)
+{
+const float ActualDist = (Location - OldLocation).Size();
+if (ActualDist > UE_KINDA_SMALL_NUMBER)
+{
+const float WaterTime = timeTick * (End - Location).Size() / ActualDist;
+remainingTime += WaterTime;
+}
+MoveUpdatedComponent(End - Location, UpdatedComponentInput->GetRotation(), true, Output);
+}
+if (!bRootMotionVelocity && (Velocity.Z > 2.f * UCharacterMovementComponent::SWIMBOBSPEED) && (Velocity.Z < 0.f)) //allow for falling out of water
+{
+Velocity.Z = UCharacterMovementComponent::SWIMBOBSPEED - Velocity.Size2D() * 0.7f; //smooth bobbing
+}
+if ((remainingTime >= UCharacterMovementComponent::MIN_TICK_TIME) && (Iterations < GetMaxSimulationIterations()))
+{
+PhysSwimming(remainingTime, Iterations, Output);
+}
+}
+float FCharacterMovementComponentAsyncInput::Swim(const FVector& Delta, FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+{
+const FVector Start = UpdatedComponentInput->GetPosition();
+float AirTime = 0.f;
+SafeMoveUpdatedComponent(Delta, UpdatedComponentInput->GetRotation(), true, Hit, Output);
+if (!IsInWater(Output)) //then left water
+{
+const FVector Location = UpdatedComponentInput->GetPosition();
+const FVector End = FindWaterLine(Start, Location);
+const float DesiredDist = Delta.Size();
+if (End != Location && DesiredDist > UE_KINDA_SMALL_NUMBER)
+{
+AirTime = (End - Location).Size() / DesiredDist;
+if (((Location - Start) | (End - Location)) > 0.f)
+{
+AirTime = 0.f;
+}
+SafeMoveUpdatedComponent(End - Location, UpdatedComponentInput->GetRotation(), true, Hit, Output);
+}
+}
+return AirTime;
+}
+// The water volume is snapshotted at input build as its bounds, so the surface is the top of the bounds and no volume is queried here.
+FVector FCharacterMovementComponentAsyncInput::FindWaterLine(const FVector& InWater, const FVector& OutofWater) const
+{
+const float SurfaceZ = PhysicsVolumeWaterBounds.Max.Z;
+if (!bPhysicsVolumeIsWater || FMath::IsNearlyEqual(InWater.Z, OutofWater.Z) || (FMath::Min(InWater.Z, OutofWater.Z) > SurfaceZ) || (FMath::Max(InWater.Z, OutofWater.Z) < SurfaceZ))
+{
+return OutofWater;
+}
+const FVector Dir = CharacterMovementAsyncMath::GetSafeNormal(InWater - OutofWater);
+const FVector SurfacePoint = FMath::Lerp(OutofWater, InWater, (SurfaceZ - OutofWater.Z) / (InWater.Z - OutofWater.Z));
+return SurfacePoint + 0.1f * Dir;
+}
+float FCharacterMovementComponentAsyncInput::ImmersionDepth(const FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!bPhysicsVolumeIsWater)
+{
+return 0.f;
+}
+const float CollisionHalfHeight = Output.ScaledCapsuleHalfHeight;
+if ((CollisionHalfHeight == 0.f) || (Buoyancy == 0.f))
+{
+return 1.f;
+}
+// Fraction of the capsule's vertical extent below the surface. A capsule whose top is under water is fully immersed.
+const float TopZ = UpdatedComponentInput->GetPosition().Z + CollisionHalfHeight;
+const float HitTime = (TopZ - PhysicsVolumeWaterBounds.Max.Z) / (2.f * CollisionHalfHeight);
+return (HitTime <= 0.f || HitTime >= 1.f) ? 1.f : (1.f - HitTime);
+}
+bool FCharacterMovementComponentAsyncInput::IsInWater(const FCharacterMovementComponentAsyncOutput& Output) const
+{
+return bPhysicsVolumeIsWater && bNavAgentPropsCanSwim && PhysicsVolumeWaterBounds.IsInsideOrOn(UpdatedComponentInput->GetPosition());
+}
+bool FCharacterMovementComponentAsyncInput::IsSwimming(const FCharacterMovementComponentAsyncOutput& Output) const
+{
+return (Output.MovementMode == MOVE_Swimming);
+}
+// Stands in for PhysicsVolumeChanged, which the game thread component runs when its physics volume changes.
+void FCharacterMovementComponentAsyncInput::UpdateSwimmingFromPhysicsVolume(FCharacterMovementComponentAsyncOutput& Output) const
+{
+const bool bInWater = IsInWater(Output);
+if (bInWater && !IsSwimming(Output) && (Output.MovementMode == MOVE_Walking || Output.MovementMode == MOVE_Falling))
+{
+SetMovementMode(MOVE_Swimming, Output);
+}
+else if (!bInWater && IsSwimming(Output))
+{
+SetMovementMode(MOVE_Falling, Output);
+}
+}
+static std::atomic<FCharacterMovementComponentAsyncInput::FPhysCustomFunction> GAsyncCharacterMovementCustomModes[256];
+void FCharacterMovementComponentAsyncInput::RegisterCustomMovementMode(uint8 CustomMode, FPhysCustomFunction PhysCustomFunction)
+{
+check(IsInGameThread());
+ensureMsgf(GAsyncCharacterMovementCustomModes[CustomMode].load() == nullptr || PhysCustomFunction == nullptr, TEXT("Async custom movement mode %d registered twice."), CustomMode);
+GAsyncCharacterMovementCustomModes[CustomMode].store(PhysCustomFunction);
+}
+void FCharacterMovementComponentAsyncInput::UnregisterCustomMovementMode(uint8 CustomMode)
+{
+check(IsInGameThread());
+GAsyncCharacterMovementCustomModes[CustomMode].store(nullptr);
+}
+void FCharacterMovementComponentAsyncInput::PhysCustom(float deltaTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (const FPhysCustomFunction PhysCustomFunction = GAsyncCharacterMovementCustomModes[Output.CustomMovementMode].load(std::memory_order_acquire))
+{
+PhysCustomFunction(*this, deltaTime, Iterations, Output);
+return;
+}
+// Unknown custom modes stop, as every mode did before it had an async implementation.
+SetMovementMode(MOVE_None, Output);
+}
+void FCharacterMovementComponentAsyncInput::PhysicsRotation(float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!(bOrientRotationToMovement || bUseControllerDesiredRotation))
+{
+return;
+}
+if (!bHasValidData)
+{
+return;
+}
+FRotator CurrentRotation = FRotator(UpdatedComponentInput->GetRotation());
+CurrentRotation.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): CurrentRotation"));
+FRotator DeltaRot = Output.GetDeltaRotation(GetRotationRate(Output), DeltaTime);
+DeltaRot.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): GetDeltaRotation"));
+FRotator DesiredRotation = CurrentRotation;
+if (bOrientRotationToMovement)
+{
+DesiredRotation = ComputeOrientToMovementRotation(CurrentRotation, DeltaTime, DeltaRot, Output);
+}
+else if ( bUseControllerDesiredRotation)
+{
+DesiredRotation = CharacterInput->ControllerDesiredRotation;
+}
+else
+{
+return;
+}
+if (ShouldRemainVertical(Output))
+{
+DesiredRotation.Pitch = 0.f;
+DesiredRotation.Yaw = FRotator::NormalizeAxis(DesiredRotation.Yaw);
+DesiredRotation.Roll = 0.f;
+}
+else
+{
+DesiredRotation.Normalize();
+}
+// Accumulate a desired new rotation.
+const float AngleTolerance = 1e-3f;
+if (!CurrentRotation.Equals(DesiredRotation, AngleTolerance))
+{
+// PITCH
+if (!FMath::IsNearlyEqual(CurrentRotation.Pitch, DesiredRotation.Pitch, AngleTolerance))
+{
+DesiredRotation.Pitch = FMath::FixedTurn(CurrentRotation.Pitch, DesiredRotation.Pitch, DeltaRot.Pitch);
+}
+// YAW
+if (!FMath::IsNearlyEqual(CurrentRotation.Yaw, DesiredRotation.Yaw, AngleTolerance))
+{
+DesiredRotation.Yaw = FMath::FixedTurn(CurrentRotation.Yaw, DesiredRotation.Yaw, DeltaRot.Yaw);
+}
+// ROLL
+if (!FMath::IsNearlyEqual(CurrentRotation.Roll, DesiredRotation.Roll, AngleTolerance))
+{
+DesiredRotation.Roll = FMath::FixedTurn(CurrentRotation.Roll, DesiredRotation.Roll, DeltaRot.Roll);
+}
+// Set the new rotation.
+DesiredRotation.DiagnosticCheckNaN(TEXT("CharacterMovementComponent::PhysicsRotation(): DesiredRotation"));
+MoveUpdatedComponent(FVector::ZeroVector, DesiredRotation.Quaternion(), /*bSweep*/ false, Output);
+}
+}
+void FCharacterMovementComponentAsyncInput::MoveAlongFloor(const FVector& InVelocity, float DeltaSeconds, FStepDownResult* OutStepDownResult, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!Output.CurrentFloor.IsWalkableFloor())
+{
+return;
+}
+// Move along the current floor
+const FVector Delta = FVector(InVelocity.X, InVelocity.Y, 0.f) * DeltaSeconds;
+FHitResult Hit(1.f);
+FVector RampVector = ComputeGroundMovementDelta(Delta, Output.CurrentFloor.HitResult, Output.CurrentFloor.bLineTrace, Output);
+SafeMoveUpdatedComponent(RampVector, UpdatedComponentInput->GetRotation(), true, Hit, Output);
+float LastMoveTimeSlice = DeltaSeconds;
+if (Hit.bStartPenetrating)
+{
+// Allow this hit to be used as an impact we can deflect off, otherwise we do nothing the rest of the update and appear to hitch.
+HandleImpact(Hit, Output);
+SlideAlongSurface(Delta, 1.f, Hit.Normal, Hit, true, Output);
+if (Hit.bStartPenetrating)
+{
+OnCharacterStuckInGeometry(&Hit, Output);
+}
+}
+else if (Hit.IsValidBlockingHit())
+{
+// We impacted something (most likely another ramp, but possibly a barrier).
+float PercentTimeApplied = Hit.Time;
+if ((Hit.Time > 0.f) && (Hit.Normal.Z > UE_KINDA_SMALL_NUMBER) && IsWalkable(Hit))
+{
+const float InitialPercentRemaining = 1.f - PercentTimeApplied;
+RampVector = ComputeGroundMovementDelta(Delta * InitialPercentRemaining, Hit, false, Output);
+LastMoveTimeSlice = InitialPercentRemaining * LastMoveTimeSlice;
+SafeMoveUpdatedComponent(RampVector, UpdatedComponentInput->GetRotation(), true, Hit, Output);
+const float SecondHitPercent = Hit.Time * InitialPercentRemaining;
+PercentTimeApplied = FMath::Clamp(PercentTimeApplied + SecondHitPercent, 0.f, 1.f);
+}
+if (Hit.IsValidBlockingHit())
+{
+if (CanStepUp(Hit, Output) || (Output.NewMovementBase != NULL && Output.NewMovementBaseOwner == Hit.GetActor()))
+{
+// hit a barrier, try to step up
+const FVector PreStepUpLocation = UpdatedComponentInput->GetPosition();
+const FVector GravDir(0.f, 0.f, -1.f);
+if (!StepUp(GravDir, Delta * (1.f - PercentTimeApplied), Hit, Output, OutStepDownResult))
+{
+HandleImpact(Hit, Output, LastMoveTimeSlice, RampVector);
+SlideAlongSurface(Delta, 1.f - PercentTimeApplied, Hit.Normal, Hit, true, Output);
+}
+else
+{
+if (!bMaintainHorizontalGroundVelocity)
+{
+// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments. Only consider horizontal movement.
+Output.bJustTeleported = true;
+const float StepUpTimeSlice = (1.f - PercentTimeApplied) * DeltaSeconds;
+if (!RootMotion.bHasAnimRootMotion && !RootMotion.bHasOverrideRootMotion && StepUpTimeSlice >= UE_KINDA_SMALL_NUMBER)
+{
+Output.Velocity = (UpdatedComponentInput->GetPosition() - PreStepUpLocation) / StepUpTimeSlice;
+Output.Velocity.Z = 0;
+}
+}
+}
+}
+}
+}
+}
+FVector FCharacterMovementComponentAsyncInput::ComputeGroundMovementDelta(const FVector& Delta, const FHitResult& RampHit, const bool bHitFromLineTrace, FCharacterMovementComponentAsyncOutput& Output) const
+{
+const FVector FloorNormal = RampHit.ImpactNormal;
+const FVector ContactNormal = RampHit.Normal;
+if (FloorNormal.Z < (1.f - UE_KINDA_SMALL_NUMBER) && FloorNormal.Z > UE_KINDA_SMALL_NUMBER && ContactNormal.Z > UE_KINDA_SMALL_NUMBER && !bHitFromLineTrace && IsWalkable(RampHit))
+{
+// Compute a vector that moves parallel to the surface, by projecting the horizontal movement direction onto the ramp.
+const float FloorDotDelta = (FloorNormal | Delta);
+FVector RampMovement(Delta.X, Delta.Y, -FloorDotDelta / FloorNormal.Z);
+if (bMaintainHorizontalGroundVelocity)
+{
+return RampMovement;
+}
+else
+{
+return CharacterMovementAsyncMath::GetSafeNormal(RampMovement) * Delta.Size();
+}
+}
+return Delta;
+}
+bool FCharacterMovementComponentAsyncInput::CanCrouchInCurrentState(FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!bCanEverCrouch)
+{
+return false;
+}
+return (IsFalling(Output) || IsMovingOnGround(Output)) && UpdatedComponentInput->bIsSimulatingPhysics;
+}
+FVector FCharacterMovementComponentAsyncInput::ConstrainInputAcceleration(FVector InputAcceleration, const FCharacterMovementComponentAsyncOutput& Output) const
+{
+// walking or falling pawns ignore up/down sliding
+if (InputAcceleration.Z != 0.f && (IsMovingOnGround(Output) || IsFalling(Output)))
+{
+return FVector(InputAcceleration.X, InputAcceleration.Y, 0.f);
+}
+return InputAcceleration;
+}
+FVector FCharacterMovementComponentAsyncInput::ScaleInputAcceleration(FVector InputAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
+{
+return MaxAcceleration * CharacterMovementAsyncMath::GetClampedToMaxSize(InputAcceleration, 1.0f);
+}
+float FCharacterMovementComponentAsyncInput::ComputeAnalogInputModifier(FVector Acceleration) const
+{
+const float MaxAccel = MaxAcceleration;
+if (Acceleration.SizeSquared() > 0.f && MaxAccel > UE_SMALL_NUMBER)
+{
+return FMath::Clamp(Acceleration.Size() / MaxAccel, 0.f, 1.f);
+}
+return 0.f;
+}
+FVector FCharacterMovementComponentAsyncInput::ConstrainDirectionToPlane(FVector Direction) const
+{
+if (bConstrainToPlane)
+{
+Direction = CharacterMovementAsyncMath::VectorPlaneProject(Direction, PlaneConstraintNormal);
+}
+return Direction;
+}
+FVector FCharacterMovementComponentAsyncInput::ConstrainNormalToPlane(FVector Normal) const
+{
+if (bConstrainToPlane)
+{
+Normal = CharacterMovementAsyncMath::GetSafeNormal(CharacterMovementAsyncMath::VectorPlaneProject(Normal, PlaneConstraintNormal));
+}
+return Normal;
+}
+FVector FCharacterMovementComponentAsyncInput::ConstrainLocationToPlane(FVector Location) const
+{
+if (bConstrainToPlane)
+{
+Location = FVector::PointPlaneProject(Location, PlaneConstraintOrigin, PlaneConstraintNormal);
+}
+return Location;
+}
+void FCharacterMovementComponentAsyncInput::MaintainHorizontalGroundVelocity(FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (Output.Velocity.Z != 0.f)
+{
+if (bMaintainHorizontalGroundVelocity)
+{
+// Ramp movement already maintained the velocity, so we just want to remove the vertical component.
+Output.Velocity.Z = 0.f;
+}
+else
+{
+// Rescale velocity to be horizontal but maintain magnitude of last update.
+Output.Velocity = CharacterMovementAsyncMath::GetSafeNormal2D(Output.Velocity) * Output.Velocity.Size();
+}
+}
+}
+bool FCharacterMovementComponentAsyncInput::MoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FCharacterMovementComponentAsyncOutput& Output, FHitResult* OutHitResult, ETeleportType TeleportType) const
+{
+const FVector NewDelta = ConstrainDirectionToPlane(Delta);
+return UpdatedComponentInput->MoveComponent(Delta, NewRotation, bSweep, OutHitResult, Output.MoveComponentFlags, TeleportType, *this, Output);
+}
+bool FCharacterMovementComponentAsyncInput::SafeMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult& OutHit, FCharacterMovementComponentAsyncOutput& Output, ETeleportType Teleport) const
+{
+bool bMoveResult = false;
+// Scope for move flags
+{
+// Conditionally ignore blocking overlaps (based on CVar)
+const EMoveComponentFlags IncludeBlockingOverlapsWithoutEvents = (MOVECOMP_NeverIgnoreBlockingOverlaps | MOVECOMP_DisableBlockingOverlapDispatch);
+EMoveComponentFlags& MoveComponentFlags = Output.MoveComponentFlags;
+TGuardValue<EMoveComponentFlags> ScopedFlagRestore(MoveComponentFlags, MovementComponentCVars::MoveIgnoreFirstBlockingOverlap ? MoveComponentFlags : (MoveComponentFlags | IncludeBlockingOverlapsWithoutEvents));
+bMoveResult = MoveUpdatedComponent(Delta, NewRotation, bSweep, Output, &OutHit, Teleport);
+}
+// Handle initial penetrations
+if (OutHit.bStartPenetrating/* && UpdatedComponent*/)
+{
+const FVector RequestedAdjustment = GetPenetrationAdjustment(OutHit);
+if (ResolvePenetration(RequestedAdjustment, OutHit, NewRotation, Output))
+{
+// Retry original move
+bMoveResult = MoveUpdatedComponent(Delta, NewRotation, bSweep, Output, &OutHit, Teleport);
+}
+}
+return bMoveResult;
+}
+void FCharacterMovementComponentAsyncInput::ApplyAccumulatedForces(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (Output.PendingImpulseToApply.Z != 0.f || Output.PendingForceToApply.Z != 0.f)
+{
+// check to see if applied momentum is enough to overcome gravity
+if (IsMovingOnGround(Output) && (Output.PendingImpulseToApply.Z + (Output.PendingForceToApply.Z * DeltaSeconds) + (GravityZ * DeltaSeconds) > UE_SMALL_NUMBER))
+{
+SetMovementMode(MOVE_Falling, Output);
+}
+}
+Output.Velocity += Output.PendingImpulseToApply + (Output.PendingForceToApply * DeltaSeconds);
+// Don't call ClearAccumulatedForces() because it could affect launch velocity
+Output.PendingImpulseToApply = FVector::ZeroVector;
+Output.PendingForceToApply = FVector::ZeroVector;
+}
+void FCharacterMovementComponentAsyncInput::ClearAccumulatedForces(FCharacterMovementComponentAsyncOutput& Output) const
+{
+Output.PendingImpulseToApply = FVector::ZeroVector;
+Output.PendingForceToApply = FVector::ZeroVector;
+Output.PendingLaunchVelocity = FVector::ZeroVector;
+}
+void FCharacterMovementComponentAsyncInput::SetMovementMode(EMovementMode NewMovementMode, FCharacterMovementComponentAsyncOutput& Output, uint8 NewCustomMode) const
+{
+if (NewMovementMode != MOVE_Custom)
+{
+NewCustomMode = 0;
+}
+// If trying to use NavWalking but there is no navmesh, use walking instead.
+if (NewMovementMode == MOVE_NavWalking && !NavMeshSnapshot.IsValid())
+{
+NewMovementMode = MOVE_Walking;
+}
+// Do nothing if nothing is changing.
+if (Output.MovementMode == NewMovementMode)
+{
+// Allow changes in custom sub-mode.
+if ((NewMovementMode != MOVE_Custom) || (NewCustomMode == Output.CustomMovementMode))
+{
+return;
+}
+}
+const EMovementMode PrevMovementMode = Output.MovementMode;
+const uint8 PrevCustomMode = Output.CustomMovementMode;
+Output.MovementMode = NewMovementMode;
+Output.CustomMovementMode = NewCustomMode;
+// We allow setting movement mode before we have a component to update, in case this happens at startup.
+if (!bHasValidData)
+{
+return;
+}
+// Handle change in movement mode
+OnMovementModeChanged(PrevMovementMode, PrevCustomMode, Output);
+}
+void FCharacterMovementComponentAsyncInput::OnMovementModeChanged(EMovementMode PreviousMovementMode, uint8 PreviousCustomMode, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!bHasValidData)
+{
+return;
+}
+// Collision settings belong to the game thread component and are left as they are. NavWalking only restarts its navmesh projection.
+if (Output.MovementMode == MOVE_NavWalking)
+{
+Output.GroundMovementMode = Output.MovementMode;
+// Walking uses only XY velocity
+Output.Velocity.Z = 0.f;
+Output.CachedNavTriangle = INDEX_NONE;
+Output.bNavWalkingFallback = false;
+}
+else if (PreviousMovementMode == MOVE_NavWalking)
+{
+Output.CachedNavTriangle = INDEX_NONE;
+}
+// React to changes in the movement mode.
+if (Output.MovementMode == MOVE_Walking)
+{
+// Walking uses only XY velocity, and must be on a walkable floor, with a Base.
+Output.Velocity.Z = 0.f;
+Output.bCrouchMaintainsBaseLocation = true;
+Output.GroundMovementMode = Output.MovementMode;
+// make sure we update our new floor/base on initial entry of the walking physics
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+FindFloor(UpdatedComponentInput->GetPosition(), Output.CurrentFloor, false, Output);
+AdjustFloorHeight(Output);
+SetBaseFromFloor(Output.CurrentFloor, Output);
+}
+else
+{
+Output.CurrentFloor.Clear();
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+Output.bCrouchMaintainsBaseLocation = false;
+if (Output.MovementMode == MOVE_Falling)
+{
+}
+//SetBase(NULL);
+Output.NewMovementBase = nullptr;
+Output.NewMovementBaseOwner = nullptr;
+if (Output.MovementMode == MOVE_None)
+{
+ensure(false);
+}
+}
+if (Output.MovementMode == MOVE_Falling && PreviousMovementMode != MOVE_Falling)
+{
+}
+CharacterInput->OnMovementModeChanged(PreviousMovementMode, *this, Output, PreviousCustomMode);
+}
+void FCharacterMovementComponentAsyncInput::FindFloor(const FVector& CapsuleLocation, FFindFloorResult& OutFloorResult, bool bCanUseCachedLocation, FCharacterMovementComponentAsyncOutput& Output, const FHitResult* DownwardSweepResult) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, FindFloor);
+// No collision, no floor...
+if (!bHasValidData || !UpdatedComponentInput->bIsQueryCollisionEnabled)
+{
+OutFloorResult.Clear();
+return;
+}
+// Increase height check slightly if walking, to prevent floor height adjustment from later invalidating the floor result.
+const float MaxFloorDist = UCharacterMovementComponent::MAX_FLOOR_DIST;
+const float MinFloorDist = UCharacterMovementComponent::MIN_FLOOR_DIST;
+const float HeightCheckAdjust = (IsMovingOnGround(Output) ? MaxFloorDist + UE_KINDA_SMALL_NUMBER : -MaxFloorDist);
+float FloorSweepTraceDist = FMath::Max(MaxFloorDist, MaxStepHeight + HeightCheckAdjust);
+float FloorLineTraceDist = FloorSweepTraceDist;
+bool bNeedToValidateFloor = true;
+// Sweep floor
+if (FloorLineTraceDist > 0.f || FloorSweepTraceDist > 0.f)
+{
+if (bAlwaysCheckFloor || !bCanUseCachedLocation || Output.bForceNextFloorCheck || Output.bJustTeleported)
+{
+Output.bForceNextFloorCheck = false;
+ComputeFloorDist(CapsuleLocation, FloorLineTraceDist, FloorSweepTraceDist, OutFloorResult, Output.ScaledCapsuleRadius, Output, DownwardSweepResult);
+Output.CachedFloorLocation = CapsuleLocation;
+}
+else
+{
+// Force floor check if base has collision disabled or if it does not block us.
+UPrimitiveComponent* MovementBase = Output.NewMovementBase;
+bool bCanReuseFloor = (CharacterMovementAsyncCVars::FloorCache != 0) && Output.CurrentFloor.IsWalkableFloor() && (MovementBase != NULL);
+if (bCanReuseFloor)
+{
+// We can't read the base on the physics thread, rely on the transforms captured with the inputs.
+FCharacterMovementAsyncBaseTable::FEntry MovementBaseEntry;
+bCanReuseFloor = FindMovementBase(*this, Output, MovementBaseEntry) && !MovementBaseEntry.HasMoved();
+}
+if (bCanReuseFloor)
+{
+// The floor is only valid close to where it was computed.
+const FVector CacheOffset = CapsuleLocation - Output.CachedFloorLocation;
+const float Tolerance = FMath::Max(0.f, CharacterMovementAsyncCVars::FloorCacheTolerance);
+bCanReuseFloor = (CacheOffset.SizeSquared2D() <= FMath::Square(Tolerance)) && (FMath::Abs(CacheOffset.Z) <= Tolerance);
+if (bCanReuseFloor)
+{
+OutFloorResult = Output.CurrentFloor;
+// Account for vertical drift, the floor itself has not moved.
+OutFloorResult.FloorDist += CacheOffset.Z;
+OutFloorResult.LineDist += CacheOffset.Z;
+bCanReuseFloor = (OutFloorResult.FloorDist <= FloorSweepTraceDist);
+}
+}
+if (bCanReuseFloor)
+{
+bNeedToValidateFloor = false;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementFloorCacheHits);
+}
+else
+{
+Output.bForceNextFloorCheck = false;
+ComputeFloorDist(CapsuleLocation, FloorLineTraceDist, FloorSweepTraceDist, OutFloorResult, Output.ScaledCapsuleRadius, Output, DownwardSweepResult);
+Output.CachedFloorLocation = CapsuleLocation;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementFloorCacheMisses);
+}
+}
+}
+if (bNeedToValidateFloor && OutFloorResult.bBlockingHit && !OutFloorResult.bLineTrace)
+{
+const bool bCheckRadius = true;
+if (ShouldComputePerchResult(OutFloorResult.HitResult, Output, bCheckRadius))
+{
+float MaxPerchFloorDist = FMath::Max(MaxFloorDist, MaxStepHeight + HeightCheckAdjust);
+if (IsMovingOnGround(Output))
+{
+MaxPerchFloorDist += FMath::Max(0.f, PerchAdditionalHeight);
+}
+FFindFloorResult PerchFloorResult;
+if (ComputePerchResult(GetValidPerchRadius(Output), OutFloorResult.HitResult, MaxPerchFloorDist, PerchFloorResult, Output))
+{
+// Don't allow the floor distance adjustment to push us up too high, or we will move beyond the perch distance and fall next time.
+const float AvgFloorDist = (MinFloorDist + MaxFloorDist) * 0.5f;
+const float MoveUpDist = (AvgFloorDist - OutFloorResult.FloorDist);
+if (MoveUpDist + PerchFloorResult.FloorDist >= MaxPerchFloorDist)
+{
+OutFloorResult.FloorDist = AvgFloorDist;
+}
+// If the regular capsule is on an unwalkable surface but the perched one would allow us to stand, override the normal to be one that is walkable.
+if (!OutFloorResult.bWalkableFloor)
+{
+// Floor distances are used as the distance of the regular capsule to the point of collision, to make sure AdjustFloorHeight() behaves correctly.
+OutFloorResult.SetFromLineTrace(PerchFloorResult.HitResult, OutFloorResult.FloorDist, FMath::Max(OutFloorResult.FloorDist, MinFloorDist), true);
+}
+}
+else
+{
+// We had no floor (or an invalid one because it was unwalkable), and couldn't perch here, so invalidate floor (which will cause us to start falling).
+OutFloorResult.bWalkableFloor = false;
+}
+}
+}
+}
+void FCharacterMovementComponentAsyncInput::ComputeFloorDist(const FVector& CapsuleLocation, float LineDistance, float SweepDistance, FFindFloorResult& OutFloorResult, float SweepRadius, FCharacterMovementComponentAsyncOutput& Output, const FHitResult* DownwardSweepResult) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, ComputeFloorDist);
+OutFloorResult.Clear();
+float PawnRadius = Output.ScaledCapsuleRadius;
+float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
+bool bSkipSweep = false;
+if (DownwardSweepResult != NULL && DownwardSweepResult->IsValidBlockingHit())
+{
+// Only if the supplied sweep was vertical and downward.
+if ((DownwardSweepResult->TraceStart.Z > DownwardSweepResult->TraceEnd.Z) &&
+(DownwardSweepResult->TraceStart - DownwardSweepResult->TraceEnd).SizeSquared2D() <= UE_KINDA_SMALL_NUMBER)
+{
+// Reject hits that are barely on the cusp of the radius of the capsule
+if (IsWithinEdgeTolerance(DownwardSweepResult->Location, DownwardSweepResult->ImpactPoint, PawnRadius))
+{
+// Don't try a redundant sweep, regardless of whether this sweep is usable.
+bSkipSweep = true;
+const bool bIsWalkable = IsWalkable(*DownwardSweepResult);
+const float FloorDist = (CapsuleLocation.Z - DownwardSweepResult->Location.Z);
+OutFloorResult.SetFromSweep(*DownwardSweepResult, FloorDist, bIsWalkable);
+if (bIsWalkable)
+{
+// Use the supplied downward sweep as the floor hit result.
+return;
+}
+}
+}
+}
+// We require the sweep distance to be >= the line distance, otherwise the HitResult can't be interpreted as the sweep result.
+if (SweepDistance < LineDistance)
+{
+ensure(SweepDistance >= LineDistance);
+return;
+}
+bool bBlockingHit = false;
+// Sweep test
+if (!bSkipSweep && SweepDistance > 0.f && SweepRadius > 0.f)
+{
+const float ShrinkScale = 0.9f;
+const float ShrinkScaleOverlap = 0.1f;
+float ShrinkHeight = (PawnHalfHeight - PawnRadius) * (1.f - ShrinkScale);
+float TraceDist = SweepDistance + ShrinkHeight;
+FCollisionShape CapsuleShape = FCollisionShape::MakeCapsule(SweepRadius, PawnHalfHeight - ShrinkHeight);
+FHitResult Hit(1.f);
+bBlockingHit = FloorSweepTest(Hit, CapsuleLocation, CapsuleLocation + FVector(0.f, 0.f, -TraceDist), CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams, Output);
+if (bBlockingHit)
+{
+// Reject hits adjacent to us, we only care about hits on the bottom portion of our capsule.
+// Check 2D distance to impact point, reject if within a tolerance from radius.
+if (Hit.bStartPenetrating || !IsWithinEdgeTolerance(CapsuleLocation, Hit.ImpactPoint, CapsuleShape.Capsule.Radius))
+{
+// Use a capsule with a slightly smaller radius and shorter height to avoid the adjacent object.
+// Capsule must not be nearly zero or the trace will fall back to a line trace from the start point and have the wrong length.
+CapsuleShape.Capsule.Radius = FMath::Max(0.f, CapsuleShape.Capsule.Radius - UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE - UE_KINDA_SMALL_NUMBER);
+if (!CapsuleShape.IsNearlyZero())
+{
+ShrinkHeight = (PawnHalfHeight - PawnRadius) * (1.f - ShrinkScaleOverlap);
+TraceDist = SweepDistance + ShrinkHeight;
+CapsuleShape.Capsule.HalfHeight = FMath::Max(PawnHalfHeight - ShrinkHeight, CapsuleShape.Capsule.Radius);
+Hit.Reset(1.f, false);
+bBlockingHit = FloorSweepTest(Hit, CapsuleLocation, CapsuleLocation + FVector(0.f, 0.f, -TraceDist), CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams, Output);
+}
+}
+// Reduce hit distance by ShrinkHeight because we shrank the capsule for the trace.
+// We allow negative distances here, because this allows us to pull out of penetrations.
+const float MaxPenetrationAdjust = FMath::Max(UCharacterMovementComponent::MAX_FLOOR_DIST, PawnRadius);
+const float SweepResult = FMath::Max(-MaxPenetrationAdjust, Hit.Time * TraceDist - ShrinkHeight);
+OutFloorResult.SetFromSweep(Hit, SweepResult, false);
+if (Hit.IsValidBlockingHit() && IsWalkable(Hit))
+{
+if (SweepResult <= SweepDistance)
+{
+// Hit within test distance.
+OutFloorResult.bWalkableFloor = true;
+return;
+}
+}
+}
+}
+// Since we require a longer sweep than line trace, we don't want to run the line trace if the sweep missed everything.
+// We do however want to try a line trace if the sweep was stuck in penetration.
+if (!OutFloorResult.bBlockingHit && !OutFloorResult.HitResult.bStartPenetrating)
+{
+OutFloorResult.FloorDist = SweepDistance;
+return;
+}
+// Line trace
+if (LineDistance > 0.f)
+{
+const float ShrinkHeight = PawnHalfHeight;
+const FVector LineTraceStart = CapsuleLocation;
+const float TraceDist = LineDistance + ShrinkHeight;
+const FVector Down = FVector(0.f, 0.f, -TraceDist);
+FHitResult Hit(1.f);
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, ComputeFloorDist, LineTrace);
+bBlockingHit = RunCapturedSceneQuery(LineTraceStart, LineTraceStart + Down, &Hit, nullptr, [&]() { return World->LineTraceSingleByChannel(Hit, LineTraceStart, LineTraceStart + Down, CollisionChannel, QueryParams, CollisionResponseParams); });
+}
+if (bBlockingHit)
+{
+if (Hit.Time > 0.f)
+{
+// Reduce hit distance by ShrinkHeight because we started the trace higher than the base.
+// We allow negative distances here, because this allows us to pull out of penetrations.
+const float MaxPenetrationAdjust = FMath::Max(UCharacterMovementComponent::MAX_FLOOR_DIST, PawnRadius);
+const float LineResult = FMath::Max(-MaxPenetrationAdjust, Hit.Time * TraceDist - ShrinkHeight);
+OutFloorResult.bBlockingHit = true;
+if (LineResult <= LineDistance && IsWalkable(Hit))
+{
+OutFloorResult.SetFromLineTrace(Hit, OutFloorResult.FloorDist, LineResult, true);
+return;
+}
+}
+}
+}
+OutFloorResult.bWalkableFloor = false;
+}
+bool FCharacterMovementComponentAsyncInput::FloorSweepTest(FHitResult& OutHit, const FVector& Start, const FVector& End, ECollisionChannel TraceChannel, const FCollisionShape& CollisionShape, const FCollisionQueryParams& Params, const FCollisionResponseParams& ResponseParam, FCharacterMovementComponentAsyncOutput& Output) const
+{
+bool bBlockingHit = false;
+if (!bUseFlatBaseForFloorChecks)
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, FloorSweepTest, Sweep);
+bBlockingHit = RunCapturedSceneQuery(Start, End, &OutHit, nullptr, [&]() { return World->SweepSingleByChannel(OutHit, Start, End, FQuat::Identity, TraceChannel, CollisionShape, Params, ResponseParam); });
+}
+else
+{
+// Test with a box that is enclosed by the capsule.
+const float CapsuleRadius = CollisionShape.GetCapsuleRadius();
+const float CapsuleHeight = CollisionShape.GetCapsuleHalfHeight();
+const FCollisionShape BoxShape = FCollisionShape::MakeBox(FVector(CapsuleRadius * 0.707f, CapsuleRadius * 0.707f, CapsuleHeight));
+// First test with the box rotated so the corners are along the major axes (ie rotated 45 degrees).
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, FloorSweepTest, Sweep);
+bBlockingHit = RunCapturedSceneQuery(Start, End, &OutHit, nullptr, [&]() { return World->SweepSingleByChannel(OutHit, Start, End, FQuat(FVector(0.f, 0.f, -1.f), UE_PI * 0.25f), TraceChannel, BoxShape, Params, ResponseParam); });
+}
+if (!bBlockingHit)
+{
+// Test again with the same box, not rotated.
+OutHit.Reset(1.f, false);
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, FloorSweepTest, Sweep);
+bBlockingHit = RunCapturedSceneQuery(Start, End, &OutHit, nullptr, [&]() { return World->SweepSingleByChannel(OutHit, Start, End, FQuat::Identity, TraceChannel, BoxShape, Params, ResponseParam); });
+}
+}
+return bBlockingHit;
+}
+bool FCharacterMovementComponentAsyncInput::IsWithinEdgeTolerance(const FVector& CapsuleLocation, const FVector& TestImpactPoint, const float CapsuleRadius) const
+{
+const float DistFromCenterSq = (TestImpactPoint - CapsuleLocation).SizeSquared2D();
+const float ReducedRadiusSq = FMath::Square(FMath::Max(UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE + UE_KINDA_SMALL_NUMBER, CapsuleRadius - UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE));
+return DistFromCenterSq < ReducedRadiusSq;
+}
+bool FCharacterMovementComponentAsyncInput::IsWalkable(const FHitResult& Hit) const
+{
+if (!Hit.IsValidBlockingHit())
+{
+// No hit, or starting in penetration
+return false;
+}
+// Never walk up vertical surfaces.
+if (Hit.ImpactNormal.Z < UE_KINDA_SMALL_NUMBER)
+{
+return false;
+}
+float TestWalkableZ = WalkableFloorZ;
+// Can't walk on this surface if it is too steep.
+if (Hit.ImpactNormal.Z < TestWalkableZ)
+{
+return false;
+}
+return true;
+}
+void FCharacterMovementComponentAsyncInput::UpdateCharacterStateAfterMovement(float DeltaSeconds, FCharacterMovementComponentAsyncOutput& Output) const
+{
+// Proxies get replicated crouch state.
+if (CharacterInput->LocalRole != ROLE_SimulatedProxy)
+{
+// Uncrouch if no longer allowed to be crouched
+if (Output.bIsCrouched && !CanCrouchInCurrentState(Output))
+{
+}
+}
+}
+int32 FCharacterMovementComponentAsyncInput::GetMaxSimulationIterations() const
+{
+int32 MaxIterations = MaxSimulationIterations;
+// Reduced rate movement LOD updates cover their whole interval in fewer, longer substeps.
+if (GAsyncCharacterMovementLODUpdate && CharacterMovementAsyncCVars::MovementLODMaxIterations > 0)
+{
+MaxIterations = FMath::Min(MaxIterations, CharacterMovementAsyncCVars::MovementLODMaxIterations);
+}
+if (GAsyncCharacterMovementBudgetIterations > 0)
+{
+MaxIterations = FMath::Min(MaxIterations, GAsyncCharacterMovementBudgetIterations);
+}
+return MaxIterations;
+}
+float FCharacterMovementComponentAsyncInput::GetSimulationTimeStep(float RemainingTime, int32 Iterations) const
+{
+// Shared by every physics thread worker in parallel simulation.
+static std::atomic<uint32> s_WarningCount{ 0 };
+if (RemainingTime > MaxSimulationTimeStep)
+{
+if (Iterations < GetMaxSimulationIterations())
+{
+// Subdivide moves to be no longer than MaxSimulationTimeStep seconds
+RemainingTime = FMath::Min(MaxSimulationTimeStep, RemainingTime * 0.5f);
+}
+else
+{
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+// If this is the last iteration, just use all the remaining time. Print a throttled warning.
+if (s_WarningCount.fetch_add(1, std::memory_order_relaxed) < 100)
+{
+UE_LOG(LogCharacterMovement, Warning, TEXT("GetSimulationTimeStep() - Max iterations %d hit while remaining time %.6f > MaxSimulationTimeStep (%.3f)"), GetMaxSimulationIterations(), RemainingTime, MaxSimulationTimeStep);
+}
+#endif
+}
+}
+// no less than MIN_TICK_TIME (to avoid potential divide-by-zero during simulation).
+return FMath::Max(UCharacterMovementComponent::MIN_TICK_TIME, RemainingTime);
+}
+float FCharacterMovementComponentAsyncInput::GetSimulationTimeStep(float RemainingTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+{
+++GAsyncCharacterMovementSubsteps;
+// A hit or a mode change since the last substep means the motion is not smooth, take fixed substeps.
+const bool bSmooth = !Output.bSubstepBlockingHit && (Output.SubstepMovementMode == Output.MovementMode);
+Output.bSubstepBlockingHit = false;
+Output.SubstepMovementMode = Output.MovementMode;
+const float FixedTimeStep = GetSimulationTimeStep(RemainingTime, Iterations);
+if (CharacterMovementAsyncCVars::AdaptiveSubstepping == 0 || GAsyncCharacterMovementFixedSubsteps || !bSmooth || FixedTimeStep >= RemainingTime || Iterations >= GetMaxSimulationIterations())
+{
+return FixedTimeStep;
+}
+// Acceleration the substep holds constant: input acceleration, braking when there is none, and gravity while falling.
+float AccelerationSize = Output.Acceleration.Size();
+if (IsMovingOnGround(Output) && AccelerationSize < UE_KINDA_SMALL_NUMBER && !Output.Velocity.IsNearlyZero())
+{
+AccelerationSize = GetMaxBrakingDeceleration(Output) + GroundFriction * Output.Velocity.Size();
+}
+else if (IsFalling(Output))
+{
+AccelerationSize += FMath::Abs(GravityZ);
+}
+// The position error of one step grows with 0.5 * a * t^2. Take the longest step within tolerance, never shorter than the fixed one.
+float TimeStep = FMath::Min(RemainingTime, CharacterMovementAsyncCVars::AdaptiveSubstepMaxTimeStep);
+if (AccelerationSize > UE_KINDA_SMALL_NUMBER)
+{
+TimeStep = FMath::Min(TimeStep, FMath::Sqrt(2.f * FMath::Max(0.f, CharacterMovementAsyncCVars::AdaptiveSubstepTolerance) / AccelerationSize));
+}
+return FMath::Max(FixedTimeStep, TimeStep);
+}
+void FCharacterMovementComponentAsyncInput::CalcVelocity(float DeltaTime, float Friction, bool bFluid, float BrakingDeceleration, FCharacterMovementComponentAsyncOutput& Output) const
+{
+// Do not update velocity when using root motion or when SimulatedProxy and not simulating root motion - SimulatedProxy are repped their Velocity
+if (!bHasValidData || RootMotion.bHasAnimRootMotion || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME
+|| (CharacterInput->LocalRole == ROLE_SimulatedProxy && !bWasSimulatingRootMotion))
+{
+return;
+}
+Friction = FMath::Max(0.f, Friction);
+const float MaxAccel = MaxAcceleration;
+float MaxSpeed = GetMaxSpeed(Output);
+// Check if path following requested movement
+bool bZeroRequestedAcceleration = true;
+FVector RequestedAcceleration = FVector::ZeroVector;
+float RequestedSpeed = 0.0f;
+if (ApplyRequestedMove(DeltaTime, MaxAccel, MaxSpeed, Friction, BrakingDeceleration, RequestedAcceleration, RequestedSpeed, Output))
+{
+bZeroRequestedAcceleration = false;
+}
+FVector& Acceleration = Output.Acceleration;
+FVector& Velocity = Output.Velocity;
+if (bForceMaxAccel)
+{
+// Force acceleration at full speed.
+// In consideration order for direction: Acceleration, then Velocity, then Pawn's rotation.
+if (Acceleration.SizeSquared() > UE_SMALL_NUMBER)
+{
+Acceleration = CharacterMovementAsyncMath::GetSafeNormal(Acceleration) * MaxAccel;
+}
+else
+{
+Acceleration = MaxAccel * (Velocity.SizeSquared() < UE_SMALL_NUMBER ? UpdatedComponentInput->GetForwardVector() : CharacterMovementAsyncMath::GetSafeNormal(Velocity));
+}
+Output.AnalogInputModifier = 1.f;
+}
+// Path following above didn't care about the analog modifier, but we do for everything else below, so get the fully modified value.
+// Use max of requested speed and max speed if we modified the speed in ApplyRequestedMove above.
+const float MaxInputSpeed = FMath::Max(MaxSpeed * Output.AnalogInputModifier, GetMinAnalogSpeed(Output));
+CharacterMovementAsyncKernels::FCalcVelocityParams Params;
+Params.DeltaTime = DeltaTime;
+Params.Friction = Friction;
+Params.bFluid = bFluid;
+Params.BrakingFriction = FMath::Max(0.f, (bUseSeparateBrakingFriction ? BrakingFriction : Friction) * FMath::Max(0.f, BrakingFrictionFactor));
+Params.BrakingDeceleration = FMath::Max(0.f, BrakingDeceleration);
+Params.MaxBrakingTimeStep = FMath::Clamp(BrakingSubStepTime, 1.0f / 75.0f, 1.0f / 20.0f);
+// Exp comes from the platform math library, which does not round the same everywhere.
+Params.bClosedFormBraking = (!ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC && CharacterMovementAsyncCVars::ClosedFormBraking != 0);
+Params.MaxInputSpeed = MaxInputSpeed;
+Params.RequestedAcceleration = RequestedAcceleration;
+Params.RequestedSpeed = RequestedSpeed;
+Params.bZeroRequestedAcceleration = bZeroRequestedAcceleration;
+// The batch path may already have run this exact update through the lane kernels.
+if (Output.VelocityPrediction != nullptr && Output.VelocityPrediction->MatchesCalcVelocity(Velocity, Acceleration, Params))
+{
+Velocity = Output.VelocityPrediction->Result;
+Output.VelocityPrediction = nullptr;
+return;
+}
+CharacterMovementAsyncKernels::CalcVelocity(Velocity, Acceleration, Params);
+}
+bool FCharacterMovementComponentAsyncInput::ApplyRequestedMove(float DeltaTime, float MaxAccel, float MaxSpeed, float Friction, float BrakingDeceleration, FVector& OutAcceleration, float& OutRequestedSpeed, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (Output.bHasRequestedVelocity)
+{
+const float RequestedSpeedSquared = Output.RequestedVelocity.SizeSquared();
+if (RequestedSpeedSquared < UE_KINDA_SMALL_NUMBER)
+{
+return false;
+}
+// Compute requested speed from path following
+float RequestedSpeed = FMath::Sqrt(RequestedSpeedSquared);
+const FVector RequestedMoveDir = Output.RequestedVelocity / RequestedSpeed;
+RequestedSpeed = (Output.bRequestedMoveWithMaxSpeed ? MaxSpeed : FMath::Min(MaxSpeed, RequestedSpeed));
+// Compute actual requested velocity
+const FVector MoveVelocity = RequestedMoveDir * RequestedSpeed;
+// Compute acceleration. Use MaxAccel to limit speed increase, 1% buffer.
+FVector NewAcceleration = FVector::ZeroVector;
+const float CurrentSpeedSq = Output.Velocity.SizeSquared();
+if (ShouldComputeAccelerationToReachRequestedVelocity(RequestedSpeed, Output))
+{
+// Turn in the same manner as with input acceleration.
+const float VelSize = FMath::Sqrt(CurrentSpeedSq);
+Output.Velocity = Output.Velocity - (Output.Velocity - RequestedMoveDir * VelSize) * FMath::Min(DeltaTime * Friction, 1.f);
+// How much do we need to accelerate to get to the new velocity?
+NewAcceleration = ((MoveVelocity - Output.Velocity) / DeltaTime);
+NewAcceleration = CharacterMovementAsyncMath::GetClampedToMaxSize(NewAcceleration, MaxAccel);
+}
+else
+{
+// Just set velocity directly.
+// If decelerating we do so instantly, so we don't slide through the destination if we can't brake fast enough.
+Output.Velocity = MoveVelocity;
+}
+OutRequestedSpeed = RequestedSpeed;
+OutAcceleration = NewAcceleration;
+return true;
+}
+return false;
+}
+bool FCharacterMovementComponentAsyncInput::ShouldComputeAccelerationToReachRequestedVelocity(const float RequestedSpeed, FCharacterMovementComponentAsyncOutput& Output) const
+{
+return bRequestedMoveUseAcceleration && Output.Velocity.SizeSquared() < FMath::Square(RequestedSpeed * 1.01f);
+}
+float FCharacterMovementComponentAsyncInput::GetMinAnalogSpeed(FCharacterMovementComponentAsyncOutput& Output) const
+{
+switch (Output.MovementMode)
+{
+case MOVE_Walking:
+case MOVE_NavWalking:
+case MOVE_Falling:
+return MinAnalogWalkSpeed;
+default:
+return 0.f;
+}
+}
+float FCharacterMovementComponentAsyncInput::GetMaxBrakingDeceleration(FCharacterMovementComponentAsyncOutput& Output) const
+{
+switch (Output.MovementMode)
+{
+case MOVE_Walking:
+case MOVE_NavWalking:
+return BrakingDecelerationWalking;
+case MOVE_Falling:
+return BrakingDecelerationFalling;
+case MOVE_Swimming:
+return BrakingDecelerationSwimming;
+case MOVE_Flying:
+return BrakingDecelerationFlying;
+case MOVE_Custom:
+return 0.f;
+case MOVE_None:
+default:
+return 0.f;
+}
+}
+void FCharacterMovementComponentAsyncInput::ApplyVelocityBraking(float DeltaTime, float Friction, float BrakingDeceleration, FCharacterMovementComponentAsyncOutput& Output) const
+{
+FVector& Velocity = Output.Velocity;
+if (Velocity.IsZero() || !bHasValidData || RootMotion.bHasAnimRootMotion || DeltaTime < UCharacterMovementComponent::MIN_TICK_TIME)
+{
+return;
+}
+const float FrictionFactor = FMath::Max(0.f, BrakingFrictionFactor);
+Friction = FMath::Max(0.f, Friction * FrictionFactor);
+BrakingDeceleration = FMath::Max(0.f, BrakingDeceleration);
+if (!ASYNC_CHARACTER_MOVEMENT_DETERMINISTIC && CharacterMovementAsyncCVars::ClosedFormBraking != 0)
+{
+CharacterMovementAsyncKernels::ApplyVelocityBrakingClosedForm(Velocity, Friction, BrakingDeceleration, DeltaTime);
+return;
+}
+CharacterMovementAsyncKernels::ApplyVelocityBraking(Velocity, Friction, BrakingDeceleration, DeltaTime, FMath::Clamp(BrakingSubStepTime, 1.0f / 75.0f, 1.0f / 20.0f));
+}
+FVector FCharacterMovementComponentAsyncInput::GetPenetrationAdjustment(FHitResult& HitResult) const
+{
+FVector Result = MoveComponent_GetPenetrationAdjustment(HitResult);
+{
+const bool bIsProxy = (CharacterInput->LocalRole == ROLE_SimulatedProxy);
+float MaxDistance = bIsProxy ? MaxDepenetrationWithGeometryAsProxy : MaxDepenetrationWithGeometry;
+const AActor* HitActor = HitResult.GetActor();
+if (Cast<APawn>(HitActor))
+{
+MaxDistance = bIsProxy ? MaxDepenetrationWithPawnAsProxy : MaxDepenetrationWithPawn;
+}
+Result = CharacterMovementAsyncMath::GetClampedToMaxSize(Result, MaxDistance);
+}
+return Result;
+}
+bool FCharacterMovementComponentAsyncInput::ResolvePenetration(const FVector& ProposedAdjustment, const FHitResult& Hit, const FQuat& NewRotation, FCharacterMovementComponentAsyncOutput& Output) const
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, ResolvePenetration);
+// SceneComponent can't be in penetration, so this function really only applies to PrimitiveComponent.
+const FVector Adjustment = ConstrainDirectionToPlane(ProposedAdjustment);
+if (!Adjustment.IsZero() && UpdatedComponentInput->UpdatedComponent)
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, ResolvePenetration, Overlap);
+const FVector EncroachLocation = Hit.TraceStart + Adjustment;
+bool bEncroached = RunCapturedSceneQuery(EncroachLocation, EncroachLocation, nullptr, nullptr, [&]() { return World->OverlapBlockingTestByChannel(EncroachLocation, NewRotation, CollisionChannel, UpdatedComponentInput->CollisionShape, UpdatedComponentInput->MoveComponentQueryParams, UpdatedComponentInput->MoveComponentCollisionResponseParams); });
+if (!bEncroached)
+{
+MoveUpdatedComponent(Adjustment, NewRotation, false, Output, nullptr, ETeleportType::TeleportPhysics);
+Output.bJustTeleported = true;
+return true;
+}
+else
+{
+TGuardValue<EMoveComponentFlags> ScopedFlagRestore(Output.MoveComponentFlags, EMoveComponentFlags(Output.MoveComponentFlags & (~MOVECOMP_NeverIgnoreBlockingOverlaps)));
+FHitResult SweepOutHit(1.f);
+bool bMoved = MoveUpdatedComponent(Adjustment, NewRotation, true, Output, &SweepOutHit, ETeleportType::TeleportPhysics);
+if (!bMoved && SweepOutHit.bStartPenetrating)
+{
+// Combine two MTD results to get a new direction that gets out of multiple surfaces.
+const FVector SecondMTD = GetPenetrationAdjustment(SweepOutHit);
+const FVector CombinedMTD = Adjustment + SecondMTD;
+if (SecondMTD != Adjustment && !CombinedMTD.IsZero())
+{
+bMoved = MoveUpdatedComponent(CombinedMTD, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
+}
+}
+if (!bMoved)
+{
+const FVector MoveDelta = ConstrainDirectionToPlane(Hit.TraceEnd - Hit.TraceStart);
+if (!MoveDelta.IsZero())
+{
+bMoved = MoveUpdatedComponent(Adjustment + MoveDelta, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
+if (!bMoved && FVector::DotProduct(MoveDelta, Adjustment) > 0.f)
+{
+bMoved = MoveUpdatedComponent(MoveDelta, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
+}
+}
+}
+Output.bJustTeleported |= bMoved;
+return bMoved;
+}
+}
+return false;
+}
+FVector FCharacterMovementComponentAsyncInput::MoveComponent_GetPenetrationAdjustment(FHitResult& Hit) const
+{
+if (!Hit.bStartPenetrating)
+{
+return FVector::ZeroVector;
+}
+FVector Result;
+const float PullBackDistance = FMath::Abs(MovementComponentCVars::PenetrationPullbackDistance);
+const float PenetrationDepth = (Hit.PenetrationDepth > 0.f ? Hit.PenetrationDepth : 0.125f);
+Result = Hit.Normal * (PenetrationDepth + PullBackDistance);
+return ConstrainDirectionToPlane(Result);
+}
+float FCharacterMovementComponentAsyncInput::MoveComponent_SlideAlongSurface(const FVector& Delta, float Time, const FVector& Normal, FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output, bool bHandleImpact) const
+{
+if (!Hit.bBlockingHit)
+{
+return 0.f;
+}
+float PercentTimeApplied = 0.f;
+const FVector OldHitNormal = Normal;
+FVector SlideDelta = ComputeSlideVector(Delta, Time, Normal, Hit, Output);
+if ((SlideDelta | Delta) > 0.f)
+{
+const FQuat Rotation = UpdatedComponentInput->GetRotation();
+SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, Output);
+const float FirstHitPercent = Hit.Time;
+PercentTimeApplied = FirstHitPercent;
+if (Hit.IsValidBlockingHit())
+{
+// Notify first impact
+if (bHandleImpact)
+{
+HandleImpact(Hit, Output, FirstHitPercent * Time, SlideDelta);
+}
+// Compute new slide normal when hitting multiple surfaces.
+TwoWallAdjust(SlideDelta, Hit, OldHitNormal, Output);
+// Only proceed if the new direction is of significant length and not in reverse of original attempted move.
+if (!SlideDelta.IsNearlyZero(1e-3f) && (SlideDelta | Delta) > 0.f)
+{
+// Perform second move
+SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, Output);
+const float SecondHitPercent = Hit.Time * (1.f - FirstHitPercent);
+PercentTimeApplied += SecondHitPercent;
+// Notify second impact
+if (bHandleImpact && Hit.bBlockingHit)
+{
+HandleImpact(Hit, Output, SecondHitPercent * Time, SlideDelta);
+}
+}
+}
+return FMath::Clamp(PercentTimeApplied, 0.f, 1.f);
+}
+return 0.f;
+}
+FVector FCharacterMovementComponentAsyncInput::MoveComponent_ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!bConstrainToPlane)
+{
+return CharacterMovementAsyncMath::VectorPlaneProject(Delta, Normal) * Time;
+}
+else
+{
+const FVector ProjectedNormal = ConstrainNormalToPlane(Normal);
+return CharacterMovementAsyncMath::VectorPlaneProject(Delta, ProjectedNormal) * Time;
+}
+}
+// Shared broadphase for the MoveComponent sweeps of many characters.
+// Characters are grouped into grid cells and each cell issues one overlap query over the union of everything its characters can reach this tick.
+// Sweeps that stay inside their cell's bounds are then tested against the cell's candidates only, so the acceleration structure is traversed once per cell instead of once per move.
+// Everything a sweep needs from a candidate is copied when the region is built, so workers never touch the live component or its game thread pose.
+struct FCharacterMovementAsyncSceneQueryBatch
+{
+struct FShape
+{
+const Chaos::FImplicitObject* Geometry = nullptr;
+bool bSimple = false;
+bool bComplex = false;
+};
+struct FCandidate
+{
+// Identity only, never dereferenced after Build.
+const UPrimitiveComponent* Component = nullptr;
+TWeakObjectPtr<UPrimitiveComponent> WeakComponent;
+FActorInstanceHandle OwnerHandle;
+uint32 ComponentId = 0;
+uint32 OwnerId = 0;
+int32 Item = INDEX_NONE;
+ECollisionChannel ObjectType = ECC_WorldStatic;
+FCollisionResponseContainer Responses;
+// Query shapes and transform of the body's particle, valid for the tick the region was built in.
+Chaos::FRigidTransform3 Transform;
+TArray<FShape, TInlineAllocator<2>> Shapes;
+};
+struct FRegion
+{
+FBox Bounds = FBox(ForceInit);
+TArray<FCandidate> Candidates;
+bool Contains(const FVector& Start, const FVector& End, const FCollisionShape& Shape) const;
+};
+TArray<FRegion> Regions;
+// Region index for each character passed to Build, INDEX_NONE if the character was skipped.
+TArray<int32> CharacterRegions;
+void Reset();
+// Reads particle state through the physics thread API, or the game thread API for callers on the game thread.
+void Build(const UWorld* World, TArrayView<const FBox> CharacterBounds, float CellSize, bool bPhysicsThread = true);
+const FRegion* GetRegion(int32 CharacterIndex) const;
+// Responses come from the moving character's object type and response params, as captured in its input.
+// Candidates in PawnHash are skipped, their hits come from the hash.
+static bool SweepMulti(const FRegion& Region, TArray<FHitResult>& OutHits, const UPrimitiveComponent* Component, ECollisionChannel ObjectType, const FVector& Start, const FVector& End, const FQuat& Rot, const FCollisionShape& Shape, const FCollisionQueryParams& Params, const FCollisionResponseParams& ResponseParams, const FCharacterMovementAsyncPawnHash* PawnHash = nullptr);
+// Bounds covering everything a character can sweep against in one tick: its move, a step up and a floor check below it.
+static FBox ComputeReachableBounds(const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output, const FVector& Location, const FVector& Velocity, float DeltaSeconds);
+};
+bool FCharacterMovementAsyncSceneQueryBatch::FRegion::Contains(const FVector& Start, const FVector& End, const FCollisionShape& Shape) const
+{
+// Other shapes take the scene query.
+if (!(Shape.IsCapsule() || Shape.IsSphere() || Shape.IsBox()) || Shape.IsNearlyZero())
+{
+return false;
+}
+const FVector Extent = Shape.GetExtent();
+FBox SweepBounds(Start - Extent, Start + Extent);
+SweepBounds += FBox(End - Extent, End + Extent);
+return Bounds.IsInsideOrOn(SweepBounds.Min) && Bounds.IsInsideOrOn(SweepBounds.Max);
+}
+void FCharacterMovementAsyncSceneQueryBatch::Reset()
+{
+Regions.Reset();
+CharacterRegions.Reset();
+}
+template <typename HandleType>
+static void SnapshotSceneQueryCandidate(const HandleType& Handle, FCharacterMovementAsyncSceneQueryBatch::FCandidate& Candidate)
+{
+Candidate.Transform = Chaos::FRigidTransform3(Handle.X(), Handle.R());
+for (const TUniquePtr<Chaos::FPerShapeData>& Shape : Handle.ShapesArray())
+{
+if (Shape.IsValid() && Shape->GetQueryEnabled() && Shape->GetGeometry().IsValid())
+{
+// Same simple and complex split the scene query filter makes.
+const uint32 Flags = Shape->GetQueryData().Word3;
+Candidate.Shapes.Add({ Shape->GetGeometry().Get(), (Flags & EPDF_SimpleCollision) != 0, (Flags & EPDF_ComplexCollision) != 0 });
+}
+}
+}
+void FCharacterMovementAsyncSceneQueryBatch::Build(const UWorld* World, TArrayView<const FBox> CharacterBounds, float CellSize, bool bPhysicsThread)
+{
+Reset();
+if (World == nullptr)
+{
+return;
+}
+CellSize = FMath::Max(CellSize, 100.f);
+TMap<FIntVector, int32> CellToRegion;
+CharacterRegions.SetNumUninitialized(CharacterBounds.Num());
+for (int32 CharacterIndex = 0; CharacterIndex < CharacterBounds.Num(); ++CharacterIndex)
+{
+const FBox& Bounds = CharacterBounds[CharacterIndex];
+if (!Bounds.IsValid)
+{
+CharacterRegions[CharacterIndex] = INDEX_NONE;
+continue;
+}
+const FVector Center = Bounds.GetCenter();
+const FIntVector Cell(FMath::FloorToInt(Center.X / CellSize), FMath::FloorToInt(Center.Y / CellSize), FMath::FloorToInt(Center.Z / CellSize));
+int32& RegionIndex = CellToRegion.FindOrAdd(Cell, INDEX_NONE);
+if (RegionIndex == INDEX_NONE)
+{
+RegionIndex = Regions.AddDefaulted();
+}
+Regions[RegionIndex].Bounds += Bounds;
+CharacterRegions[CharacterIndex] = RegionIndex;
+}
+// One broadphase traversal per region. Every object type is gathered, responses are resolved per moving component in SweepMulti.
+TArray<FOverlapResult> Overlaps;
+for (FRegion& Region : Regions)
+{
+Overlaps.Reset();
+const FCollisionShape RegionShape = FCollisionShape::MakeBox(Region.Bounds.GetExtent());
+World->OverlapMultiByObjectType(Overlaps, Region.Bounds.GetCenter(), FQuat::Identity, FCollisionObjectQueryParams(FCollisionObjectQueryParams::AllObjects), RegionShape, FCollisionQueryParams(SCENE_QUERY_STAT(AsyncCharacterMovementBatch), false));
+Region.Candidates.Reset(Overlaps.Num());
+for (const FOverlapResult& Overlap : Overlaps)
+{
+UPrimitiveComponent* Component = Overlap.GetComponent();
+const FBodyInstance* Body = Component ? Component->GetBodyInstance(NAME_None, true, Overlap.ItemIndex) : nullptr;
+FPhysicsActorHandle Proxy = Body ? Body->ActorHandle : nullptr;
+if (Proxy == nullptr)
+{
+continue;
+}
+FCandidate& Candidate = Region.Candidates.AddDefaulted_GetRef();
+if (bPhysicsThread)
+{
+if (const auto* Rigid = Proxy->GetPhysicsThreadAPI())
+{
+SnapshotSceneQueryCandidate(*Rigid, Candidate);
+}
+}
+else
+{
+SnapshotSceneQueryCandidate(Proxy->GetGameThreadAPI(), Candidate);
+}
+if (Candidate.Shapes.Num() == 0)
+{
+Region.Candidates.Pop(false);
+continue;
+}
+const AActor* Owner = Component->GetOwner();
+Candidate.Component = Component;
+Candidate.WeakComponent = Component;
+Candidate.OwnerHandle = FActorInstanceHandle(const_cast<AActor*>(Owner));
+Candidate.ComponentId = Component->GetUniqueID();
+Candidate.OwnerId = Owner ? Owner->GetUniqueID() : 0;
+Candidate.Item = Overlap.ItemIndex;
+Candidate.ObjectType = Component->GetCollisionObjectType();
+Candidate.Responses = Component->GetCollisionResponseToChannels();
+}
+}
+}
+const FCharacterMovementAsyncSceneQueryBatch::FRegion* FCharacterMovementAsyncSceneQueryBatch::GetRegion(int32 CharacterIndex) const
+{
+if (!CharacterRegions.IsValidIndex(CharacterIndex) || CharacterRegions[CharacterIndex] == INDEX_NONE)
+{
+return nullptr;
+}
+return &Regions[CharacterRegions[CharacterIndex]];
+}
+// Matches ComponentSweepMulti ordering: by time, overlaps up to the first blocking hit, blocking hit last.
+static void SortHitsLikeComponentSweep(TArray<FHitResult>& Hits)
+{
+Algo::StableSortBy(Hits, [](const FHitResult& Hit) { return Hit.Time; });
+int32 FirstBlockingIndex = INDEX_NONE;
+for (int32 HitIdx = 0; HitIdx < Hits.Num(); ++HitIdx)
+{
+if (Hits[HitIdx].bBlockingHit && !Hits[HitIdx].bStartPenetrating)
+{
+FirstBlockingIndex = HitIdx;
+break;
+}
+}
+if (FirstBlockingIndex != INDEX_NONE)
+{
+const FHitResult BlockingHit = Hits[FirstBlockingIndex];
+Hits.RemoveAt(FirstBlockingIndex, Hits.Num() - FirstBlockingIndex, false);
+Hits.Add(BlockingHit);
+}
+}
+// Sweeps Shape against one candidate's snapshotted query shapes and fills OutHit with the earliest contact.
+static bool SweepSceneQueryCandidate(const FCharacterMovementAsyncSceneQueryBatch::FCandidate& Candidate, const FVector& Start, const FVector& End, const FQuat& Rot, const FCollisionShape& Shape, bool bTraceComplex, FHitResult& OutHit)
+{
+const FVector Delta = End - Start;
+const Chaos::FReal Length = Delta.Size();
+const Chaos::FVec3 Dir = (Length > UE_SMALL_NUMBER) ? Chaos::FVec3(Delta / Length) : Chaos::FVec3(0.f, 0.f, -1.f);
+const Chaos::FRigidTransform3 StartTransform(Start, Rot);
+bool bHit = false;
+Chaos::FReal BestTime = TNumericLimits<Chaos::FReal>::Max();
+Chaos::FVec3 BestPosition = Chaos::FVec3::ZeroVector;
+Chaos::FVec3 BestNormal = Chaos::FVec3::ZeroVector;
+int32 BestFaceIndex = INDEX_NONE;
+auto SweepAgainst = [&](const auto& SweptGeometry)
+{
+for (const FCharacterMovementAsyncSceneQueryBatch::FShape& CandidateShape : Candidate.Shapes)
+{
+if (!(bTraceComplex ? CandidateShape.bComplex : CandidateShape.bSimple))
+{
+continue;
+}
+Chaos::FReal Time = 0.f;
+Chaos::FVec3 Position, Normal, FaceNormal;
+int32 FaceIndex = INDEX_NONE;
+// With MTD, a start in penetration reports the negative penetration depth as its time.
+if (Chaos::SweepQuery(*CandidateShape.Geometry, Candidate.Transform, SweptGeometry, StartTransform, Dir, Length, Time, Position, Normal, FaceIndex, FaceNormal, 0.f, true) && Time < BestTime)
+{
+bHit = true;
+BestTime = Time;
+BestPosition = Position;
+BestNormal = Normal;
+BestFaceIndex = FaceIndex;
+}
+}
+};
+if (Shape.IsCapsule())
+{
+const Chaos::FReal AxisHalfLength = Shape.GetCapsuleAxisHalfLength();
+SweepAgainst(Chaos::FCapsule(Chaos::FVec3(0.f, 0.f, -AxisHalfLength), Chaos::FVec3(0.f, 0.f, AxisHalfLength), Shape.GetCapsuleRadius()));
+}
+else if (Shape.IsSphere())
+{
+SweepAgainst(Chaos::FSphere(Chaos::FVec3::ZeroVector, Shape.GetSphereRadius()));
+}
+else if (Shape.IsBox())
+{
+const Chaos::FVec3 Extent = Shape.GetBox();
+SweepAgainst(Chaos::TBox<Chaos::FReal, 3>(-Extent, Extent));
+}
+if (!bHit)
+{
+return false;
+}
+OutHit = FHitResult(1.f);
+OutHit.TraceStart = Start;
+OutHit.TraceEnd = End;
+if (BestTime <= 0.f)
+{
+OutHit.bStartPenetrating = true;
+OutHit.PenetrationDepth = (float)-BestTime;
+OutHit.Time = 0.f;
+OutHit.Distance = 0.f;
+OutHit.Location = Start;
+}
+else
+{
+OutHit.Time = (float)(BestTime / Length);
+OutHit.Distance = (float)BestTime;
+OutHit.Location = Start + Dir * BestTime;
+}
+OutHit.ImpactPoint = BestPosition;
+OutHit.Normal = BestNormal;
+OutHit.ImpactNormal = BestNormal;
+OutHit.FaceIndex = BestFaceIndex;
+OutHit.Item = Candidate.Item;
+OutHit.Component = Candidate.WeakComponent;
+OutHit.HitObjectHandle = Candidate.OwnerHandle;
+return true;
+}
+bool FCharacterMovementAsyncSceneQueryBatch::SweepMulti(const FRegion& Region, TArray<FHitResult>& OutHits, const UPrimitiveComponent* Component, ECollisionChannel ObjectType, const FVector& Start, const FVector& End, const FQuat& Rot, const FCollisionShape& Shape, const FCollisionQueryParams& Params, const FCollisionResponseParams& ResponseParams, const FCharacterMovementAsyncPawnHash* PawnHash)
+{
+OutHits.Reset();
+const TArray<uint32>& IgnoredComponents = Params.GetIgnoredComponents();
+for (const FCandidate& Candidate : Region.Candidates)
+{
+if (Candidate.Component == Component || IgnoredComponents.Contains(Candidate.ComponentId) || (PawnHash && PawnHash->Contains(Candidate.Component)))
+{
+continue;
+}
+if (Candidate.OwnerId != 0 && Params.GetIgnoredSourceObjects().Contains(Candidate.OwnerId))
+{
+continue;
+}
+// Same pairwise response a component sweep would resolve: the weaker of the two responses wins.
+const ECollisionResponse Response = (ECollisionResponse)FMath::Min<uint8>(Candidate.Responses.GetResponse(ObjectType), ResponseParams.CollisionResponse.GetResponse(Candidate.ObjectType));
+if (Response == ECR_Ignore)
+{
+continue;
+}
+FHitResult Hit(1.f);
+if (SweepSceneQueryCandidate(Candidate, Start, End, Rot, Shape, Params.bTraceComplex, Hit))
+{
+Hit.bBlockingHit = (Response == ECR_Block);
+OutHits.Add(Hit);
+}
+}
+SortHitsLikeComponentSweep(OutHits);
+return OutHits.ContainsByPredicate([](const FHitResult& Hit) { return Hit.bBlockingHit; });
+}
+FBox FCharacterMovementAsyncSceneQueryBatch::ComputeReachableBounds(const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output, const FVector& Location, const FVector& Velocity, float DeltaSeconds)
+{
+const float Travel = (Velocity.Size() + Input.MaxAcceleration * DeltaSeconds) * DeltaSeconds;
+const float Radius = Output.ScaledCapsuleRadius;
+const float HalfHeight = Output.ScaledCapsuleHalfHeight;
+const float Vertical = Input.MaxStepHeight + UCharacterMovementComponent::MAX_FLOOR_DIST * 2.f;
+const FVector Extent(Radius + Travel, Radius + Travel, HalfHeight + Travel + Vertical);
+return FBox(Location - Extent, Location + Extent);
+}
+static void BenchmarkSceneQueryBatch(const TArray<FString>& Args, UWorld* World)
+{
+if (World == nullptr)
+{
+return;
+}
+const int32 MovesPerCharacter = (Args.Num() > 0) ? FMath::Max(1, FCString::Atoi(*Args[0])) : 8;
+const float DeltaSeconds = 1.f / 30.f;
+TArray<UPrimitiveComponent*> Components;
+TArray<FBox> CharacterBounds;
+TArray<float> Speeds;
+for (TActorIterator<ACharacter> It(World); It; ++It)
+{
+UCharacterMovementComponent* MovementComponent = It->GetCharacterMovement();
+UPrimitiveComponent* Component = MovementComponent ? MovementComponent->UpdatedPrimitive : nullptr;
+if (Component == nullptr)
+{
+continue;
+}
+const float Travel = MovementComponent->GetMaxSpeed() * DeltaSeconds;
+const FVector Extent = Component->Bounds.BoxExtent + FVector(Travel, Travel, MovementComponent->MaxStepHeight + Travel);
+Components.Add(Component);
+CharacterBounds.Add(FBox(Component->GetComponentLocation() - Extent, Component->GetComponentLocation() + Extent));
+Speeds.Add(MovementComponent->GetMaxSpeed());
+}
+if (Components.Num() == 0)
+{
+UE_LOG(LogCharacterMovement, Log, TEXT("BenchmarkSceneQueryBatch: no characters in world."));
+return;
+}
+// Same deltas for both paths.
+FRandomStream Stream(0x5eed);
+TArray<FVector> Deltas;
+Deltas.SetNumUninitialized(Components.Num() * MovesPerCharacter);
+for (int32 DeltaIdx = 0; DeltaIdx < Deltas.Num(); ++DeltaIdx)
+{
+Deltas[DeltaIdx] = Stream.GetUnitVector().GetSafeNormal2D() * Stream.FRandRange(0.f, Speeds[DeltaIdx / MovesPerCharacter] * DeltaSeconds);
+}
+// The blocking hit of a sweep, which ComponentSweepMulti and SweepMulti both put last.
+struct FBlockingResult
+{
+bool bBlocking = false;
+float Time = 1.f;
+FVector Normal = FVector::ZeroVector;
+};
+auto GetBlockingResult = [](bool bBlocking, const TArray<FHitResult>& Hits)
+{
+FBlockingResult Result;
+Result.bBlocking = bBlocking && Hits.Num() > 0;
+if (Result.bBlocking)
+{
+Result.Time = Hits.Last().Time;
+Result.Normal = Hits.Last().Normal;
+}
+return Result;
+};
+TArray<FHitResult> Hits;
+TArray<FBlockingResult> SerialResults;
+SerialResults.SetNum(Deltas.Num());
+const uint64 SerialStart = FPlatformTime::Cycles64();
+for (int32 DeltaIdx = 0; DeltaIdx < Deltas.Num(); ++DeltaIdx)
+{
+UPrimitiveComponent* Component = Components[DeltaIdx / MovesPerCharacter];
+const FVector Start = Component->GetComponentLocation();
+FComponentQueryParams Params(SCENE_QUERY_STAT(AsyncCharacterMovementBenchmark), Component->GetOwner());
+const bool bBlocking = World->ComponentSweepMulti(Hits, Component, Start, Start + Deltas[DeltaIdx], Component->GetComponentQuat(), Params);
+SerialResults[DeltaIdx] = GetBlockingResult(bBlocking, Hits);
+}
+const uint64 SerialCycles = FPlatformTime::Cycles64() - SerialStart;
+FCharacterMovementAsyncSceneQueryBatch QueryBatch;
+int32 NumMismatches = 0;
+int32 NumTimeMismatches = 0;
+int32 NumNormalMismatches = 0;
+int32 NumFallbacks = 0;
+const uint64 BatchStart = FPlatformTime::Cycles64();
+// Console commands run on the game thread, so the regions read the game thread particles here.
+QueryBatch.Build(World, CharacterBounds, CharacterMovementAsyncCVars::BatchSceneQueryCellSize, false);
+const uint64 BuildCycles = FPlatformTime::Cycles64() - BatchStart;
+for (int32 DeltaIdx = 0; DeltaIdx < Deltas.Num(); ++DeltaIdx)
+{
+const int32 CharacterIndex = DeltaIdx / MovesPerCharacter;
+UPrimitiveComponent* Component = Components[CharacterIndex];
+const FVector Start = Component->GetComponentLocation();
+const FVector End = Start + Deltas[DeltaIdx];
+const FCollisionShape Shape = Component->GetCollisionShape();
+FComponentQueryParams Params(SCENE_QUERY_STAT(AsyncCharacterMovementBenchmark), Component->GetOwner());
+const FCharacterMovementAsyncSceneQueryBatch::FRegion* Region = QueryBatch.GetRegion(CharacterIndex);
+bool bBlocking = false;
+if (Region && Region->Contains(Start, End, Shape))
+{
+// The params and responses ComponentSweepMulti derives from the component, as the input builder captures them.
+FCollisionResponseParams ResponseParams;
+Component->InitSweepCollisionParams(Params, ResponseParams);
+bBlocking = FCharacterMovementAsyncSceneQueryBatch::SweepMulti(*Region, Hits, Component, Component->GetCollisionObjectType(), Start, End, Component->GetComponentQuat(), Shape, Params, ResponseParams);
+}
+else
+{
+++NumFallbacks;
+bBlocking = World->ComponentSweepMulti(Hits, Component, Start, End, Component->GetComponentQuat(), Params);
+}
+const FBlockingResult BatchResult = GetBlockingResult(bBlocking, Hits);
+const FBlockingResult& SerialResult = SerialResults[DeltaIdx];
+if (BatchResult.bBlocking != SerialResult.bBlocking)
+{
+++NumMismatches;
+}
+else if (BatchResult.bBlocking)
+{
+NumTimeMismatches += (FMath::Abs(BatchResult.Time - SerialResult.Time) > 1e-3f) ? 1 : 0;
+NumNormalMismatches += ((BatchResult.Normal | SerialResult.Normal) < 0.999f) ? 1 : 0;
+}
+}
+const uint64 BatchCycles = FPlatformTime::Cycles64() - BatchStart;
+const double SerialMs = FPlatformTime::ToMilliseconds64(SerialCycles);
+const double BatchMs = FPlatformTime::ToMilliseconds64(BatchCycles);
+UE_LOG(LogCharacterMovement, Log, TEXT("BenchmarkSceneQueryBatch: %d characters, %d moves. Per-move sweeps %.3f ms, batched %.3f ms (broadphase build %.3f ms, %d regions, %d fallbacks), speedup %.2fx, blocking mismatches %d, hit time mismatches %d, hit normal mismatches %d."),
+Components.Num(), Deltas.Num(), SerialMs, BatchMs, FPlatformTime::ToMilliseconds64(BuildCycles), QueryBatch.Regions.Num(), NumFallbacks, (BatchMs > 0.0) ? SerialMs / BatchMs : 0.0, NumMismatches, NumTimeMismatches, NumNormalMismatches);
+}
+static FAutoConsoleCommandWithWorldAndArgs BenchmarkSceneQueryBatchCommand(
+TEXT("p.AsyncCharacterMovement.BenchmarkSceneQueryBatch"),
+TEXT("Sweeps every character in the world along random moves, once with one ComponentSweepMulti per move and once through the batched broadphase, and logs both timings. Optional argument: moves per character (default 8)."),
+FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&BenchmarkSceneQueryBatch));
+// Per-thread scratch buffers for the hits of MoveComponent sweeps.
+// Buffers are reset when borrowed but keep their capacity, so once they have grown to the largest sweep seen on a thread, moves stop touching the heap.
+// Every growth counts as one allocation in STAT_AsyncCharacterMovementScratchAllocations, which should read 0 in steady state.
+struct FCharacterMovementAsyncScratch
+{
+static constexpr int32 MaxDepth = 4;
+TArray<FHitResult> HitBuffers[MaxDepth];
+int32 Depth = 0;
+// Total buffer growths on this thread.
+uint32 NumAllocations = 0;
+static FCharacterMovementAsyncScratch& Get()
+{
+static thread_local FCharacterMovementAsyncScratch Scratch;
+return Scratch;
+}
+};
+// Borrows a hit buffer from the calling thread's scratch for the lifetime of the scope. Scopes may nest up to FCharacterMovementAsyncScratch::MaxDepth.
+struct FCharacterMovementAsyncScopedHits
+{
+FCharacterMovementAsyncScratch& Scratch;
+TArray<FHitResult>& Hits;
+const int32 InitialMax;
+FCharacterMovementAsyncScopedHits()
+: Scratch(FCharacterMovementAsyncScratch::Get())
+, Hits(Acquire(Scratch))
+, InitialMax(Hits.Max())
+{
+Hits.Reset();
+}
+static TArray<FHitResult>& Acquire(FCharacterMovementAsyncScratch& InScratch)
+{
+checkf(InScratch.Depth < FCharacterMovementAsyncScratch::MaxDepth, TEXT("Async character movement scratch hit buffers nested too deep."));
+return InScratch.HitBuffers[InScratch.Depth++];
+}
+~FCharacterMovementAsyncScopedHits()
+{
+if (Hits.Max() > InitialMax)
+{
+++Scratch.NumAllocations;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementScratchAllocations);
+}
+--Scratch.Depth;
+}
+};
+// Adds the hits of a capsule sweep against the other characters in the pawn hash to InOutHits, and keeps them ordered like a component sweep.
+// Returns true if any of the hits blocks.
+static bool SweepPawnHash(const FCharacterMovementAsyncPawnHash& PawnHash, const FCharacterMovementComponentAsyncInput& Input, const FCharacterMovementComponentAsyncOutput& Output, const FVector& Start, const FVector& End, TArray<FHitResult>& InOutHits)
+{
+const FUpdatedComponentAsyncInput& UpdatedComponentInput = *Input.UpdatedComponentInput;
+const UPrimitiveComponent* Component = UpdatedComponentInput.UpdatedComponent;
+const FCollisionQueryParams& Params = UpdatedComponentInput.MoveComponentQueryParams;
+const float Radius = Output.ScaledCapsuleRadius;
+const float HalfHeight = Output.ScaledCapsuleHalfHeight;
+const FVector Extent(Radius, Radius, HalfHeight);
+FBox SweepBounds(Start - Extent, Start + Extent);
+SweepBounds += FBox(End - Extent, End + Extent);
+const int32 NumStaticHits = InOutHits.Num();
+PawnHash.ForEachCandidate(SweepBounds, [&](const FCharacterMovementAsyncPawnHash::FEntry& Other)
+{
+if (Other.Component == Component || Params.GetIgnoredComponents().Contains(Other.Component->GetUniqueID()))
+{
+return;
+}
+const AActor* OtherOwner = Other.Owner;
+if (OtherOwner && Params.GetIgnoredSourceObjects().Contains(OtherOwner->GetUniqueID()))
+{
+return;
+}
+const ECollisionResponse Response = FCharacterMovementAsyncPawnHash::GetPairResponse(Input, Other);
+if (Response == ECR_Ignore)
+{
+return;
+}
+INC_DWORD_STAT(STAT_AsyncCharacterMovementPawnHashTests);
+float Time = 1.f;
+float Penetration = 0.f;
+FVector Normal = FVector::ZeroVector;
+if (!SweepCapsuleCapsule(Start, End, Radius, HalfHeight, Other.Location, Other.Radius, Other.HalfHeight, Time, Normal, Penetration))
+{
+return;
+}
+INC_DWORD_STAT(STAT_AsyncCharacterMovementPawnHashHits);
+FHitResult Hit(Time);
+Hit.TraceStart = Start;
+Hit.TraceEnd = End;
+Hit.Location = Start + Time * (End - Start);
+Hit.Normal = Normal;
+Hit.ImpactNormal = Normal;
+const FVector OtherToLocation = Hit.Location - Other.Location;
+const float AxisOffset = FMath::Clamp<float>(OtherToLocation.Z, -(Other.HalfHeight - Other.Radius), Other.HalfHeight - Other.Radius);
+Hit.ImpactPoint = Other.Location + FVector(0.f, 0.f, AxisOffset) + Normal * Other.Radius;
+Hit.Distance = (float)(Hit.Location - Start).Size();
+Hit.bBlockingHit = (Response == ECR_Block);
+Hit.bStartPenetrating = (Penetration > 0.f);
+Hit.PenetrationDepth = Penetration;
+Hit.Component = const_cast<UPrimitiveComponent*>(Other.Component);
+Hit.HitObjectHandle = FActorInstanceHandle(const_cast<AActor*>(OtherOwner));
+InOutHits.Add(Hit);
+});
+if (InOutHits.Num() == NumStaticHits)
+{
+return false;
+}
+SortHitsLikeComponentSweep(InOutHits);
+return InOutHits.ContainsByPredicate([](const FHitResult& Hit) { return Hit.bBlockingHit; });
+}
+bool FUpdatedComponentAsyncInput::MoveComponent(const FVector& Delta, const FQuat& NewRotationQuat, bool bSweep, FHitResult* OutHit,  EMoveComponentFlags MoveFlags, ETeleportType Teleport,  const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const 
+{
+const FVector TraceStart = GetPosition();
+const FVector TraceEnd = TraceStart + Delta;
+float DeltaSizeSq = (TraceEnd - TraceStart).SizeSquared();
+const FQuat InitialRotationQuat = GetRotation();
+const float MinMovementDistSq = (bSweep ? FMath::Square(4.f * UE_KINDA_SMALL_NUMBER) : 0.f);
+if (DeltaSizeSq <= MinMovementDistSq)
+{
+if (NewRotationQuat.Equals(InitialRotationQuat, SCENECOMPONENT_QUAT_TOLERANCE))
+{
+// copy to optional output param
+if (OutHit)
+{
+OutHit->Init(TraceStart, TraceEnd);
+}
+return true;
+}
+DeltaSizeSq = 0.f;
+}
+const bool bSkipPhysicsMove = ((MoveFlags & MOVECOMP_SkipPhysicsMove) != MOVECOMP_NoFlags);
+FHitResult BlockingHit(NoInit);
+BlockingHit.bBlockingHit = false;
+BlockingHit.Time = 1.f;
+bool bFilledHitResult = false;
+bool bMoved = false;
+bool bIncludesOverlapsAtEnd = false;
+bool bRotationOnly = false;
+TInlineOverlapInfoArray PendingOverlaps;
+if (!bSweep)
+{
+SetPosition(TraceEnd);
+SetRotation(NewRotationQuat);
+bRotationOnly = (DeltaSizeSq == 0);
+bIncludesOverlapsAtEnd = bRotationOnly && (AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale)) && bIsQueryCollisionEnabled;
+}
+else
+{
+FCharacterMovementAsyncScopedHits ScopedHits;
+TArray<FHitResult>& Hits = ScopedHits.Hits;
+FVector NewLocation = TraceStart;
+// Perform movement collision checking if needed for this actor.
+if (bIsQueryCollisionEnabled && (DeltaSizeSq > 0.f))
+{
+// now capturing params when building inputs.
+const FCharacterMovementAsyncSceneQueryBatch::FRegion* SceneQueryRegion = Output.SceneQueryRegion;
+bool bHadBlockingHit = false;
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, MoveComponent, Sweep);
+bHadBlockingHit = RunCapturedSceneQuery(TraceStart, TraceEnd, nullptr, &Hits, [&]()
+{
+if (SceneQueryRegion && SceneQueryRegion->Contains(TraceStart, TraceEnd, CollisionShape))
+{
+return FCharacterMovementAsyncSceneQueryBatch::SweepMulti(*SceneQueryRegion, Hits, UpdatedComponent, Input.CollisionChannel, TraceStart, TraceEnd, InitialRotationQuat, CollisionShape, MoveComponentQueryParams, MoveComponentCollisionResponseParams, Output.PawnHash);
+}
+if (Output.PawnHash != nullptr)
+{
+// Characters in the hash come from SweepPawnHash. Only those the sweep can reach are ignored, so the params are copied only when there are any.
+const FVector Extent = CollisionShape.GetExtent();
+FBox SweepBounds(TraceStart - Extent, TraceStart + Extent);
+SweepBounds += FBox(TraceEnd - Extent, TraceEnd + Extent);
+TOptional<FCollisionQueryParams> HashQueryParams;
+Output.PawnHash->ForEachCandidate(SweepBounds, [&](const FCharacterMovementAsyncPawnHash::FEntry& Other)
+{
+if (Other.Component != UpdatedComponent)
+{
+if (!HashQueryParams.IsSet())
+{
+HashQueryParams.Emplace(MoveComponentQueryParams);
+}
+HashQueryParams->AddIgnoredComponent(Other.Component);
+}
+});
+bool bBlocking = Input.World->SweepMultiByChannel(Hits, TraceStart, TraceEnd, InitialRotationQuat, Input.CollisionChannel, CollisionShape, HashQueryParams.IsSet() ? HashQueryParams.GetValue() : MoveComponentQueryParams, MoveComponentCollisionResponseParams);
+// A character that already moved this tick can be in the scene outside its hash bounds.
+if (Hits.RemoveAll([&](const FHitResult& Hit) { return Output.PawnHash->Contains(Hit.GetComponent()); }) > 0)
+{
+bBlocking = Hits.ContainsByPredicate([](const FHitResult& Hit) { return Hit.bBlockingHit; });
+}
+return bBlocking;
+}
+return Input.World->ComponentSweepMulti(Hits, UpdatedComponent, TraceStart, TraceEnd, InitialRotationQuat, MoveComponentQueryParams);
+});
+}
+if (Output.PawnHash != nullptr && !GAsyncCharacterMovementSkipPawnHash)
+{
+bHadBlockingHit |= SweepPawnHash(*Output.PawnHash, Input, Output, TraceStart, TraceEnd, Hits);
+}
+if (Hits.Num() > 0)
+{
+const float DeltaSize = FMath::Sqrt(DeltaSizeSq);
+for (int32 HitIdx = 0; HitIdx < Hits.Num(); HitIdx++)
+{
+FUpdatedComponentAsyncInput::PullBackHit(Hits[HitIdx], TraceStart, TraceEnd, DeltaSize);
+}
+}
+// If we are looking for overlaps, store those as well.
+int32 FirstNonInitialOverlapIdx = INDEX_NONE;
+if (bHadBlockingHit || (bGatherOverlaps))
+{
+int32 BlockingHitIndex = INDEX_NONE;
+float BlockingHitNormalDotDelta = UE_BIG_NUMBER;
+for (int32 HitIdx = 0; HitIdx < Hits.Num(); HitIdx++)
+{
+const FHitResult& TestHit = Hits[HitIdx];
+if (TestHit.bBlockingHit)
+{
+// This ignores if query/hit actor are based on each other. Can we determine this on PT?
+if (!FUpdatedComponentAsyncInput::ShouldIgnoreHitResult(Input.World, TestHit, Delta, nullptr/*Actor*/, MoveFlags))
+{
+if (TestHit.bStartPenetrating)
+{
+// We may have multiple initial hits, and want to choose the one with the normal most opposed to our movement.
+const float NormalDotDelta = (TestHit.ImpactNormal | Delta);
+if (NormalDotDelta < BlockingHitNormalDotDelta)
+{
+BlockingHitNormalDotDelta = NormalDotDelta;
+BlockingHitIndex = HitIdx;
+}
+}
+else if (BlockingHitIndex == INDEX_NONE)
+{
+// First non-overlapping blocking hit should be used, if an overlapping hit was not.
+// This should be the only non-overlapping blocking hit, and last in the results.
+BlockingHitIndex = HitIdx;
+break;
+}
+}
+}
+else if (bGatherOverlaps)
+{
+UPrimitiveComponent* OverlapComponent = TestHit.Component.Get();
+// Overlaps are speculative, this flag will be chcked when applying outputs.
+if (OverlapComponent && (true || bForceGatherOverlaps))
+{
+if (!FUpdatedComponentAsyncInput::ShouldIgnoreOverlapResult(Input.World, nullptr, *UpdatedComponent, TestHit.GetActor(), *OverlapComponent ))
+{
+// don't process touch events after initial blocking hits
+if (BlockingHitIndex >= 0 && TestHit.Time > Hits[BlockingHitIndex].Time)
+{
+break;
+}
+if (FirstNonInitialOverlapIdx == INDEX_NONE && TestHit.Time > 0.f)
+{
+// We are about to add the first non-initial overlap.
+FirstNonInitialOverlapIdx = PendingOverlaps.Num();
+}
+Output.UpdatedComponentOutput.AddUniqueSpeculativeOverlap(FOverlapInfo(TestHit));
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::UpdatedComponent);
+}
+}
+}
+}
+// Update blocking hit, if there was a valid one.
+if (BlockingHitIndex >= 0)
+{
+BlockingHit = Hits[BlockingHitIndex];
+bFilledHitResult = true;
+}
+}
+// Update NewLocation based on the hit result
+if (!BlockingHit.bBlockingHit)
+{
+NewLocation = TraceEnd;
+}
+else
+{
+check(bFilledHitResult);
+NewLocation = TraceStart + (BlockingHit.Time * (TraceEnd - TraceStart));
+// Sanity check
+const FVector ToNewLocation = (NewLocation - TraceStart);
+if (ToNewLocation.SizeSquared() <= MinMovementDistSq)
+{
+// We don't want really small movements to put us on or inside a surface.
+NewLocation = TraceStart;
+BlockingHit.Time = 0.f;
+// Remove any pending overlaps after this point, we are not going as far as we swept.
+if (FirstNonInitialOverlapIdx != INDEX_NONE)
+{
+const bool bAllowShrinking = false;
+PendingOverlaps.SetNum(FirstNonInitialOverlapIdx, bAllowShrinking);
+}
+}
+}
+bIncludesOverlapsAtEnd = AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale);
+}
+else if (DeltaSizeSq > 0.f)
+{
+// apply move delta even if components has collisions disabled
+NewLocation += Delta;
+bIncludesOverlapsAtEnd = false;
+}
+else if (DeltaSizeSq == 0.f && bIsQueryCollisionEnabled)
+{
+bIncludesOverlapsAtEnd = AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale);
+bRotationOnly = true;
+}
+SetPosition(NewLocation);
+SetRotation(NewRotationQuat);
+bMoved = true;
+}
+// Handle blocking hit notifications. Avoid if pending kill (which could happen after overlaps).
+const bool bAllowHitDispatch = !BlockingHit.bStartPenetrating || !(MoveFlags & MOVECOMP_DisableBlockingOverlapDispatch);
+if (BlockingHit.bBlockingHit && bAllowHitDispatch/* && IsValid(this)*/)
+{
+check(bFilledHitResult);
+}
+if (BlockingHit.bBlockingHit)
+{
+Output.bSubstepBlockingHit = true;
+}
+// copy to optional output param
+if (OutHit)
+{
+if (bFilledHitResult)
+{
+*OutHit = BlockingHit;
+}
+else
+{
+OutHit->Init(TraceStart, TraceEnd);
+}
+}
+return bMoved;
+}
+bool FUpdatedComponentAsyncInput::AreSymmetricRotations(const FQuat& A, const FQuat& B, const FVector& Scale3D) const
+{
+if (Scale3D.X != Scale3D.Y)
+{
+return false;
+}
+const FVector AUp = A.GetAxisZ();
+const FVector BUp = B.GetAxisZ();
+return AUp.Equals(BUp);
+}
+void FUpdatedComponentAsyncInput::PullBackHit(FHitResult& Hit, const FVector& Start, const FVector& End, const float Dist)
+{
+const float DesiredTimeBack = FMath::Clamp(0.1f, 0.1f / Dist, 1.f / Dist) + 0.001f;
+Hit.Time = FMath::Clamp(Hit.Time - DesiredTimeBack, 0.f, 1.f);
+}
+bool FUpdatedComponentAsyncInput::ShouldCheckOverlapFlagToQueueOverlaps(const UPrimitiveComponent& ThisComponent)
+{
+const FScopedMovementUpdate* CurrentUpdate = ThisComponent.GetCurrentScopedMovement();
+if (CurrentUpdate)
+{
+return CurrentUpdate->RequiresOverlapsEventFlag();
+}
+// By default we require the GetGenerateOverlapEvents() to queue up overlaps, since we require it to trigger events.
+return true;
+}
+bool FUpdatedComponentAsyncInput::ShouldIgnoreHitResult(const UWorld* InWorld, FHitResult const& TestHit, FVector const& MovementDirDenormalized, const AActor* MovingActor, EMoveComponentFlags MoveFlags)
+{
+if (TestHit.bBlockingHit)
+{
+// check "ignore bases" functionality
+if ((MoveFlags & MOVECOMP_IgnoreBases) && false/*MovingActor*/)//we let overlap components go through because their overlap is still needed and will cause beginOverlap/endOverlap events
+{
+// ignore if there's a base relationship between moving actor and hit actor
+AActor const* const HitActor = TestHit.GetActor();
+if (HitActor)
+{
+if (MovingActor->IsBasedOnActor(HitActor) || HitActor->IsBasedOnActor(MovingActor))
+{
+return true;
+}
+}
+}
+// If we started penetrating, we may want to ignore it if we are moving out of penetration.
+// This helps prevent getting stuck in walls.
+if ((TestHit.Distance < PrimitiveComponentCVars::HitDistanceToleranceCVar || TestHit.bStartPenetrating) && !(MoveFlags & MOVECOMP_NeverIgnoreBlockingOverlaps))
+{
+const float DotTolerance = PrimitiveComponentCVars::InitialOverlapToleranceCVar;
+// Dot product of movement direction against 'exit' direction
+const FVector MovementDir = CharacterMovementAsyncMath::GetSafeNormal(MovementDirDenormalized);
+const float MoveDot = (TestHit.ImpactNormal | MovementDir);
+const bool bMovingOut = MoveDot > DotTolerance;
+// If we are moving out, ignore this result!
+if (bMovingOut)
+{
+return true;
+}
+}
+}
+return false;
+}
+bool FUpdatedComponentAsyncInput::ShouldIgnoreOverlapResult(const UWorld* World, const AActor* ThisActor, const UPrimitiveComponent& ThisComponent, const AActor* OtherActor, const UPrimitiveComponent& OtherComponent)
+{
+if (&ThisComponent == &OtherComponent)
+{
+return true;
+}
+// We're passing in null for ThisActor as we don't have that data, ensuring owner exists when filling inputs anyway.
+if (/*!ThisActor || */!OtherActor)
+{
+return true;
+}
+// Cannot read this on PT, check when applying speculative overlaps.
+if (!World)
+{
+return true;
+}
+return false;
+}
+void FUpdatedComponentAsyncInput::SetPosition(const FVector& InPosition) const
+{
+if (FCharacterMovementAsyncDeferredTransform* Deferred = FindDeferredTransform(this))
+{
+Deferred->Position = InPosition;
+Deferred->bPositionDirty = true;
+return;
+}
+if (PhysicsHandle->GetPhysicsThreadAPI() == nullptr)
+{
+return;
+}
+if (auto Rigid = PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle())
+{
+PhysicsHandle->GetPhysicsThreadAPI()->SetX(InPosition);
+Rigid->SetP(InPosition); 
+// Kinematics do not normal marshall changes back to game thread, mark dirty to ensure game thread
+// gets change in position.
+if (Rigid->ObjectState() == Chaos::EObjectStateType::Kinematic)
+{
+FScopeLock DirtyParticlesLock(&GAsyncCharacterMovementDirtyParticlesLock);
+PhysicsHandle->GetSolver<Chaos::FPBDRigidsSolver>()->GetParticles().MarkTransientDirtyParticle(Rigid);
+}
+}
+else
+{
+ensure(false);
+}
+}
+FVector FUpdatedComponentAsyncInput::GetPosition() const
+{
+if (const FCharacterMovementAsyncDeferredTransform* Deferred = FindDeferredTransform(this))
+{
+return Deferred->Position;
+}
+if (PhysicsHandle && PhysicsHandle->GetPhysicsThreadAPI())
 {
-Velocity = FVector::ZeroVector;
+return PhysicsHandle->GetPhysicsThreadAPI()->X();
+}
+return FVector::ZeroVector;
+}
+void FUpdatedComponentAsyncInput::SetRotation(const FQuat& InRotation) const
+{
+if (FCharacterMovementAsyncDeferredTransform* Deferred = FindDeferredTransform(this))
+{
+Deferred->Rotation = InRotation;
+Deferred->bRotationDirty = true;
 return;
 }
+if (PhysicsHandle->GetPhysicsThreadAPI() == nullptr)
+{
+return;
 }
-// Clamp to zero if nearly zero, or if below min threshold and braking.
-const float VSizeSq = Velocity.SizeSquared();
-if (VSizeSq <= UE_KINDA_SMALL_NUMBER || (!bZeroBraking && VSizeSq <= FMath::Square(UCharacterMovementComponent::BRAKE_TO_STOP_VELOCITY)))
+if (auto Rigid = PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle())
 {
-Velocity = FVector::ZeroVector;
+PhysicsHandle->GetPhysicsThreadAPI()->SetR(InRotation);
+Rigid->SetQ(InRotation); 
+if (Rigid->ObjectState() == Chaos::EObjectStateType::Kinematic)
+{
+FScopeLock DirtyParticlesLock(&GAsyncCharacterMovementDirtyParticlesLock);
+PhysicsHandle->GetSolver<Chaos::FPBDRigidsSolver>()->GetParticles().MarkTransientDirtyParticle(Rigid);
 }
 }
-FVector FCharacterMovementComponentAsyncInput::GetPenetrationAdjustment(FHitResult& HitResult) const
+else
 {
-FVector Result = MoveComponent_GetPenetrationAdjustment(HitResult);
+ensure(false);
+}
+}
+FQuat FUpdatedComponentAsyncInput::GetRotation() const
 {
-const bool bIsProxy = (CharacterInput->LocalRole == ROLE_SimulatedProxy);
-float MaxDistance = bIsProxy ? MaxDepenetrationWithGeometryAsProxy : MaxDepenetrationWithGeometry;
-const AActor* HitActor = HitResult.GetActor();
-if (Cast<APawn>(HitActor))
+if (const FCharacterMovementAsyncDeferredTransform* Deferred = FindDeferredTransform(this))
 {
-MaxDistance = bIsProxy ? MaxDepenetrationWithPawnAsProxy : MaxDepenetrationWithPawn;
+return Deferred->Rotation;
 }
-Result = Result.GetClampedToMaxSize(MaxDistance);
+if (PhysicsHandle && PhysicsHandle->GetPhysicsThreadAPI())
+{
+return PhysicsHandle->GetPhysicsThreadAPI()->R();
 }
-return Result;
+return FQuat::Identity;
 }
-bool FCharacterMovementComponentAsyncInput::ResolvePenetration(const FVector& ProposedAdjustment, const FHitResult& Hit, const FQuat& NewRotation, FCharacterMovementComponentAsyncOutput& Output) const
+float FCharacterMovementComponentAsyncInput::SlideAlongSurface(const FVector& Delta, float Time, const FVector& InNormal, FHitResult& Hit, bool bHandleImpact, FCharacterMovementComponentAsyncOutput& Output) const 
 {
-// SceneComponent can't be in penetration, so this function really only applies to PrimitiveComponent.
-const FVector Adjustment = ConstrainDirectionToPlane(ProposedAdjustment);
-if (!Adjustment.IsZero() && UpdatedComponentInput->UpdatedComponent)
+if (!Hit.bBlockingHit)
 {
-bool bEncroached = World->OverlapBlockingTestByChannel(Hit.TraceStart + Adjustment, NewRotation, CollisionChannel, UpdatedComponentInput->CollisionShape, UpdatedComponentInput->MoveComponentQueryParams, UpdatedComponentInput->MoveComponentCollisionResponseParams);
-if (!bEncroached)
+return 0.f;
+}
+FVector Normal(InNormal);
+if (IsMovingOnGround(Output))
 {
-MoveUpdatedComponent(Adjustment, NewRotation, false, Output, nullptr, ETeleportType::TeleportPhysics);
-Output.bJustTeleported = true;
-return true;
+// We don't want to be pushed up an unwalkable surface.
+if (Normal.Z > 0.f)
+{
+if (!IsWalkable(Hit))
+{
+Normal = CharacterMovementAsyncMath::GetSafeNormal2D(Normal);
 }
-else
+}
+else if (Normal.Z < -UE_KINDA_SMALL_NUMBER)
 {
-TGuardValue<EMoveComponentFlags> ScopedFlagRestore(Output.MoveComponentFlags, EMoveComponentFlags(Output.MoveComponentFlags & (~MOVECOMP_NeverIgnoreBlockingOverlaps)));
-FHitResult SweepOutHit(1.f);
-bool bMoved = MoveUpdatedComponent(Adjustment, NewRotation, true, Output, &SweepOutHit, ETeleportType::TeleportPhysics);
-if (!bMoved && SweepOutHit.bStartPenetrating)
+// Don't push down into the floor when the impact is on the upper portion of the capsule.
+if (Output.CurrentFloor.FloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST && Output.CurrentFloor.bBlockingHit)
 {
-// Combine two MTD results to get a new direction that gets out of multiple surfaces.
-const FVector SecondMTD = GetPenetrationAdjustment(SweepOutHit);
-const FVector CombinedMTD = Adjustment + SecondMTD;
-if (SecondMTD != Adjustment && !CombinedMTD.IsZero())
+const FVector FloorNormal = Output.CurrentFloor.HitResult.Normal;
+const bool bFloorOpposedToMovement = (Delta | FloorNormal) < 0.f && (FloorNormal.Z < 1.f - UE_DELTA);
+if (bFloorOpposedToMovement)
 {
-bMoved = MoveUpdatedComponent(CombinedMTD, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
+Normal = FloorNormal;
 }
+Normal = CharacterMovementAsyncMath::GetSafeNormal2D(Normal);
 }
-if (!bMoved)
+}
+}
+return MoveComponent_SlideAlongSurface(Delta, Time, Normal, Hit, Output, bHandleImpact);
+}
+FVector FCharacterMovementComponentAsyncInput::ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
 {
-const FVector MoveDelta = ConstrainDirectionToPlane(Hit.TraceEnd - Hit.TraceStart);
-if (!MoveDelta.IsZero())
+FVector Result = MoveComponent_ComputeSlideVector(Delta, Time, Normal, Hit, Output);
+// prevent boosting up slopes
+if (IsFalling(Output))
 {
-bMoved = MoveUpdatedComponent(Adjustment + MoveDelta, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
-if (!bMoved && FVector::DotProduct(MoveDelta, Adjustment) > 0.f)
+Result = HandleSlopeBoosting(Result, Delta, Time, Normal, Hit, Output);
+}
+return Result;
+}
+FVector FCharacterMovementComponentAsyncInput::HandleSlopeBoosting(const FVector& SlideResult, const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
 {
-bMoved = MoveUpdatedComponent(MoveDelta, NewRotation, true, Output, nullptr, ETeleportType::TeleportPhysics);
+FVector Result = SlideResult;
+if (Result.Z > 0.f)
+{
+// Don't move any higher than we originally intended.
+const float ZLimit = Delta.Z * Time;
+if (Result.Z - ZLimit > UE_KINDA_SMALL_NUMBER)
+{
+if (ZLimit > 0.f)
+{
+// Rescale the entire vector (not just the Z component) otherwise we change the direction and likely head right back into the impact.
+const float UpPercent = ZLimit / Result.Z;
+Result *= UpPercent;
+}
+else
+{
+// We were heading down but were going to deflect upwards. Just make the deflection horizontal.
+Result = FVector::ZeroVector;
 }
+// Make remaining portion of original result horizontal and parallel to impact normal.
+const FVector RemainderXY = (SlideResult - Result) * FVector(1.f, 1.f, 0.f);
+const FVector NormalXY = CharacterMovementAsyncMath::GetSafeNormal2D(Normal);
+const FVector Adjust = MoveComponent_ComputeSlideVector(RemainderXY, 1.f, NormalXY, Hit, Output); //Super::ComputeSlideVector(RemainderXY, 1.f, NormalXY, Hit);
+Result += Adjust;
 }
 }
-Output.bJustTeleported |= bMoved;
-return bMoved;
+return Result;
 }
+void FCharacterMovementComponentAsyncInput::OnCharacterStuckInGeometry(const FHitResult* Hit, FCharacterMovementComponentAsyncOutput& Output) const 
+{
+// Don't update velocity based on our (failed) change in position this update since we're stuck.
+Output.bJustTeleported = true;
 }
+bool FCharacterMovementComponentAsyncInput::CanStepUp(const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!Hit.IsValidBlockingHit() || !bHasValidData || Output.MovementMode == MOVE_Falling)
+{
 return false;
 }
-FVector FCharacterMovementComponentAsyncInput::MoveComponent_GetPenetrationAdjustment(FHitResult& Hit) const
+// No component for "fake" hits when we are on a known good base.
+const UPrimitiveComponent* HitComponent = Hit.Component.Get();
+if (!HitComponent)
 {
-if (!Hit.bStartPenetrating)
+return true;
+}
+// No actor for "fake" hits when we are on a known good base.
+const AActor* HitActor = Hit.GetActor();
+if (!HitActor)
 {
-return FVector::ZeroVector;
+return true;
 }
-FVector Result;
-const float PullBackDistance = FMath::Abs(MovementComponentCVars::PenetrationPullbackDistance);
-const float PenetrationDepth = (Hit.PenetrationDepth > 0.f ? Hit.PenetrationDepth : 0.125f);
-Result = Hit.Normal * (PenetrationDepth + PullBackDistance);
-return ConstrainDirectionToPlane(Result);
+return true;
 }
-float FCharacterMovementComponentAsyncInput::MoveComponent_SlideAlongSurface(const FVector& Delta, float Time, const FVector& Normal, FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output, bool bHandleImpact) const
+bool FCharacterMovementComponentAsyncInput::StepUp(const FVector& GravDir, const FVector& Delta, const FHitResult& InHit, FCharacterMovementComponentAsyncOutput& Output, FStepDownResult* OutStepDownResult) const
 {
-if (!Hit.bBlockingHit)
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, StepUp);
+if (!CanStepUp(InHit, Output) || MaxStepHeight <= 0.f)
 {
-return 0.f;
+return false;
 }
-float PercentTimeApplied = 0.f;
-const FVector OldHitNormal = Normal;
-FVector SlideDelta = ComputeSlideVector(Delta, Time, Normal, Hit, Output);
-if ((SlideDelta | Delta) > 0.f)
-{
-const FQuat Rotation = UpdatedComponentInput->GetRotation();
-SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, Output);
-const float FirstHitPercent = Hit.Time;
-PercentTimeApplied = FirstHitPercent;
-if (Hit.IsValidBlockingHit())
+const FVector OldLocation = UpdatedComponentInput->GetPosition();
+float PawnRadius = Output.ScaledCapsuleRadius;
+float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
+// Don't bother stepping up if top of capsule is hitting something.
+const float InitialImpactZ = InHit.ImpactPoint.Z;
+if (InitialImpactZ > OldLocation.Z + (PawnHalfHeight - PawnRadius))
 {
-// Notify first impact
-if (bHandleImpact)
+return false;
+}
+if (GravDir.IsZero())
 {
-HandleImpact(Hit, Output, FirstHitPercent * Time, SlideDelta);
+return false;
 }
-// Compute new slide normal when hitting multiple surfaces.
-TwoWallAdjust(SlideDelta, Hit, OldHitNormal, Output);
-// Only proceed if the new direction is of significant length and not in reverse of original attempted move.
-if (!SlideDelta.IsNearlyZero(1e-3f) && (SlideDelta | Delta) > 0.f)
+FFindFloorResult& CurrentFloor = Output.CurrentFloor;
+//float MaxStepHeight = MaxStepHeight;
+// Gravity should be a normalized direction
+ensure(GravDir.IsNormalized());
+float StepTravelUpHeight = MaxStepHeight;
+float StepTravelDownHeight = StepTravelUpHeight;
+const float StepSideZ = -1.f * FVector::DotProduct(InHit.ImpactNormal, GravDir);
+float PawnInitialFloorBaseZ = OldLocation.Z - PawnHalfHeight;
+float PawnFloorPointZ = PawnInitialFloorBaseZ;
+if (IsMovingOnGround(Output) && CurrentFloor.IsWalkableFloor())
 {
-// Perform second move
-SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, Output);
-const float SecondHitPercent = Hit.Time * (1.f - FirstHitPercent);
-PercentTimeApplied += SecondHitPercent;
-// Notify second impact
-if (bHandleImpact && Hit.bBlockingHit)
+// Since we float a variable amount off the floor, we need to enforce max step height off the actual point of impact with the floor.
+const float FloorDist = FMath::Max(0.f, CurrentFloor.GetDistanceToFloor());
+PawnInitialFloorBaseZ -= FloorDist;
+StepTravelUpHeight = FMath::Max(StepTravelUpHeight - FloorDist, 0.f);
+StepTravelDownHeight = (MaxStepHeight + UCharacterMovementComponent::MAX_FLOOR_DIST * 2.f);
+const bool bHitVerticalFace = !IsWithinEdgeTolerance(InHit.Location, InHit.ImpactPoint, PawnRadius);
+if (!CurrentFloor.bLineTrace && !bHitVerticalFace)
 {
-HandleImpact(Hit, Output, SecondHitPercent * Time, SlideDelta);
+PawnFloorPointZ = CurrentFloor.HitResult.ImpactPoint.Z;
 }
+else
+{
+// Base floor point is the base of the capsule moved down by how far we are hovering over the surface we are hitting.
+PawnFloorPointZ -= CurrentFloor.FloorDist;
 }
 }
-return FMath::Clamp(PercentTimeApplied, 0.f, 1.f);
+// Don't step up if the impact is below us, accounting for distance from floor.
+if (InitialImpactZ <= PawnInitialFloorBaseZ)
+{
+return false;
 }
-return 0.f;
+const FQuat PawnRotation = UpdatedComponentInput->GetRotation();
+// The step cache needs the floor point measured from a walkable floor, and only skips sweeps shorter than the capsule radius.
+const bool bUseStepUpCache = (CharacterMovementAsyncCVars::StepUpCache != 0) && IsMovingOnGround(Output) && CurrentFloor.IsWalkableFloor() && (InHit.GetComponent() != nullptr);
+if (bUseStepUpCache)
+{
+const float NormalTolerance = 0.99f;
+if (Output.StepUpCacheComponent == InHit.GetComponent() && (InHit.ImpactNormal | Output.StepUpCacheNormal) >= NormalTolerance && Delta.SizeSquared2D() <= FMath::Square(PawnRadius))
+{
+// Lift the capsule without a sweep, then sweep forward and down as the full step up does. Anything the lift moved the capsule into
+// makes the forward sweep start in penetration, and anything ahead blocks it, so the cache never passes through obstacles.
+MoveUpdatedComponent(-GravDir * StepTravelUpHeight, PawnRotation, false, Output);
+FHitResult ForwardHit(1.f);
+MoveUpdatedComponent(Delta, PawnRotation, true, Output, &ForwardHit);
+FHitResult CachedHit(1.f);
+if (!ForwardHit.bBlockingHit)
+{
+MoveUpdatedComponent(GravDir * StepTravelDownHeight, PawnRotation, true, Output, &CachedHit);
 }
-FVector FCharacterMovementComponentAsyncInput::MoveComponent_ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+const float CachedDeltaZ = CachedHit.ImpactPoint.Z - PawnFloorPointZ;
+if (!ForwardHit.bBlockingHit && !CachedHit.bStartPenetrating && CachedHit.IsValidBlockingHit() && CachedHit.GetComponent() == Output.StepUpCacheComponent && (CachedHit.ImpactNormal | Output.StepUpCacheTopNormal) >= NormalTolerance
+&& IsWalkable(CachedHit) && CachedDeltaZ > 0.f && CachedDeltaZ <= MaxStepHeight && FMath::Abs(CachedDeltaZ - Output.StepUpCacheHeight) <= CharacterMovementAsyncCVars::StepUpCacheHeightTolerance
+&& IsWithinEdgeTolerance(CachedHit.Location, CachedHit.ImpactPoint, PawnRadius))
 {
-if (!bConstrainToPlane)
+if (OutStepDownResult != NULL)
 {
-return FVector::VectorPlaneProject(Delta, Normal) * Time;
+// The verification sweep is a valid downward sweep, FindFloor takes the floor from it.
+*OutStepDownResult = FStepDownResult();
+FindFloor(UpdatedComponentInput->GetPosition(), OutStepDownResult->FloorResult, false, Output, &CachedHit);
+OutStepDownResult->bComputedFloor = true;
 }
-else
+// The up sweep was skipped.
+const uint32 SavedQueries = 1;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementStepUpCacheHits);
+INC_DWORD_STAT_BY(STAT_AsyncCharacterMovementStepUpSavedQueries, SavedQueries);
+if (GAsyncCharacterMovementQueryCounters)
 {
-const FVector ProjectedNormal = ConstrainNormalToPlane(Normal);
-return FVector::VectorPlaneProject(Delta, ProjectedNormal) * Time;
+++GAsyncCharacterMovementQueryCounters->NumStepUpCacheHits;
+GAsyncCharacterMovementQueryCounters->NumStepUpSavedQueries += SavedQueries;
+}
+Output.bJustTeleported |= !bMaintainHorizontalGroundVelocity;
+return true;
 }
+// The staircase changed under us, put the capsule back and run the full step up.
+MoveUpdatedComponent(OldLocation - UpdatedComponentInput->GetPosition(), PawnRotation, false, Output);
+Output.StepUpCacheComponent = nullptr;
 }
-bool FUpdatedComponentAsyncInput::MoveComponent(const FVector& Delta, const FQuat& NewRotationQuat, bool bSweep, FHitResult* OutHit,  EMoveComponentFlags MoveFlags, ETeleportType Teleport,  const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const 
+INC_DWORD_STAT(STAT_AsyncCharacterMovementStepUpCacheMisses);
+}
+// step up - treat as vertical wall
+FHitResult SweepUpHit(1.f);
+MoveUpdatedComponent(-GravDir * StepTravelUpHeight, PawnRotation, true, Output, &SweepUpHit);
+if (SweepUpHit.bStartPenetrating)
 {
-const FVector TraceStart = GetPosition();
-const FVector TraceEnd = TraceStart + Delta;
-float DeltaSizeSq = (TraceEnd - TraceStart).SizeSquared();
-const FQuat InitialRotationQuat = GetRotation();
-const float MinMovementDistSq = (bSweep ? FMath::Square(4.f * UE_KINDA_SMALL_NUMBER) : 0.f);
-if (DeltaSizeSq <= MinMovementDistSq)
+ensure(false);
+return false;
+}
+FHitResult Hit(1.f);
+MoveUpdatedComponent(Delta, PawnRotation, true, Output, &Hit);
+const bool bForwardClear = !Hit.bBlockingHit;
+// Check result of forward movement
+if (Hit.bBlockingHit)
 {
-if (NewRotationQuat.Equals(InitialRotationQuat, SCENECOMPONENT_QUAT_TOLERANCE))
+if (Hit.bStartPenetrating)
 {
-// copy to optional output param
-if (OutHit)
+ensure(false);
+return false;
+}
+// If we hit something above us and also something ahead of us, we should notify about the upward hit as well.
+// The forward hit will be handled later (in the bSteppedOver case below).
+// In the case of hitting something above but not forward, we are not blocked from moving so we don't need the notification.
+if (SweepUpHit.bBlockingHit && Hit.bBlockingHit)
 {
-OutHit->Init(TraceStart, TraceEnd);
+HandleImpact(SweepUpHit, Output);
 }
+// pawn ran into a wall
+HandleImpact(Hit, Output);
+if (IsFalling(Output))
+{
 return true;
 }
-DeltaSizeSq = 0.f;
-}
-const bool bSkipPhysicsMove = ((MoveFlags & MOVECOMP_SkipPhysicsMove) != MOVECOMP_NoFlags);
-FHitResult BlockingHit(NoInit);
-BlockingHit.bBlockingHit = false;
-BlockingHit.Time = 1.f;
-bool bFilledHitResult = false;
-bool bMoved = false;
-bool bIncludesOverlapsAtEnd = false;
-bool bRotationOnly = false;
-TInlineOverlapInfoArray PendingOverlaps;
-if (!bSweep)
+// adjust and try again
+const float ForwardHitTime = Hit.Time;
+const float ForwardSlideAmount = SlideAlongSurface(Delta, 1.f - Hit.Time, Hit.Normal, Hit, true, Output);
+if (IsFalling(Output))
 {
-SetPosition(TraceEnd);
-SetRotation(NewRotationQuat);
-bRotationOnly = (DeltaSizeSq == 0);
-bIncludesOverlapsAtEnd = bRotationOnly && (AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale)) && bIsQueryCollisionEnabled;
+ensure(false);
+//ScopedStepUpMovement.RevertMove();
+return false;
 }
-else
-{
-TArray<FHitResult> Hits;
-FVector NewLocation = TraceStart;
-// Perform movement collision checking if needed for this actor.
-if (bIsQueryCollisionEnabled && (DeltaSizeSq > 0.f))
-{
-// now capturing params when building inputs.
-bool const bHadBlockingHit = Input.World->ComponentSweepMulti(Hits, UpdatedComponent, TraceStart, TraceEnd, InitialRotationQuat, MoveComponentQueryParams);
-if (Hits.Num() > 0)
-{
-const float DeltaSize = FMath::Sqrt(DeltaSizeSq);
-for (int32 HitIdx = 0; HitIdx < Hits.Num(); HitIdx++)
+// If both the forward hit and the deflection got us nowhere, there is no point in this step up.
+if (ForwardHitTime == 0.f && ForwardSlideAmount == 0.f)
 {
-FUpdatedComponentAsyncInput::PullBackHit(Hits[HitIdx], TraceStart, TraceEnd, DeltaSize);
+ensure(false);
+return false;
 }
 }
-// If we are looking for overlaps, store those as well.
-int32 FirstNonInitialOverlapIdx = INDEX_NONE;
-if (bHadBlockingHit || (bGatherOverlaps))
-{
-int32 BlockingHitIndex = INDEX_NONE;
-float BlockingHitNormalDotDelta = UE_BIG_NUMBER;
-for (int32 HitIdx = 0; HitIdx < Hits.Num(); HitIdx++)
+// Step down
+MoveUpdatedComponent(GravDir * StepTravelDownHeight, UpdatedComponentInput->GetRotation(), true, Output, &Hit);
+if (Hit.bStartPenetrating)
 {
-const FHitResult& TestHit = Hits[HitIdx];
-if (TestHit.bBlockingHit)
+ensure(false);
+//ScopedStepUpMovement.RevertMove();
+return false;
+}
+FStepDownResult StepDownResult;
+if (Hit.IsValidBlockingHit())
 {
-// This ignores if query/hit actor are based on each other. Can we determine this on PT?
-if (!FUpdatedComponentAsyncInput::ShouldIgnoreHitResult(Input.World, TestHit, Delta, nullptr/*Actor*/, MoveFlags))
+// See if this step sequence would have allowed us to travel higher than our max step height allows.
+const float DeltaZ = Hit.ImpactPoint.Z - PawnFloorPointZ;
+if (DeltaZ > MaxStepHeight)
 {
-if (TestHit.bStartPenetrating)
+ensure(false);
+return false;
+}
+// Reject unwalkable surface normals here.
+if (!IsWalkable(Hit))
 {
-// We may have multiple initial hits, and want to choose the one with the normal most opposed to our movement.
-const float NormalDotDelta = (TestHit.ImpactNormal | Delta);
-if (NormalDotDelta < BlockingHitNormalDotDelta)
+// Reject if normal opposes movement direction
+const bool bNormalTowardsMe = (Delta | Hit.ImpactNormal) < 0.f;
+if (bNormalTowardsMe)
 {
-BlockingHitNormalDotDelta = NormalDotDelta;
-BlockingHitIndex = HitIdx;
-}
+ensure(false);
+return false;
 }
-else if (BlockingHitIndex == INDEX_NONE)
+// Also reject if we would end up being higher than our starting location by stepping down.
+// It's fine to step down onto an unwalkable normal below us, we will just slide off. Rejecting those moves would prevent us from being able to walk off the edge.
+if (Hit.Location.Z > OldLocation.Z)
 {
-// First non-overlapping blocking hit should be used, if an overlapping hit was not.
-// This should be the only non-overlapping blocking hit, and last in the results.
-BlockingHitIndex = HitIdx;
-break;
-}
+ensure(false);
+return false;
 }
 }
-else if (bGatherOverlaps)
+// Reject moves where the downward sweep hit something very close to the edge of the capsule. This maintains consistency with FindFloor as well.
+if (!IsWithinEdgeTolerance(Hit.Location, Hit.ImpactPoint, PawnRadius))
 {
-UPrimitiveComponent* OverlapComponent = TestHit.Component.Get();
-// Overlaps are speculative, this flag will be chcked when applying outputs.
-if (OverlapComponent && (true || bForceGatherOverlaps))
+ensure(false);
+return false;
+}
+// Don't step up onto invalid surfaces if traveling higher.
+if (DeltaZ > 0.f && !CanStepUp(Hit, Output))
 {
-if (!FUpdatedComponentAsyncInput::ShouldIgnoreOverlapResult(Input.World, nullptr, *UpdatedComponent, TestHit.GetActor(), *OverlapComponent ))
+ensure(false);
+return false;
+}
+// See if we can validate the floor as a result of this step down. In almost all cases this should succeed, and we can avoid computing the floor outside this method.
+if (OutStepDownResult != NULL)
 {
-// don't process touch events after initial blocking hits
-if (BlockingHitIndex >= 0 && TestHit.Time > Hits[BlockingHitIndex].Time)
+FindFloor(UpdatedComponentInput->GetPosition(), StepDownResult.FloorResult, false, Output, &Hit);
+// Reject unwalkable normals if we end up higher than our initial height.
+// It's fine to walk down onto an unwalkable surface, don't reject those moves.
+if (Hit.Location.Z > OldLocation.Z)
 {
-break;
-}
-if (FirstNonInitialOverlapIdx == INDEX_NONE && TestHit.Time > 0.f)
+// We should reject the floor result if we are trying to step up an actual step where we are not able to perch (this is rare).
+// In those cases we should instead abort the step up and try to slide along the stair.
+if (!StepDownResult.FloorResult.bBlockingHit && StepSideZ < CharacterMovementConstants::MAX_STEP_SIDE_Z)
 {
-// We are about to add the first non-initial overlap.
-FirstNonInitialOverlapIdx = PendingOverlaps.Num();
+//ScopedStepUpMovement.RevertMove();
+ensure(false);
+return false;
 }
-Output.UpdatedComponentOutput.AddUniqueSpeculativeOverlap(FOverlapInfo(TestHit));
 }
+StepDownResult.bComputedFloor = true;
 }
 }
+// Remember a step reached without obstruction on the way up and forward, with its walkable top on the stepped component.
+if (bUseStepUpCache)
+{
+const float StepHeight = Hit.ImpactPoint.Z - PawnFloorPointZ;
+if (!SweepUpHit.bBlockingHit && bForwardClear && Hit.IsValidBlockingHit() && Hit.GetComponent() == InHit.GetComponent() && IsWalkable(Hit) && StepHeight > 0.f)
+{
+Output.StepUpCacheComponent = InHit.GetComponent();
+Output.StepUpCacheNormal = InHit.ImpactNormal;
+Output.StepUpCacheHeight = StepHeight;
+Output.StepUpCacheTopNormal = Hit.ImpactNormal;
 }
-// Update blocking hit, if there was a valid one.
-if (BlockingHitIndex >= 0)
+else
 {
-BlockingHit = Hits[BlockingHitIndex];
-bFilledHitResult = true;
+Output.StepUpCacheComponent = nullptr;
 }
 }
-// Update NewLocation based on the hit result
-if (!BlockingHit.bBlockingHit)
+// Copy step down result.
+if (OutStepDownResult != NULL)
 {
-NewLocation = TraceEnd;
+*OutStepDownResult = StepDownResult;
 }
-else
+// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments.
+Output.bJustTeleported |= !bMaintainHorizontalGroundVelocity;
+return true;
+}
+bool FCharacterMovementComponentAsyncInput::CanWalkOffLedges(FCharacterMovementComponentAsyncOutput& Output) const
 {
-check(bFilledHitResult);
-NewLocation = TraceStart + (BlockingHit.Time * (TraceEnd - TraceStart));
-// Sanity check
-const FVector ToNewLocation = (NewLocation - TraceStart);
-if (ToNewLocation.SizeSquared() <= MinMovementDistSq)
+if (!bCanWalkOffLedgesWhenCrouching && Output.bIsCrouched)
 {
-// We don't want really small movements to put us on or inside a surface.
-NewLocation = TraceStart;
-BlockingHit.Time = 0.f;
-// Remove any pending overlaps after this point, we are not going as far as we swept.
-if (FirstNonInitialOverlapIdx != INDEX_NONE)
+return false;
+}
+return bCanWalkOffLedges;
+}
+FVector FCharacterMovementComponentAsyncInput::GetLedgeMove(const FVector& OldLocation, const FVector& Delta, const FVector& GravDir, FCharacterMovementComponentAsyncOutput& Output) const
 {
-const bool bAllowShrinking = false;
-PendingOverlaps.SetNum(FirstNonInitialOverlapIdx, bAllowShrinking);
+if (!bHasValidData || Delta.IsZero())
+{
+return FVector::ZeroVector;
 }
+FVector SideDir(Delta.Y, -1.f * Delta.X, 0.f);
+// Walkway edges are mostly straight, so the side found by a nearby probe on the same floor and heading is still the one to take.
+// A wrong cached side is caught by the floor check after the side step, which then clears the cache.
+const FVector ApproachDir = CharacterMovementAsyncMath::GetSafeNormal2D(Delta);
+const bool bUseLedgeProbeCache = (CharacterMovementAsyncCVars::LedgeProbeCache != 0) && (Output.NewMovementBase != nullptr);
+if (bUseLedgeProbeCache && Output.LedgeProbeComponent == Output.NewMovementBase && (ApproachDir | Output.LedgeProbeDirection) >= 0.98f
+&& FVector::DistSquared(OldLocation, Output.LedgeProbeLocation) <= FMath::Square(CharacterMovementAsyncCVars::LedgeProbeCacheTolerance))
+{
+FCharacterMovementAsyncBaseTable::FEntry FloorEntry;
+if (FindMovementBase(*this, Output, FloorEntry) && !FloorEntry.HasMoved())
+{
+INC_DWORD_STAT(STAT_AsyncCharacterMovementLedgeProbeCacheHits);
+return SideDir * Output.LedgeProbeSide;
 }
 }
-bIncludesOverlapsAtEnd = AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale);
+int8 Side = 0;
+if (CheckLedgeDirection(OldLocation, SideDir, GravDir, Output))
+{
+Side = 1;
 }
-else if (DeltaSizeSq > 0.f)
+else if (CheckLedgeDirection(OldLocation, -SideDir, GravDir, Output))
 {
-// apply move delta even if components has collisions disabled
-NewLocation += Delta;
-bIncludesOverlapsAtEnd = false;
+Side = -1;
 }
-else if (DeltaSizeSq == 0.f && bIsQueryCollisionEnabled)
+if (bUseLedgeProbeCache)
 {
-bIncludesOverlapsAtEnd = AreSymmetricRotations(InitialRotationQuat, NewRotationQuat, Input.UpdatedComponentInput->Scale);
-bRotationOnly = true;
+// A failed probe is not cached. Something may free a side nearby, and a character without one stops or falls anyway.
+Output.LedgeProbeComponent = (Side != 0) ? Output.NewMovementBase : nullptr;
+Output.LedgeProbeDirection = ApproachDir;
+Output.LedgeProbeLocation = OldLocation;
+Output.LedgeProbeSide = Side;
+INC_DWORD_STAT(STAT_AsyncCharacterMovementLedgeProbeCacheMisses);
 }
-SetPosition(NewLocation);
-SetRotation(NewRotationQuat);
-bMoved = true;
+return SideDir * Side;
 }
-// Handle blocking hit notifications. Avoid if pending kill (which could happen after overlaps).
-const bool bAllowHitDispatch = !BlockingHit.bStartPenetrating || !(MoveFlags & MOVECOMP_DisableBlockingOverlapDispatch);
-if (BlockingHit.bBlockingHit && bAllowHitDispatch/* && IsValid(this)*/)
+bool FCharacterMovementComponentAsyncInput::CheckLedgeDirection(const FVector& OldLocation, const FVector& SideStep, const FVector& GravDir, FCharacterMovementComponentAsyncOutput& Output) const
 {
-check(bFilledHitResult);
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, CheckLedgeDirection);
+const FVector SideDest = OldLocation + SideStep;
+const FCollisionShape CapsuleShape = GetPawnCapsuleCollisionShape(EShrinkCapsuleExtent::SHRINK_None, Output);
+FHitResult Result(1.f);
+{
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, CheckLedgeDirection, Sweep);
+RunCapturedSceneQuery(OldLocation, SideDest, &Result, nullptr, [&]() { return World->SweepSingleByChannel(Result, OldLocation, SideDest, FQuat::Identity, CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams); });
 }
-// copy to optional output param
-if (OutHit)
+if (!Result.bBlockingHit || IsWalkable(Result))
 {
-if (bFilledHitResult)
+if (!Result.bBlockingHit)
 {
-*OutHit = BlockingHit;
+ASYNC_CHARACTER_MOVEMENT_QUERY_SCOPE(Output, CheckLedgeDirection, Sweep);
+const FVector LedgeTraceEnd = SideDest + GravDir * (MaxStepHeight + LedgeCheckThreshold);
+RunCapturedSceneQuery(SideDest, LedgeTraceEnd, &Result, nullptr, [&]() { return World->SweepSingleByChannel(Result, SideDest, LedgeTraceEnd, FQuat::Identity, CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams); });
 }
-else
+if ((Result.Time < 1.f) && IsWalkable(Result))
 {
-OutHit->Init(TraceStart, TraceEnd);
+return true;
 }
 }
-return bMoved;
+return false;
 }
-bool FUpdatedComponentAsyncInput::AreSymmetricRotations(const FQuat& A, const FQuat& B, const FVector& Scale3D) const
+FVector FCharacterMovementComponentAsyncInput::GetPawnCapsuleExtent(const EShrinkCapsuleExtent ShrinkMode, const float CustomShrinkAmount, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (Scale3D.X != Scale3D.Y)
+float Radius = Output.ScaledCapsuleRadius;
+float HalfHeight = Output.ScaledCapsuleHalfHeight;
+FVector CapsuleExtent(Radius, Radius, HalfHeight);
+float RadiusEpsilon = 0.f;
+float HeightEpsilon = 0.f;
+switch (ShrinkMode)
 {
-return false;
+case EShrinkCapsuleExtent::SHRINK_None:
+return CapsuleExtent;
+case EShrinkCapsuleExtent::SHRINK_RadiusCustom:
+RadiusEpsilon = CustomShrinkAmount;
+break;
+case EShrinkCapsuleExtent::SHRINK_HeightCustom:
+HeightEpsilon = CustomShrinkAmount;
+break;
+case EShrinkCapsuleExtent::SHRINK_AllCustom:
+RadiusEpsilon = CustomShrinkAmount;
+HeightEpsilon = CustomShrinkAmount;
+break;
+default:
+ensure(false);
+break;
 }
-const FVector AUp = A.GetAxisZ();
-const FVector BUp = B.GetAxisZ();
-return AUp.Equals(BUp);
+// Don't shrink to zero extent.
+const float MinExtent = UE_KINDA_SMALL_NUMBER * 10.f;
+CapsuleExtent.X = FMath::Max(CapsuleExtent.X - RadiusEpsilon, MinExtent);
+CapsuleExtent.Y = CapsuleExtent.X;
+CapsuleExtent.Z = FMath::Max(CapsuleExtent.Z - HeightEpsilon, MinExtent);
+return CapsuleExtent;
 }
-void FUpdatedComponentAsyncInput::PullBackHit(FHitResult& Hit, const FVector& Start, const FVector& End, const float Dist)
+FCollisionShape FCharacterMovementComponentAsyncInput::GetPawnCapsuleCollisionShape(const EShrinkCapsuleExtent ShrinkMode, FCharacterMovementComponentAsyncOutput& Output, const float CustomShrinkAmount) const
 {
-const float DesiredTimeBack = FMath::Clamp(0.1f, 0.1f / Dist, 1.f / Dist) + 0.001f;
-Hit.Time = FMath::Clamp(Hit.Time - DesiredTimeBack, 0.f, 1.f);
+FVector Extent = GetPawnCapsuleExtent(ShrinkMode, CustomShrinkAmount, Output);
+return FCollisionShape::MakeCapsule(Extent);
 }
-bool FUpdatedComponentAsyncInput::ShouldCheckOverlapFlagToQueueOverlaps(const UPrimitiveComponent& ThisComponent)
+void FCharacterMovementComponentAsyncInput::TwoWallAdjust(FVector& OutDelta, const FHitResult& Hit, const FVector& OldHitNormal, FCharacterMovementComponentAsyncOutput& Output) const
+{
+FVector Delta = OutDelta;
+const FVector HitNormal = Hit.Normal;
+if ((OldHitNormal | HitNormal) <= 0.f) //90 or less corner, so use cross product for direction
 {
-const FScopedMovementUpdate* CurrentUpdate = ThisComponent.GetCurrentScopedMovement();
-if (CurrentUpdate)
+const FVector DesiredDir = Delta;
+FVector NewDir = (HitNormal ^ OldHitNormal);
+NewDir = CharacterMovementAsyncMath::GetSafeNormal(NewDir);
+Delta = (Delta | NewDir) * (1.f - Hit.Time) * NewDir;
+if ((DesiredDir | Delta) < 0.f)
 {
-return CurrentUpdate->RequiresOverlapsEventFlag();
+Delta = -1.f * Delta;
 }
-// By default we require the GetGenerateOverlapEvents() to queue up overlaps, since we require it to trigger events.
-return true;
 }
-bool FUpdatedComponentAsyncInput::ShouldIgnoreHitResult(const UWorld* InWorld, FHitResult const& TestHit, FVector const& MovementDirDenormalized, const AActor* MovingActor, EMoveComponentFlags MoveFlags)
-{
-if (TestHit.bBlockingHit)
-{
-// check "ignore bases" functionality
-if ((MoveFlags & MOVECOMP_IgnoreBases) && false/*MovingActor*/)//we let overlap components go through because their overlap is still needed and will cause beginOverlap/endOverlap events
+else //adjust to new wall
 {
-// ignore if there's a base relationship between moving actor and hit actor
-AActor const* const HitActor = TestHit.GetActor();
-if (HitActor)
+const FVector DesiredDir = Delta;
+Delta = ComputeSlideVector(Delta, 1.f - Hit.Time, HitNormal, Hit, Output);
+if ((Delta | DesiredDir) <= 0.f)
 {
-if (MovingActor->IsBasedOnActor(HitActor) || HitActor->IsBasedOnActor(MovingActor))
+Delta = FVector::ZeroVector;
+}
+else if (FMath::Abs((HitNormal | OldHitNormal) - 1.f) < UE_KINDA_SMALL_NUMBER)
 {
-return true;
+// we hit the same wall again even after adjusting to move along it the first time
+// nudge away from it (this can happen due to precision issues)
+Delta += HitNormal * 0.01f;
 }
 }
+OutDelta = Delta;
 }
-// If we started penetrating, we may want to ignore it if we are moving out of penetration.
-// This helps prevent getting stuck in walls.
-if ((TestHit.Distance < PrimitiveComponentCVars::HitDistanceToleranceCVar || TestHit.bStartPenetrating) && !(MoveFlags & MOVECOMP_NeverIgnoreBlockingOverlaps))
+void FCharacterMovementComponentAsyncInput::RevertMove(const FVector& OldLocation, UPrimitiveComponent* OldBase, const FVector& PreviousBaseLocation, const FFindFloorResult& OldFloor, bool bFailMove, FCharacterMovementComponentAsyncOutput& Output) const
 {
-const float DotTolerance = PrimitiveComponentCVars::InitialOverlapToleranceCVar;
-// Dot product of movement direction against 'exit' direction
-const FVector MovementDir = MovementDirDenormalized.GetSafeNormal();
-const float MoveDot = (TestHit.ImpactNormal | MovementDir);
-const bool bMovingOut = MoveDot > DotTolerance;
-// If we are moving out, ignore this result!
-if (bMovingOut)
+UpdatedComponentInput->SetPosition(OldLocation);
+Output.bJustTeleported = false;
+// Base transforms are fixed for the whole tick on the physics thread, so the previous base cannot have moved since the move started.
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+if (OldBase != nullptr)
 {
-return true;
+Output.CurrentFloor = OldFloor;
+Output.NewMovementBase = OldBase;
+Output.NewMovementBaseOwner = OldFloor.HitResult.GetActor();
 }
+else
+{
+Output.NewMovementBase = nullptr;
+Output.NewMovementBaseOwner = nullptr;
 }
+if (bFailMove)
+{
+// end movement now
+Output.Velocity = FVector::ZeroVector;
+Output.Acceleration = FVector::ZeroVector;
 }
-return false;
 }
-bool FUpdatedComponentAsyncInput::ShouldIgnoreOverlapResult(const UWorld* World, const AActor* ThisActor, const UPrimitiveComponent& ThisComponent, const AActor* OtherActor, const UPrimitiveComponent& OtherComponent)
-{
-if (&ThisComponent == &OtherComponent)
+ETeleportType FCharacterMovementComponentAsyncInput::GetTeleportType(FCharacterMovementComponentAsyncOutput& Output) const
 {
-return true;
+// ensuring in inputs on networek large correction
+return Output.bJustTeleported  ? ETeleportType::TeleportPhysics : ETeleportType::None;
 }
-// We're passing in null for ThisActor as we don't have that data, ensuring owner exists when filling inputs anyway.
-if (/*!ThisActor || */!OtherActor)
+void FCharacterMovementComponentAsyncInput::HandleWalkingOffLedge(const FVector& PreviousFloorImpactNormal, const FVector& PreviousFloorContactNormal, const FVector& PreviousLocation, float TimeDelta) const
 {
-return true;
+// ACharacter::OnWalkingOffLedge is a game thread event, the falling transition itself is handled by StartFalling.
 }
-// Cannot read this on PT, check when applying speculative overlaps.
-if (!World)
+bool FCharacterMovementComponentAsyncInput::ShouldCatchAir(const FFindFloorResult& OldFloor, const FFindFloorResult& NewFloor) const
 {
-return true;
-}
 return false;
 }
-void FUpdatedComponentAsyncInput::SetPosition(const FVector& InPosition) const
-{
-if (PhysicsHandle->GetPhysicsThreadAPI() == nullptr)
+void FCharacterMovementComponentAsyncInput::StartFalling(int32 Iterations, float remainingTime, float timeTick, const FVector& Delta, const FVector& subLoc, FCharacterMovementComponentAsyncOutput& Output) const
 {
-return;
-}
-if (auto Rigid = PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle())
+// start falling 
+const float DesiredDist = Delta.Size();
+const float ActualDist = (UpdatedComponentInput->GetPosition() - subLoc).Size2D();
+remainingTime = (DesiredDist < UE_KINDA_SMALL_NUMBER)
+? 0.f
+: remainingTime + timeTick * (1.f - FMath::Min(1.f, ActualDist / DesiredDist));
+if (IsMovingOnGround(Output))
 {
-PhysicsHandle->GetPhysicsThreadAPI()->SetX(InPosition);
-Rigid->SetP(InPosition); 
-// Kinematics do not normal marshall changes back to game thread, mark dirty to ensure game thread
-// gets change in position.
-if (Rigid->ObjectState() == Chaos::EObjectStateType::Kinematic)
+// Probably don't need this hack with async physics.
+// This is to catch cases where the first frame of PIE is executed, and the
+// level is not yet visible. In those cases, the player will fall out of the
+// world... So, don't set MOVE_Falling straight away.
+if (!GIsEditor || (World->HasBegunPlay() && (World->GetTimeSeconds() >= 1.f)))
 {
-PhysicsHandle->GetSolver<Chaos::FPBDRigidsSolver>()->GetParticles().MarkTransientDirtyParticle(Rigid);
-}
+SetMovementMode(MOVE_Falling, Output); //default behavior if script didn't change physics
 }
 else
 {
-ensure(false);
+// Make sure that the floor check code continues processing during this delay.
+Output.bForceNextFloorCheck = true;
 }
 }
-FVector FUpdatedComponentAsyncInput::GetPosition() const
+StartNewPhysics(remainingTime, Iterations, Output);
+}
+void FCharacterMovementComponentAsyncInput::SetBaseFromFloor(const FFindFloorResult& FloorResult, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (PhysicsHandle && PhysicsHandle->GetPhysicsThreadAPI())
+if (FloorResult.IsWalkableFloor())
 {
-return PhysicsHandle->GetPhysicsThreadAPI()->X();
+//SetBase(FloorResult.HitResult.GetComponent(), FloorResult.HitResult.BoneName);
+Output.NewMovementBase = FloorResult.HitResult.GetComponent();
+Output.NewMovementBaseOwner = FloorResult.HitResult.GetActor();
 }
-return FVector::ZeroVector;
+else
+{
+//SetBase(nullptr);
+Output.NewMovementBase = nullptr;
+Output.NewMovementBaseOwner = nullptr;
 }
-void FUpdatedComponentAsyncInput::SetRotation(const FQuat& InRotation) const
+}
+void FCharacterMovementComponentAsyncInput::AdjustFloorHeight(FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (PhysicsHandle->GetPhysicsThreadAPI() == nullptr)
+FFindFloorResult& CurrentFloor = Output.CurrentFloor;
+// If we have a floor check that hasn't hit anything, don't adjust height.
+if (!CurrentFloor.IsWalkableFloor())
 {
 return;
 }
-if (auto Rigid = PhysicsHandle->GetHandle_LowLevel()->CastToRigidParticle())
+float OldFloorDist = CurrentFloor.FloorDist;
+if (CurrentFloor.bLineTrace)
 {
-PhysicsHandle->GetPhysicsThreadAPI()->SetR(InRotation);
-Rigid->SetQ(InRotation); 
-if (Rigid->ObjectState() == Chaos::EObjectStateType::Kinematic)
+if (OldFloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST && CurrentFloor.LineDist >= UCharacterMovementComponent::MIN_FLOOR_DIST)
 {
-PhysicsHandle->GetSolver<Chaos::FPBDRigidsSolver>()->GetParticles().MarkTransientDirtyParticle(Rigid);
-}
+return;
 }
 else
 {
-ensure(false);
+// Falling back to a line trace means the sweep was unwalkable (or in penetration). Use the line distance for the vertical adjustment.
+OldFloorDist = CurrentFloor.LineDist;
 }
 }
-FQuat FUpdatedComponentAsyncInput::GetRotation() const
+// Move up or down to maintain floor height.
+if (OldFloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST || OldFloorDist > UCharacterMovementComponent::MAX_FLOOR_DIST)
 {
-if (PhysicsHandle && PhysicsHandle->GetPhysicsThreadAPI())
+FHitResult AdjustHit(1.f);
+const float InitialZ = UpdatedComponentInput->GetPosition().Z;
+const float AvgFloorDist = (UCharacterMovementComponent::MIN_FLOOR_DIST + UCharacterMovementComponent::MAX_FLOOR_DIST) * 0.5f;
+const float MoveDist = AvgFloorDist - OldFloorDist;
+SafeMoveUpdatedComponent(FVector(0.f, 0.f, MoveDist), UpdatedComponentInput->GetRotation(), true, AdjustHit, Output);
+if (!AdjustHit.IsValidBlockingHit())
 {
-return PhysicsHandle->GetPhysicsThreadAPI()->R();
-}
-return FQuat::Identity;
+CurrentFloor.FloorDist += MoveDist;
 }
-float FCharacterMovementComponentAsyncInput::SlideAlongSurface(const FVector& Delta, float Time, const FVector& InNormal, FHitResult& Hit, bool bHandleImpact, FCharacterMovementComponentAsyncOutput& Output) const 
-{
-if (!Hit.bBlockingHit)
+else if (MoveDist > 0.f)
 {
-return 0.f;
+const float CurrentZ = UpdatedComponentInput->GetPosition().Z;
+CurrentFloor.FloorDist += CurrentZ - InitialZ;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
 }
-FVector Normal(InNormal);
-if (IsMovingOnGround(Output))
-{
-// We don't want to be pushed up an unwalkable surface.
-if (Normal.Z > 0.f)
+else
 {
-if (!IsWalkable(Hit))
+checkSlow(MoveDist < 0.f);
+const float CurrentZ = UpdatedComponentInput->GetPosition().Z;
+CurrentFloor.FloorDist = CurrentZ - AdjustHit.Location.Z;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Floor);
+if (IsWalkable(AdjustHit))
 {
-Normal = Normal.GetSafeNormal2D();
+CurrentFloor.SetFromSweep(AdjustHit, CurrentFloor.FloorDist, true);
 }
 }
-else if (Normal.Z < -UE_KINDA_SMALL_NUMBER)
-{
-// Don't push down into the floor when the impact is on the upper portion of the capsule.
-if (Output.CurrentFloor.FloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST && Output.CurrentFloor.bBlockingHit)
-{
-const FVector FloorNormal = Output.CurrentFloor.HitResult.Normal;
-const bool bFloorOpposedToMovement = (Delta | FloorNormal) < 0.f && (FloorNormal.Z < 1.f - UE_DELTA);
-if (bFloorOpposedToMovement)
+// FloorDist now describes the adjusted location.
+Output.CachedFloorLocation = UpdatedComponentInput->GetPosition();
+// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments.
+// Also avoid it if we moved out of penetration
+Output.bJustTeleported |= !bMaintainHorizontalGroundVelocity || (OldFloorDist < 0.f);
+// If something caused us to adjust our height (especially a depentration) we should ensure another check next frame or we will keep a stale result.
+if (CharacterInput->LocalRole != ROLE_SimulatedProxy)
 {
-Normal = FloorNormal;
-}
-Normal = Normal.GetSafeNormal2D();
-}
+Output.bForceNextFloorCheck = true;
 }
 }
-return MoveComponent_SlideAlongSurface(Delta, Time, Normal, Hit, Output, bHandleImpact);
 }
-FVector FCharacterMovementComponentAsyncInput::ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+bool FCharacterMovementComponentAsyncInput::ShouldComputePerchResult(const FHitResult& InHit, FCharacterMovementComponentAsyncOutput& Output, bool bCheckRadius) const
 {
-FVector Result = MoveComponent_ComputeSlideVector(Delta, Time, Normal, Hit, Output);
-// prevent boosting up slopes
-if (IsFalling(Output))
+if (!InHit.IsValidBlockingHit())
 {
-Result = HandleSlopeBoosting(Result, Delta, Time, Normal, Hit, Output);
-}
-return Result;
+return false;
 }
-FVector FCharacterMovementComponentAsyncInput::HandleSlopeBoosting(const FVector& SlideResult, const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
-{
-FVector Result = SlideResult;
-if (Result.Z > 0.f)
-{
-// Don't move any higher than we originally intended.
-const float ZLimit = Delta.Z * Time;
-if (Result.Z - ZLimit > UE_KINDA_SMALL_NUMBER)
-{
-if (ZLimit > 0.f)
+// Don't try to perch if the edge radius is very small.
+if (GetPerchRadiusThreshold() <= UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE)
 {
-// Rescale the entire vector (not just the Z component) otherwise we change the direction and likely head right back into the impact.
-const float UpPercent = ZLimit / Result.Z;
-Result *= UpPercent;
+return false;
 }
-else
+if (bCheckRadius)
 {
-// We were heading down but were going to deflect upwards. Just make the deflection horizontal.
-Result = FVector::ZeroVector;
-}
-// Make remaining portion of original result horizontal and parallel to impact normal.
-const FVector RemainderXY = (SlideResult - Result) * FVector(1.f, 1.f, 0.f);
-const FVector NormalXY = Normal.GetSafeNormal2D();
-const FVector Adjust = MoveComponent_ComputeSlideVector(RemainderXY, 1.f, NormalXY, Hit, Output); //Super::ComputeSlideVector(RemainderXY, 1.f, NormalXY, Hit);
-Result += Adjust;
-}
+const float DistFromCenterSq = (InHit.ImpactPoint - InHit.Location).SizeSquared2D();
+const float StandOnEdgeRadius = GetValidPerchRadius(Output);
+if (DistFromCenterSq <= FMath::Square(StandOnEdgeRadius))
+{
+// Already within perch radius.
+return false;
 }
-return Result;
 }
-void FCharacterMovementComponentAsyncInput::OnCharacterStuckInGeometry(const FHitResult* Hit, FCharacterMovementComponentAsyncOutput& Output) const 
-{
-// Don't update velocity based on our (failed) change in position this update since we're stuck.
-Output.bJustTeleported = true;
+return true;
 }
-bool FCharacterMovementComponentAsyncInput::CanStepUp(const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+bool FCharacterMovementComponentAsyncInput::ComputePerchResult(const float TestRadius, const FHitResult& InHit, const float InMaxFloorDist, FFindFloorResult& OutPerchFloorResult, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (!Hit.IsValidBlockingHit() || !bHasValidData || Output.MovementMode == MOVE_Falling)
+ASYNC_CHARACTER_MOVEMENT_QUERY_SITE_SCOPE(Output, ComputePerchResult);
+if (InMaxFloorDist <= 0.f)
 {
 return false;
 }
-// No component for "fake" hits when we are on a known good base.
-const UPrimitiveComponent* HitComponent = Hit.Component.Get();
-if (!HitComponent)
+// Sweep further than actual requested distance, because a reduced capsule radius means we could miss some hits that the normal radius would contact.
+const float PawnRadius = Output.ScaledCapsuleRadius;
+const float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
+//CharacterOwner->GetCapsuleComponent()->GetScaledCapsuleSize(PawnRadius, PawnHalfHeight);
+const float InHitAboveBase = FMath::Max(0.f, InHit.ImpactPoint.Z - (InHit.Location.Z - PawnHalfHeight));
+const float PerchLineDist = FMath::Max(0.f, InMaxFloorDist - InHitAboveBase);
+const float PerchSweepDist = FMath::Max(0.f, InMaxFloorDist);
+const float ActualSweepDist = PerchSweepDist + PawnRadius;
+ComputeFloorDist(InHit.Location, PerchLineDist, ActualSweepDist, OutPerchFloorResult, TestRadius, Output);
+if (!OutPerchFloorResult.IsWalkableFloor())
 {
-return true;
+return false;
 }
-// No actor for "fake" hits when we are on a known good base.
-const AActor* HitActor = Hit.GetActor();
-if (!HitActor)
+else if (InHitAboveBase + OutPerchFloorResult.FloorDist > InMaxFloorDist)
 {
-return true;
+// Hit something past max distance
+OutPerchFloorResult.bWalkableFloor = false;
+return false;
 }
 return true;
 }
-bool FCharacterMovementComponentAsyncInput::StepUp(const FVector& GravDir, const FVector& Delta, const FHitResult& InHit, FCharacterMovementComponentAsyncOutput& Output, FStepDownResult* OutStepDownResult) const
+float FCharacterMovementComponentAsyncInput::GetPerchRadiusThreshold() const
 {
-if (!CanStepUp(InHit, Output) || MaxStepHeight <= 0.f)
+// Don't allow negative values.
+return FMath::Max(0.f, PerchRadiusThreshold);
+}
+float FCharacterMovementComponentAsyncInput::GetValidPerchRadius(const FCharacterMovementComponentAsyncOutput& Output) const
 {
-return false;
+const float PawnRadius = Output.ScaledCapsuleRadius;
+return FMath::Clamp(PawnRadius - GetPerchRadiusThreshold(), 0.11f, PawnRadius);
 }
-const FVector OldLocation = UpdatedComponentInput->GetPosition();
-float PawnRadius = Output.ScaledCapsuleRadius;
-float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
-// Don't bother stepping up if top of capsule is hitting something.
-const float InitialImpactZ = InHit.ImpactPoint.Z;
-if (InitialImpactZ > OldLocation.Z + (PawnHalfHeight - PawnRadius))
+bool FCharacterMovementComponentAsyncInput::CheckFall(const FFindFloorResult& OldFloor, const FHitResult& Hit, const FVector& Delta, const FVector& OldLocation, float remainingTime, float timeTick, int32 Iterations, bool bMustJump, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (!bHasValidData)
 {
 return false;
 }
-if (GravDir.IsZero())
+if (bMustJump || CanWalkOffLedges(Output))
 {
+HandleWalkingOffLedge(OldFloor.HitResult.ImpactNormal, OldFloor.HitResult.Normal, OldLocation, timeTick);
+if (IsMovingOnGround(Output))
+{
+// If still walking, then fall. If not, assume the user set a different mode they want to keep.
+StartFalling(Iterations, remainingTime, timeTick, Delta, OldLocation, Output);
+}
+return true;
+}
 return false;
 }
-FFindFloorResult& CurrentFloor = Output.CurrentFloor;
-//float MaxStepHeight = MaxStepHeight;
-// Gravity should be a normalized direction
-ensure(GravDir.IsNormalized());
-float StepTravelUpHeight = MaxStepHeight;
-float StepTravelDownHeight = StepTravelUpHeight;
-const float StepSideZ = -1.f * FVector::DotProduct(InHit.ImpactNormal, GravDir);
-float PawnInitialFloorBaseZ = OldLocation.Z - PawnHalfHeight;
-float PawnFloorPointZ = PawnInitialFloorBaseZ;
-if (IsMovingOnGround(Output) && CurrentFloor.IsWalkableFloor())
+FVector FCharacterMovementComponentAsyncInput::GetFallingLateralAcceleration(float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Since we float a variable amount off the floor, we need to enforce max step height off the actual point of impact with the floor.
-const float FloorDist = FMath::Max(0.f, CurrentFloor.GetDistanceToFloor());
-PawnInitialFloorBaseZ -= FloorDist;
-StepTravelUpHeight = FMath::Max(StepTravelUpHeight - FloorDist, 0.f);
-StepTravelDownHeight = (MaxStepHeight + UCharacterMovementComponent::MAX_FLOOR_DIST * 2.f);
-const bool bHitVerticalFace = !IsWithinEdgeTolerance(InHit.Location, InHit.ImpactPoint, PawnRadius);
-if (!CurrentFloor.bLineTrace && !bHitVerticalFace)
+// No acceleration in Z
+FVector FallAcceleration = FVector(Output.Acceleration.X, Output.Acceleration.Y, 0.f);
+// bound acceleration, falling object has minimal ability to impact acceleration
+if (!RootMotion.bHasAnimRootMotion && FallAcceleration.SizeSquared2D() > 0.f)
 {
-PawnFloorPointZ = CurrentFloor.HitResult.ImpactPoint.Z;
+FallAcceleration = GetAirControl(DeltaTime, AirControl, FallAcceleration, Output);
+FallAcceleration = CharacterMovementAsyncMath::GetClampedToMaxSize(FallAcceleration, MaxAcceleration);
 }
-else
+return FallAcceleration;
+}
+float FCharacterMovementComponentAsyncInput::BoostAirControl(float DeltaTime, float TickAirControl, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Base floor point is the base of the capsule moved down by how far we are hovering over the surface we are hitting.
-PawnFloorPointZ -= CurrentFloor.FloorDist;
+// Allow a burst of initial acceleration
+if (AirControlBoostMultiplier > 0.f && Output.Velocity.SizeSquared2D() < FMath::Square(AirControlBoostVelocityThreshold))
+{
+TickAirControl = FMath::Min(1.f, AirControlBoostMultiplier * TickAirControl);
 }
+return TickAirControl;
 }
-// Don't step up if the impact is below us, accounting for distance from floor.
-if (InitialImpactZ <= PawnInitialFloorBaseZ)
+bool FCharacterMovementComponentAsyncInput::ShouldLimitAirControl(float DeltaTime, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
 {
-return false;
+return (FallAcceleration.SizeSquared2D() > 0.f);
 }
-// step up - treat as vertical wall
-FHitResult SweepUpHit(1.f);
-const FQuat PawnRotation = UpdatedComponentInput->GetRotation();
-MoveUpdatedComponent(-GravDir * StepTravelUpHeight, PawnRotation, true, Output, &SweepUpHit);
-if (SweepUpHit.bStartPenetrating)
+FVector FCharacterMovementComponentAsyncInput::LimitAirControl(float DeltaTime, const FVector& FallAcceleration, const FHitResult& HitResult, bool bCheckForValidLandingSpot, FCharacterMovementComponentAsyncOutput& Output) const
 {
-ensure(false);
-return false;
-}
-FHitResult Hit(1.f);
-MoveUpdatedComponent(Delta, PawnRotation, true, Output, &Hit);
-// Check result of forward movement
-if (Hit.bBlockingHit)
+FVector Result(FallAcceleration);
+if (HitResult.IsValidBlockingHit() && HitResult.Normal.Z > CharacterMovementConstants::VERTICAL_SLOPE_NORMAL_Z)
 {
-if (Hit.bStartPenetrating)
+if (!bCheckForValidLandingSpot || !IsValidLandingSpot(HitResult.Location, HitResult, Output))
 {
-ensure(false);
-return false;
-}
-// If we hit something above us and also something ahead of us, we should notify about the upward hit as well.
-// The forward hit will be handled later (in the bSteppedOver case below).
-// In the case of hitting something above but not forward, we are not blocked from moving so we don't need the notification.
-if (SweepUpHit.bBlockingHit && Hit.bBlockingHit)
+// If acceleration is into the wall, limit contribution.
+if (FVector::DotProduct(FallAcceleration, HitResult.Normal) < 0.f)
 {
-HandleImpact(SweepUpHit, Output);
+// Allow movement parallel to the wall, but not into it because that may push us up.
+const FVector Normal2D = CharacterMovementAsyncMath::GetSafeNormal2D(HitResult.Normal);
+Result = CharacterMovementAsyncMath::VectorPlaneProject(FallAcceleration, Normal2D);
 }
-// pawn ran into a wall
-HandleImpact(Hit, Output);
-if (IsFalling(Output))
-{
-return true;
 }
-// adjust and try again
-const float ForwardHitTime = Hit.Time;
-const float ForwardSlideAmount = SlideAlongSurface(Delta, 1.f - Hit.Time, Hit.Normal, Hit, true, Output);
-if (IsFalling(Output))
-{
-ensure(false);
-//ScopedStepUpMovement.RevertMove();
-return false;
 }
-// If both the forward hit and the deflection got us nowhere, there is no point in this step up.
-if (ForwardHitTime == 0.f && ForwardSlideAmount == 0.f)
+else if (HitResult.bStartPenetrating)
 {
-ensure(false);
-return false;
+// Allow movement out of penetration.
+return (FVector::DotProduct(Result, HitResult.Normal) > 0.f ? Result : FVector::ZeroVector);
 }
+return Result;
 }
-// Step down
-MoveUpdatedComponent(GravDir * StepTravelDownHeight, UpdatedComponentInput->GetRotation(), true, Output, &Hit);
-if (Hit.bStartPenetrating)
+FVector FCharacterMovementComponentAsyncInput::NewFallVelocity(const FVector& InitialVelocity, const FVector& Gravity, float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
 {
-ensure(false);
-//ScopedStepUpMovement.RevertMove();
-return false;
+const float TerminalLimit = FMath::Abs(PhysicsVolumeTerminalVelocity);
+if (Output.VelocityPrediction != nullptr && Output.VelocityPrediction->MatchesNewFallVelocity(InitialVelocity, Gravity, DeltaTime, TerminalLimit))
+{
+const FVector Result = Output.VelocityPrediction->Result;
+Output.VelocityPrediction = nullptr;
+return Result;
 }
-FStepDownResult StepDownResult;
-if (Hit.IsValidBlockingHit())
+return CharacterMovementAsyncKernels::NewFallVelocity(InitialVelocity, Gravity, DeltaTime, TerminalLimit);
+}
+bool FCharacterMovementComponentAsyncInput::IsValidLandingSpot(const FVector& CapsuleLocation, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// See if this step sequence would have allowed us to travel higher than our max step height allows.
-const float DeltaZ = Hit.ImpactPoint.Z - PawnFloorPointZ;
-if (DeltaZ > MaxStepHeight)
+if (!Hit.bBlockingHit)
 {
-ensure(false);
 return false;
 }
-// Reject unwalkable surface normals here.
-if (!IsWalkable(Hit))
+// Skip some checks if penetrating. Penetration will be handled by the FindFloor call (using a smaller capsule)
+if (!Hit.bStartPenetrating)
 {
-// Reject if normal opposes movement direction
-const bool bNormalTowardsMe = (Delta | Hit.ImpactNormal) < 0.f;
-if (bNormalTowardsMe)
+// Reject unwalkable floor normals.
+if (!IsWalkable(Hit))
 {
-ensure(false);
 return false;
 }
-// Also reject if we would end up being higher than our starting location by stepping down.
-// It's fine to step down onto an unwalkable normal below us, we will just slide off. Rejecting those moves would prevent us from being able to walk off the edge.
-if (Hit.Location.Z > OldLocation.Z)
+float PawnRadius = Output.ScaledCapsuleRadius;
+float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
+// Reject hits that are above our lower hemisphere (can happen when sliding down a vertical surface).
+const float LowerHemisphereZ = Hit.Location.Z - PawnHalfHeight + PawnRadius;
+if (Hit.ImpactPoint.Z >= LowerHemisphereZ)
 {
-ensure(false);
 return false;
 }
-}
-// Reject moves where the downward sweep hit something very close to the edge of the capsule. This maintains consistency with FindFloor as well.
+// Reject hits that are barely on the cusp of the radius of the capsule
 if (!IsWithinEdgeTolerance(Hit.Location, Hit.ImpactPoint, PawnRadius))
 {
-ensure(false);
 return false;
 }
-// Don't step up onto invalid surfaces if traveling higher.
-if (DeltaZ > 0.f && !CanStepUp(Hit, Output))
-{
-ensure(false);
-return false;
 }
-// See if we can validate the floor as a result of this step down. In almost all cases this should succeed, and we can avoid computing the floor outside this method.
-if (OutStepDownResult != NULL)
-{
-FindFloor(UpdatedComponentInput->GetPosition(), StepDownResult.FloorResult, false, Output, &Hit);
-// Reject unwalkable normals if we end up higher than our initial height.
-// It's fine to walk down onto an unwalkable surface, don't reject those moves.
-if (Hit.Location.Z > OldLocation.Z)
+else
 {
-// We should reject the floor result if we are trying to step up an actual step where we are not able to perch (this is rare).
-// In those cases we should instead abort the step up and try to slide along the stair.
-if (!StepDownResult.FloorResult.bBlockingHit && StepSideZ < CharacterMovementConstants::MAX_STEP_SIDE_Z)
+// Penetrating
+if (Hit.Normal.Z < UE_KINDA_SMALL_NUMBER)
 {
-//ScopedStepUpMovement.RevertMove();
-ensure(false);
+// Normal is nearly horizontal or downward, that's a penetration adjustment next to a vertical or overhanging wall. Don't pop to the floor.
 return false;
 }
 }
-StepDownResult.bComputedFloor = true;
-}
-}
-// Copy step down result.
-if (OutStepDownResult != NULL)
+FFindFloorResult FloorResult;
+FindFloor(CapsuleLocation, FloorResult, false, Output, &Hit);
+if (!FloorResult.IsWalkableFloor())
 {
-*OutStepDownResult = StepDownResult;
+return false;
 }
-// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments.
-Output.bJustTeleported |= !bMaintainHorizontalGroundVelocity;
 return true;
 }
-bool FCharacterMovementComponentAsyncInput::CanWalkOffLedges(FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::ProcessLanded(const FHitResult& Hit, float remainingTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (!bCanWalkOffLedgesWhenCrouching && Output.bIsCrouched)
+if (IsFalling(Output))
 {
-return false;
+SetPostLandedPhysics(Hit, Output);
 }
-return bCanWalkOffLedges;
+StartNewPhysics(remainingTime, Iterations, Output);
 }
-FVector FCharacterMovementComponentAsyncInput::GetLedgeMove(const FVector& OldLocation, const FVector& Delta, const FVector& GravDir, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::SetPostLandedPhysics(const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (!bHasValidData || Delta.IsZero())
 {
-return FVector::ZeroVector;
+const FVector PreImpactAccel = Output.Acceleration + (IsFalling(Output) ? FVector(0.f, 0.f, GravityZ) : FVector::ZeroVector);
+const FVector PreImpactVelocity = Output.Velocity;
+if (DefaultLandMovementMode == MOVE_Walking ||
+DefaultLandMovementMode == MOVE_NavWalking ||
+DefaultLandMovementMode == MOVE_Falling)
+{
+SetMovementMode(Output.GroundMovementMode, Output);
 }
-FVector SideDir(Delta.Y, -1.f * Delta.X, 0.f);
-if (CheckLedgeDirection(OldLocation, SideDir, GravDir, Output))
+else
 {
-return SideDir;
+SetDefaultMovementMode(Output);
 }
-SideDir *= -1.f;
-if (CheckLedgeDirection(OldLocation, SideDir, GravDir, Output))
+}
+}
+void FCharacterMovementComponentAsyncInput::SetDefaultMovementMode(FCharacterMovementComponentAsyncOutput& Output) const
+{
+if (Output.MovementMode != DefaultLandMovementMode)
+{
+const float SavedVelocityZ = Output.Velocity.Z;
+SetMovementMode(DefaultLandMovementMode, Output);
+// Avoid 1-frame delay if trying to walk but walking fails at this location.
+if (Output.MovementMode == MOVE_Walking && Output.NewMovementBase == NULL)
 {
-return SideDir;
+Output.Velocity.Z = SavedVelocityZ; // Prevent temporary walking state from zeroing Z velocity.
+SetMovementMode(MOVE_Falling, Output);
 }
-return FVector::ZeroVector;
 }
-bool FCharacterMovementComponentAsyncInput::CheckLedgeDirection(const FVector& OldLocation, const FVector& SideStep, const FVector& GravDir, FCharacterMovementComponentAsyncOutput& Output) const
+}
+bool FCharacterMovementComponentAsyncInput::ShouldCheckForValidLandingSpot(float DeltaTime, const FVector& Delta, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
 {
-const FVector SideDest = OldLocation + SideStep;
-const FCollisionShape CapsuleShape = GetPawnCapsuleCollisionShape(EShrinkCapsuleExtent::SHRINK_None, Output);
-FHitResult Result(1.f);
-World->SweepSingleByChannel(Result, OldLocation, SideDest, FQuat::Identity, CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams);
-if (!Result.bBlockingHit || IsWalkable(Result))
+// See if we hit an edge of a surface on the lower portion of the capsule.
+// In this case the normal will not equal the impact normal, and a downward sweep may find a walkable surface on top of the edge.
+if (Hit.Normal.Z > UE_KINDA_SMALL_NUMBER && !Hit.Normal.Equals(Hit.ImpactNormal))
 {
-if (!Result.bBlockingHit)
+const FVector PawnLocation = UpdatedComponentInput->GetPosition();
+if (IsWithinEdgeTolerance(PawnLocation, Hit.ImpactPoint, Output.ScaledCapsuleHalfHeight))
+{
+return true;
+}
+}
+return false;
+}
+bool FCharacterMovementComponentAsyncInput::ShouldRemainVertical(FCharacterMovementComponentAsyncOutput& Output) const
+{
+// Always remain vertical when walking or falling.
+return IsMovingOnGround(Output) || IsFalling(Output);
+}
+bool FCharacterMovementComponentAsyncInput::CanAttemptJump(FCharacterMovementComponentAsyncOutput& Output) const
 {
-World->SweepSingleByChannel(Result, SideDest, SideDest + GravDir * (MaxStepHeight + LedgeCheckThreshold), FQuat::Identity, CollisionChannel, CapsuleShape, QueryParams, CollisionResponseParams);
+return IsJumpAllowed() &&
+!Output.bWantsToCrouch &&
+(IsMovingOnGround(Output) || IsFalling(Output));  // Falling included for double-jump and non-zero jump hold time, but validated by character.
 }
-if ((Result.Time < 1.f) && IsWalkable(Result))
+bool FCharacterMovementComponentAsyncInput::DoJump(bool bReplayingMoves, FCharacterMovementComponentAsyncOutput& Output) const
+{
+if ( CharacterInput->CanJump(*this, Output))
+{
+// Don't jump if we can't move up/down.
+if (!bConstrainToPlane || FMath::Abs(PlaneConstraintNormal.Z) != 1.f)
 {
+Output.Velocity.Z = FMath::Max(Output.Velocity.Z, JumpZVelocity);
+SetMovementMode(MOVE_Falling, Output);
 return true;
 }
 }
 return false;
 }
-FVector FCharacterMovementComponentAsyncInput::GetPawnCapsuleExtent(const EShrinkCapsuleExtent ShrinkMode, const float CustomShrinkAmount, FCharacterMovementComponentAsyncOutput& Output) const
+bool FCharacterMovementComponentAsyncInput::IsJumpAllowed() const
 {
-float Radius = Output.ScaledCapsuleRadius;
-float HalfHeight = Output.ScaledCapsuleHalfHeight;
-FVector CapsuleExtent(Radius, Radius, HalfHeight);
-float RadiusEpsilon = 0.f;
-float HeightEpsilon = 0.f;
-switch (ShrinkMode)
+return bNavAgentPropsCanJump && bMovementStateCanJump;
+}
+float FCharacterMovementComponentAsyncInput::GetMaxSpeed(FCharacterMovementComponentAsyncOutput& Output) const
 {
-case EShrinkCapsuleExtent::SHRINK_None:
-return CapsuleExtent;
-case EShrinkCapsuleExtent::SHRINK_RadiusCustom:
-RadiusEpsilon = CustomShrinkAmount;
-break;
-case EShrinkCapsuleExtent::SHRINK_HeightCustom:
-HeightEpsilon = CustomShrinkAmount;
-break;
-case EShrinkCapsuleExtent::SHRINK_AllCustom:
-RadiusEpsilon = CustomShrinkAmount;
-HeightEpsilon = CustomShrinkAmount;
-break;
+switch (Output.MovementMode)
+{
+case MOVE_Walking:
+case MOVE_NavWalking:
+return IsCrouching(Output) ? MaxWalkSpeedCrouched : MaxWalkSpeed;
+case MOVE_Falling:
+return MaxWalkSpeed;
+case MOVE_Swimming:
+return MaxSwimSpeed;
+case MOVE_Flying:
+return MaxFlySpeed;
+case MOVE_Custom:
+return MaxCustomMovementSpeed;
+case MOVE_None:
 default:
-ensure(false);
-break;
+return 0.f;
 }
-// Don't shrink to zero extent.
-const float MinExtent = UE_KINDA_SMALL_NUMBER * 10.f;
-CapsuleExtent.X = FMath::Max(CapsuleExtent.X - RadiusEpsilon, MinExtent);
-CapsuleExtent.Y = CapsuleExtent.X;
-CapsuleExtent.Z = FMath::Max(CapsuleExtent.Z - HeightEpsilon, MinExtent);
-return CapsuleExtent;
 }
-FCollisionShape FCharacterMovementComponentAsyncInput::GetPawnCapsuleCollisionShape(const EShrinkCapsuleExtent ShrinkMode, FCharacterMovementComponentAsyncOutput& Output, const float CustomShrinkAmount) const
+bool FCharacterMovementComponentAsyncInput::IsCrouching(const FCharacterMovementComponentAsyncOutput& Output) const
 {
-FVector Extent = GetPawnCapsuleExtent(ShrinkMode, CustomShrinkAmount, Output);
-return FCollisionShape::MakeCapsule(Extent);
+return Output.bIsCrouched;
 }
-void FCharacterMovementComponentAsyncInput::TwoWallAdjust(FVector& OutDelta, const FHitResult& Hit, const FVector& OldHitNormal, FCharacterMovementComponentAsyncOutput& Output) const
+bool FCharacterMovementComponentAsyncInput::IsFalling(const FCharacterMovementComponentAsyncOutput& Output) const
 {
-FVector Delta = OutDelta;
-const FVector HitNormal = Hit.Normal;
-if ((OldHitNormal | HitNormal) <= 0.f) //90 or less corner, so use cross product for direction
+return (Output.MovementMode == MOVE_Falling);
+}
+bool FCharacterMovementComponentAsyncInput::IsFlying(const FCharacterMovementComponentAsyncOutput& Output) const
 {
-const FVector DesiredDir = Delta;
-FVector NewDir = (HitNormal ^ OldHitNormal);
-NewDir = NewDir.GetSafeNormal();
-Delta = (Delta | NewDir) * (1.f - Hit.Time) * NewDir;
-if ((DesiredDir | Delta) < 0.f)
+return (Output.MovementMode == MOVE_Flying);
+}
+bool FCharacterMovementComponentAsyncInput::IsMovingOnGround(const FCharacterMovementComponentAsyncOutput& Output) const
 {
-Delta = -1.f * Delta;
+return ((Output.MovementMode == MOVE_Walking) || (Output.MovementMode == MOVE_NavWalking));
 }
+bool FCharacterMovementComponentAsyncInput::IsExceedingMaxSpeed(float MaxSpeed, const FCharacterMovementComponentAsyncOutput& Output) const
+{
+return CharacterMovementAsyncKernels::IsExceedingMaxSpeed(Output.Velocity, MaxSpeed);
 }
-else //adjust to new wall
+FRotator FCharacterMovementComponentAsyncInput::ComputeOrientToMovementRotation(const FRotator& CurrentRotation, float DeltaTime, FRotator& DeltaRotation, FCharacterMovementComponentAsyncOutput& Output) const
 {
-const FVector DesiredDir = Delta;
-Delta = ComputeSlideVector(Delta, 1.f - Hit.Time, HitNormal, Hit, Output);
-if ((Delta | DesiredDir) <= 0.f)
+if (Output.Acceleration.SizeSquared() < UE_KINDA_SMALL_NUMBER)
 {
-Delta = FVector::ZeroVector;
-}
-else if (FMath::Abs((HitNormal | OldHitNormal) - 1.f) < UE_KINDA_SMALL_NUMBER)
+// AI path following request can orient us in that direction (it's effectively an acceleration)
+if (Output.bHasRequestedVelocity && Output.RequestedVelocity.SizeSquared() > UE_KINDA_SMALL_NUMBER)
 {
-// we hit the same wall again even after adjusting to move along it the first time
-// nudge away from it (this can happen due to precision issues)
-Delta += HitNormal * 0.01f;
+return CharacterMovementAsyncMath::GetSafeNormal(Output.RequestedVelocity).Rotation();
 }
+// Don't change rotation if there is no acceleration.
+return CurrentRotation;
 }
-OutDelta = Delta;
-}
-void FCharacterMovementComponentAsyncInput::RevertMove(const FVector& OldLocation, UPrimitiveComponent* OldBase, const FVector& PreviousBaseLocation, const FFindFloorResult& OldFloor, bool bFailMove, FCharacterMovementComponentAsyncOutput& Output) const
-{
-ETeleportType TeleportType = GetTeleportType(Output);
-ensure(TeleportType == ETeleportType::TeleportPhysics);
-UpdatedComponentInput->SetPosition(OldLocation);
-Output.bJustTeleported = false;
-// We can't read off movement base, ensure that our base hasn't changed, and use cached data.
-ensure(MovementBaseAsyncData.CachedMovementBase == OldBase);
-MovementBaseAsyncData.Validate(Output);
-ensure(false);
+// Rotate toward direction of acceleration.
+return CharacterMovementAsyncMath::GetSafeNormal(Output.Acceleration).Rotation();
 }
-ETeleportType FCharacterMovementComponentAsyncInput::GetTeleportType(FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncInput::RestorePreAdditiveRootMotionVelocity(FCharacterMovementComponentAsyncOutput& Output) const
 {
-// ensuring in inputs on networek large correction
-return Output.bJustTeleported  ? ETeleportType::TeleportPhysics : ETeleportType::None;
-}
-void FCharacterMovementComponentAsyncInput::HandleWalkingOffLedge(const FVector& PreviousFloorImpactNormal, const FVector& PreviousFloorContactNormal, const FVector& PreviousLocation, float TimeDelta) const
+// Restore last frame's pre-additive Velocity if we had additive applied 
+// so that we're not adding more additive velocity than intended
+if (Output.bIsAdditiveVelocityApplied)
 {
-ensure(false);
+Output.Velocity = Output.LastPreAdditiveVelocity;
+Output.bIsAdditiveVelocityApplied = false;
 }
-bool FCharacterMovementComponentAsyncInput::ShouldCatchAir(const FFindFloorResult& OldFloor, const FFindFloorResult& NewFloor) const
-{
-return false;
 }
-void FCharacterMovementComponentAsyncInput::StartFalling(int32 Iterations, float remainingTime, float timeTick, const FVector& Delta, const FVector& subLoc, FCharacterMovementComponentAsyncOutput& Output) const
-{
-// start falling 
-const float DesiredDist = Delta.Size();
-const float ActualDist = (UpdatedComponentInput->GetPosition() - subLoc).Size2D();
-remainingTime = (DesiredDist < UE_KINDA_SMALL_NUMBER)
-? 0.f
-: remainingTime + timeTick * (1.f - FMath::Min(1.f, ActualDist / DesiredDist));
-if (IsMovingOnGround(Output))
+void FCharacterMovementComponentAsyncInput::ApplyRootMotionToVelocity(float deltaTime, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Probably don't need this hack with async physics.
-// This is to catch cases where the first frame of PIE is executed, and the
-// level is not yet visible. In those cases, the player will fall out of the
-// world... So, don't set MOVE_Falling straight away.
-if (!GIsEditor || (World->HasBegunPlay() && (World->GetTimeSeconds() >= 1.f)))
+// Animation root motion is distinct from root motion sources right now and takes precedence
+if (RootMotion.bHasAnimRootMotion && deltaTime > 0.f)
 {
-SetMovementMode(MOVE_Falling, Output); //default behavior if script didn't change physics
+Output.Velocity = ConstrainAnimRootMotionVelocity(Output.AnimRootMotionVelocity, Output.Velocity, Output);
+return;
 }
-else
+const FVector OldVelocity = Output.Velocity;
+bool bAppliedRootMotion = false;
+// Apply override velocity
+if (RootMotion.bHasOverrideRootMotion)
 {
-// Make sure that the floor check code continues processing during this delay.
-Output.bForceNextFloorCheck = true;
+Output.Velocity = RootMotion.OverrideVelocity;
+bAppliedRootMotion = true;
+#if ROOT_MOTION_DEBUG
+if (RootMotionSourceDebug::CVarDebugRootMotionSources.GetValueOnGameThread() == 1)
+{
+FString AdjustedDebugString = FString::Printf(TEXT("ApplyRootMotionToVelocity HasOverrideVelocity Velocity(%s)"),
+*Output.Velocity.ToCompactString());
 }
+#endif
 }
-StartNewPhysics(remainingTime, Iterations, Output);
+// Next apply additive root motion
+if (RootMotion.bHasAdditiveRootMotion)
+{
+Output.LastPreAdditiveVelocity = Output.Velocity; // Save off pre-additive Velocity for restoration next tick
+Output.Velocity += RootMotion.AdditiveVelocity;
+Output.bIsAdditiveVelocityApplied = true; // Remember that we have it applied
+bAppliedRootMotion = true;
 }
-void FCharacterMovementComponentAsyncInput::SetBaseFromFloor(const FFindFloorResult& FloorResult, FCharacterMovementComponentAsyncOutput& Output) const
+// Switch to Falling if we have vertical velocity from root motion so we can lift off the ground
+const FVector AppliedVelocityDelta = Output.Velocity - OldVelocity;
+if (bAppliedRootMotion && AppliedVelocityDelta.Z != 0.f && IsMovingOnGround(Output))
 {
-if (FloorResult.IsWalkableFloor())
+float LiftoffBound;
+if (RootMotion.bUseSensitiveLiftoff)
 {
-//SetBase(FloorResult.HitResult.GetComponent(), FloorResult.HitResult.BoneName);
-Output.NewMovementBase = FloorResult.HitResult.GetComponent();
-Output.NewMovementBaseOwner = FloorResult.HitResult.GetActor();
+// Sensitive bounds - "any positive force"a
+LiftoffBound = UE_SMALL_NUMBER;
 }
 else
 {
-//SetBase(nullptr);
-Output.NewMovementBase = nullptr;
-Output.NewMovementBaseOwner = nullptr;
+// Default bounds - the amount of force gravity is applying this tick
+LiftoffBound = FMath::Max(GravityZ * deltaTime, UE_SMALL_NUMBER);
+}
+if (AppliedVelocityDelta.Z > LiftoffBound)
+{
+SetMovementMode(MOVE_Falling, Output);
 }
 }
-void FCharacterMovementComponentAsyncInput::AdjustFloorHeight(FCharacterMovementComponentAsyncOutput& Output) const
+}
+FVector FCharacterMovementComponentAsyncInput::ConstrainAnimRootMotionVelocity(const FVector& RootMotionVelocity, const FVector& CurrentVelocity, FCharacterMovementComponentAsyncOutput& Output) const
 {
-FFindFloorResult& CurrentFloor = Output.CurrentFloor;
-// If we have a floor check that hasn't hit anything, don't adjust height.
-if (!CurrentFloor.IsWalkableFloor())
+FVector Result = RootMotionVelocity;
+// Do not override Velocity.Z if in falling physics, we want to keep the effect of gravity.
+if (IsFalling(Output))
 {
-return;
+Result.Z = CurrentVelocity.Z;
 }
-float OldFloorDist = CurrentFloor.FloorDist;
-if (CurrentFloor.bLineTrace)
+return Result;
+}
+FVector FCharacterMovementComponentAsyncInput::CalcAnimRootMotionVelocity(const FVector& RootMotionDeltaMove, float DeltaSeconds, const FVector& CurrentVelocity) const
 {
-if (OldFloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST && CurrentFloor.LineDist >= UCharacterMovementComponent::MIN_FLOOR_DIST)
+if (ensure(DeltaSeconds > 0.f))
 {
-return;
+FVector RootMotionVelocity = RootMotionDeltaMove / DeltaSeconds;
+return RootMotionVelocity;
 }
 else
 {
-// Falling back to a line trace means the sweep was unwalkable (or in penetration). Use the line distance for the vertical adjustment.
-OldFloorDist = CurrentFloor.LineDist;
+return CurrentVelocity;
 }
 }
-// Move up or down to maintain floor height.
-if (OldFloorDist < UCharacterMovementComponent::MIN_FLOOR_DIST || OldFloorDist > UCharacterMovementComponent::MAX_FLOOR_DIST)
+FVector FCharacterMovementComponentAsyncInput::GetAirControl(float DeltaTime, float TickAirControl, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
 {
-FHitResult AdjustHit(1.f);
-const float InitialZ = UpdatedComponentInput->GetPosition().Z;
-const float AvgFloorDist = (UCharacterMovementComponent::MIN_FLOOR_DIST + UCharacterMovementComponent::MAX_FLOOR_DIST) * 0.5f;
-const float MoveDist = AvgFloorDist - OldFloorDist;
-SafeMoveUpdatedComponent(FVector(0.f, 0.f, MoveDist), UpdatedComponentInput->GetRotation(), true, AdjustHit, Output);
-if (!AdjustHit.IsValidBlockingHit())
+// Boost
+if (TickAirControl != 0.f)
 {
-CurrentFloor.FloorDist += MoveDist;
+TickAirControl = BoostAirControl(DeltaTime, TickAirControl, FallAcceleration, Output);
 }
-else if (MoveDist > 0.f)
-{
-const float CurrentZ = UpdatedComponentInput->GetPosition().Z;
-CurrentFloor.FloorDist += CurrentZ - InitialZ;
+return TickAirControl * FallAcceleration;
 }
-else
+void FCharacterAsyncInput::FaceRotation(FRotator NewControlRotation, float DeltaTime, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
 {
-checkSlow(MoveDist < 0.f);
-const float CurrentZ = UpdatedComponentInput->GetPosition().Z;
-CurrentFloor.FloorDist = CurrentZ - AdjustHit.Location.Z;
-if (IsWalkable(AdjustHit))
+// Only if we actually are going to use any component of rotation.
+if (bUseControllerRotationPitch || bUseControllerRotationYaw || bUseControllerRotationRoll)
 {
-CurrentFloor.SetFromSweep(AdjustHit, CurrentFloor.FloorDist, true);
+FRotator& CurrentRotation = Output.CharacterOutput->Rotation;
+if (!bUseControllerRotationPitch)
+{
+NewControlRotation.Pitch = CurrentRotation.Pitch;
 }
+if (!bUseControllerRotationYaw)
+{
+NewControlRotation.Yaw = CurrentRotation.Yaw;
 }
-// Don't recalculate velocity based on this height adjustment, if considering vertical adjustments.
-// Also avoid it if we moved out of penetration
-Output.bJustTeleported |= !bMaintainHorizontalGroundVelocity || (OldFloorDist < 0.f);
-// If something caused us to adjust our height (especially a depentration) we should ensure another check next frame or we will keep a stale result.
-if (CharacterInput->LocalRole != ROLE_SimulatedProxy)
+if (!bUseControllerRotationRoll)
 {
-Output.bForceNextFloorCheck = true;
+NewControlRotation.Roll = CurrentRotation.Roll;
 }
+CurrentRotation = NewControlRotation;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
 }
 }
-bool FCharacterMovementComponentAsyncInput::ShouldComputePerchResult(const FHitResult& InHit, FCharacterMovementComponentAsyncOutput& Output, bool bCheckRadius) const
+void FCharacterAsyncInput::CheckJumpInput(float DeltaSeconds, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (!InHit.IsValidBlockingHit())
+if (Output.CharacterOutput->bPressedJump || Output.CharacterOutput->JumpCurrentCountPreJump != Output.CharacterOutput->JumpCurrentCount)
 {
-return false;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
 }
-// Don't try to perch if the edge radius is very small.
-if (GetPerchRadiusThreshold() <= UCharacterMovementComponent::SWEEP_EDGE_REJECT_DISTANCE)
+Output.CharacterOutput->JumpCurrentCountPreJump = Output.CharacterOutput->JumpCurrentCount;
+if (Output.CharacterOutput->bPressedJump)
 {
-return false;
+// If this is the first jump and we're already falling,
+// then increment the JumpCount to compensate.
+const bool bFirstJump = Output.CharacterOutput->JumpCurrentCount == 0;
+if (bFirstJump && Input.IsFalling(Output))
+{
+Output.CharacterOutput->JumpCurrentCount++;
 }
-if (bCheckRadius)
+// TODO bClientUpdating
+const bool bDidJump = CanJump(Input, Output) && Input.DoJump(/*bClientUpdating*/false, Output);
+if (bDidJump)
 {
-const float DistFromCenterSq = (InHit.ImpactPoint - InHit.Location).SizeSquared2D();
-const float StandOnEdgeRadius = GetValidPerchRadius(Output);
-if (DistFromCenterSq <= FMath::Square(StandOnEdgeRadius))
+if (!Output.CharacterOutput->bWasJumping)
 {
-// Already within perch radius.
-return false;
+Output.CharacterOutput->JumpCurrentCount++;
+Output.CharacterOutput->JumpForceTimeRemaining = JumpMaxHoldTime;
 }
 }
-return true;
+Output.CharacterOutput->bWasJumping = bDidJump;
 }
-bool FCharacterMovementComponentAsyncInput::ComputePerchResult(const float TestRadius, const FHitResult& InHit, const float InMaxFloorDist, FFindFloorResult& OutPerchFloorResult, FCharacterMovementComponentAsyncOutput& Output) const
+}
+void FCharacterAsyncInput::ClearJumpInput(float DeltaSeconds, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
 {
-if (InMaxFloorDist <= 0.f)
+if (Output.CharacterOutput->bPressedJump)
 {
-return false;
-}
-// Sweep further than actual requested distance, because a reduced capsule radius means we could miss some hits that the normal radius would contact.
-const float PawnRadius = Output.ScaledCapsuleRadius;
-const float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
-//CharacterOwner->GetCapsuleComponent()->GetScaledCapsuleSize(PawnRadius, PawnHalfHeight);
-const float InHitAboveBase = FMath::Max(0.f, InHit.ImpactPoint.Z - (InHit.Location.Z - PawnHalfHeight));
-const float PerchLineDist = FMath::Max(0.f, InMaxFloorDist - InHitAboveBase);
-const float PerchSweepDist = FMath::Max(0.f, InMaxFloorDist);
-const float ActualSweepDist = PerchSweepDist + PawnRadius;
-ComputeFloorDist(InHit.Location, PerchLineDist, ActualSweepDist, OutPerchFloorResult, TestRadius, Output);
-if (!OutPerchFloorResult.IsWalkableFloor())
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
+Output.CharacterOutput->JumpKeyHoldTime += DeltaSeconds;
+// Don't disable bPressedJump right away if it's still held.
+// Don't modify JumpForceTimeRemaining because a frame of update may be remaining.
+if (Output.CharacterOutput->JumpKeyHoldTime >= JumpMaxHoldTime)
 {
-return false;
+Output.CharacterOutput->bClearJumpInput = true;
+Output.CharacterOutput->bPressedJump = false;
 }
-else if (InHitAboveBase + OutPerchFloorResult.FloorDist > InMaxFloorDist)
+}
+else if (Output.CharacterOutput->JumpForceTimeRemaining != 0.0f || Output.CharacterOutput->bWasJumping)
 {
-// Hit something past max distance
-OutPerchFloorResult.bWalkableFloor = false;
-return false;
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
+Output.CharacterOutput->JumpForceTimeRemaining = 0.0f;
+Output.CharacterOutput->bWasJumping = false;
 }
-return true;
 }
-float FCharacterMovementComponentAsyncInput::GetPerchRadiusThreshold() const
+bool FCharacterAsyncInput::CanJump(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// Don't allow negative values.
-return FMath::Max(0.f, PerchRadiusThreshold);
-}
-float FCharacterMovementComponentAsyncInput::GetValidPerchRadius(const FCharacterMovementComponentAsyncOutput& Output) const
+// Ensure the character isn't currently crouched.
+bool bCanJump = !Output.bIsCrouched;
+// Ensure that the CharacterMovement state is valid
+bCanJump &= Input.CanAttemptJump(Output);
+if (bCanJump)
 {
-const float PawnRadius = Output.ScaledCapsuleRadius;
-return FMath::Clamp(PawnRadius - GetPerchRadiusThreshold(), 0.11f, PawnRadius);
-}
-bool FCharacterMovementComponentAsyncInput::CheckFall(const FFindFloorResult& OldFloor, const FHitResult& Hit, const FVector& Delta, const FVector& OldLocation, float remainingTime, float timeTick, int32 Iterations, bool bMustJump, FCharacterMovementComponentAsyncOutput& Output) const
+// Ensure JumpHoldTime and JumpCount are valid.
+if (!Output.CharacterOutput->bWasJumping || Input.CharacterInput->JumpMaxHoldTime <= 0.0f)
 {
-if (!bHasValidData)
+if (Output.CharacterOutput->JumpCurrentCount == 0 && Input.IsFalling(Output))
 {
-return false;
+bCanJump = Output.CharacterOutput->JumpCurrentCount + 1 < Input.CharacterInput->JumpMaxCount;
 }
-if (bMustJump || CanWalkOffLedges(Output))
+else
 {
-HandleWalkingOffLedge(OldFloor.HitResult.ImpactNormal, OldFloor.HitResult.Normal, OldLocation, timeTick);
-if (IsMovingOnGround(Output))
+bCanJump = Output.CharacterOutput->JumpCurrentCount < Input.CharacterInput->JumpMaxCount;
+}
+}
+else
 {
-// If still walking, then fall. If not, assume the user set a different mode they want to keep.
-StartFalling(Iterations, remainingTime, timeTick, Delta, OldLocation, Output);
+const bool bJumpKeyHeld = (Output.CharacterOutput->bPressedJump && Output.CharacterOutput->JumpKeyHoldTime < Input.CharacterInput->JumpMaxHoldTime);
+bCanJump = bJumpKeyHeld &&
+((Output.CharacterOutput->JumpCurrentCount < Input.CharacterInput->JumpMaxCount) || (Output.CharacterOutput->bWasJumping && Output.CharacterOutput->JumpCurrentCount == Input.CharacterInput->JumpMaxCount));
 }
-return true;
 }
-return false;
+return bCanJump;
 }
-FVector FCharacterMovementComponentAsyncInput::GetFallingLateralAcceleration(float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterAsyncInput::ResetJumpState(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
 {
-// No acceleration in Z
-FVector FallAcceleration = FVector(Output.Acceleration.X, Output.Acceleration.Y, 0.f);
-// bound acceleration, falling object has minimal ability to impact acceleration
-if (!RootMotion.bHasAnimRootMotion && FallAcceleration.SizeSquared2D() > 0.f)
+MarkOutputDirty(Output, ECharacterMovementAsyncOutputDirty::Character);
+if (Output.CharacterOutput->bPressedJump == true)
 {
-FallAcceleration = GetAirControl(DeltaTime, AirControl, FallAcceleration, Output);
-FallAcceleration = FallAcceleration.GetClampedToMaxSize(MaxAcceleration);
+Output.CharacterOutput->bClearJumpInput = true;
 }
-return FallAcceleration;
+Output.CharacterOutput->bPressedJump = false;
+Output.CharacterOutput->bWasJumping = false;
+Output.CharacterOutput->JumpKeyHoldTime = 0.0f;
+Output.CharacterOutput->JumpForceTimeRemaining = 0.0f;
+if (!Input.IsFalling(Output))
+{
+Output.CharacterOutput->JumpCurrentCount = 0;
+Output.CharacterOutput->JumpCurrentCountPreJump = 0;
 }
-float FCharacterMovementComponentAsyncInput::BoostAirControl(float DeltaTime, float TickAirControl, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
+}
+void FCharacterAsyncInput::OnMovementModeChanged(EMovementMode PrevMovementMode, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output, uint8 PreviousCustomMode)
 {
-// Allow a burst of initial acceleration
-if (AirControlBoostMultiplier > 0.f && Output.Velocity.SizeSquared2D() < FMath::Square(AirControlBoostVelocityThreshold))
+if (!Output.CharacterOutput->bPressedJump || !Input.IsFalling(Output))
 {
-TickAirControl = FMath::Min(1.f, AirControlBoostMultiplier * TickAirControl);
+ResetJumpState(Input, Output);
 }
-return TickAirControl;
 }
-bool FCharacterMovementComponentAsyncInput::ShouldLimitAirControl(float DeltaTime, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
+FName FCharacterMovementComponentAsyncCallback::GetFNameForStatId() const
 {
-return (FallAcceleration.SizeSquared2D() > 0.f);
+const static FLazyName StaticName("FCharacterMovementComponentAsyncCallback");
+return StaticName;
 }
-FVector FCharacterMovementComponentAsyncInput::LimitAirControl(float DeltaTime, const FVector& FallAcceleration, const FHitResult& HitResult, bool bCheckForValidLandingSpot, FCharacterMovementComponentAsyncOutput& Output) const
-{
-FVector Result(FallAcceleration);
-if (HitResult.IsValidBlockingHit() && HitResult.Normal.Z > CharacterMovementConstants::VERTICAL_SLOPE_NORMAL_Z)
-{
-if (!bCheckForValidLandingSpot || !IsValidLandingSpot(HitResult.Location, HitResult, Output))
+// Structure-of-arrays view of every character simulated in one physics tick.
+// Each phase streams through contiguous arrays for all characters before the next phase starts, instead of running one character end to end.
+struct FCharacterMovementComponentAsyncBatch
+{
+TArray<const FCharacterMovementComponentAsyncInput*> Inputs;
+TArray<FCharacterMovementComponentAsyncOutput*> Outputs;
+// Hot state read by the phases, indexed like Inputs/Outputs.
+TArray<FVector> Locations;
+TArray<FVector> Velocities;
+TArray<TEnumAsByte<EMovementMode>> MovementModes;
+TArray<bool> bControlled;
+// Controlled characters, grouped by movement mode so characters running the same Phys* function are simulated back to back.
+TArray<int32> SimulationOrder;
+// Simulated proxies extrapolated on the physics thread, in input order.
+TArray<int32> SimulatedProxies;
+// Run PerformMovement on task graph workers.
+bool bParallel = false;
+// Shared broadphase for MoveComponent sweeps, built once per tick when enabled.
+FCharacterMovementAsyncSceneQueryBatch SceneQueries;
+// First velocity update of each controlled character, computed in lanes per movement mode.
+TArray<FCharacterMovementAsyncVelocityPrediction> VelocityPredictions;
+CharacterMovementAsyncKernels::FCalcVelocityLanes AcceleratingLanes;
+CharacterMovementAsyncKernels::FCalcVelocityLanes BrakingLanes;
+CharacterMovementAsyncKernels::FVectorLanes FallingVelocities;
+TArray<float> FallingTerminalLimits;
+void Reset(int32 NumCharacters);
+void Add(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output);
+int32 Num() const { return Inputs.Num(); }
+void Simulate(float DeltaSeconds);
+void Gather(float DeltaSeconds);
+void CheckJumpInput(float DeltaSeconds);
+void ComputeInputAcceleration();
+void BuildSimulationOrder();
+void BuildSceneQueries(float DeltaSeconds);
+void PredictVelocities(float DeltaSeconds);
+void PerformMovement(float DeltaSeconds);
+void SimulateProxies(float DeltaSeconds);
+void Scatter();
+};
+void FCharacterMovementComponentAsyncBatch::Reset(int32 NumCharacters)
+{
+Inputs.Reset(NumCharacters);
+Outputs.Reset(NumCharacters);
+Locations.Reset(NumCharacters);
+Velocities.Reset(NumCharacters);
+MovementModes.Reset(NumCharacters);
+bControlled.Reset(NumCharacters);
+SimulationOrder.Reset(NumCharacters);
+SimulatedProxies.Reset(NumCharacters);
+}
+void FCharacterMovementComponentAsyncBatch::Add(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output)
+{
+Inputs.Add(&Input);
+Outputs.Add(&Output);
+}
+void FCharacterMovementComponentAsyncBatch::Simulate(float DeltaSeconds)
+{
+const int32 NumCharacters = Num();
+Locations.SetNumUninitialized(NumCharacters);
+Velocities.SetNumUninitialized(NumCharacters);
+MovementModes.SetNumUninitialized(NumCharacters);
+bControlled.SetNumUninitialized(NumCharacters);
+Gather(DeltaSeconds);
+CheckJumpInput(DeltaSeconds);
+ComputeInputAcceleration();
+BuildSimulationOrder();
+BuildSceneQueries(DeltaSeconds);
+PredictVelocities(DeltaSeconds);
+PerformMovement(DeltaSeconds);
+SimulateProxies(DeltaSeconds);
+Scatter();
+}
+void FCharacterMovementComponentAsyncBatch::Gather(float DeltaSeconds)
+{
+SimulatedProxies.Reset();
+for (int32 Index = 0; Index < Num(); ++Index)
+{
+const FCharacterMovementComponentAsyncInput& Input = *Inputs[Index];
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+// Same role filtering as FCharacterMovementComponentAsyncInput::Simulate.
+AdvanceOutputSerial(Output);
+Output.DeltaTime = DeltaSeconds;
+if (Input.CharacterInput->LocalRole == ROLE_SimulatedProxy)
 {
-// If acceleration is into the wall, limit contribution.
-if (FVector::DotProduct(FallAcceleration, HitResult.Normal) < 0.f)
+if (CharacterMovementAsyncCVars::SimulatedProxy != 0)
 {
-// Allow movement parallel to the wall, but not into it because that may push us up.
-const FVector Normal2D = HitResult.Normal.GetSafeNormal2D();
-Result = FVector::VectorPlaneProject(FallAcceleration, Normal2D);
+SimulatedProxies.Add(Index);
 }
+else
+{
+ensure(false);
 }
 }
-else if (HitResult.bStartPenetrating)
-{
-// Allow movement out of penetration.
-return (FVector::DotProduct(Result, HitResult.Normal) > 0.f ? Result : FVector::ZeroVector);
+bControlled[Index] = (Input.CharacterInput->LocalRole > ROLE_SimulatedProxy) && Input.CharacterInput->bIsLocallyControlled;
+Locations[Index] = Input.UpdatedComponentInput->GetPosition();
+Velocities[Index] = Output.Velocity;
+MovementModes[Index] = Output.MovementMode;
 }
-return Result;
 }
-FVector FCharacterMovementComponentAsyncInput::NewFallVelocity(const FVector& InitialVelocity, const FVector& Gravity, float DeltaTime, FCharacterMovementComponentAsyncOutput& Output) const
-{
-FVector Result = InitialVelocity;
-if (DeltaTime > 0.f)
+void FCharacterMovementComponentAsyncBatch::CheckJumpInput(float DeltaSeconds)
 {
-Result += Gravity * DeltaTime;
-// Don't exceed terminal velocity.
-const float TerminalLimit = FMath::Abs(PhysicsVolumeTerminalVelocity);
-if (Result.SizeSquared() > FMath::Square(TerminalLimit))
+// We need to check the jump state before adjusting input acceleration, to minimize latency
+// and to make sure acceleration respects our potentially new falling state.
+for (int32 Index = 0; Index < Num(); ++Index)
 {
-const FVector GravityDir = Gravity.GetSafeNormal();
-if ((Result | GravityDir) > TerminalLimit)
+if (!bControlled[Index])
 {
-Result = FVector::PointPlaneProject(Result, FVector::ZeroVector, GravityDir) + GravityDir * TerminalLimit;
-}
+continue;
 }
+const FCharacterMovementComponentAsyncInput& Input = *Inputs[Index];
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+Input.CharacterInput->CheckJumpInput(DeltaSeconds, Input, Output);
+// Jumping changes both mode and velocity.
+Velocities[Index] = Output.Velocity;
+MovementModes[Index] = Output.MovementMode;
 }
-return Result;
 }
-bool FCharacterMovementComponentAsyncInput::IsValidLandingSpot(const FVector& CapsuleLocation, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncBatch::ComputeInputAcceleration()
 {
-if (!Hit.bBlockingHit)
+for (int32 Index = 0; Index < Num(); ++Index)
 {
-return false;
+if (!bControlled[Index])
+{
+continue;
 }
-// Skip some checks if penetrating. Penetration will be handled by the FindFloor call (using a smaller capsule)
-if (!Hit.bStartPenetrating)
+const FCharacterMovementComponentAsyncInput& Input = *Inputs[Index];
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+// apply input to acceleration
+Output.Acceleration = Input.ScaleInputAcceleration(Input.ConstrainInputAcceleration(Input.InputVector, Output), Output);
+Output.AnalogInputModifier = Input.ComputeAnalogInputModifier(Output.Acceleration);
+}
+}
+void FCharacterMovementComponentAsyncBatch::BuildSimulationOrder()
 {
-// Reject unwalkable floor normals.
-if (!IsWalkable(Hit))
+SimulationOrder.Reset();
+for (int32 Index = 0; Index < Num(); ++Index)
 {
-return false;
-}
-float PawnRadius = Output.ScaledCapsuleRadius;
-float PawnHalfHeight = Output.ScaledCapsuleHalfHeight;
-// Reject hits that are above our lower hemisphere (can happen when sliding down a vertical surface).
-const float LowerHemisphereZ = Hit.Location.Z - PawnHalfHeight + PawnRadius;
-if (Hit.ImpactPoint.Z >= LowerHemisphereZ)
+if (bControlled[Index])
 {
-return false;
+SimulationOrder.Add(Index);
 }
-// Reject hits that are barely on the cusp of the radius of the capsule
-if (!IsWithinEdgeTolerance(Hit.Location, Hit.ImpactPoint, PawnRadius))
-{
-return false;
 }
+// Stable so characters sharing a mode keep their input order, which keeps results deterministic.
+Algo::StableSortBy(SimulationOrder, [this](int32 Index) { return (uint8)MovementModes[Index]; });
 }
-else
+void FCharacterMovementComponentAsyncBatch::BuildSceneQueries(float DeltaSeconds)
 {
-// Penetrating
-if (Hit.Normal.Z < UE_KINDA_SMALL_NUMBER)
+SceneQueries.Reset();
+if (CharacterMovementAsyncCVars::BatchSceneQueries == 0 || SimulationOrder.Num() == 0)
 {
-// Normal is nearly horizontal or downward, that's a penetration adjustment next to a vertical or overhanging wall. Don't pop to the floor.
-return false;
+return;
 }
+TArray<FBox, TInlineAllocator<256>> CharacterBounds;
+CharacterBounds.SetNum(Num());
+for (const int32 Index : SimulationOrder)
+{
+CharacterBounds[Index] = FCharacterMovementAsyncSceneQueryBatch::ComputeReachableBounds(*Inputs[Index], *Outputs[Index], Locations[Index], Velocities[Index], DeltaSeconds);
 }
-FFindFloorResult FloorResult;
-FindFloor(CapsuleLocation, FloorResult, false, Output, &Hit);
-if (!FloorResult.IsWalkableFloor())
+SceneQueries.Build(Inputs[SimulationOrder[0]]->World, CharacterBounds, CharacterMovementAsyncCVars::BatchSceneQueryCellSize);
+for (const int32 Index : SimulationOrder)
 {
-return false;
+Outputs[Index]->SceneQueryRegion = SceneQueries.GetRegion(Index);
 }
-return true;
 }
-void FCharacterMovementComponentAsyncInput::ProcessLanded(const FHitResult& Hit, float remainingTime, int32 Iterations, FCharacterMovementComponentAsyncOutput& Output) const
+void FCharacterMovementComponentAsyncBatch::PredictVelocities(float DeltaSeconds)
 {
-if (IsFalling(Output))
+using namespace CharacterMovementAsyncKernels;
+VelocityPredictions.Reset();
+VelocityPredictions.SetNum(Num());
+if (CharacterMovementAsyncCVars::BatchVelocityKernels == 0)
 {
-SetPostLandedPhysics(Hit, Output);
+return;
 }
-StartNewPhysics(remainingTime, Iterations, Output);
+// Walking characters accelerating or braking, and falling characters. A kernel call shares its time steps and gravity,
+// so only characters that agree with the first of their group join it. The rest compute their velocity in PerformMovement as usual.
+TArray<int32, TInlineAllocator<256>> Accelerating;
+TArray<int32, TInlineAllocator<256>> Braking;
+TArray<int32, TInlineAllocator<256>> Falling;
+float WalkingDeltaTime = -1.f;
+float WalkingBrakingTimeStep = -1.f;
+float FallingDeltaTime = -1.f;
+FVector FallingGravity = FVector::ZeroVector;
+for (const int32 Index : SimulationOrder)
+{
+const FCharacterMovementComponentAsyncInput& Input = *Inputs[Index];
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+if (!Input.bHasValidData || Input.RootMotion.bHasAnimRootMotion || Input.RootMotion.bHasOverrideRootMotion || Input.bForceMaxAccel || Output.bHasRequestedVelocity)
+{
+continue;
 }
-void FCharacterMovementComponentAsyncInput::SetPostLandedPhysics(const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
+// First substep of PhysWalking and PhysFalling, PhysNavWalking takes the whole tick.
+float TimeStep = DeltaSeconds;
+if (MovementModes[Index] != MOVE_NavWalking && TimeStep > Input.MaxSimulationTimeStep)
 {
+TimeStep = FMath::Min(Input.MaxSimulationTimeStep, TimeStep * 0.5f);
+}
+TimeStep = FMath::Max(UCharacterMovementComponent::MIN_TICK_TIME, TimeStep);
+FCharacterMovementAsyncVelocityPrediction& Prediction = VelocityPredictions[Index];
+if (MovementModes[Index] == MOVE_Walking || MovementModes[Index] == MOVE_NavWalking)
 {
-const FVector PreImpactAccel = Output.Acceleration + (IsFalling(Output) ? FVector(0.f, 0.f, GravityZ) : FVector::ZeroVector);
-const FVector PreImpactVelocity = Output.Velocity;
-if (DefaultLandMovementMode == MOVE_Walking ||
-DefaultLandMovementMode == MOVE_NavWalking ||
-DefaultLandMovementMode == MOVE_Falling)
+const float BrakingTimeStep = FMath::Clamp(Input.BrakingSubStepTime, 1.0f / 75.0f, 1.0f / 20.0f);
+if (WalkingDeltaTime < 0.f)
 {
-SetMovementMode(Output.GroundMovementMode, Output);
+WalkingDeltaTime = TimeStep;
+WalkingBrakingTimeStep = BrakingTimeStep;
 }
-else
+if (TimeStep != WalkingDeltaTime || BrakingTimeStep != WalkingBrakingTimeStep)
 {
-SetDefaultMovementMode(Output);
-}
+continue;
 }
+Prediction.Kind = FCharacterMovementAsyncVelocityPrediction::EKind::CalcVelocity;
+Prediction.Velocity = Output.Velocity;
+Prediction.DeltaTime = TimeStep;
+Prediction.Acceleration = FVector(Output.Acceleration.X, Output.Acceleration.Y, 0.f);
+Prediction.Friction = FMath::Max(0.f, Input.GroundFriction);
+Prediction.BrakingFriction = FMath::Max(0.f, (Input.bUseSeparateBrakingFriction ? Input.BrakingFriction : Prediction.Friction) * FMath::Max(0.f, Input.BrakingFrictionFactor));
+Prediction.BrakingDeceleration = FMath::Max(0.f, Input.GetMaxBrakingDeceleration(Output));
+Prediction.MaxBrakingTimeStep = BrakingTimeStep;
+Prediction.MaxInputSpeed = FMath::Max(Input.GetMaxSpeed(Output) * Output.AnalogInputModifier, Input.GetMinAnalogSpeed(Output));
+// Without acceleration CalcVelocity only brakes.
+(Prediction.Acceleration.IsZero() ? Braking : Accelerating).Add(Index);
 }
-void FCharacterMovementComponentAsyncInput::SetDefaultMovementMode(FCharacterMovementComponentAsyncOutput& Output) const
+else if (MovementModes[Index] == MOVE_Falling)
 {
-if (Output.MovementMode != DefaultLandMovementMode)
+const FVector Gravity(0.f, 0.f, Input.GravityZ);
+if (FallingDeltaTime < 0.f)
 {
-const float SavedVelocityZ = Output.Velocity.Z;
-SetMovementMode(DefaultLandMovementMode, Output);
-// Avoid 1-frame delay if trying to walk but walking fails at this location.
-if (Output.MovementMode == MOVE_Walking && Output.NewMovementBase == NULL)
+FallingDeltaTime = TimeStep;
+FallingGravity = Gravity;
+}
+if (TimeStep != FallingDeltaTime || Gravity != FallingGravity)
 {
-Output.Velocity.Z = SavedVelocityZ; // Prevent temporary walking state from zeroing Z velocity.
-SetMovementMode(MOVE_Falling, Output);
+continue;
 }
+// Gravity applies to the velocity left by air control, which only matches while that leaves it unchanged.
+Prediction.Kind = FCharacterMovementAsyncVelocityPrediction::EKind::NewFallVelocity;
+Prediction.Velocity = Output.Velocity;
+Prediction.DeltaTime = TimeStep;
+Prediction.Gravity = Gravity;
+Prediction.TerminalLimit = FMath::Abs(Input.PhysicsVolumeTerminalVelocity);
+Falling.Add(Index);
 }
 }
-bool FCharacterMovementComponentAsyncInput::ShouldCheckForValidLandingSpot(float DeltaTime, const FVector& Delta, const FHitResult& Hit, FCharacterMovementComponentAsyncOutput& Output) const
-{
-// See if we hit an edge of a surface on the lower portion of the capsule.
-// In this case the normal will not equal the impact normal, and a downward sweep may find a walkable surface on top of the edge.
-if (Hit.Normal.Z > UE_KINDA_SMALL_NUMBER && !Hit.Normal.Equals(Hit.ImpactNormal))
+if (Accelerating.Num() > 0)
 {
-const FVector PawnLocation = UpdatedComponentInput->GetPosition();
-if (IsWithinEdgeTolerance(PawnLocation, Hit.ImpactPoint, Output.ScaledCapsuleHalfHeight))
+AcceleratingLanes.SetNum(Accelerating.Num());
+for (int32 Lane = 0; Lane < Accelerating.Num(); ++Lane)
 {
-return true;
+const FCharacterMovementAsyncVelocityPrediction& Prediction = VelocityPredictions[Accelerating[Lane]];
+AcceleratingLanes.Velocities.Set(Lane, Prediction.Velocity);
+AcceleratingLanes.Accelerations.Set(Lane, Prediction.Acceleration);
+AcceleratingLanes.Friction[Lane] = Prediction.Friction;
+AcceleratingLanes.BrakingFriction[Lane] = Prediction.BrakingFriction;
+AcceleratingLanes.BrakingDeceleration[Lane] = Prediction.BrakingDeceleration;
+AcceleratingLanes.MaxInputSpeed[Lane] = Prediction.MaxInputSpeed;
 }
+CalcVelocityBatch(AcceleratingLanes, WalkingDeltaTime, WalkingBrakingTimeStep);
+for (int32 Lane = 0; Lane < Accelerating.Num(); ++Lane)
+{
+VelocityPredictions[Accelerating[Lane]].Result = AcceleratingLanes.Velocities.Get(Lane);
 }
-return false;
 }
-bool FCharacterMovementComponentAsyncInput::ShouldRemainVertical(FCharacterMovementComponentAsyncOutput& Output) const
+if (Braking.Num() > 0)
 {
-// Always remain vertical when walking or falling.
-return IsMovingOnGround(Output) || IsFalling(Output);
+BrakingLanes.SetNum(Braking.Num());
+for (int32 Lane = 0; Lane < Braking.Num(); ++Lane)
+{
+const FCharacterMovementAsyncVelocityPrediction& Prediction = VelocityPredictions[Braking[Lane]];
+BrakingLanes.Velocities.Set(Lane, Prediction.Velocity);
+BrakingLanes.BrakingFriction[Lane] = Prediction.BrakingFriction;
+BrakingLanes.BrakingDeceleration[Lane] = Prediction.BrakingDeceleration;
 }
-bool FCharacterMovementComponentAsyncInput::CanAttemptJump(FCharacterMovementComponentAsyncOutput& Output) const
+ApplyVelocityBrakingBatch(BrakingLanes.Velocities, BrakingLanes.BrakingFriction, BrakingLanes.BrakingDeceleration, WalkingDeltaTime, WalkingBrakingTimeStep);
+for (int32 Lane = 0; Lane < Braking.Num(); ++Lane)
 {
-return IsJumpAllowed() &&
-!Output.bWantsToCrouch &&
-(IsMovingOnGround(Output) || IsFalling(Output));  // Falling included for double-jump and non-zero jump hold time, but validated by character.
+VelocityPredictions[Braking[Lane]].Result = BrakingLanes.Velocities.Get(Lane);
 }
-bool FCharacterMovementComponentAsyncInput::DoJump(bool bReplayingMoves, FCharacterMovementComponentAsyncOutput& Output) const
+}
+if (Falling.Num() > 0)
 {
-if ( CharacterInput->CanJump(*this, Output))
+FallingVelocities.SetNum(Falling.Num());
+FallingTerminalLimits.SetNumZeroed(Align(Falling.Num(), NumLanes));
+for (int32 Lane = 0; Lane < Falling.Num(); ++Lane)
 {
-// Don't jump if we can't move up/down.
-if (!bConstrainToPlane || FMath::Abs(PlaneConstraintNormal.Z) != 1.f)
+const FCharacterMovementAsyncVelocityPrediction& Prediction = VelocityPredictions[Falling[Lane]];
+FallingVelocities.Set(Lane, Prediction.Velocity);
+FallingTerminalLimits[Lane] = Prediction.TerminalLimit;
+}
+NewFallVelocityBatch(FallingVelocities, FallingGravity, FallingDeltaTime, FallingTerminalLimits);
+for (int32 Lane = 0; Lane < Falling.Num(); ++Lane)
 {
-Output.Velocity.Z = FMath::Max(Output.Velocity.Z, JumpZVelocity);
-SetMovementMode(MOVE_Falling, Output);
-return true;
+VelocityPredictions[Falling[Lane]].Result = FallingVelocities.Get(Lane);
+}
+}
+for (const int32 Index : SimulationOrder)
+{
+if (VelocityPredictions[Index].Kind != FCharacterMovementAsyncVelocityPrediction::EKind::None)
+{
+Outputs[Index]->VelocityPrediction = &VelocityPredictions[Index];
 }
 }
-return false;
 }
-bool FCharacterMovementComponentAsyncInput::IsJumpAllowed() const
+void FCharacterMovementComponentAsyncBatch::PerformMovement(float DeltaSeconds)
 {
-return bNavAgentPropsCanJump && bMovementStateCanJump;
+if (bParallel)
+{
+// Workers pull small batches off the shared range as they finish, so a few expensive characters don't stall the rest.
+// Each character only touches its own input and output, and results stay at their input index, so output order is deterministic.
+ParallelFor(TEXT("AsyncCharacterMovement.PerformMovement"), SimulationOrder.Num(), FMath::Max(1, CharacterMovementAsyncCVars::ParallelSimulateMinBatchSize), [this, DeltaSeconds](int32 OrderIndex)
+{
+const int32 Index = SimulationOrder[OrderIndex];
+Inputs[Index]->PerformMovement(DeltaSeconds, *Outputs[Index]);
+}, EParallelForFlags::Unbalanced);
+return;
 }
-float FCharacterMovementComponentAsyncInput::GetMaxSpeed(FCharacterMovementComponentAsyncOutput& Output) const
+for (int32 OrderIndex = 0; OrderIndex < SimulationOrder.Num(); ++OrderIndex)
 {
-switch (Output.MovementMode)
+// Pull the next character's state in while this one simulates.
+if (OrderIndex + 1 < SimulationOrder.Num())
 {
-case MOVE_Walking:
-case MOVE_NavWalking:
-return IsCrouching(Output) ? MaxWalkSpeedCrouched : MaxWalkSpeed;
-case MOVE_Falling:
-return MaxWalkSpeed;
-case MOVE_Swimming:
-return MaxSwimSpeed;
-case MOVE_Flying:
-return MaxFlySpeed;
-case MOVE_Custom:
-return MaxCustomMovementSpeed;
-case MOVE_None:
-default:
-return 0.f;
+const int32 NextIndex = SimulationOrder[OrderIndex + 1];
+FPlatformMisc::Prefetch(Inputs[NextIndex]);
+FPlatformMisc::Prefetch(Outputs[NextIndex]);
 }
+const int32 Index = SimulationOrder[OrderIndex];
+Inputs[Index]->PerformMovement(DeltaSeconds, *Outputs[Index]);
 }
-bool FCharacterMovementComponentAsyncInput::IsCrouching(const FCharacterMovementComponentAsyncOutput& Output) const
+}
+void FCharacterMovementComponentAsyncBatch::SimulateProxies(float DeltaSeconds)
 {
-return Output.bIsCrouched;
+// Extrapolation only touches the hot arrays, so run it for all proxies back to back before any scene query.
+for (const int32 Index : SimulatedProxies)
+{
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+Locations[Index] = ExtrapolateSimulatedProxy(*Inputs[Index], Output, Locations[Index], DeltaSeconds);
+Velocities[Index] = Output.Velocity;
+MovementModes[Index] = Output.MovementMode;
 }
-bool FCharacterMovementComponentAsyncInput::IsFalling(const FCharacterMovementComponentAsyncOutput& Output) const
+auto ResolveProxy = [this](int32 Index)
 {
-return (Output.MovementMode == MOVE_Falling);
+const FCharacterMovementComponentAsyncInput& Input = *Inputs[Index];
+FCharacterMovementComponentAsyncOutput& Output = *Outputs[Index];
+ASYNC_CHARACTER_MOVEMENT_QUERY_CHARACTER_SCOPE(Input);
+const FVector OldLocation = Input.UpdatedComponentInput->GetPosition();
+ResolveSimulatedProxyMove(Input, Output, OldLocation, Locations[Index]);
+if (Locations[Index] != OldLocation)
+{
+Input.UpdatedComponentInput->SetPosition(Locations[Index]);
 }
-bool FCharacterMovementComponentAsyncInput::IsFlying(const FCharacterMovementComponentAsyncOutput& Output) const
+};
+if (bParallel)
 {
-return (Output.MovementMode == MOVE_Flying);
+// Proxies are cheap, so hand them out in bigger batches than controlled characters.
+ParallelFor(TEXT("AsyncCharacterMovement.SimulateProxies"), SimulatedProxies.Num(), FMath::Max(1, CharacterMovementAsyncCVars::ParallelSimulateMinBatchSize) * 4, [this, &ResolveProxy](int32 ProxyIndex)
+{
+ResolveProxy(SimulatedProxies[ProxyIndex]);
+});
+return;
 }
-bool FCharacterMovementComponentAsyncInput::IsMovingOnGround(const FCharacterMovementComponentAsyncOutput& Output) const
+for (const int32 Index : SimulatedProxies)
 {
-return ((Output.MovementMode == MOVE_Walking) || (Output.MovementMode == MOVE_NavWalking));
+ResolveProxy(Index);
 }
-bool FCharacterMovementComponentAsyncInput::IsExceedingMaxSpeed(float MaxSpeed, const FCharacterMovementComponentAsyncOutput& Output) const
+}
+void FCharacterMovementComponentAsyncBatch::Scatter()
 {
-MaxSpeed = FMath::Max(0.f, MaxSpeed);
-const float MaxSpeedSquared = FMath::Square(MaxSpeed);
-// Allow 1% error tolerance, to account for numeric imprecision.
-const float OverVelocityPercent = 1.01f;
-return (Output.Velocity.SizeSquared() > MaxSpeedSquared * OverVelocityPercent);
+// The outputs already hold the end of tick state, only drop per-tick pointers.
+for (const int32 Index : SimulationOrder)
+{
+// Regions and predictions only live for this tick.
+Outputs[Index]->SceneQueryRegion = nullptr;
+Outputs[Index]->VelocityPrediction = nullptr;
 }
-FRotator FCharacterMovementComponentAsyncInput::ComputeOrientToMovementRotation(const FRotator& CurrentRotation, float DeltaTime, FRotator& DeltaRotation, FCharacterMovementComponentAsyncOutput& Output) const
+}
+// Locations of the player characters, which movement LOD and the movement budget measure distances from.
+static void GatherViewLocations(const FCharacterMovementComponentAsyncCallbackInput& CallbackInput, TArray<FVector>& OutViewLocations)
 {
-if (Output.Acceleration.SizeSquared() < UE_KINDA_SMALL_NUMBER)
+OutViewLocations.Reset();
+for (const auto& AsyncInput : CallbackInput.AsyncInputs)
 {
-// AI path following request can orient us in that direction (it's effectively an acceleration)
-if (Output.bHasRequestedVelocity && Output.RequestedVelocity.SizeSquared() > UE_KINDA_SMALL_NUMBER)
+if (AsyncInput->bHasValidData && AsyncInput->bIsMovementLODViewer)
 {
-return Output.RequestedVelocity.GetSafeNormal().Rotation();
+OutViewLocations.Add(AsyncInput->UpdatedComponentInput->GetPosition());
 }
-// Don't change rotation if there is no acceleration.
-return CurrentRotation;
 }
-// Rotate toward direction of acceleration.
-return Output.Acceleration.GetSafeNormal().Rotation();
 }
-void FCharacterMovementComponentAsyncInput::RestorePreAdditiveRootMotionVelocity(FCharacterMovementComponentAsyncOutput& Output) const
+static double GetDistanceSquaredToNearestView(const TArray<FVector>& ViewLocations, const FVector& Location)
 {
-// Restore last frame's pre-additive Velocity if we had additive applied 
-// so that we're not adding more additive velocity than intended
-if (Output.bIsAdditiveVelocityApplied)
+double DistanceSquared = UE_BIG_NUMBER;
+for (const FVector& ViewLocation : ViewLocations)
 {
-Output.Velocity = Output.LastPreAdditiveVelocity;
-Output.bIsAdditiveVelocityApplied = false;
+DistanceSquared = FMath::Min(DistanceSquared, FVector::DistSquared(Location, ViewLocation));
 }
+return DistanceSquared;
 }
-void FCharacterMovementComponentAsyncInput::ApplyRootMotionToVelocity(float deltaTime, FCharacterMovementComponentAsyncOutput& Output) const
+// Picks each character's movement LOD from its distance to the nearest player and its relevancy. Players themselves stay at full rate.
+static void AssignMovementLODLevels(const FCharacterMovementComponentAsyncCallbackInput& CallbackInput)
 {
-// Animation root motion is distinct from root motion sources right now and takes precedence
-if (RootMotion.bHasAnimRootMotion && deltaTime > 0.f)
+static thread_local TArray<FVector> ViewLocations;
+GatherViewLocations(CallbackInput, ViewLocations);
+const int32 MaxLevel = FMath::Clamp(CharacterMovementAsyncCVars::MovementLODMaxLevel, 0, 7);
+const float Distance = FMath::Max(1.f, CharacterMovementAsyncCVars::MovementLODDistance);
+for (const auto& AsyncInput : CallbackInput.AsyncInputs)
 {
-Output.Velocity = ConstrainAnimRootMotionVelocity(Output.AnimRootMotionVelocity, Output.Velocity, Output);
-return;
-}
-const FVector OldVelocity = Output.Velocity;
-bool bAppliedRootMotion = false;
-// Apply override velocity
-if (RootMotion.bHasOverrideRootMotion)
+if (!AsyncInput->bHasValidData)
 {
-Output.Velocity = RootMotion.OverrideVelocity;
-bAppliedRootMotion = true;
-#if ROOT_MOTION_DEBUG
-if (RootMotionSourceDebug::CVarDebugRootMotionSources.GetValueOnGameThread() == 1)
+continue;
+}
+FCharacterMovementComponentAsyncOutput& SimState = *AsyncInput->AsyncSimState;
+// Without a viewer there is nothing to measure from, so nobody is reduced. This also keeps a client's own character at full rate.
+if (AsyncInput->bIsMovementLODViewer || ViewLocations.Num() == 0)
 {
-FString AdjustedDebugString = FString::Printf(TEXT("ApplyRootMotionToVelocity HasOverrideVelocity Velocity(%s)"),
-*Output.Velocity.ToCompactString());
+SimState.MovementLODLevel = 0;
+continue;
 }
-#endif
+if (!AsyncInput->bIsMovementLODRelevant)
+{
+SimState.MovementLODLevel = (uint8)MaxLevel;
+continue;
 }
-// Next apply additive root motion
-if (RootMotion.bHasAdditiveRootMotion)
+const double DistanceSquared = GetDistanceSquaredToNearestView(ViewLocations, AsyncInput->UpdatedComponentInput->GetPosition());
+int32 Level = 0;
+for (double Threshold = Distance; Level < MaxLevel && DistanceSquared >= Threshold * Threshold; Threshold *= 2.0)
 {
-Output.LastPreAdditiveVelocity = Output.Velocity; // Save off pre-additive Velocity for restoration next tick
-Output.Velocity += RootMotion.AdditiveVelocity;
-Output.bIsAdditiveVelocityApplied = true; // Remember that we have it applied
-bAppliedRootMotion = true;
+++Level;
 }
-// Switch to Falling if we have vertical velocity from root motion so we can lift off the ground
-const FVector AppliedVelocityDelta = Output.Velocity - OldVelocity;
-if (bAppliedRootMotion && AppliedVelocityDelta.Z != 0.f && IsMovingOnGround(Output))
+SimState.MovementLODLevel = (uint8)Level;
+}
+}
+// Plans the tick's movement budget before any character simulates. Players and characters near them are guaranteed their update.
+// The others are admitted nearest first at their recent peak cost, and those that no longer fit are marked over budget.
+// Characters without a cost yet, such as a freshly spawned wave, are priced at the mean of the others.
+static void ScheduleMovementBudget(const FCharacterMovementComponentAsyncCallbackInput& CallbackInput)
 {
-float LiftoffBound;
-if (RootMotion.bUseSensitiveLiftoff)
+struct FCandidate
 {
-// Sensitive bounds - "any positive force"a
-LiftoffBound = UE_SMALL_NUMBER;
-}
-else
+FCharacterMovementComponentAsyncOutput* Output;
+double DistanceSquared;
+};
+static thread_local TArray<FVector> ViewLocations;
+static thread_local TArray<FCandidate> Candidates;
+GatherViewLocations(CallbackInput, ViewLocations);
+Candidates.Reset();
+const double GuaranteedDistanceSquared = FMath::Square((double)CharacterMovementAsyncCVars::MovementBudgetGuaranteedDistance);
+double KnownCostMs = 0.0;
+int32 NumKnownCosts = 0;
+for (const auto& AsyncInput : CallbackInput.AsyncInputs)
 {
-// Default bounds - the amount of force gravity is applying this tick
-LiftoffBound = FMath::Max(GravityZ * deltaTime, UE_SMALL_NUMBER);
-}
-if (AppliedVelocityDelta.Z > LiftoffBound)
+// Only characters that run PerformMovement.
+if (!AsyncInput->bHasValidData || AsyncInput->CharacterInput->LocalRole <= ROLE_SimulatedProxy || !AsyncInput->CharacterInput->bIsLocallyControlled)
 {
-SetMovementMode(MOVE_Falling, Output);
+continue;
 }
+FCharacterMovementComponentAsyncOutput& SimState = *AsyncInput->AsyncSimState;
+SimState.bMovementBudgetExceeded = false;
+if (SimState.MovementBudgetCostMs > 0.f)
+{
+KnownCostMs += SimState.MovementBudgetCostMs;
+++NumKnownCosts;
 }
+// Players are guaranteed even when no viewer was gathered. An autonomous proxy is always the client's own player.
+const bool bIsPlayer = AsyncInput->bIsMovementLODViewer || AsyncInput->CharacterInput->LocalRole == ROLE_AutonomousProxy;
+const double DistanceSquared = bIsPlayer ? 0.0 : GetDistanceSquaredToNearestView(ViewLocations, AsyncInput->UpdatedComponentInput->GetPosition());
+SimState.bMovementBudgetGuaranteed = bIsPlayer || (DistanceSquared <= GuaranteedDistanceSquared);
+Candidates.Add({ &SimState, DistanceSquared });
 }
-FVector FCharacterMovementComponentAsyncInput::ConstrainAnimRootMotionVelocity(const FVector& RootMotionVelocity, const FVector& CurrentVelocity, FCharacterMovementComponentAsyncOutput& Output) const
+const double DefaultCostMs = (NumKnownCosts > 0) ? KnownCostMs / NumKnownCosts : 0.0;
+auto GetCostMs = [DefaultCostMs](const FCharacterMovementComponentAsyncOutput& SimState) { return (SimState.MovementBudgetCostMs > 0.f) ? (double)SimState.MovementBudgetCostMs : DefaultCostMs; };
+double SpentMs = 0.0;
+for (const FCandidate& Candidate : Candidates)
 {
-FVector Result = RootMotionVelocity;
-// Do not override Velocity.Z if in falling physics, we want to keep the effect of gravity.
-if (IsFalling(Output))
+if (Candidate.Output->bMovementBudgetGuaranteed)
 {
-Result.Z = CurrentVelocity.Z;
+SpentMs += GetCostMs(*Candidate.Output);
 }
-return Result;
 }
-FVector FCharacterMovementComponentAsyncInput::CalcAnimRootMotionVelocity(const FVector& RootMotionDeltaMove, float DeltaSeconds, const FVector& CurrentVelocity) const
+// Stable so characters at the same distance keep their input order.
+Algo::StableSortBy(Candidates, [](const FCandidate& Candidate) { return Candidate.DistanceSquared; });
+for (const FCandidate& Candidate : Candidates)
 {
-if (ensure(DeltaSeconds > 0.f))
+if (Candidate.Output->bMovementBudgetGuaranteed)
 {
-FVector RootMotionVelocity = RootMotionDeltaMove / DeltaSeconds;
-return RootMotionVelocity;
+continue;
 }
-else
+const double CostMs = GetCostMs(*Candidate.Output);
+if (SpentMs + CostMs > CharacterMovementAsyncCVars::MovementBudgetMs)
 {
-return CurrentVelocity;
+Candidate.Output->bMovementBudgetExceeded = true;
+continue;
 }
+SpentMs += CostMs;
 }
-FVector FCharacterMovementComponentAsyncInput::GetAirControl(float DeltaTime, float TickAirControl, const FVector& FallAcceleration, FCharacterMovementComponentAsyncOutput& Output) const
+}
+// Frame in the high half, checksum in the low half, so readers on other threads always see a matching pair.
+static std::atomic<uint64> GAsyncCharacterMovementTickChecksum{ MAX_uint64 };
+// Sums per character hashes so the result does not depend on the order characters were queued in, which differs between peers.
+static uint32 ComputeTickChecksum(const FCharacterMovementComponentAsyncCallbackInput& CallbackInput)
 {
-// Boost
-if (TickAirControl != 0.f)
+uint32 Checksum = 0;
+for (const auto& AsyncInput : CallbackInput.AsyncInputs)
 {
-TickAirControl = BoostAirControl(DeltaTime, TickAirControl, FallAcceleration, Output);
+if (!AsyncInput->bHasValidData || AsyncInput->UpdatedComponentInput == nullptr)
+{
+continue;
 }
-return TickAirControl * FallAcceleration;
+const FCharacterMovementComponentAsyncOutput& SimState = *AsyncInput->AsyncSimState;
+const FVector Position = AsyncInput->UpdatedComponentInput->GetPosition();
+const FQuat Rotation = AsyncInput->UpdatedComponentInput->GetRotation();
+const uint8 Modes[2] = { (uint8)SimState.MovementMode, SimState.CustomMovementMode };
+uint32 Hash = FCrc::MemCrc32(&Position, sizeof(Position));
+Hash = FCrc::MemCrc32(&Rotation, sizeof(Rotation), Hash);
+Hash = FCrc::MemCrc32(&SimState.Velocity, sizeof(SimState.Velocity), Hash);
+Hash = FCrc::MemCrc32(Modes, sizeof(Modes), Hash);
+Checksum += Hash;
 }
-void FCharacterAsyncInput::FaceRotation(FRotator NewControlRotation, float DeltaTime, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
-{
-// Only if we actually are going to use any component of rotation.
-if (bUseControllerRotationPitch || bUseControllerRotationYaw || bUseControllerRotationRoll)
+return Checksum;
+}
+bool FCharacterMovementComponentAsyncCallback::GetLastTickChecksum(int32& OutFrame, uint32& OutChecksum)
 {
-FRotator& CurrentRotation = Output.CharacterOutput->Rotation;
-if (!bUseControllerRotationPitch)
+const uint64 Packed = GAsyncCharacterMovementTickChecksum.load(std::memory_order_acquire);
+if (Packed == MAX_uint64)
 {
-NewControlRotation.Pitch = CurrentRotation.Pitch;
+return false;
 }
-if (!bUseControllerRotationYaw)
-{
-NewControlRotation.Yaw = CurrentRotation.Yaw;
+OutFrame = (int32)(Packed >> 32);
+OutChecksum = (uint32)Packed;
+return true;
 }
-if (!bUseControllerRotationRoll)
+void FCharacterMovementComponentAsyncCallback::OnPreSimulate_Internal()
 {
-NewControlRotation.Roll = CurrentRotation.Roll;
-}
-CurrentRotation = NewControlRotation;
+bool bDefaultPath = (CharacterMovementAsyncCVars::BatchSimulate == 0 && CharacterMovementAsyncCVars::ParallelSimulate == 0);
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+// Captures record from Simulate, one character after the other.
+bDefaultPath |= FCharacterMovementAsyncCaptureRecorder::Get().bRecording;
+#endif
+// Built once per tick, before any character simulates.
+static thread_local FCharacterMovementAsyncBaseTable BaseTable;
+BaseTable.Reset();
+static thread_local FCharacterMovementAsyncPawnHash PawnHash;
+bool bPawnHash = (CharacterMovementAsyncCVars::PawnHash != 0);
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+// Replays run without the hash, so record through the scene queries.
+bPawnHash &= !FCharacterMovementAsyncCaptureRecorder::Get().bRecording;
+#endif
+PawnHash.Reset(CharacterMovementAsyncCVars::PawnHashCellSize);
+const FCharacterMovementComponentAsyncCallbackInput* CallbackInput = GetConsumerInput();
+const int32 Frame = GetSolver()->GetCurrentFrame();
+if (CallbackInput != nullptr)
+{
+if (CharacterMovementAsyncCVars::MovementLOD != 0)
+{
+AssignMovementLODLevels(*CallbackInput);
 }
+if (CharacterMovementAsyncCVars::MovementBudget != 0)
+{
+GAsyncCharacterMovementBudgetStartCycles.store(FPlatformTime::Cycles64(), std::memory_order_relaxed);
+ScheduleMovementBudget(*CallbackInput);
 }
-void FCharacterAsyncInput::CheckJumpInput(float DeltaSeconds, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
+const int32 SnapshotFrames = CharacterMovementAsyncCVars::SnapshotFrames;
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+// Snapshots are only restored from a resimulation, which needs the solver to capture rewind data.
+static std::atomic<bool> s_bWarnedNoRewindData{ false };
+if (SnapshotFrames > 0 && GetSolver()->GetRewindData() == nullptr && !s_bWarnedNoRewindData.exchange(true, std::memory_order_relaxed))
 {
-Output.CharacterOutput->JumpCurrentCountPreJump = Output.CharacterOutput->JumpCurrentCount;
-if (Output.CharacterOutput->bPressedJump)
+UE_LOG(LogCharacterMovement, Warning, TEXT("AsyncCharacterMovement: p.AsyncCharacterMovement.SnapshotFrames is %d but the physics solver does not capture rewind data, so snapshots are never restored."), SnapshotFrames);
+}
+#endif
+for (const auto& AsyncInput : CallbackInput->AsyncInputs)
 {
-// If this is the first jump and we're already falling,
-// then increment the JumpCount to compensate.
-const bool bFirstJump = Output.CharacterOutput->JumpCurrentCount == 0;
-if (bFirstJump && Input.IsFalling(Output))
+BaseTable.Add(*AsyncInput);
+AsyncInput->AsyncSimState->MovementBaseTable = &BaseTable;
+if (bPawnHash)
 {
-Output.CharacterOutput->JumpCurrentCount++;
+PawnHash.Add(*AsyncInput);
+AsyncInput->AsyncSimState->PawnHash = &PawnHash;
 }
-// TODO bClientUpdating
-const bool bDidJump = CanJump(Input, Output) && Input.DoJump(/*bClientUpdating*/false, Output);
-if (bDidJump)
+if (SnapshotFrames > 0 && AsyncInput->bHasValidData)
 {
-if (!Output.CharacterOutput->bWasJumping)
+// State entering this frame, before any character moves.
+FCharacterMovementComponentAsyncOutput& SimState = *AsyncInput->AsyncSimState;
+if (!SimState.SnapshotRing.IsValid() || SimState.SnapshotRing->Slots.Num() != SnapshotFrames)
 {
-Output.CharacterOutput->JumpCurrentCount++;
-Output.CharacterOutput->JumpForceTimeRemaining = JumpMaxHoldTime;
+SimState.SnapshotRing = MakeShared<FCharacterMovementAsyncSnapshotRing>(SnapshotFrames);
 }
+SimState.SnapshotRing->GetSlot(Frame).Save(Frame, *AsyncInput, SimState);
 }
-Output.CharacterOutput->bWasJumping = bDidJump;
 }
 }
-void FCharacterAsyncInput::ClearJumpInput(float DeltaSeconds, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
+ON_SCOPE_EXIT
 {
-if (Output.CharacterOutput->bPressedJump)
+// Replays and other Simulate calls outside the tick are not budgeted.
+if (const uint64 BudgetStartCycles = GAsyncCharacterMovementBudgetStartCycles.exchange(0, std::memory_order_relaxed))
 {
-Output.CharacterOutput->JumpKeyHoldTime += DeltaSeconds;
-// Don't disable bPressedJump right away if it's still held.
-// Don't modify JumpForceTimeRemaining because a frame of update may be remaining.
-if (Output.CharacterOutput->JumpKeyHoldTime >= JumpMaxHoldTime)
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncBudgetReport::Get().EndTick(FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - BudgetStartCycles));
+#endif
+}
+// The table only lives for this tick.
+if (CallbackInput != nullptr)
 {
-Output.CharacterOutput->bClearJumpInput = true;
-Output.CharacterOutput->bPressedJump = false;
+if (CharacterMovementAsyncCVars::TickChecksum != 0)
+{
+const uint32 Checksum = ComputeTickChecksum(*CallbackInput);
+GAsyncCharacterMovementTickChecksum.store(((uint64)(uint32)Frame << 32) | Checksum, std::memory_order_release);
+UE_LOG(LogCharacterMovement, VeryVerbose, TEXT("AsyncCharacterMovement: frame %d checksum %08x over %d characters."), Frame, Checksum, CallbackInput->AsyncInputs.Num());
 }
+for (const auto& AsyncInput : CallbackInput->AsyncInputs)
+{
+AsyncInput->AsyncSimState->MovementBaseTable = nullptr;
+AsyncInput->AsyncSimState->PawnHash = nullptr;
 }
-else
+}
+};
+if (bDefaultPath)
 {
-Output.CharacterOutput->JumpForceTimeRemaining = 0.0f;
-Output.CharacterOutput->bWasJumping = false;
+PreSimulateImpl<FCharacterMovementComponentAsyncInput, FCharacterMovementComponentAsyncOutput>(*this);
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncQueryStats::Get().EndTick();
+#endif
+#if ASYNC_CHARACTER_MOVEMENT_CAPTURE
+FCharacterMovementAsyncCaptureRecorder::Get().EndTick();
+#endif
+return;
 }
+if (CallbackInput == nullptr)
+{
+return;
 }
-bool FCharacterAsyncInput::CanJump(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
+FCharacterMovementComponentAsyncCallbackOutput& CallbackOutput = GetProducerOutputData_Internal();
+const int32 NumInputs = CallbackInput->AsyncInputs.Num();
+// Reused across ticks so steady state does not reallocate the arrays.
+static thread_local FCharacterMovementComponentAsyncBatch Batch;
+Batch.Reset(NumInputs);
+Batch.bParallel = (CharacterMovementAsyncCVars::ParallelSimulate != 0);
+for (int32 InputIdx = 0; InputIdx < NumInputs; ++InputIdx)
 {
-// Ensure the character isn't currently crouched.
-bool bCanJump = !Output.bIsCrouched;
-// Ensure that the CharacterMovement state is valid
-bCanJump &= Input.CanAttemptJump(Output);
-if (bCanJump)
+const FCharacterMovementComponentAsyncInput& AsyncInput = *CallbackInput->AsyncInputs[InputIdx];
+Batch.Add(AsyncInput, *AsyncInput.AsyncSimState);
+}
+Batch.Simulate(GetDeltaTime_Internal());
+// Marshal by input index, so output ordering matches the serial path.
+CallbackOutput.AsyncOutputs.SetNum(NumInputs);
+for (int32 InputIdx = 0; InputIdx < NumInputs; ++InputIdx)
 {
-// Ensure JumpHoldTime and JumpCount are valid.
-if (!Output.CharacterOutput->bWasJumping || Input.CharacterInput->JumpMaxHoldTime <= 0.0f)
+TUniquePtr<FCharacterMovementComponentAsyncOutput>& AsyncOutput = CallbackOutput.AsyncOutputs[InputIdx];
+if (!AsyncOutput.IsValid())
 {
-if (Output.CharacterOutput->JumpCurrentCount == 0 && Input.IsFalling(Output))
+AsyncOutput = MakeUnique<FCharacterMovementComponentAsyncOutput>();
+}
+AsyncOutput->Copy(*Batch.Outputs[InputIdx]);
+}
+#if ASYNC_CHARACTER_MOVEMENT_QUERY_STATS
+FCharacterMovementAsyncQueryStats::Get().EndTick();
+#endif
+}
+int32 FCharacterMovementComponentAsyncCallback::RestoreSnapshots_Internal(int32 Frame)
 {
-bCanJump = Output.CharacterOutput->JumpCurrentCount + 1 < Input.CharacterInput->JumpMaxCount;
+const FCharacterMovementComponentAsyncCallbackInput* CallbackInput = GetConsumerInput();
+if (CallbackInput == nullptr)
+{
+return 0;
 }
-else
+int32 NumRestored = 0;
+for (const auto& AsyncInput : CallbackInput->AsyncInputs)
 {
-bCanJump = Output.CharacterOutput->JumpCurrentCount < Input.CharacterInput->JumpMaxCount;
+FCharacterMovementComponentAsyncOutput& SimState = *AsyncInput->AsyncSimState;
+const FCharacterMovementAsyncSnapshot* Snapshot = SimState.SnapshotRing.IsValid() ? SimState.SnapshotRing->Find(Frame) : nullptr;
+if (Snapshot != nullptr)
+{
+Snapshot->Restore(*AsyncInput, SimState);
+++NumRestored;
 }
 }
-else
+if (NumRestored < CallbackInput->AsyncInputs.Num())
 {
-const bool bJumpKeyHeld = (Output.CharacterOutput->bPressedJump && Output.CharacterOutput->JumpKeyHoldTime < Input.CharacterInput->JumpMaxHoldTime);
-bCanJump = bJumpKeyHeld &&
-((Output.CharacterOutput->JumpCurrentCount < Input.CharacterInput->JumpMaxCount) || (Output.CharacterOutput->bWasJumping && Output.CharacterOutput->JumpCurrentCount == Input.CharacterInput->JumpMaxCount));
+UE_LOG(LogCharacterMovement, Verbose, TEXT("RestoreSnapshots: %d of %d characters have no snapshot of frame %d, they resimulate from their current state."), CallbackInput->AsyncInputs.Num() - NumRestored, CallbackInput->AsyncInputs.Num(), Frame);
 }
+return NumRestored;
 }
-return bCanJump;
+// Chaos only calls this on callbacks registered with ESimCallbackOptions::Rewind, which the callback's TSimCallbackObject base passes.
+void FCharacterMovementComponentAsyncCallback::FirstPreResimStep_Internal()
+{
+// Chaos rewound the particles to the frame it resimulates from, rewind movement state with them.
+RestoreSnapshots_Internal(GetSolver()->GetCurrentFrame());
 }
-void FCharacterAsyncInput::ResetJumpState(const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output) const
+// Game thread record of when each proxy's replicated state was first seen, so the age survives physics steps that skip inputs.
+struct FCharacterMovementAsyncProxyArrival
 {
-if (Output.CharacterOutput->bPressedJump == true)
+uint32 StateId = 0;
+double ArrivalTime = 0.0;
+uint64 LastFrame = 0;
+};
+static TMap<FObjectKey, FCharacterMovementAsyncProxyArrival> GAsyncCharacterMovementProxyArrivals;
+static uint64 GAsyncCharacterMovementProxyArrivalsPruneFrame = 0;
+static void FillReplicatedProxyInput_External(const UCharacterMovementComponent& MovementComponent, const ACharacter& Character, FCharacterMovementComponentAsyncInput& Input)
 {
-Output.CharacterOutput->bClearJumpInput = true;
+// Drop proxies that stopped building inputs, such as destroyed or no longer relevant ones.
+if (GFrameCounter - GAsyncCharacterMovementProxyArrivalsPruneFrame >= 60)
+{
+GAsyncCharacterMovementProxyArrivalsPruneFrame = GFrameCounter;
+for (auto It = GAsyncCharacterMovementProxyArrivals.CreateIterator(); It; ++It)
+{
+if (GFrameCounter - It.Value().LastFrame > 60)
+{
+It.RemoveCurrent();
 }
-Output.CharacterOutput->bPressedJump = false;
-Output.CharacterOutput->bWasJumping = false;
-Output.CharacterOutput->JumpKeyHoldTime = 0.0f;
-Output.CharacterOutput->JumpForceTimeRemaining = 0.0f;
-if (!Input.IsFalling(Output))
+}
+}
+// Zero keeps the proxy extrapolating from where it is, until replicated movement arrives.
+Input.ReplicatedProxyStateId = 0;
+Input.ReplicatedProxyAge = 0.f;
+if (!Character.IsReplicatingMovement())
 {
-Output.CharacterOutput->JumpCurrentCount = 0;
-Output.CharacterOutput->JumpCurrentCountPreJump = 0;
+return;
 }
+const FRepMovement& RepMovement = Character.GetReplicatedMovement();
+const uint8 PackedMovementMode = Character.GetReplicatedMovementMode();
+TEnumAsByte<EMovementMode> MovementMode = MOVE_None;
+TEnumAsByte<EMovementMode> GroundMovementMode = MOVE_None;
+uint8 CustomMovementMode = 0;
+MovementComponent.UnpackNetworkMovementMode(PackedMovementMode, MovementMode, CustomMovementMode, GroundMovementMode);
+Input.ReplicatedProxyLocation = FRepMovement::RebaseOntoLocalOrigin(RepMovement.Location, &Character);
+Input.ReplicatedProxyVelocity = RepMovement.LinearVelocity;
+Input.ReplicatedProxyMovementMode = MovementMode;
+// A new server time stamp starts the extrapolation over even when the state itself repeats.
+const float ServerTimeStamp = Character.GetReplicatedServerLastTransformUpdateTimeStamp();
+uint32 StateId = FCrc::MemCrc32(&RepMovement.Location, sizeof(RepMovement.Location));
+StateId = FCrc::MemCrc32(&RepMovement.LinearVelocity, sizeof(RepMovement.LinearVelocity), StateId);
+StateId = FCrc::MemCrc32(&ServerTimeStamp, sizeof(ServerTimeStamp), StateId);
+StateId = FCrc::MemCrc32(&PackedMovementMode, sizeof(PackedMovementMode), StateId);
+Input.ReplicatedProxyStateId = FMath::Max(StateId, 1u);
+const double Now = Character.GetWorld()->GetTimeSeconds();
+FCharacterMovementAsyncProxyArrival& Arrival = GAsyncCharacterMovementProxyArrivals.FindOrAdd(FObjectKey(&MovementComponent));
+if (Arrival.StateId != Input.ReplicatedProxyStateId)
+{
+Arrival.StateId = Input.ReplicatedProxyStateId;
+Arrival.ArrivalTime = Now;
+}
+Arrival.LastFrame = GFrameCounter;
+Input.ReplicatedProxyAge = (float)(Now - Arrival.ArrivalTime);
+}
+// Swimming reads the volume as a box whose top is the water line, which is exact for the usual axis aligned water volumes.
+static void FillPhysicsVolumeInput_External(const UCharacterMovementComponent& MovementComponent, FCharacterMovementComponentAsyncInput& Input)
+{
+const APhysicsVolume* PhysicsVolume = MovementComponent.GetPhysicsVolume();
+const UBrushComponent* BrushComponent = PhysicsVolume ? PhysicsVolume->GetBrushComponent() : nullptr;
+Input.bPhysicsVolumeIsWater = PhysicsVolume && PhysicsVolume->bWaterVolume && BrushComponent;
+Input.PhysicsVolumeFluidFriction = PhysicsVolume ? PhysicsVolume->FluidFriction : 0.f;
+Input.PhysicsVolumeWaterBounds = BrushComponent ? BrushComponent->Bounds.GetBox() : FBox(ForceInit);
+Input.Buoyancy = MovementComponent.Buoyancy;
+Input.bNavAgentPropsCanSwim = MovementComponent.CanEverSwim();
+}
+// Net relevance to any connection, the way the net driver decides it. Servers only, everything matters to the local player elsewhere.
+static bool IsMovementLODRelevant_External(const ACharacter& Character)
+{
+const UWorld* World = Character.GetWorld();
+if (Character.bAlwaysRelevant || World->GetNetMode() == NM_Standalone || World->GetNetMode() == NM_Client)
+{
+return true;
 }
-void FCharacterAsyncInput::OnMovementModeChanged(EMovementMode PrevMovementMode, const FCharacterMovementComponentAsyncInput& Input, FCharacterMovementComponentAsyncOutput& Output, uint8 PreviousCustomMode)
+for (FConstPlayerControllerIterator It = World->GetPlayerControllerIterator(); It; ++It)
 {
-if (!Output.CharacterOutput->bPressedJump || !Input.IsFalling(Output))
+const APlayerController* PlayerController = It->Get();
+const AActor* ViewTarget = PlayerController ? PlayerController->GetViewTarget() : nullptr;
+if (ViewTarget != nullptr && Character.IsNetRelevantFor(PlayerController, ViewTarget, ViewTarget->GetActorLocation()))
 {
-ResetJumpState(Input, Output);
+return true;
 }
 }
-FName FCharacterMovementComponentAsyncCallback::GetFNameForStatId() const
+return false;
+}
+// Fills the inputs this file adds on top of the engine's. UCharacterMovementComponent::FillAsyncInput calls it last, on the game thread.
+void FCharacterMovementComponentAsyncInput::FillExtendedInput_External(const UCharacterMovementComponent& MovementComponent)
 {
-const static FLazyName StaticName("FCharacterMovementComponentAsyncCallback");
-return StaticName;
+check(IsInGameThread());
+const ACharacter* Character = MovementComponent.GetCharacterOwner();
+if (Character == nullptr)
+{
+return;
 }
-void FCharacterMovementComponentAsyncCallback::OnPreSimulate_Internal()
+FillPhysicsVolumeInput_External(MovementComponent, *this);
+bCheatFlying = MovementComponent.bCheatFlying;
+// Reference taken here, so a snapshot published mid-tick only reaches the physics thread with the next input.
+NavMeshSnapshot = FCharacterMovementAsyncNavMeshSnapshot::GetForWorld(MovementComponent.GetWorld());
+const FNavAgentProperties& NavAgentProps = MovementComponent.GetNavAgentPropertiesRef();
+NavAgentRadius = NavAgentProps.AgentRadius;
+NavAgentHeight = NavAgentProps.AgentHeight;
+NavWalkingSearchHeightScale = NavAgentProps.NavWalkingSearchHeightScale;
+bSweepWhileNavWalking = MovementComponent.bSweepWhileNavWalking;
+// Players are the viewpoints: every player's character on a server, only the local one on a client.
+bIsMovementLODViewer = Character->IsPlayerControlled() && Character->GetLocalRole() != ROLE_SimulatedProxy;
+bIsMovementLODRelevant = true;
+if (CharacterMovementAsyncCVars::MovementLOD != 0 && !bIsMovementLODViewer)
 {
-PreSimulateImpl<FCharacterMovementComponentAsyncInput, FCharacterMovementComponentAsyncOutput>(*this);
+bIsMovementLODRelevant = IsMovementLODRelevant_External(*Character);
+}
+if (Character->GetLocalRole() == ROLE_SimulatedProxy)
+{
+FillReplicatedProxyInput_External(MovementComponent, *Character, *this);
+}
 }
 void FCharacterMovementComponentAsyncOutput::Copy(const FCharacterMovementComponentAsyncOutput& Value)
 {
+// Fields that changed on Value since this output was last filled from it. Anything unknown copies everything.
+ECharacterMovementAsyncOutputDirty Changed = ECharacterMovementAsyncOutputDirty::All;
+const uint32 HistorySize = UE_ARRAY_COUNT(OutputDirtyHistory);
+if (CharacterMovementAsyncCVars::DeltaOutputCopy != 0 && Value.OutputId != 0 && CopySourceId == Value.OutputId && CopySourceSerial <= Value.OutputSerial && Value.OutputSerial - CopySourceSerial <= HistorySize)
+{
+uint8 Mask = 0;
+for (uint32 Serial = CopySourceSerial + 1; Serial <= Value.OutputSerial; ++Serial)
+{
+Mask |= (Serial == Value.OutputSerial) ? Value.OutputDirtyMask : Value.OutputDirtyHistory[Serial % HistorySize];
+}
+Changed = (ECharacterMovementAsyncOutputDirty)Mask;
+}
+CopySourceId = Value.OutputId;
+CopySourceSerial = Value.OutputSerial;
+// This output's own contents were replaced, so whatever is copied from it next must take everything.
+AdvanceOutputSerial(*this);
+OutputDirtyMask = (uint8)ECharacterMovementAsyncOutputDirty::All;
 bIsValid = Value.bIsValid;
 bWasSimulatingRootMotion = Value.bWasSimulatingRootMotion;
 MovementMode = Value.MovementMode;
@@ -3053,7 +8751,41 @@ ScaledCapsuleHalfHeight = Value.ScaledCapsuleHalfHeight;
 bIsCrouched = Value.bIsCrouched;
 bWantsToCrouch = Value.bWantsToCrouch;
 bMovementInProgress = Value.bMovementInProgress;
+if (EnumHasAnyFlags(Changed, ECharacterMovementAsyncOutputDirty::Floor))
+{
 CurrentFloor = Value.CurrentFloor;
+}
+CachedFloorLocation = Value.CachedFloorLocation;
+MovementSleepCounter = Value.MovementSleepCounter;
+ProxyStateId = Value.ProxyStateId;
+CachedNavSnapshotId = Value.CachedNavSnapshotId;
+CachedNavTriangle = Value.CachedNavTriangle;
+CachedNavLocation = Value.CachedNavLocation;
+bNavWalkingFallback = Value.bNavWalkingFallback;
+StepUpCacheComponent = Value.StepUpCacheComponent;
+StepUpCacheNormal = Value.StepUpCacheNormal;
+StepUpCacheHeight = Value.StepUpCacheHeight;
+StepUpCacheTopNormal = Value.StepUpCacheTopNormal;
+LedgeProbeComponent = Value.LedgeProbeComponent;
+LedgeProbeDirection = Value.LedgeProbeDirection;
+LedgeProbeLocation = Value.LedgeProbeLocation;
+LedgeProbeSide = Value.LedgeProbeSide;
+bSubstepBlockingHit = Value.bSubstepBlockingHit;
+SubstepMovementMode = Value.SubstepMovementMode;
+MovementLODLevel = Value.MovementLODLevel;
+MovementLODTick = Value.MovementLODTick;
+MovementLODInterval = Value.MovementLODInterval;
+MovementLODPosition = Value.MovementLODPosition;
+MovementLODStartPosition = Value.MovementLODStartPosition;
+MovementLODStartRotation = Value.MovementLODStartRotation;
+MovementLODTargetPosition = Value.MovementLODTargetPosition;
+MovementLODTargetRotation = Value.MovementLODTargetRotation;
+MovementBudgetCostMs = Value.MovementBudgetCostMs;
+MovementBudgetDeferredTime = Value.MovementBudgetDeferredTime;
+MovementBudgetDeferredTicks = Value.MovementBudgetDeferredTicks;
+bMovementBudgetGuaranteed = Value.bMovementBudgetGuaranteed;
+bMovementBudgetExceeded = Value.bMovementBudgetExceeded;
+ProxyExtrapolationTime = Value.ProxyExtrapolationTime;
 bHasRequestedVelocity = Value.bHasRequestedVelocity;
 bRequestedMoveWithMaxSpeed = Value.bRequestedMoveWithMaxSpeed;
 RequestedVelocity = Value.RequestedVelocity;
@@ -3074,9 +8806,15 @@ bShouldAddMovementBaseTickDependency = Value.bShouldAddMovementBaseTickDependenc
 bShouldRemoveMovementBaseTickDependency = Value.bShouldRemoveMovementBaseTickDependency;
 NewMovementBase = Value.NewMovementBase;
 NewMovementBaseOwner = Value.NewMovementBaseOwner;
+if (EnumHasAnyFlags(Changed, ECharacterMovementAsyncOutputDirty::UpdatedComponent))
+{
 UpdatedComponentOutput = Value.UpdatedComponentOutput;
+}
+if (EnumHasAnyFlags(Changed, ECharacterMovementAsyncOutputDirty::Character))
+{
 *CharacterOutput = *Value.CharacterOutput;
 }
+}
 FRotator FCharacterMovementComponentAsyncOutput::GetDeltaRotation(const FRotator& InRotationRate, float InDeltaTime)
 {
 return FRotator(GetAxisDeltaRotation(InRotationRate.Pitch, InDeltaTime), GetAxisDeltaRotation(InRotationRate.Yaw, InDeltaTime), GetAxisDeltaRotation(InRotationRate.Roll, InDeltaTime));